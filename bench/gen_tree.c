@@ -0,0 +1,284 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Writes a synthetic tree for the benchmarks. The same options and seed
+// always give the same tree, file for file and byte for byte.
+
+#define WRITE_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    int depth; // levels of directories below the root
+    int fanout; // directories per directory
+    int files; // files per directory
+    uint64_t min_size;
+    uint64_t max_size;
+    int size_classes; // 0 for sizes spread over the whole range
+    double dup_ratio; // files that copy an earlier file
+    double link_ratio; // files that are a hard link to an earlier file
+    uint64_t seed;
+} TreeOptions;
+
+// A file already written, later files copy or link it
+typedef struct {
+    char *path;
+    uint64_t content_seed;
+    uint64_t size;
+} GeneratedFile;
+
+typedef struct {
+    TreeOptions options;
+    uint64_t state; // the generator the tree is drawn from
+    GeneratedFile *generated;
+    size_t num_generated;
+    size_t capacity;
+    uint64_t num_dirs;
+    uint64_t num_files;
+    uint64_t num_dups;
+    uint64_t num_links;
+    uint64_t bytes;
+} TreeGenerator;
+
+// splitmix64, small and the same everywhere
+uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15u);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+    return z ^ (z >> 31);
+}
+
+double next_unit(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Sizes are spread evenly over the orders of magnitude, like real trees
+// with many small and few large files
+uint64_t next_size(TreeGenerator *generator) {
+    const TreeOptions *options = &generator->options;
+    double low = log((double)options->min_size);
+    double high = log((double)options->max_size);
+    if (options->size_classes > 0) {
+        // Few distinct sizes, most files go through the staged hashing
+        int size_class = next_random(&generator->state) % options->size_classes;
+        double step = options->size_classes > 1
+                          ? (high - low) / (options->size_classes - 1)
+                          : 0;
+        return (uint64_t)exp(low + step * size_class);
+    }
+    return (uint64_t)exp(low + (high - low) * next_unit(&generator->state));
+}
+
+int write_content(const char *path, uint64_t content_seed, uint64_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    static uint64_t buffer[WRITE_BUFFER_SIZE / sizeof(uint64_t)];
+    uint64_t state = content_seed;
+    uint64_t left = size;
+    while (left > 0) {
+        size_t len = left < sizeof(buffer) ? left : sizeof(buffer);
+        for (size_t i = 0; i < (len + 7) / 8; i++) {
+            buffer[i] = next_random(&state);
+        }
+        if (write(fd, buffer, len) != (ssize_t)len) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        left -= len;
+    }
+    return close(fd);
+}
+
+bool remember_file(TreeGenerator *generator, const char *path,
+                   uint64_t content_seed, uint64_t size) {
+    if (generator->num_generated == generator->capacity) {
+        size_t capacity = generator->capacity ? generator->capacity * 2 : 1024;
+        GeneratedFile *generated =
+            realloc(generator->generated, capacity * sizeof(GeneratedFile));
+        if (generated == NULL) {
+            perror("Failed to allocate memory for generated files");
+            return false;
+        }
+        generator->generated = generated;
+        generator->capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        perror("Failed to allocate memory for generated files");
+        return false;
+    }
+    generator->generated[generator->num_generated++] =
+        (GeneratedFile){copy, content_seed, size};
+    return true;
+}
+
+int generate_file(TreeGenerator *generator, const char *path) {
+    double kind = next_unit(&generator->state);
+    uint64_t pick = next_random(&generator->state);
+    const TreeOptions *options = &generator->options;
+    generator->num_files++;
+
+    if (generator->num_generated > 0 && kind < options->link_ratio) {
+        const GeneratedFile *target =
+            &generator->generated[pick % generator->num_generated];
+        if (link(target->path, path) != 0) {
+            perror(path);
+            return -1;
+        }
+        generator->num_links++;
+        return 0;
+    }
+
+    uint64_t content_seed, size;
+    if (generator->num_generated > 0 &&
+        kind < options->link_ratio + options->dup_ratio) {
+        const GeneratedFile *original =
+            &generator->generated[pick % generator->num_generated];
+        content_seed = original->content_seed;
+        size = original->size;
+        generator->num_dups++;
+    } else {
+        content_seed = next_random(&generator->state);
+        size = next_size(generator);
+    }
+    if (write_content(path, content_seed, size) != 0)
+        return -1;
+    generator->bytes += size;
+    return remember_file(generator, path, content_seed, size) ? 0 : -1;
+}
+
+int generate_dir(TreeGenerator *generator, const char *path, int level) {
+    if (mkdir(path, 0755) != 0 && !(level == 0 && errno == EEXIST)) {
+        perror(path);
+        return -1;
+    }
+    generator->num_dirs++;
+
+    char child[PATH_MAX];
+    for (int i = 0; i < generator->options.files; i++) {
+        if (snprintf(child, sizeof(child), "%s/file_%d", path, i) >=
+            (int)sizeof(child)) {
+            fprintf(stderr, "Path too long below %s\n", path);
+            return -1;
+        }
+        if (generate_file(generator, child) != 0)
+            return -1;
+    }
+    if (level == generator->options.depth)
+        return 0;
+    for (int i = 0; i < generator->options.fanout; i++) {
+        if (snprintf(child, sizeof(child), "%s/dir_%d", path, i) >=
+            (int)sizeof(child)) {
+            fprintf(stderr, "Path too long below %s\n", path);
+            return -1;
+        }
+        if (generate_dir(generator, child, level + 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--depth <n>] [--fanout <n>] [--files <n>]\n"
+            "       [--min-size <bytes>] [--max-size <bytes>] "
+            "[--size-classes <n>]\n"
+            "       [--dup-ratio <0..1>] [--link-ratio <0..1>] [--seed <n>] "
+            "<directory>\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    TreeOptions options = {.depth = 3,
+                           .fanout = 4,
+                           .files = 16,
+                           .min_size = 1024,
+                           .max_size = 1024 * 1024,
+                           .size_classes = 0,
+                           .dup_ratio = 0.2,
+                           .link_ratio = 0.05,
+                           .seed = 1};
+    struct option long_options[] = {
+        {"depth", required_argument, NULL, 'd'},
+        {"fanout", required_argument, NULL, 'f'},
+        {"files", required_argument, NULL, 'n'},
+        {"min-size", required_argument, NULL, 'm'},
+        {"max-size", required_argument, NULL, 'M'},
+        {"size-classes", required_argument, NULL, 'c'},
+        {"dup-ratio", required_argument, NULL, 'r'},
+        {"link-ratio", required_argument, NULL, 'l'},
+        {"seed", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}};
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'd':
+            options.depth = atoi(optarg);
+            break;
+        case 'f':
+            options.fanout = atoi(optarg);
+            break;
+        case 'n':
+            options.files = atoi(optarg);
+            break;
+        case 'm':
+            options.min_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'M':
+            options.max_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            options.size_classes = atoi(optarg);
+            break;
+        case 'r':
+            options.dup_ratio = atof(optarg);
+            break;
+        case 'l':
+            options.link_ratio = atof(optarg);
+            break;
+        case 's':
+            options.seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || options.depth < 0 || options.fanout < 0 ||
+        options.files < 0 || options.min_size == 0 ||
+        options.max_size < options.min_size ||
+        options.dup_ratio + options.link_ratio > 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    TreeGenerator generator = {.options = options, .state = options.seed};
+    int result = generate_dir(&generator, argv[optind], 0);
+    if (result == 0) {
+        printf("Generated %llu files (%llu copies, %llu hard links) in %llu "
+               "directories, %llu bytes\n",
+               (unsigned long long)generator.num_files,
+               (unsigned long long)generator.num_dups,
+               (unsigned long long)generator.num_links,
+               (unsigned long long)generator.num_dirs,
+               (unsigned long long)generator.bytes);
+    }
+    for (size_t i = 0; i < generator.num_generated; i++) {
+        free(generator.generated[i].path);
+    }
+    free(generator.generated);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+#include "../src/lib/hash_table.h"
+#include "../src/lib/path_store.h"
+#include "../src/lib/ring_buffer.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmarks of the two structures all threads share, the ring buffer
+// between the walkers and the workers and the index of full digests. Every
+// run reports ops/s and latency percentiles as JSON, for thread counts from
+// 1 up to --max-threads, so two runs can be diffed.
+
+// Latencies are kept in a log-linear histogram: exact below 64 ns, then 32
+// buckets per power of two, which is within 3% everywhere
+#define LINEAR_BUCKETS 64
+#define SUB_BUCKET_BITS 5
+#define NUM_BUCKETS (LINEAR_BUCKETS + (64 - 6) * (1 << SUB_BUCKET_BITS))
+#define NUM_HOT_HASHES 65536
+
+typedef struct {
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t max;
+} Histogram;
+
+typedef struct {
+    int ops; // per producer or per index thread
+    int max_threads;
+    int buffer_size;
+    int producers; // 0 for as many producers as consumers
+    double hit_ratio;
+} BenchOptions;
+
+typedef struct {
+    alignas(CACHE_LINE_SIZE) Histogram histogram;
+    pthread_barrier_t *start;
+    RingBuffer *buffer;
+    FilePath file;
+    int ops;
+    uint64_t seed;
+    double hit_ratio;
+    uint64_t transferred; // elements a consumer read
+} BenchThread;
+
+uint8_t hot_hashes[NUM_HOT_HASHES][BLAKE3_OUT_LEN];
+
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15u);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+    return z ^ (z >> 31);
+}
+
+int get_bucket_index(uint64_t value) {
+    if (value < LINEAR_BUCKETS)
+        return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - SUB_BUCKET_BITS)) &
+              ((1 << SUB_BUCKET_BITS) - 1);
+    return LINEAR_BUCKETS + (exponent - 6) * (1 << SUB_BUCKET_BITS) + sub;
+}
+
+// Smallest value that falls into the bucket
+uint64_t get_bucket_value(int index) {
+    if (index < LINEAR_BUCKETS)
+        return index;
+    int exponent = (index - LINEAR_BUCKETS) / (1 << SUB_BUCKET_BITS) + 6;
+    int sub = (index - LINEAR_BUCKETS) % (1 << SUB_BUCKET_BITS);
+    return ((uint64_t)1 << exponent) +
+           ((uint64_t)sub << (exponent - SUB_BUCKET_BITS));
+}
+
+void record_latency(Histogram *histogram, uint64_t start) {
+    uint64_t latency = now_ns() - start;
+    histogram->counts[get_bucket_index(latency)]++;
+    if (latency > histogram->max)
+        histogram->max = latency;
+}
+
+void merge_histogram(Histogram *total, const Histogram *histogram) {
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        total->counts[i] += histogram->counts[i];
+    }
+    if (histogram->max > total->max)
+        total->max = histogram->max;
+}
+
+uint64_t get_percentile(const Histogram *histogram, double percentile) {
+    uint64_t total = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        total += histogram->counts[i];
+    }
+    uint64_t rank = (uint64_t)(total * percentile / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank)
+            return get_bucket_value(i);
+    }
+    return histogram->max;
+}
+
+void print_latencies(const char *name, const Histogram *histogram) {
+    printf("\"%s\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+           "\"p99.9\": %llu, \"max\": %llu}",
+           name, (unsigned long long)get_percentile(histogram, 50),
+           (unsigned long long)get_percentile(histogram, 90),
+           (unsigned long long)get_percentile(histogram, 99),
+           (unsigned long long)get_percentile(histogram, 99.9),
+           (unsigned long long)histogram->max);
+}
+
+void *produce(void *arg) {
+    BenchThread *thread = arg;
+    pthread_barrier_wait(thread->start);
+    for (int i = 0; i < thread->ops; i++) {
+        uint64_t start = now_ns();
+        write_ring_buffer(thread->buffer, thread->file);
+        record_latency(&thread->histogram, start);
+    }
+    return NULL;
+}
+
+void *consume(void *arg) {
+    BenchThread *thread = arg;
+    pthread_barrier_wait(thread->start);
+    FilePath file;
+    while (1) {
+        uint64_t start = now_ns();
+        if (!read_ring_buffer(thread->buffer, &file))
+            break;
+        record_latency(&thread->histogram, start);
+        thread->transferred++;
+    }
+    return NULL;
+}
+
+// Hits add a file to a digest that is in the index already, misses add a
+// new digest
+void *add_hashes(void *arg) {
+    BenchThread *thread = arg;
+    uint8_t hash[BLAKE3_OUT_LEN];
+    pthread_barrier_wait(thread->start);
+    for (int i = 0; i < thread->ops; i++) {
+        uint64_t pick = next_random(&thread->seed);
+        if ((pick >> 11) * (1.0 / 9007199254740992.0) < thread->hit_ratio) {
+            memcpy(hash, hot_hashes[pick % NUM_HOT_HASHES], BLAKE3_OUT_LEN);
+        } else {
+            for (size_t j = 0; j < BLAKE3_OUT_LEN; j += sizeof(uint64_t)) {
+                uint64_t bits = next_random(&thread->seed);
+                memcpy(hash + j, &bits, sizeof(bits));
+            }
+        }
+        uint64_t start = now_ns();
+        add_new_hash(hash, thread->file, NULL);
+        record_latency(&thread->histogram, start);
+    }
+    return NULL;
+}
+
+// Starts the threads behind a barrier and returns the wall time of the run
+// in nanoseconds, or 0 if the threads could not be started. The consumers of
+// a ring buffer only stop once it is closed, so the first num_producers
+// threads are joined and the buffer closed before the others are joined.
+uint64_t run_threads(BenchThread *threads, void *(**functions)(void *),
+                     int num_threads, int num_producers, RingBuffer *buffer) {
+    pthread_t *ids = malloc(num_threads * sizeof(pthread_t));
+    pthread_barrier_t start;
+    if (ids == NULL ||
+        pthread_barrier_init(&start, NULL, num_threads + 1) != 0) {
+        perror("Failed to set up benchmark threads");
+        free(ids);
+        return 0;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].start = &start;
+        if (pthread_create(&ids[i], NULL, functions[i], &threads[i]) != 0) {
+            // The others wait on the barrier forever
+            perror("Failed to create benchmark thread");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < num_producers; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    if (buffer != NULL)
+        close_ring_buffer(buffer);
+    for (int i = num_producers; i < num_threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    uint64_t wall = now_ns() - begin;
+    pthread_barrier_destroy(&start);
+    free(ids);
+    return wall > 0 ? wall : 1;
+}
+
+int bench_ring_buffer_run(const BenchOptions *options, FilePath file,
+                          int num_producers, int num_consumers) {
+    RingBuffer *buffer = create_ring_buffer(options->buffer_size);
+    int num_threads = num_producers + num_consumers;
+    BenchThread *threads = aligned_alloc(
+        CACHE_LINE_SIZE, num_threads * sizeof(BenchThread));
+    void *(**functions)(void *) = malloc(num_threads * sizeof(*functions));
+    if (buffer == NULL || threads == NULL || functions == NULL) {
+        perror("Failed to allocate memory for the benchmark");
+        return -1;
+    }
+    memset(threads, 0, num_threads * sizeof(BenchThread));
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].buffer = buffer;
+        threads[i].file = file;
+        threads[i].ops = options->ops;
+        functions[i] = i < num_producers ? produce : consume;
+    }
+
+    uint64_t wall = run_threads(threads, functions, num_threads,
+                                num_producers, buffer);
+    if (wall == 0)
+        return -1;
+
+    Histogram *writes = calloc(1, sizeof(Histogram));
+    Histogram *reads = calloc(1, sizeof(Histogram));
+    uint64_t transferred = 0;
+    for (int i = 0; i < num_threads; i++) {
+        merge_histogram(i < num_producers ? writes : reads,
+                        &threads[i].histogram);
+        transferred += threads[i].transferred;
+    }
+    printf("      {\"producers\": %d, \"consumers\": %d, \"ops\": %llu, "
+           "\"ops_per_second\": %.0f, \"latency_ns\": {",
+           num_producers, num_consumers, (unsigned long long)transferred,
+           transferred / (wall / 1e9));
+    print_latencies("write", writes);
+    printf(", ");
+    print_latencies("read", reads);
+    printf("}}");
+
+    free(writes);
+    free(reads);
+    free(functions);
+    free(threads);
+    destroy_ring_buffer(buffer);
+    return transferred == (uint64_t)num_producers * options->ops ? 0 : -1;
+}
+
+int bench_hash_index_run(const BenchOptions *options, FilePath file,
+                         int num_threads) {
+    // Every run starts from the same index, the hot digests and nothing else
+    free_hashes();
+    for (int i = 0; i < NUM_HOT_HASHES; i++) {
+        add_new_hash(hot_hashes[i], file, NULL);
+    }
+
+    BenchThread *threads = aligned_alloc(
+        CACHE_LINE_SIZE, num_threads * sizeof(BenchThread));
+    void *(**functions)(void *) = malloc(num_threads * sizeof(*functions));
+    if (threads == NULL || functions == NULL) {
+        perror("Failed to allocate memory for the benchmark");
+        return -1;
+    }
+    memset(threads, 0, num_threads * sizeof(BenchThread));
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].file = file;
+        threads[i].ops = options->ops;
+        threads[i].seed = i + 1;
+        threads[i].hit_ratio = options->hit_ratio;
+        functions[i] = add_hashes;
+    }
+    uint64_t wall = run_threads(threads, functions, num_threads, 0, NULL);
+    if (wall == 0)
+        return -1;
+
+    Histogram *adds = calloc(1, sizeof(Histogram));
+    for (int i = 0; i < num_threads; i++) {
+        merge_histogram(adds, &threads[i].histogram);
+    }
+    uint64_t ops = (uint64_t)num_threads * options->ops;
+    printf("      {\"threads\": %d, \"ops\": %llu, \"ops_per_second\": %.0f, "
+           "\"latency_ns\": {",
+           num_threads, (unsigned long long)ops, ops / (wall / 1e9));
+    print_latencies("add", adds);
+    printf("}}");
+
+    free(adds);
+    free(functions);
+    free(threads);
+    return 0;
+}
+
+int bench_ring_buffer(const BenchOptions *options, FilePath file) {
+    printf("  \"ring_buffer\": {\n    \"buffer_size\": %d,\n"
+           "    \"ops_per_producer\": %d,\n    \"runs\": [\n",
+           options->buffer_size, options->ops);
+    for (int n = 1; n <= options->max_threads; n *= 2) {
+        int producers = options->producers > 0 ? options->producers : n;
+        if (n > 1)
+            printf(",\n");
+        if (bench_ring_buffer_run(options, file, producers, n) != 0)
+            return -1;
+    }
+    printf("\n    ]\n  }");
+    return 0;
+}
+
+int bench_hash_index(const BenchOptions *options, FilePath file) {
+    printf("  \"hash_index\": {\n    \"hit_ratio\": %.3f,\n"
+           "    \"ops_per_thread\": %d,\n    \"runs\": [\n",
+           options->hit_ratio, options->ops);
+    for (int n = 1; n <= options->max_threads; n *= 2) {
+        if (n > 1)
+            printf(",\n");
+        if (bench_hash_index_run(options, file, n) != 0)
+            return -1;
+    }
+    printf("\n    ]\n  }");
+    free_hashes();
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--ops <n>] [--max-threads <n>] [--buffer-size <n>]\n"
+            "       [--producers <n>] [--hit-ratio <0..1>] "
+            "[ring|index|all]\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options = {.ops = 200000,
+                            .max_threads = 64,
+                            .buffer_size = 4096,
+                            .producers = 0,
+                            .hit_ratio = 0.5};
+    struct option long_options[] = {
+        {"ops", required_argument, NULL, 'o'},
+        {"max-threads", required_argument, NULL, 't'},
+        {"buffer-size", required_argument, NULL, 'b'},
+        {"producers", required_argument, NULL, 'p'},
+        {"hit-ratio", required_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'o':
+            options.ops = atoi(optarg);
+            break;
+        case 't':
+            options.max_threads = atoi(optarg);
+            break;
+        case 'b':
+            options.buffer_size = atoi(optarg);
+            break;
+        case 'p':
+            options.producers = atoi(optarg);
+            break;
+        case 'h':
+            options.hit_ratio = atof(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    const char *which = optind < argc ? argv[optind] : "all";
+    bool ring = strcmp(which, "ring") == 0 || strcmp(which, "all") == 0;
+    bool index = strcmp(which, "index") == 0 || strcmp(which, "all") == 0;
+    if ((!ring && !index) || options.ops < 1 || options.max_threads < 1 ||
+        options.buffer_size < 1 || options.producers < 0 ||
+        options.hit_ratio < 0 || options.hit_ratio > 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // The structures only pass the file around, one is enough
+    uint32_t dir = intern_dir(NO_DIR, "bench");
+    FilePath file = dir == NO_DIR ? NULL : intern_file(dir, "file");
+    if (file == NULL)
+        return 1;
+    uint64_t seed = 0;
+    for (int i = 0; i < NUM_HOT_HASHES; i++) {
+        for (size_t j = 0; j < BLAKE3_OUT_LEN; j += sizeof(uint64_t)) {
+            uint64_t bits = next_random(&seed);
+            memcpy(hot_hashes[i] + j, &bits, sizeof(bits));
+        }
+    }
+
+    int result = 0;
+    printf("{\n");
+    if (ring)
+        result = bench_ring_buffer(&options, file);
+    if (result == 0 && index) {
+        if (ring)
+            printf(",\n");
+        result = bench_hash_index(&options, file);
+    }
+    printf("\n}\n");
+    free_path_store();
+    return result == 0 ? 0 : 1;
+}
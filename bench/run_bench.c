@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs dedup over trees and reports throughput, peak memory and the time of
+// each stage of the pipeline. A cold run drops the pages of every file
+// first, the directories stay cached, so it measures reading the data from
+// the disk rather than walking it.
+
+#define MAX_RUNS 64
+#define MAX_ARGS 16
+#define NUM_STAGES 9
+
+typedef struct {
+    double wall; // seconds
+    double files_per_second;
+    double mb_per_second;
+    double rss_mb; // peak resident set of dedup
+    double stages[NUM_STAGES]; // seconds, as dedup --timing prints them
+} RunResult;
+
+const char *stage_names[NUM_STAGES] = {"walk",  "queue",  "wait",
+                                       "hash",  "index",  "lock",
+                                       "verify", "action", "spill"};
+
+// Size of the tree being measured, nftw has no user pointer
+uint64_t tree_bytes = 0;
+
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Each inode counts once, the names of a hard linked file share its size
+int count_file(const char *path, const struct stat *file_stat, int type,
+               struct FTW *ftw) {
+    (void)path;
+    (void)ftw;
+    if (type == FTW_F && S_ISREG(file_stat->st_mode))
+        tree_bytes += file_stat->st_size / file_stat->st_nlink;
+    return 0;
+}
+
+int drop_file_cache(const char *path, const struct stat *file_stat, int type,
+                    struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(file_stat->st_mode))
+        return 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return 0;
+}
+
+void parse_line(const char *line, RunResult *result, unsigned *files) {
+    char stage[16];
+    double seconds;
+    unsigned count;
+    int matched = 0;
+    // Only the count is assigned if the rest of the line does not match
+    if (sscanf(line, "Found %u files%n", &count, &matched) == 1 && matched) {
+        *files = count;
+        return;
+    }
+    if (sscanf(line, "Time in %15[a-z]: %lf s", stage, &seconds) != 2)
+        return;
+    for (int i = 0; i < NUM_STAGES; i++) {
+        if (strcmp(stage, stage_names[i]) == 0)
+            result->stages[i] = seconds;
+    }
+}
+
+// Runs dedup once with its output going to a pipe we read the numbers from
+int run_dedup(char *const *argv, RunResult *result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("Failed to create pipe");
+        return -1;
+    }
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    memset(result, 0, sizeof(*result));
+    unsigned files = 0;
+    FILE *output = fdopen(fds[0], "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    while (output != NULL && getline(&line, &line_size, output) >= 0) {
+        parse_line(line, result, &files);
+    }
+    free(line);
+    if (output != NULL)
+        fclose(output);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("Failed to wait for dedup");
+        return -1;
+    }
+    result->wall = now_seconds() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "dedup failed\n");
+        return -1;
+    }
+    result->files_per_second = files / result->wall;
+    result->mb_per_second = tree_bytes / (1024.0 * 1024.0) / result->wall;
+    result->rss_mb = usage.ru_maxrss / 1024.0;
+    return 0;
+}
+
+void print_header() {
+    printf("%-24s %-5s %4s %9s %12s %9s %8s", "tree", "cache", "run", "wall s",
+           "files/s", "MB/s", "rss MB");
+    for (int i = 0; i < NUM_STAGES; i++) {
+        printf(" %8s", stage_names[i]);
+    }
+    printf("\n");
+}
+
+void print_result(const char *tree, const char *mode, const char *run,
+                  const RunResult *result) {
+    printf("%-24s %-5s %4s %9.3f %12.0f %9.1f %8.1f", tree, mode, run,
+           result->wall, result->files_per_second, result->mb_per_second,
+           result->rss_mb);
+    for (int i = 0; i < NUM_STAGES; i++) {
+        printf(" %8.3f", result->stages[i]);
+    }
+    printf("\n");
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double median(double *values, int n) {
+    qsort(values, n, sizeof(double), compare_doubles);
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// The median of every column, one slow run does not move it
+RunResult median_result(const RunResult *results, int n) {
+    RunResult result;
+    double values[MAX_RUNS];
+#define MEDIAN_OF(field)                                                       \
+    do {                                                                       \
+        for (int i = 0; i < n; i++)                                            \
+            values[i] = results[i].field;                                      \
+        result.field = median(values, n);                                      \
+    } while (0)
+    MEDIAN_OF(wall);
+    MEDIAN_OF(files_per_second);
+    MEDIAN_OF(mb_per_second);
+    MEDIAN_OF(rss_mb);
+    for (int s = 0; s < NUM_STAGES; s++) {
+        MEDIAN_OF(stages[s]);
+    }
+#undef MEDIAN_OF
+    return result;
+}
+
+int bench_tree(char **argv, int tree_arg, int runs, bool cold) {
+    const char *tree = argv[tree_arg];
+    const char *mode = cold ? "cold" : "warm";
+    RunResult results[MAX_RUNS];
+    if (!cold && run_dedup(argv, &results[0]) != 0) {
+        // Fill the page cache first
+        return -1;
+    }
+    for (int i = 0; i < runs; i++) {
+        if (cold && nftw(tree, drop_file_cache, 64, FTW_PHYS) != 0) {
+            perror("Failed to drop the page cache of the tree");
+            return -1;
+        }
+        if (run_dedup(argv, &results[i]) != 0)
+            return -1;
+        char run[16];
+        snprintf(run, sizeof(run), "%d", i + 1);
+        print_result(tree, mode, run, &results[i]);
+    }
+    RunResult result = median_result(results, runs);
+    print_result(tree, mode, "med", &result);
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--dedup <binary>] [--runs <n>] [--cold] [--warm]\n"
+            "       [--io-uring] <tree>...\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    struct option options[] = {{"dedup", required_argument, NULL, 'd'},
+                               {"runs", required_argument, NULL, 'r'},
+                               {"cold", no_argument, NULL, 'c'},
+                               {"warm", no_argument, NULL, 'w'},
+                               {"io-uring", no_argument, NULL, 'u'},
+                               {NULL, 0, NULL, 0}};
+    char *dedup = "./dedup";
+    int runs = 5;
+    bool cold = false, warm = false, io_uring = false;
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+        case 'd':
+            dedup = optarg;
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'c':
+            cold = true;
+            break;
+        case 'w':
+            warm = true;
+            break;
+        case 'u':
+            io_uring = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || runs < 1 || runs > MAX_RUNS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!cold && !warm) {
+        cold = warm = true;
+    }
+
+    char *dedup_argv[MAX_ARGS];
+    int n = 0;
+    dedup_argv[n++] = dedup;
+    dedup_argv[n++] = "--timing";
+    if (io_uring) {
+        dedup_argv[n++] = "--io-uring";
+    }
+    int tree_arg = n++;
+    dedup_argv[n] = NULL;
+
+    print_header();
+    for (int i = optind; i < argc; i++) {
+        tree_bytes = 0;
+        if (nftw(argv[i], count_file, 64, FTW_PHYS) != 0) {
+            perror(argv[i]);
+            return 1;
+        }
+        dedup_argv[tree_arg] = argv[i];
+        if ((cold && bench_tree(dedup_argv, tree_arg, runs, true) != 0) ||
+            (warm && bench_tree(dedup_argv, tree_arg, runs, false) != 0))
+            return 1;
+    }
+    return 0;
+}
@@ -1,18 +1,35 @@
 #ifndef _DEFAULT_SOURCE
 #define _DEFAULT_SOURCE
 #include "blake3.h"
+#include "lib/action.h"
+#include "lib/checkpoint.h"
+#include "lib/chunk_index.h"
+#include "lib/chunker.h"
+#include "lib/external.h"
+#include "lib/hash_cache.h"
 #include "lib/hash_table.h"
+#include "lib/inode_table.h"
 #include "lib/hashing.h"
+#include "lib/output.h"
+#include "lib/reader.h"
 #include <linux/limits.h>
 #include <stdint.h>
 #include <time.h>
 #endif
 
-#include "lib/ring_buffer.h"
+#include "lib/scheduler.h"
+#include "lib/shard_index.h"
+#include "lib/size_table.h"
+#include "lib/stats.h"
+#include "lib/tree_hash.h"
+#include "lib/uring_hasher.h"
+#include "lib/verify.h"
+#include "lib/walker.h"
 #include "shared/consts.h"
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdio.h>
@@ -26,159 +43,1028 @@
 #define COLOR_FILE "\x1b[94m"
 #define COLOR_RESET "\x1b[0m"
 
-#define NUM_WORKERS 24
-#define BUFFER_SIZE 4096
+// Blocking workers per core, most of them wait for reads
+#define WORKERS_PER_CPU 2
+#define MIN_WORKERS 8
+#define MAX_WORKERS 256
+// With io_uring a few threads keep many files in flight each
+#define NUM_URING_WORKERS 4
+#define URING_DEPTH 64
+// Seconds between two progress lines
+#define PROGRESS_INTERVAL 5
+
+bool use_io_uring = false;
+bool use_cache = false;
+bool print_timing = false;
+bool use_verify = false;
+bool use_chunks = false;
+// Stage a candidate starts at, an index needs the full digest of every file
+HashStage start_stage = HASH_STAGE_HEAD;
+// Workers meet here before they compare or act on the duplicates
+pthread_barrier_t pool_barrier;
 
 typedef struct {
-    char *path;
-    unsigned *file_count;
-    unsigned *dir_count;
-    RingBuffer *buffer;
-} ThreadArgs;
-
-volatile int writing = 1;
-
-void *list_directory(void *arg) {
-    ThreadArgs *args = (ThreadArgs *)arg;
-    DIR *dir = opendir(args->path);
-    if (dir == NULL) {
-        perror("Failed to open directory");
-        return NULL;
+    Walker *walker;
+    Scheduler *scheduler;
+    int interval; // seconds
+    uint64_t start;
+    uint64_t last_time; // time and bytes of the last line, for the rate
+    uint64_t last_bytes;
+    bool done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} Progress;
+
+char *format_size(size_t size) {
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int i = 0;
+    double display_size = (double)size;
+    for (; display_size > 1024 && i < 4; ++i) {
+        display_size /= 1024;
     }
 
-    struct dirent *entry;
-    struct stat path_stat;
+    char *result = malloc(20); // Allocate enough space for the result
+    snprintf(result, 20, "%.2f %s", display_size, units[i]);
+    return result;
+}
+
+// Records the hash of a stage of a file of the given size, returns true if
+// the file needs the next stage. On the first collision held is set to the
+// earlier file, which needs the next stage as well.
+bool record_hash(FilePath file, int hashed, const uint8_t *hash,
+                 uint64_t size, FilePath *held) {
+    *held = NULL;
+    uint64_t start = get_time_ns();
+    uint64_t nested = get_nested_time();
+    bool collides = false;
+    uint32_t num_files = 0;
+    FilePath first = NULL;
+    if (hashed == HASH_STAGE_FULL) {
+        // Add the file and hash to the hashmap, or spill them
+        if (is_indexing())
+            add_index_file(hash, size, file);
+        else if (is_external())
+            add_external_hash(hash, file);
+        else
+            num_files = add_new_hash(hash, file, &first);
+    } else {
+        collides = add_candidate_hash(hash, file, held);
+    }
+    add_outer_stage_time(STAGE_INDEX, start, nested);
+    // Verified groups are streamed once they are compared
+    if (num_files > 1 && !use_verify) {
+        if (first != NULL)
+            output_duplicate(hash, first);
+        output_duplicate(hash, file);
+    }
+    return collides;
+}
+
+// Hash a candidate one stage at a time and only go on with the next stage
+// while it still collides with another file. Returns true if a stage of the
+// file was read rather than found in the cache.
+bool hash_candidate(FilePath file, HashStage stage, const uint8_t *previous) {
     char path[PATH_MAX];
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip the entries "." and ".." as we don't want to loop on them.
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+    if (get_file_path(file, path, sizeof(path)) >= sizeof(path))
+        return false;
 
-        if (strcmp(args->path, "/") == 0) {
-            snprintf(path, sizeof(path), "%s%s", args->path, entry->d_name);
-        } else {
-            snprintf(path, sizeof(path), "%s" PATH_SEPARATOR "%s", args->path,
-                     entry->d_name);
-        }
+    uint8_t hash[MAX_DIGEST_LEN];
+    CacheKey key;
+    struct stat file_stat;
+    // The cache is keyed on the descriptor the stage is read through, so
+    // the key and the digest are of the same file
+    int fd = use_cache ? open(path, O_RDONLY | O_NONBLOCK) : -1;
+    bool keyed = fd >= 0 && fstat(fd, &file_stat) == 0;
+    if (keyed)
+        get_cache_key(&file_stat, &key);
+    int hashed = keyed ? lookup_cached_hash(&key, stage, hash) : -1;
+    uint64_t size = keyed ? key.size : 0;
+    // An interrupted scan may have hashed the stage already
+    if (hashed < 0)
+        hashed = lookup_checkpoint_hash(path, stage, hash, &size);
+    bool read = hashed < 0;
+    if (read) {
+        uint64_t start = get_time_ns();
+        hashed = keyed ? compute_stage_hash_fd(fd, file_stat.st_size, stage,
+                                               previous, hash, &size)
+                       : compute_stage_hash(path, stage, previous, hash,
+                                            &size);
+        add_stage_time(STAGE_HASH, start);
+    }
+    if (fd >= 0)
+        close(fd);
+    if (read) {
+        if (hashed < 0)
+            return false;
+        if (keyed)
+            store_cached_hash(&key, hashed, hash);
+        store_checkpoint_hash(path, stage, hashed, size, hash);
+    }
 
-        if (stat(path, &path_stat) != 0) {
-            fprintf(stderr, "File: %s ", path);
-            perror("Error");
+    FilePath held;
+    if (!record_hash(file, hashed, hash, size, &held))
+        return read;
+    if (held != NULL) {
+        // Both files collided in this stage, so the held one has the same
+        // stage hash and can be chained with it. It was counted when it
+        // was first hashed.
+        hash_candidate(held, get_next_stage(hashed), hash);
+    }
+    return hash_candidate(file, get_next_stage(hashed), hash) || read;
+}
+
+// Hashes a candidate from the given stage on and counts it as one file
+void hash_file(FilePath file, HashStage stage) {
+    uint64_t start = get_time_ns();
+    if (hash_candidate(file, stage, NULL))
+        add_hashed_file(start);
+}
+
+// Hashes a batch of files the walk found small enough to be hashed in full
+// right away, with one read each. Files that changed since the walk go the
+// way of any other candidate.
+void hash_small_files(const SmallBatch *batch) {
+    uint8_t *buffer = get_read_buffer();
+    for (uint32_t i = 0; i < batch->count; i++) {
+        FilePath file = batch->files[i];
+        char path[PATH_MAX];
+        uint8_t hash[MAX_DIGEST_LEN];
+        uint64_t size = (uint64_t)batch->sizes[i];
+        if (get_file_path(file, path, sizeof(path)) >= sizeof(path))
             continue;
+        if (lookup_checkpoint_hash(path, HASH_STAGE_FULL, hash, &size) < 0) {
+            uint64_t start = get_time_ns();
+            int result = buffer != NULL ? hash_small_file(path,
+                                                          batch->sizes[i],
+                                                          buffer, hash)
+                                        : 1;
+            add_stage_time(STAGE_HASH, start);
+            if (result < 0)
+                continue;
+            if (result > 0) {
+                hash_file(file, HASH_STAGE_HEAD);
+                continue;
+            }
+            store_checkpoint_hash(path, HASH_STAGE_FULL, HASH_STAGE_FULL,
+                                  size, hash);
+            add_hashed_file(start);
         }
+        FilePath held;
+        record_hash(file, HASH_STAGE_FULL, hash, size, &held);
+    }
+}
 
-        if (S_ISDIR(path_stat.st_mode)) {
-            (*args->dir_count)++;
-            char *current_path = args->path;
-            args->path = path;
-            list_directory(args);
-            args->path = current_path;
-        } else {
-            if (S_ISREG(path_stat.st_mode)) {
-                write_ring_buffer(args->buffer, args->path, entry->d_name);
-                (*args->file_count)++;
-            }
+// Spells out the path of the job's file, the ring needs it while the job is
+// in flight
+bool set_job_file(HashJob *job, FilePath file) {
+    job->file = file;
+    return get_file_path(file, job->path, sizeof(job->path)) <
+           sizeof(job->path);
+}
+
+HashJob *create_next_job(FilePath file, const HashJob *done) {
+    HashJob *job = malloc(sizeof(HashJob));
+    if (job == NULL) {
+        perror("Failed to allocate memory for hash job");
+        return NULL;
+    }
+    if (!set_job_file(job, file)) {
+        free(job);
+        return NULL;
+    }
+    job->stage = get_next_stage(done->hashed);
+    job->chained = true;
+    memcpy(job->previous, done->hash, MAX_DIGEST_LEN);
+    // Taken from the index rather than the scheduler
+    job->device = -1;
+    job->bytes = 0;
+    job->read = false;
+    return job;
+}
+
+bool push_job(HashJob ***jobs, size_t *num_jobs, size_t *capacity,
+              HashJob *job) {
+    if (*num_jobs == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : URING_DEPTH;
+        HashJob **new_jobs = realloc(*jobs, new_capacity * sizeof(HashJob *));
+        if (new_jobs == NULL) {
+            perror("Failed to allocate memory for hash jobs");
+            return false;
         }
+        *jobs = new_jobs;
+        *capacity = new_capacity;
     }
-    closedir(dir);
-    return NULL;
+    (*jobs)[(*num_jobs)++] = job;
+    return true;
 }
 
-char *format_size(size_t size) {
-    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
-    int i = 0;
-    double display_size = (double)size;
-    for (; display_size > 1024 && i < 4; ++i) {
-        display_size /= 1024;
+// Returns true if the stage of the job is in the checkpoint. The hash cache
+// is looked up by the ring once it has stat'ed the file.
+bool hash_job_from_cache(HashJob *job) {
+    job->keyed = use_cache;
+    job->size = 0;
+    job->hashed = lookup_checkpoint_hash(job->path, job->stage, job->hash,
+                                         &job->size);
+    job->large = false;
+    job->cached = job->hashed >= 0;
+    return job->cached;
+}
+
+// Frees a job whose file needs no other stage, handing its device slot back.
+// Held files were counted when they were first hashed.
+void free_job(Scheduler *scheduler, HashJob *job) {
+    if (job->device >= 0 && job->read)
+        add_hashed_file(job->taken);
+    finish_file(scheduler, job->device, 1, job->bytes, job->taken);
+    free(job);
+}
+
+// Records a finished job, the job and the held file go to ready if they
+// need another stage
+void finish_job(Scheduler *scheduler, HashJob *done, HashJob ***ready,
+                size_t *num_ready, size_t *ready_capacity) {
+    if (done->large) {
+        // Blocks the ring, but the helpers speed it up
+        uint64_t start = get_time_ns();
+        uint64_t bytes = get_thread_bytes();
+        done->hashed = compute_stage_hash(done->path, HASH_STAGE_FULL, NULL,
+                                          done->hash, &done->size);
+        add_stage_time(STAGE_HASH, start);
+        done->bytes += get_thread_bytes() - bytes;
+    }
+    if (done->keyed && !done->cached && done->hashed >= 0)
+        store_cached_hash(&done->key, done->hashed, done->hash);
+    if (!done->cached && done->hashed >= 0) {
+        store_checkpoint_hash(done->path, done->stage, done->hashed,
+                              done->size, done->hash);
+        done->read = true;
     }
 
-    char *result = malloc(20); // Allocate enough space for the result
-    snprintf(result, 20, "%.2f %s", display_size, units[i]);
-    return result;
+    FilePath held;
+    if (done->hashed < 0 ||
+        !record_hash(done->file, done->hashed, done->hash, done->size,
+                     &held)) {
+        free_job(scheduler, done);
+        return;
+    }
+    if (held != NULL) {
+        HashJob *job = create_next_job(held, done);
+        if (job != NULL && !push_job(ready, num_ready, ready_capacity, job))
+            free(job);
+    }
+    done->stage = get_next_stage(done->hashed);
+    done->chained = true;
+    memcpy(done->previous, done->hash, MAX_DIGEST_LEN);
+    if (!push_job(ready, num_ready, ready_capacity, done))
+        free_job(scheduler, done);
 }
 
-void *print_file_path(void *arg) {
-    HashAlgorithm blake3_algorithm = {.init = blake3_init,
-                                      .update = blake3_update,
-                                      .finalize = blake3_finalize};
-    RingBuffer *buffer = (RingBuffer *)arg;
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_nsec += 50000000; // Wait up to 50 mseconds
-
-    char *path;
+// Takes the next candidate, or a batch of small ones if batch is given,
+// counting the time the worker has nothing to do. Returns the device of the
+// file, or -1 once there are no more.
+int wait_for_file(Scheduler *scheduler, FilePath *file, SmallBatch **batch) {
+    uint64_t start = get_time_ns();
+    int device = take_file(scheduler, file, batch, true);
+    add_stage_time(STAGE_WAIT, start);
+    return device;
+}
+
+// Chunks every file and indexes it by the hash of its chunk digests
+void chunk_files(Scheduler *scheduler) {
+    uint8_t *data = malloc(CDC_WINDOW + CDC_READ_SIZE);
+    if (data == NULL) {
+        perror("Failed to allocate memory for chunk buffer");
+        return;
+    }
+    FilePath file;
+    int device;
+    while ((device = wait_for_file(scheduler, &file, NULL)) >= 0) {
+        uint64_t taken = get_time_ns();
+        uint64_t bytes = get_thread_bytes();
+        uint8_t hash[MAX_DIGEST_LEN];
+        uint64_t size;
+        FilePath held;
+        memset(hash, 0, sizeof(hash));
+        if (chunk_file(file, data, hash, &size) == 0)
+            record_hash(file, HASH_STAGE_FULL, hash, size, &held);
+        finish_file(scheduler, device, 1, get_thread_bytes() - bytes, taken);
+    }
+    free(data);
+}
+
+// Same as hash_candidate, but keeps many files in flight on one io_uring.
+// Files that need another stage go back into the ring before new ones.
+void hash_with_io_uring(Scheduler *scheduler, UringHasher *hasher) {
+    HashJob **ready = NULL;
+    size_t num_ready = 0, ready_capacity = 0;
+    bool open = true;
     while (1) {
-        if (is_ring_buffer_empty(buffer)) {
-            if (writing == 0) 
+        while (uring_hasher_has_room(hasher)) {
+            HashJob *job = NULL;
+            if (num_ready > 0) {
+                job = ready[--num_ready];
+            } else if (open && (job = malloc(sizeof(HashJob))) != NULL) {
+                // Only block on the scheduler when there is nothing to wait
+                // for
+                bool idle = uring_hasher_is_idle(hasher);
+                FilePath file;
+                job->device = idle ? wait_for_file(scheduler, &file, NULL)
+                                   : take_file(scheduler, &file, NULL, false);
+                if (job->device >= 0) {
+                    job->taken = get_time_ns();
+                    job->bytes = 0;
+                    job->read = false;
+                    if (!set_job_file(job, file)) {
+                        free_job(scheduler, job);
+                        continue;
+                    }
+                    job->stage = start_stage;
+                    job->chained = false;
+                } else {
+                    open = !idle;
+                    free(job);
+                    job = NULL;
+                }
+            }
+            if (job == NULL)
+                break;
+            if (hash_job_from_cache(job)) {
+                finish_job(scheduler, job, &ready, &num_ready,
+                           &ready_capacity);
+                continue;
+            }
+            if (submit_hash_job(hasher, job) != 0) {
+                push_job(&ready, &num_ready, &ready_capacity, job);
+                break;
+            }
+        }
+
+        HashJob *done = next_finished_job(hasher);
+        if (done == NULL) {
+            if (!open && num_ready == 0)
                 break;
             continue;
         }
-        path = read_and_free_ring_buffer(buffer, &timeout);
-
-        // Calculate and print the hash of the file
-        uint8_t hash[BLAKE3_OUT_LEN];
-        size_t size = 0;
-        if (compute_hash(path, &blake3_algorithm, hash, &size) == 0) {
-            char hash_str[BLAKE3_OUT_LEN * 2 +
-                          1]; // Each byte will be 2 characters
-                              // in hex, plus null terminator
-            for (size_t i = 0; i < BLAKE3_OUT_LEN; i++) {
-                sprintf(&hash_str[i * 2], "%02x", hash[i]);
+
+        finish_job(scheduler, done, &ready, &num_ready, &ready_capacity);
+    }
+    free(ready);
+}
+
+// Once every worker is done hashing the index no longer changes, one of
+// them collects its groups and all of them compare the files. The same
+// goes for acting on the groups once they are verified.
+void finish_in_pool() {
+    if (use_verify) {
+        if (pthread_barrier_wait(&pool_barrier) ==
+            PTHREAD_BARRIER_SERIAL_THREAD)
+            prepare_verification();
+        pthread_barrier_wait(&pool_barrier);
+        verify_groups();
+    }
+    if (get_action() != ACTION_REPORT) {
+        if (pthread_barrier_wait(&pool_barrier) ==
+            PTHREAD_BARRIER_SERIAL_THREAD)
+            prepare_actions();
+        pthread_barrier_wait(&pool_barrier);
+        run_actions();
+    }
+}
+
+void *print_file_path(void *arg) {
+    set_thread_role("worker");
+    Scheduler *scheduler = (Scheduler *)arg;
+
+    UringHasher *hasher = use_io_uring && !use_chunks
+                              ? create_uring_hasher(URING_DEPTH)
+                              : NULL;
+    if (use_chunks) {
+        chunk_files(scheduler);
+    } else if (hasher != NULL) {
+        hash_with_io_uring(scheduler, hasher);
+    } else {
+        // Runs until the scheduler is closed and drained
+        FilePath file;
+        SmallBatch *batch;
+        int device;
+        while ((device = wait_for_file(scheduler, &file, &batch)) >= 0) {
+            uint64_t taken = get_time_ns();
+            uint64_t bytes = get_thread_bytes();
+            uint32_t files = 1;
+            if (batch != NULL) {
+                hash_small_files(batch);
+                files = batch->count;
+                free(batch);
+            } else if (is_external()) {
+                hash_file(file, get_external_stage());
+            } else {
+                hash_file(file, start_stage);
             }
-            // printf(COLOR_FILE "%s %s (size %ld)\n" COLOR_RESET, hash_str, path,
-            //        size);
+            finish_file(scheduler, device, files, get_thread_bytes() - bytes,
+                        taken);
+            if (is_external())
+                finish_external_file();
+        }
+    }
+    if (hasher != NULL) {
+        destroy_uring_hasher(hasher);
+    }
+    // Lend a hand with the large files the other workers are still on
+    help_tree_hashes();
+    if (use_verify || get_action() != ACTION_REPORT)
+        finish_in_pool();
+    return NULL;
+}
+
+void print_progress(Progress *progress) {
+    StatsTotals totals;
+    sum_stats(&totals);
+    uint64_t now = get_time_ns();
+    double seconds = (now - progress->last_time) / 1e9;
+    double rate = seconds > 0
+                      ? (totals.bytes - progress->last_bytes) / seconds
+                      : 0;
+    progress->last_time = now;
+    progress->last_bytes = totals.bytes;
 
-            // Add the file path and hash to the hashmap
-            add_new_hash(hash_str, path);
+    fprintf(stderr,
+            "[%.0f s] %u files in %u directories, %u candidates, "
+            "%llu hashed, %.1f MiB read at %.1f MiB/s, queue %d%% full, "
+            "%llu errors\n",
+            (now - progress->start) / 1e9,
+            atomic_load(&progress->walker->file_count),
+            atomic_load(&progress->walker->dir_count),
+            atomic_load(&progress->walker->candidate_count),
+            (unsigned long long)totals.files, totals.bytes / 1048576.0,
+            rate / 1048576.0, get_queue_fill(progress->scheduler),
+            (unsigned long long)totals.errors);
+}
+
+// Prints a line every interval until the scan is done
+void *report_progress(void *arg) {
+    Progress *progress = (Progress *)arg;
+    pthread_mutex_lock(&progress->mutex);
+    while (!progress->done) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += progress->interval;
+        int result = 0;
+        while (!progress->done && result != ETIMEDOUT) {
+            result = pthread_cond_timedwait(&progress->cond, &progress->mutex,
+                                            &deadline);
         }
-        // free_ring_buffer(buffer);
+        if (!progress->done)
+            print_progress(progress);
     }
+    pthread_mutex_unlock(&progress->mutex);
     return NULL;
 }
 
+int start_progress(Progress *progress, pthread_t *thread) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&progress->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&progress->mutex, NULL);
+    progress->done = false;
+    progress->last_time = progress->start;
+    progress->last_bytes = 0;
+    if (pthread_create(thread, NULL, report_progress, progress) != 0) {
+        perror("Failed to create progress thread");
+        return -1;
+    }
+    return 0;
+}
+
+void stop_progress(Progress *progress, pthread_t thread) {
+    pthread_mutex_lock(&progress->mutex);
+    progress->done = true;
+    pthread_cond_signal(&progress->cond);
+    pthread_mutex_unlock(&progress->mutex);
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&progress->cond);
+    pthread_mutex_destroy(&progress->mutex);
+}
+
+// Starts streaming the duplicates to path. For "-" the records take over
+// stdout and the rest of the report goes to stderr.
+int open_output(const char *path, OutputFormat format) {
+    int fd;
+    if (strcmp(path, "-") == 0) {
+        fflush(stdout);
+        fd = dup(STDOUT_FILENO);
+        if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Failed to redirect stdout");
+            return -1;
+        }
+    } else {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("Failed to open output file");
+            return -1;
+        }
+    }
+    return start_output(format, fd);
+}
+
+// The other names of the files are only known once the walk is done, they
+// follow the groups
+void output_hard_links() {
+    DuplicateGroup *groups;
+    long count = list_duplicate_groups(&groups);
+    if (count < 0)
+        return;
+    for (long i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < groups[i].num_files; j++) {
+            InodeLinks *links = find_inode_links(groups[i].files[j]);
+            for (unsigned k = 0; links != NULL && k < links->num_links; k++) {
+                output_hard_link(links->links[k], groups[i].files[j]);
+            }
+        }
+    }
+    free(groups);
+}
+
+// Writes the counters of the run as JSON, to stdout for "-"
+int write_stats(const char *path, Walker *walker, Scheduler *scheduler,
+                uint64_t start) {
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to open stats file");
+        return -1;
+    }
+    fprintf(file,
+            "{\n  \"elapsed_s\": %.6f,\n  \"walk\": {\"files\": %u, "
+            "\"directories\": %u, \"candidates\": %u, ",
+            (get_time_ns() - start) / 1e9, atomic_load(&walker->file_count),
+            atomic_load(&walker->dir_count),
+            atomic_load(&walker->candidate_count));
+    // Files that are all queued are not grouped by size
+    if (walker->queue_all) {
+        fprintf(file, "\"colliding_sizes\": null, ");
+    } else {
+        fprintf(file, "\"colliding_sizes\": %u, ",
+                is_external() ? count_external_sizes()
+                              : count_colliding_sizes());
+    }
+    fprintf(file, "\"hard_links\": %u},\n",
+            is_external() ? count_external_links() : count_hard_links());
+    if (use_verify) {
+        fprintf(file,
+                "  \"verify\": {\"groups\": %llu, \"differing_files\": %llu, "
+                "\"unreadable_files\": %llu, \"bytes\": %llu},\n",
+                (unsigned long long)count_verified_groups(),
+                (unsigned long long)count_differing_files(),
+                (unsigned long long)count_unreadable_files(),
+                (unsigned long long)count_verified_bytes());
+    }
+    if (get_action() != ACTION_REPORT) {
+        write_action_json(file);
+    }
+    if (use_chunks) {
+        write_chunk_json(file);
+    }
+    write_scheduler_json(scheduler, file);
+    write_stats_json(file);
+    fprintf(file, "}\n");
+    if (file == stdout)
+        return fflush(file) == 0 ? 0 : -1;
+    if (fclose(file) != 0) {
+        perror("Failed to write stats file");
+        return -1;
+    }
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--io-uring] [--cache <file>] [--first-pass <engine>]\n"
+            "       [--chunks] [--verify] [--action <action>] [--dry-run] "
+            "[--hardlink-fallback]\n"
+            "       [--output <file>] [--output-format <format>] "
+            "[--memory <MiB>]\n"
+            "       [--workers <n>] [--read-size <KiB>] [--huge-pages] "
+            "[--drop-cache] [--direct]\n"
+            "       [--checkpoint <file> [--resume]] [--timing] "
+            "[--progress[=<seconds>]]\n"
+            "       [--stats <file>] [--index <file>] <directory>\n"
+            "       %s --merge <index>...\n"
+            "Engines: blake3 (default), fast\n"
+            "Actions: report (default), dedupe, hardlink\n"
+            "Output formats: ndjson (default), binary\n",
+            program, program);
+}
+
 int main(int argc, char *argv[]) {
-    unsigned file_count = 0;
-    unsigned dir_count = 0;
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <directory>\n", argv[0]);
+    struct option options[] = {{"io-uring", no_argument, NULL, 'u'},
+                               {"cache", required_argument, NULL, 'c'},
+                               {"timing", no_argument, NULL, 't'},
+                               {"progress", optional_argument, NULL, 'p'},
+                               {"stats", required_argument, NULL, 's'},
+                               {"first-pass", required_argument, NULL, 'f'},
+                               {"verify", no_argument, NULL, 'v'},
+                               {"chunks", no_argument, NULL, 'k'},
+                               {"action", required_argument, NULL, 'a'},
+                               {"dry-run", no_argument, NULL, 'n'},
+                               {"hardlink-fallback", no_argument, NULL, 'l'},
+                               {"output", required_argument, NULL, 'o'},
+                               {"output-format", required_argument, NULL, 'F'},
+                               {"memory", required_argument, NULL, 'm'},
+                               {"workers", required_argument, NULL, 'w'},
+                               {"read-size", required_argument, NULL, 'r'},
+                               {"huge-pages", no_argument, NULL, 'H'},
+                               {"drop-cache", no_argument, NULL, 'D'},
+                               {"direct", no_argument, NULL, 'O'},
+                               {"checkpoint", required_argument, NULL, 'C'},
+                               {"resume", no_argument, NULL, 'R'},
+                               {"index", required_argument, NULL, 'x'},
+                               {"merge", no_argument, NULL, 'M'},
+                               {NULL, 0, NULL, 0}};
+    const char *cache_file = NULL;
+    const char *stats_file = NULL;
+    const char *output_file = NULL;
+    const char *checkpoint_file = NULL;
+    bool resume = false;
+    const char *index_file = NULL;
+    bool merge = false;
+    int output_format = OUTPUT_NDJSON;
+    long memory_budget = 0; // MiB, 0 keeps everything in memory
+    int num_workers = 0; // 0 picks a number from the cores
+    ReadOptions read_options = {.read_size = DEFAULT_READ_SIZE};
+    int progress_interval = 0;
+    int action = ACTION_REPORT;
+    bool dry_run = false, hardlink_fallback = false;
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+        case 'u':
+            use_io_uring = true;
+            break;
+        case 'c':
+            cache_file = optarg;
+            break;
+        case 't':
+            print_timing = true;
+            break;
+        case 'p':
+            progress_interval = optarg ? atoi(optarg) : PROGRESS_INTERVAL;
+            if (progress_interval <= 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            stats_file = optarg;
+            break;
+        case 'f':
+            // Groups that collide in the first pass are confirmed with BLAKE3
+            if (find_hash_engine(optarg) == NULL) {
+                fprintf(stderr, "Unknown hash engine: %s\n", optarg);
+                print_usage(argv[0]);
+                return 1;
+            }
+            set_first_pass_engine(find_hash_engine(optarg));
+            break;
+        case 'v':
+            use_verify = true;
+            break;
+        case 'k':
+            use_chunks = true;
+            break;
+        case 'a':
+            action = find_action(optarg);
+            if (action < 0) {
+                fprintf(stderr, "Unknown action: %s\n", optarg);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        case 'l':
+            hardlink_fallback = true;
+            break;
+        case 'o':
+            output_file = optarg;
+            break;
+        case 'm':
+            memory_budget = atol(optarg);
+            if (memory_budget * 1024 * 1024 < EXTERNAL_MIN_BUDGET) {
+                fprintf(stderr, "The memory budget is at least %d MiB\n",
+                        EXTERNAL_MIN_BUDGET / (1024 * 1024));
+                return 1;
+            }
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                fprintf(stderr, "The number of workers is 1 to %d\n",
+                        MAX_WORKERS);
+                return 1;
+            }
+            break;
+        case 'r': {
+            long read_size = atol(optarg) * 1024;
+            if (read_size < MIN_READ_SIZE || read_size > MAX_READ_SIZE ||
+                read_size % READ_ALIGNMENT != 0) {
+                fprintf(stderr,
+                        "The read size is %d to %d KiB, in steps of %d KiB\n",
+                        MIN_READ_SIZE / 1024, MAX_READ_SIZE / 1024,
+                        READ_ALIGNMENT / 1024);
+                return 1;
+            }
+            read_options.read_size = (size_t)read_size;
+            break;
+        }
+        case 'H':
+            read_options.huge_pages = true;
+            break;
+        case 'D':
+            read_options.drop_cache = true;
+            break;
+        case 'O':
+            read_options.direct = true;
+            break;
+        case 'C':
+            checkpoint_file = optarg;
+            break;
+        case 'R':
+            resume = true;
+            break;
+        case 'x':
+            index_file = optarg;
+            break;
+        case 'M':
+            merge = true;
+            break;
+        case 'F':
+            output_format = find_output_format(optarg);
+            if (output_format < 0) {
+                fprintf(stderr, "Unknown output format: %s\n", optarg);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    // The arguments are the indexes of the shards, nothing is scanned
+    if (merge) {
+        MergeTotals totals;
+        if (merge_shard_indexes(argv + optind, argc - optind, &totals) != 0)
+            return 1;
+        char *size = format_size(totals.duplicate_bytes);
+        printf("Merged %llu files from %d indexes\n",
+               (unsigned long long)totals.files, argc - optind);
+        printf("Found %llu groups of duplicates, %llu of them across "
+               "indexes, %s in extra copies\n",
+               (unsigned long long)totals.groups,
+               (unsigned long long)totals.cross_shard_groups, size);
+        free(size);
+        return 0;
+    }
+    // The groups of the external mode are only known at the very end
+    if (memory_budget > 0 &&
+        (use_verify || use_chunks || action != ACTION_REPORT ||
+         hardlink_fallback)) {
+        fprintf(stderr, "--memory cannot be combined with --verify, --chunks "
+                        "or --action\n");
+        return 1;
+    }
+    // The groups of a shard are only known once the indexes are merged
+    if (index_file != NULL &&
+        (memory_budget > 0 || use_verify || use_chunks ||
+         action != ACTION_REPORT || hardlink_fallback || output_file != NULL)) {
+        fprintf(stderr, "--index cannot be combined with --memory, --verify, "
+                        "--chunks, --action or --output\n");
+        return 1;
+    }
+    if (resume && checkpoint_file == NULL) {
+        fprintf(stderr, "--resume needs the --checkpoint to resume from\n");
+        return 1;
+    }
+    // Chunking reads whole files with blocking reads, and the external mode
+    // counts the files of a batch as the workers finish them
+    if (use_chunks || memory_budget > 0) {
+        use_io_uring = false;
+    }
+    // FIDEDUPERANGE compares the data itself, replacing a file any other way
+    // relies on it being verified
+    if (action == ACTION_HARDLINK || hardlink_fallback) {
+        use_verify = true;
+    }
+    set_action(action, dry_run, hardlink_fallback);
+    set_read_options(&read_options);
+    // Records go out while the workers hash, so it starts before them
+    if (output_file != NULL && open_output(output_file, output_format) != 0) {
+        return 1;
+    }
+    if (memory_budget > 0 &&
+        start_external((size_t)memory_budget * 1024 * 1024) != 0) {
+        return 1;
+    }
+    // A file whose size is unique here may have a copy in another shard
+    if (index_file != NULL) {
+        if (start_shard_index(index_file) != 0)
+            return 1;
+        start_stage = HASH_STAGE_FULL;
+    }
+    uint64_t start = get_time_ns();
+    set_thread_role("main");
+    if (cache_file != NULL) {
+        // Files whose key is unchanged since the last run are not read
+        if (open_hash_cache(cache_file) != 0) {
+            return 1;
+        }
+        use_cache = true;
+    }
+    // Opened before the walk, which replays what the journal holds
+    if (checkpoint_file != NULL &&
+        open_checkpoint(checkpoint_file, argv[optind], resume) != 0) {
         return 1;
     }
 
-    // Create and initialize the ring buffer
-    RingBuffer *buffer = create_ring_buffer(BUFFER_SIZE);
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1)
+        num_cpus = 1;
+    bool default_workers = num_workers == 0;
+    if (default_workers) {
+        num_workers = num_cpus * WORKERS_PER_CPU;
+        if (num_workers < MIN_WORKERS)
+            num_workers = MIN_WORKERS;
+        if (num_workers > MAX_WORKERS)
+            num_workers = MAX_WORKERS;
+    }
+    if (use_io_uring) {
+        // Fall back to blocking reads if the kernel cannot do what we need
+        UringHasher *hasher = create_uring_hasher(URING_DEPTH);
+        if (hasher != NULL) {
+            destroy_uring_hasher(hasher);
+            if (default_workers)
+                num_workers = NUM_URING_WORKERS;
+        } else {
+            fprintf(stderr, "io_uring is not available, using blocking reads\n");
+            use_io_uring = false;
+        }
+    }
 
-    // Create the directory listing thread
-    pthread_t list_dir_thread;
-    ThreadArgs list_dir_args = {.path = argv[1],
-                                .file_count = &file_count,
-                                .dir_count = &dir_count,
-                                .buffer = buffer};
-    if (pthread_create(&list_dir_thread, NULL, list_directory,
-                       &list_dir_args) != 0) {
-        perror("Failed to create directory listing thread");
+    // Files in flight per device are limited to what the workers can read
+    // at once, a ring keeps URING_DEPTH of them
+    Scheduler *scheduler = create_scheduler(
+        use_io_uring ? num_workers * URING_DEPTH : num_workers);
+    if (scheduler == NULL) {
+        return 1;
+    }
+
+    // One directory walker per core, they share the tree by stealing work
+    Walker *walker = create_walker(num_cpus, scheduler);
+    if (walker == NULL) {
+        return 1;
+    }
+    // Chunks are shared between files of any size, and an index holds all
+    walker->queue_all = use_chunks || is_indexing();
+    // The cache and the io_uring and chunk workers go one file at a time
+    walker->batch_small = !use_cache && !use_io_uring && !use_chunks;
+
+    // Report while the scan runs, a long scan is silent otherwise
+    Progress progress = {.walker = walker,
+                         .scheduler = scheduler,
+                         .interval = progress_interval,
+                         .start = start};
+    pthread_t progress_thread;
+    if (progress_interval > 0 &&
+        start_progress(&progress, &progress_thread) != 0) {
         return 1;
     }
 
     // Create the worker threads
-    pthread_t workers[NUM_WORKERS];
-    for (int i = 0; i < NUM_WORKERS; i++) {
-        if (pthread_create(&workers[i], NULL, print_file_path, buffer) != 0) {
+    init_tree_hashing(num_workers);
+    if (use_verify)
+        init_verification(num_workers);
+    if ((use_verify || action != ACTION_REPORT) &&
+        pthread_barrier_init(&pool_barrier, NULL, num_workers) != 0) {
+        perror("Failed to create worker barrier");
+        return 1;
+    }
+    pthread_t *workers = malloc(num_workers * sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("Failed to allocate memory for worker threads");
+        return 1;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, print_file_path, scheduler) !=
+            0) {
             perror("Failed to create worker thread");
             return 1;
         }
     }
 
-    // Wait for the directory listing thread to finish
-    pthread_join(list_dir_thread, NULL);
-    writing = 0;
+    // Walk the tree, the workers hash the candidates as they come in
+    uint64_t walk_start = get_time_ns();
+    if (walk_directory(walker, argv[optind]) != 0) {
+        return 1;
+    }
+    add_stage_time(STAGE_WALK, walk_start);
+    // The files were spilled, they are queued by size now
+    int result = 0;
+    if (is_external() && queue_external_candidates(scheduler, walker) != 0) {
+        result = 1;
+    }
+    close_scheduler(scheduler);
     // Wait for the worker threads to finish
-    for (int i = 0; i < NUM_WORKERS; i++) {
+    for (int i = 0; i < num_workers; i++) {
         pthread_join(workers[i], NULL);
     }
-    print_duplicates();
-    printf("Found %d files and %d directories\n", file_count, dir_count);
+    free(workers);
+    // The scan is complete, what is left of the journal goes to disk
+    if (close_checkpoint() != 0) {
+        result = 1;
+    }
+    if (progress_interval > 0) {
+        stop_progress(&progress, progress_thread);
+    }
+    if (use_verify || action != ACTION_REPORT) {
+        pthread_barrier_destroy(&pool_barrier);
+    }
+    uint64_t indexed = 0;
+    if (is_indexing()) {
+        if (result == 0 && write_shard_index(&indexed) != 0)
+            result = 1;
+    } else if (is_external()) {
+        if (result == 0 && report_external_duplicates() != 0)
+            result = 1;
+    } else if (!is_output_started()) {
+        if (use_verify)
+            print_verified_duplicates();
+        else
+            print_duplicates();
+    }
+    if (is_output_started()) {
+        output_hard_links();
+        if (stop_output(atomic_load(&walker->file_count),
+                        atomic_load(&walker->dir_count)) != 0) {
+            return 1;
+        }
+    }
+    if (use_chunks) {
+        print_chunk_report();
+    }
+    save_hash_cache();
+    printf("Found %u files and %u directories\n",
+           atomic_load(&walker->file_count), atomic_load(&walker->dir_count));
+    if (walker->queue_all) {
+        printf("Found %u candidate files, their sizes were not grouped\n",
+               atomic_load(&walker->candidate_count));
+    } else {
+        printf("Found %u candidate files sharing %u sizes\n",
+               atomic_load(&walker->candidate_count),
+               is_external() ? count_external_sizes()
+                             : count_colliding_sizes());
+    }
+    printf("Found %u hard links to files already seen\n",
+           is_external() ? count_external_links() : count_hard_links());
+    if (is_indexing()) {
+        printf("Wrote %llu files to the index %s\n",
+               (unsigned long long)indexed, index_file);
+    }
+    if (use_verify) {
+        printf("Verified %llu groups byte for byte, %llu files differed from "
+               "their group, %llu could not be read\n",
+               (unsigned long long)count_verified_groups(),
+               (unsigned long long)count_differing_files(),
+               (unsigned long long)count_unreadable_files());
+    }
+    if (action != ACTION_REPORT) {
+        print_action_summary();
+    }
+    if (print_timing) {
+        print_stage_times();
+    }
+    if (stats_file != NULL) {
+        write_stats(stats_file, walker, scheduler, start);
+    }
 
-    // Don't forget to free the buffer when you're done with it
-    destroy_ring_buffer(buffer);
-    return 0;
+    // Don't forget to free the queues when you're done with them
+    destroy_walker(walker);
+    destroy_scheduler(scheduler);
+    free_size_table();
+    free_candidates();
+    free_hashes();
+    free_inode_table();
+    free_actions();
+    free_chunk_index();
+    free_verification();
+    free_external();
+    free_shard_index();
+    close_hash_cache();
+    free_path_store();
+    return result;
 }
@@ -0,0 +1,437 @@
+#define _POSIX_C_SOURCE 200809L
+#include "action.h"
+#include "inode_table.h"
+#include "stats.h"
+#include "verify.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// What a kernel call did for a set of files
+typedef enum {
+    ACTION_DONE,
+    ACTION_UNSUPPORTED, // the filesystem cannot do it, try the next way
+    ACTION_FAILED
+} ActionResult;
+
+// Groups in flight on a filesystem
+typedef struct {
+    dev_t dev;
+    int active;
+} FilesystemSlot;
+
+ActionMode action_mode = ACTION_REPORT;
+bool action_dry_run = false;
+bool action_hardlink_fallback = false;
+
+DuplicateGroup *action_groups = NULL;
+size_t num_action_groups = 0;
+atomic_size_t next_action_group = 0;
+
+FilesystemSlot filesystems[MAX_FILESYSTEMS];
+int num_filesystems = 0;
+pthread_mutex_t filesystem_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t filesystem_cond = PTHREAD_COND_INITIALIZER;
+
+atomic_uint_fast64_t reclaimed_bytes = 0;
+atomic_uint_fast64_t reclaimed_files = 0;
+atomic_uint_fast64_t changed_files = 0; // differed when the kernel compared
+atomic_uint_fast64_t skipped_files = 0; // no way to share them
+atomic_uint_fast64_t failed_files = 0;
+
+int find_action(const char *name) {
+    const char *names[] = {"report", "dedupe", "hardlink"};
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+void set_action(ActionMode mode, bool dry_run, bool hardlink_fallback) {
+    action_mode = mode;
+    action_dry_run = dry_run;
+    action_hardlink_fallback = hardlink_fallback;
+}
+
+ActionMode get_action() { return action_mode; }
+
+int prepare_actions() {
+    long count = list_duplicate_groups(&action_groups);
+    if (count < 0)
+        return -1;
+    num_action_groups = (size_t)count;
+    atomic_store(&next_action_group, 0);
+    return 0;
+}
+
+// Waits until the filesystem has room for another group. Filesystems beyond
+// MAX_FILESYSTEMS share the last slot.
+FilesystemSlot *acquire_filesystem(dev_t dev) {
+    pthread_mutex_lock(&filesystem_mutex);
+    FilesystemSlot *slot = NULL;
+    for (int i = 0; i < num_filesystems && slot == NULL; i++) {
+        if (filesystems[i].dev == dev)
+            slot = &filesystems[i];
+    }
+    if (slot == NULL && num_filesystems < MAX_FILESYSTEMS) {
+        slot = &filesystems[num_filesystems++];
+        slot->dev = dev;
+        slot->active = 0;
+    } else if (slot == NULL) {
+        slot = &filesystems[MAX_FILESYSTEMS - 1];
+    }
+    while (slot->active >= ACTIONS_PER_FILESYSTEM) {
+        pthread_cond_wait(&filesystem_cond, &filesystem_mutex);
+    }
+    slot->active++;
+    pthread_mutex_unlock(&filesystem_mutex);
+    return slot;
+}
+
+void release_filesystem(FilesystemSlot *slot) {
+    pthread_mutex_lock(&filesystem_mutex);
+    slot->active--;
+    pthread_cond_broadcast(&filesystem_cond);
+    pthread_mutex_unlock(&filesystem_mutex);
+}
+
+void report_failure(const char *what, FilePath file) {
+    int error = errno;
+    char path[PATH_MAX];
+    if (get_file_path(file, path, sizeof(path)) >= sizeof(path))
+        path[0] = '\0';
+    fprintf(stderr, "Failed to %s %s: %s\n", what, path, strerror(error));
+    atomic_fetch_add(&failed_files, 1);
+}
+
+// Errors of a filesystem that has no such call
+bool is_unsupported(int error) {
+    return error == EOPNOTSUPP || error == ENOTTY || error == EINVAL ||
+           error == EXDEV || error == ENOSYS;
+}
+
+// Shares the source with up to DEDUPE_BATCH_SIZE files in one call per
+// range. The kernel compares the data, a file that differs keeps its own.
+ActionResult dedupe_batch(int source_fd, off_t size, FilePath *files,
+                          const int *fds, uint32_t count) {
+    struct file_dedupe_range *range =
+        malloc(sizeof(*range) + count * sizeof(struct file_dedupe_range_info));
+    uint64_t *shared = calloc(count, sizeof(uint64_t));
+    uint32_t *members = malloc(count * sizeof(uint32_t)); // file of each info
+    bool *active = malloc(count * sizeof(bool));
+    if (range == NULL || shared == NULL || members == NULL || active == NULL) {
+        perror("Failed to allocate memory for dedupe range");
+        free(range);
+        free(shared);
+        free(members);
+        free(active);
+        return ACTION_FAILED;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        active[i] = fds[i] >= 0;
+    }
+
+    ActionResult result = ACTION_DONE;
+    off_t offset = 0;
+    while (offset < size) {
+        memset(range, 0, sizeof(*range));
+        range->src_offset = offset;
+        range->src_length = size - offset < DEDUPE_RANGE_SIZE
+                                ? size - offset
+                                : DEDUPE_RANGE_SIZE;
+        uint16_t n = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!active[i])
+                continue;
+            memset(&range->info[n], 0, sizeof(range->info[n]));
+            range->info[n].dest_fd = fds[i];
+            range->info[n].dest_offset = offset;
+            members[n++] = i;
+        }
+        if (n == 0)
+            break;
+        range->dest_count = n;
+        if (ioctl(source_fd, FIDEDUPERANGE, range) != 0) {
+            if (offset == 0 && is_unsupported(errno)) {
+                result = ACTION_UNSUPPORTED;
+            } else {
+                report_failure("dedupe", files[members[0]]);
+                result = ACTION_FAILED;
+            }
+            break;
+        }
+
+        // Files that got ahead share the rest of the range again, which
+        // changes nothing
+        uint64_t advance = UINT64_MAX;
+        for (uint16_t k = 0; k < n; k++) {
+            struct file_dedupe_range_info *info = &range->info[k];
+            uint32_t i = members[k];
+            if (info->status == FILE_DEDUPE_RANGE_SAME &&
+                info->bytes_deduped > 0) {
+                uint64_t end = offset + info->bytes_deduped;
+                shared[i] = end > shared[i] ? end : shared[i];
+                if (info->bytes_deduped < advance)
+                    advance = info->bytes_deduped;
+                continue;
+            }
+            active[i] = false;
+            if (info->status == FILE_DEDUPE_RANGE_DIFFERS) {
+                atomic_fetch_add(&changed_files, 1);
+            } else if (info->status < 0) {
+                errno = -info->status;
+                report_failure("dedupe", files[i]);
+            }
+        }
+        if (advance == UINT64_MAX)
+            break;
+        offset += advance;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (shared[i] == 0)
+            continue;
+        atomic_fetch_add(&reclaimed_bytes, shared[i]);
+        atomic_fetch_add(&reclaimed_files, 1);
+    }
+    free(range);
+    free(shared);
+    free(members);
+    free(active);
+    return result;
+}
+
+ActionResult dedupe_files(int source_fd, off_t size, FilePath *files,
+                          uint32_t count) {
+    int fds[DEDUPE_BATCH_SIZE];
+    char path[PATH_MAX];
+    for (uint32_t start = 0; start < count; start += DEDUPE_BATCH_SIZE) {
+        uint32_t n = count - start < DEDUPE_BATCH_SIZE ? count - start
+                                                       : DEDUPE_BATCH_SIZE;
+        for (uint32_t i = 0; i < n; i++) {
+            // Read only is enough for files we may write to
+            fds[i] = -1;
+            if (get_file_path(files[start + i], path, sizeof(path)) <
+                sizeof(path))
+                fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+            if (fds[i] < 0)
+                report_failure("open", files[start + i]);
+        }
+        ActionResult result =
+            dedupe_batch(source_fd, size, files + start, fds, n);
+        for (uint32_t i = 0; i < n; i++) {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+        // The same filesystem gives the same answer for the other batches
+        if (result == ACTION_UNSUPPORTED)
+            return start == 0 ? ACTION_UNSUPPORTED : ACTION_FAILED;
+    }
+    return ACTION_DONE;
+}
+
+// Makes the file share all extents of the source, the data must be equal
+ActionResult clone_file(int source_fd, off_t size, FilePath file) {
+    char path[PATH_MAX];
+    if (get_file_path(file, path, sizeof(path)) >= sizeof(path))
+        return ACTION_FAILED;
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        report_failure("open", file);
+        return ACTION_FAILED;
+    }
+    ActionResult result = ACTION_DONE;
+    if (ioctl(fd, FICLONE, source_fd) != 0) {
+        result = is_unsupported(errno) ? ACTION_UNSUPPORTED : ACTION_FAILED;
+        if (result == ACTION_FAILED)
+            report_failure("clone", file);
+    } else {
+        atomic_fetch_add(&reclaimed_bytes, size);
+        atomic_fetch_add(&reclaimed_files, 1);
+    }
+    close(fd);
+    return result;
+}
+
+// Puts a hard link to the source in place of the file. The link is made
+// under a temporary name first and renamed over the file, so the name
+// never goes missing.
+int link_path(const char *source, FilePath file) {
+    char path[PATH_MAX], temporary[PATH_MAX];
+    if (get_file_path(file, path, sizeof(path)) >= sizeof(path) ||
+        snprintf(temporary, sizeof(temporary), "%s.dedup-%ld", path,
+                 (long)getpid()) >= (int)sizeof(temporary))
+        return -1;
+    if (link(source, temporary) != 0) {
+        report_failure("link", file);
+        return -1;
+    }
+    if (rename(temporary, path) != 0) {
+        report_failure("replace", file);
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+// The other names of the file are replaced as well, its data is only freed
+// once none of them is left
+void hardlink_file(const char *source, off_t size, FilePath file) {
+    if (link_path(source, file) != 0)
+        return;
+    InodeLinks *links = find_inode_links(file);
+    for (unsigned i = 0; links != NULL && i < links->num_links; i++) {
+        link_path(source, links->links[i]);
+    }
+    atomic_fetch_add(&reclaimed_bytes, size);
+    atomic_fetch_add(&reclaimed_files, 1);
+}
+
+void print_planned_action(const char *source, FilePath file) {
+    char path[PATH_MAX];
+    if (get_file_path(file, path, sizeof(path)) < sizeof(path))
+        printf("Would %s %s %s %s\n",
+               action_mode == ACTION_HARDLINK ? "link" : "dedupe", path,
+               action_mode == ACTION_HARDLINK ? "to" : "against", source);
+}
+
+// Shares the source with files on the same filesystem
+void act_on_files(FilePath source, const struct stat *source_stat,
+                  FilePath *files, uint32_t count, bool verified) {
+    char source_path[PATH_MAX];
+    if (get_file_path(source, source_path, sizeof(source_path)) >=
+        sizeof(source_path))
+        return;
+    if (action_dry_run) {
+        for (uint32_t i = 0; i < count; i++) {
+            print_planned_action(source_path, files[i]);
+        }
+        atomic_fetch_add(&reclaimed_bytes, source_stat->st_size * count);
+        atomic_fetch_add(&reclaimed_files, count);
+        return;
+    }
+    if (action_mode == ACTION_HARDLINK) {
+        for (uint32_t i = 0; i < count; i++) {
+            hardlink_file(source_path, source_stat->st_size, files[i]);
+        }
+        return;
+    }
+
+    int source_fd = open(source_path, O_RDONLY | O_CLOEXEC);
+    if (source_fd < 0) {
+        report_failure("open", source);
+        return;
+    }
+    ActionResult result =
+        dedupe_files(source_fd, source_stat->st_size, files, count);
+    for (uint32_t i = 0; result == ACTION_UNSUPPORTED && i < count; i++) {
+        // Without the comparison of the kernel the files must be verified
+        if (verified &&
+            clone_file(source_fd, source_stat->st_size, files[i]) !=
+                ACTION_UNSUPPORTED)
+            continue;
+        if (verified && action_hardlink_fallback)
+            hardlink_file(source_path, source_stat->st_size, files[i]);
+        else
+            atomic_fetch_add(&skipped_files, 1);
+    }
+    close(source_fd);
+}
+
+// The first file of each filesystem in the group is the source for the
+// other files on it
+void act_on_group(DuplicateGroup *group) {
+    uint32_t n = group->num_files;
+    struct stat *stats = malloc(n * sizeof(struct stat));
+    bool *handled = calloc(n, sizeof(bool));
+    FilePath *files = malloc(n * sizeof(FilePath));
+    if (stats == NULL || handled == NULL || files == NULL) {
+        perror("Failed to allocate memory for duplicate group");
+        free(stats);
+        free(handled);
+        free(files);
+        return;
+    }
+    char path[PATH_MAX];
+    for (uint32_t i = 0; i < n; i++) {
+        // Nothing to gain from empty files
+        handled[i] = get_file_path(group->files[i], path, sizeof(path)) >=
+                         sizeof(path) ||
+                     stat(path, &stats[i]) != 0 || stats[i].st_size == 0;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (handled[i])
+            continue;
+        uint32_t count = 0;
+        for (uint32_t j = i + 1; j < n; j++) {
+            if (handled[j] || stats[j].st_dev != stats[i].st_dev)
+                continue;
+            handled[j] = true;
+            if (stats[j].st_ino != stats[i].st_ino)
+                files[count++] = group->files[j];
+        }
+        if (count == 0)
+            continue;
+        FilesystemSlot *slot = acquire_filesystem(stats[i].st_dev);
+        act_on_files(group->files[i], &stats[i], files, count,
+                     group->verified);
+        release_filesystem(slot);
+    }
+    free(stats);
+    free(handled);
+    free(files);
+}
+
+void run_actions() {
+    size_t index;
+    while ((index = atomic_fetch_add(&next_action_group, 1)) <
+           num_action_groups) {
+        uint64_t start = get_time_ns();
+        act_on_group(&action_groups[index]);
+        add_stage_time(STAGE_ACTION, start);
+    }
+}
+
+void print_action_summary() {
+    double mib = atomic_load(&reclaimed_bytes) / 1048576.0;
+    unsigned long long files = atomic_load(&reclaimed_files);
+    if (action_dry_run) {
+        printf("Would reclaim up to %.1f MiB from %llu files\n", mib, files);
+        return;
+    }
+    printf("Reclaimed up to %.1f MiB from %llu files, %llu changed since they "
+           "were hashed, %llu could not be shared, %llu failed\n",
+           mib, files, (unsigned long long)atomic_load(&changed_files),
+           (unsigned long long)atomic_load(&skipped_files),
+           (unsigned long long)atomic_load(&failed_files));
+}
+
+void write_action_json(FILE *file) {
+    const char *names[] = {"report", "dedupe", "hardlink"};
+    fprintf(file,
+            "  \"action\": {\"mode\": \"%s\", \"dry_run\": %s, "
+            "\"bytes\": %llu, \"files\": %llu, \"changed\": %llu, "
+            "\"skipped\": %llu, \"failed\": %llu},\n",
+            names[action_mode], action_dry_run ? "true" : "false",
+            (unsigned long long)atomic_load(&reclaimed_bytes),
+            (unsigned long long)atomic_load(&reclaimed_files),
+            (unsigned long long)atomic_load(&changed_files),
+            (unsigned long long)atomic_load(&skipped_files),
+            (unsigned long long)atomic_load(&failed_files));
+}
+
+void free_actions() {
+    free(action_groups);
+    action_groups = NULL;
+    num_action_groups = 0;
+}
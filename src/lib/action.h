@@ -0,0 +1,48 @@
+#ifndef ACTION_H
+#define ACTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Reclaims the space of duplicates once they are found. The first file of
+// each group on a filesystem is the source, the others share its data. The
+// workers take whole groups, each filesystem has a limit on the groups
+// worked on at once so a slow disk is not flooded with requests.
+
+// Destinations of one FIDEDUPERANGE call
+#define DEDUPE_BATCH_SIZE 64
+// Bytes asked for in one call, filesystems may share less per call
+#define DEDUPE_RANGE_SIZE (1024LL * 1024 * 1024)
+// Groups worked on at once on one filesystem
+#define ACTIONS_PER_FILESYSTEM 2
+#define MAX_FILESYSTEMS 64
+
+typedef enum {
+    ACTION_REPORT, // only print the duplicates
+    // Share extents with FIDEDUPERANGE, which compares the data itself.
+    // Filesystems without it get FICLONE, for verified groups only.
+    ACTION_DEDUPE,
+    // Replace the files with hard links to the source, for verified groups
+    ACTION_HARDLINK
+} ActionMode;
+
+// Function to look up an action by name, returns -1 if there is none
+int find_action(const char *name);
+// Function to pick the action, set once before the workers start. A dry
+// run prints what would be done instead.
+void set_action(ActionMode mode, bool dry_run, bool hardlink_fallback);
+ActionMode get_action();
+// Function to collect the groups to act on, called by one thread after the
+// duplicates are final. Returns -1 if there is nothing to act on.
+int prepare_actions();
+// Function for the workers to act on groups until none are left
+void run_actions();
+// Function to print how much space was reclaimed
+void print_action_summary();
+// Function to write the counters as a member of a JSON object
+void write_action_json(FILE *file);
+// Function to free the groups
+void free_actions();
+
+#endif // ACTION_H
@@ -0,0 +1,549 @@
+#define _GNU_SOURCE
+#include "checkpoint.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes of a record before its payload
+#define RECORD_HEADER_SIZE 5
+// Bytes of the entry of a file after its name
+#define FILE_ENTRY_SIZE 36
+// Payload of a digest before its path
+#define HASH_RECORD_SIZE (2 + 8 + MAX_DIGEST_LEN)
+#define LISTING_CAPACITY 4096
+
+// The journal being written, all but the descriptor guarded by the mutex
+int journal_fd = -1;
+pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_cond;
+uint8_t *journal_buffer = NULL;
+size_t journal_used = 0;
+bool journal_failed = false;
+bool journal_closing = false;
+pthread_t sync_thread;
+
+// What the earlier runs wrote, only read once the journal is open
+uint8_t *journal_data = NULL;
+CheckpointDir *checkpoint_dirs = NULL;
+CheckpointHash *checkpoint_hashes = NULL;
+
+void put_journal_integer(uint8_t *data, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        data[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+uint64_t get_journal_integer(const uint8_t *data, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+void put_checkpoint_header(uint8_t *data, const CheckpointHeader *header) {
+    memcpy(data, header->magic, sizeof(header->magic));
+    put_journal_integer(data + 8, header->version, 4);
+    put_journal_integer(data + 12, header->first_pass, 4);
+    put_journal_integer(data + 16, header->root_len, 4);
+    put_journal_integer(data + 20, header->reserved, 4);
+}
+
+void get_checkpoint_header(const uint8_t *data, CheckpointHeader *header) {
+    memcpy(header->magic, data, sizeof(header->magic));
+    header->version = (uint32_t)get_journal_integer(data + 8, 4);
+    header->first_pass = (uint32_t)get_journal_integer(data + 12, 4);
+    header->root_len = (uint32_t)get_journal_integer(data + 16, 4);
+    header->reserved = (uint32_t)get_journal_integer(data + 20, 4);
+}
+
+int write_journal(int fd, const void *data, size_t len) {
+    const uint8_t *next = data;
+    while (len > 0) {
+        ssize_t n = write(fd, next, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        next += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Writes out the buffer, the caller holds the mutex. After a failed write
+// the rest is dropped.
+void flush_journal() {
+    if (journal_used > 0 && !journal_failed &&
+        write_journal(journal_fd, journal_buffer, journal_used) != 0) {
+        perror("Failed to write checkpoint");
+        journal_failed = true;
+    }
+    journal_used = 0;
+}
+
+// Adds whole records, a record is never split between two writes
+void append_journal(const uint8_t *data, size_t len) {
+    pthread_mutex_lock(&journal_mutex);
+    if (CHECKPOINT_BUFFER_SIZE - journal_used < len)
+        flush_journal();
+    if (len <= CHECKPOINT_BUFFER_SIZE) {
+        memcpy(journal_buffer + journal_used, data, len);
+        journal_used += len;
+    } else if (!journal_failed && write_journal(journal_fd, data, len) != 0) {
+        perror("Failed to write checkpoint");
+        journal_failed = true;
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+// Writes out and syncs the journal every CHECKPOINT_INTERVAL seconds until
+// it is closed
+void *sync_journal(void *arg) {
+    (void)arg;
+    set_thread_role("checkpoint");
+    pthread_mutex_lock(&journal_mutex);
+    while (!journal_closing) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += CHECKPOINT_INTERVAL;
+        int result = 0;
+        while (!journal_closing && result != ETIMEDOUT) {
+            result = pthread_cond_timedwait(&journal_cond, &journal_mutex,
+                                            &deadline);
+        }
+        flush_journal();
+        // Records are added to the buffer while the disk catches up
+        pthread_mutex_unlock(&journal_mutex);
+        fdatasync(journal_fd);
+        pthread_mutex_lock(&journal_mutex);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    return NULL;
+}
+
+// Takes the record at offset if it is complete, a torn one ends the journal
+bool next_journal_record(size_t *offset, size_t end, uint8_t *type,
+                         const uint8_t **payload, size_t *len) {
+    if (end - *offset < RECORD_HEADER_SIZE)
+        return false;
+    const uint8_t *record = journal_data + *offset;
+    *len = get_journal_integer(record + 1, 4);
+    if (end - *offset - RECORD_HEADER_SIZE < *len)
+        return false;
+    *type = record[0];
+    *payload = record + RECORD_HEADER_SIZE;
+    *offset += RECORD_HEADER_SIZE + *len;
+    return true;
+}
+
+// Indexes the directories of the journal, returns where its complete
+// records end
+size_t load_checkpoint_dirs(size_t start, size_t end) {
+    uint32_t run = 0;
+    uint8_t type;
+    const uint8_t *payload;
+    size_t len, offset = start;
+    while (next_journal_record(&offset, end, &type, &payload, &len)) {
+        if (type == CHECKPOINT_RUN)
+            run++;
+        if (type != CHECKPOINT_DIR || len < 2)
+            continue;
+        size_t path_len = get_journal_integer(payload, 2);
+        if (len - 2 < path_len + 4)
+            continue;
+        const char *path = (const char *)payload + 2;
+        CheckpointDir *dir;
+        HASH_FIND(hh, checkpoint_dirs, path, path_len, dir);
+        if (dir != NULL)
+            continue;
+        dir = malloc(sizeof(CheckpointDir));
+        if (dir == NULL) {
+            perror("Failed to allocate memory for checkpoint");
+            return 0;
+        }
+        dir->path = path;
+        dir->run = run;
+        dir->entries = payload + 2 + path_len + 4;
+        dir->end = payload + len;
+        HASH_ADD_KEYPTR(hh, checkpoint_dirs, dir->path, path_len, dir);
+    }
+    return offset;
+}
+
+// Checks the directory of a file was listed by run or one before. A
+// directory whose path ends in a separator, as the root "/" does, keeps it.
+bool is_listed_before(const char *path, size_t len, uint32_t run) {
+    const char *slash = memrchr(path, '/', len);
+    if (slash == NULL)
+        return false;
+    size_t dir_len = slash - path;
+    CheckpointDir *dir;
+    HASH_FIND(hh, checkpoint_dirs, path, dir_len, dir);
+    if (dir == NULL)
+        HASH_FIND(hh, checkpoint_dirs, path, dir_len + 1, dir);
+    return dir != NULL && dir->run <= run;
+}
+
+// Indexes the digests of the journal, later ones replace earlier ones
+int load_checkpoint_hashes(size_t start, size_t end) {
+    uint32_t run = 0;
+    uint8_t type;
+    const uint8_t *payload;
+    size_t len, offset = start;
+    while (next_journal_record(&offset, end, &type, &payload, &len)) {
+        if (type == CHECKPOINT_RUN)
+            run++;
+        if (type != CHECKPOINT_HASH || len < HASH_RECORD_SIZE + 2)
+            continue;
+        int stage = payload[0], hashed = payload[1];
+        size_t path_len = get_journal_integer(payload + HASH_RECORD_SIZE, 2);
+        const char *path = (const char *)payload + HASH_RECORD_SIZE + 2;
+        if (stage >= NUM_HASH_STAGES || hashed >= NUM_HASH_STAGES ||
+            len - HASH_RECORD_SIZE - 2 < path_len ||
+            !is_listed_before(path, path_len, run))
+            continue;
+
+        CheckpointHash *entry;
+        HASH_FIND(hh, checkpoint_hashes, path, path_len, entry);
+        if (entry == NULL) {
+            entry = calloc(1, sizeof(CheckpointHash));
+            if (entry == NULL) {
+                perror("Failed to allocate memory for checkpoint");
+                return -1;
+            }
+            entry->path = path;
+            memset(entry->hashed, -1, sizeof(entry->hashed));
+            HASH_ADD_KEYPTR(hh, checkpoint_hashes, entry->path, path_len,
+                            entry);
+        }
+        entry->digests[hashed] = payload + 10;
+        entry->hashed[stage] = (int8_t)hashed;
+        entry->size = get_journal_integer(payload + 2, 8);
+        // Only small files are hashed at another stage than the one asked
+        // for, and then at any stage
+        if (stage != hashed)
+            memset(entry->hashed, hashed, sizeof(entry->hashed));
+    }
+    return 0;
+}
+
+// Reads the journal of the earlier runs, returns the offset the next run
+// appends at, 0 if there is none yet, or -1 if it cannot be resumed
+off_t load_checkpoint(int fd, const char *path, const char *root) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        perror("Failed to stat checkpoint");
+        return -1;
+    }
+    size_t size = file_stat.st_size;
+    if (size == 0)
+        return 0;
+    journal_data = malloc(size);
+    if (journal_data == NULL) {
+        perror("Failed to allocate memory for checkpoint");
+        return -1;
+    }
+    for (size_t done = 0; done < size;) {
+        ssize_t n = pread(fd, journal_data + done, size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("Failed to read checkpoint");
+            return -1;
+        }
+        done += n;
+    }
+
+    CheckpointHeader header;
+    if (size >= CHECKPOINT_HEADER_SIZE)
+        get_checkpoint_header(journal_data, &header);
+    if (size < CHECKPOINT_HEADER_SIZE ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION ||
+        size - CHECKPOINT_HEADER_SIZE < header.root_len) {
+        fprintf(stderr, "Not a checkpoint: %s\n", path);
+        return -1;
+    }
+    if (header.root_len != strlen(root) ||
+        memcmp(journal_data + CHECKPOINT_HEADER_SIZE, root,
+               header.root_len) != 0) {
+        fprintf(stderr, "The checkpoint is of a scan of another directory\n");
+        return -1;
+    }
+    // Digests of the first pass would not match the ones of this run
+    if (header.first_pass != get_first_pass_engine()->id) {
+        fprintf(stderr,
+                "The checkpoint is of a scan with another first pass\n");
+        return -1;
+    }
+
+    size_t start = CHECKPOINT_HEADER_SIZE + header.root_len;
+    size_t end = load_checkpoint_dirs(start, size);
+    if (end == 0 || load_checkpoint_hashes(start, end) != 0)
+        return -1;
+    fprintf(stderr, "Resuming with %u directories and %u files hashed\n",
+            HASH_COUNT(checkpoint_dirs), HASH_COUNT(checkpoint_hashes));
+    return (off_t)end;
+}
+
+int write_checkpoint_header(int fd, const char *root) {
+    CheckpointHeader header = {.version = CHECKPOINT_VERSION,
+                               .first_pass = get_first_pass_engine()->id,
+                               .root_len = (uint32_t)strlen(root)};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    uint8_t data[CHECKPOINT_HEADER_SIZE];
+    put_checkpoint_header(data, &header);
+    if (ftruncate(fd, 0) != 0 ||
+        write_journal(fd, data, sizeof(data)) != 0 ||
+        write_journal(fd, root, header.root_len) != 0) {
+        perror("Failed to write checkpoint");
+        return -1;
+    }
+    return 0;
+}
+
+int open_checkpoint(const char *path, const char *root, bool resume) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to open checkpoint");
+        return -1;
+    }
+    off_t end = resume ? load_checkpoint(fd, path, root) : 0;
+    if (end < 0 || (end == 0 && write_checkpoint_header(fd, root) != 0)) {
+        close(fd);
+        return -1;
+    }
+    // Cut off a record the interrupted run did not finish
+    if ((end > 0 && ftruncate(fd, end) != 0) ||
+        lseek(fd, 0, SEEK_END) < 0) {
+        perror("Failed to open checkpoint");
+        close(fd);
+        return -1;
+    }
+    journal_buffer = malloc(CHECKPOINT_BUFFER_SIZE);
+    if (journal_buffer == NULL) {
+        perror("Failed to allocate memory for checkpoint");
+        close(fd);
+        return -1;
+    }
+    journal_fd = fd;
+    journal_used = 0;
+    journal_failed = false;
+    journal_closing = false;
+
+    uint8_t record[RECORD_HEADER_SIZE] = {CHECKPOINT_RUN};
+    append_journal(record, sizeof(record));
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&journal_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&sync_thread, NULL, sync_journal, NULL) != 0) {
+        perror("Failed to create checkpoint thread");
+        pthread_cond_destroy(&journal_cond);
+        return -1;
+    }
+    return 0;
+}
+
+bool is_checkpoint_open() { return journal_fd >= 0; }
+
+bool find_checkpoint_dir(const char *path, CheckpointCursor *cursor) {
+    CheckpointDir *dir;
+    HASH_FIND(hh, checkpoint_dirs, path, strlen(path), dir);
+    if (dir == NULL)
+        return false;
+    cursor->next = dir->entries;
+    cursor->end = dir->end;
+    return true;
+}
+
+bool next_checkpoint_entry(CheckpointCursor *cursor, char *name,
+                           FileInfo *info) {
+    const uint8_t *next = cursor->next;
+    if (cursor->end - next < 3)
+        return false;
+    uint8_t type = next[0];
+    size_t name_len = get_journal_integer(next + 1, 2);
+    if (name_len > NAME_MAX || (size_t)(cursor->end - next - 3) < name_len)
+        return false;
+    memcpy(name, next + 3, name_len);
+    name[name_len] = '\0';
+    next += 3 + name_len;
+
+    memset(info, 0, sizeof(*info));
+    if (type == CHECKPOINT_ENTRY_DIR) {
+        info->mode = S_IFDIR;
+    } else {
+        if (cursor->end - next < FILE_ENTRY_SIZE)
+            return false;
+        int64_t mtime_ns = (int64_t)get_journal_integer(next + 24, 8);
+        info->mode = S_IFREG;
+        info->size = (off_t)get_journal_integer(next, 8);
+        info->dev = (dev_t)get_journal_integer(next + 8, 8);
+        info->ino = (ino_t)get_journal_integer(next + 16, 8);
+        info->mtime.tv_sec = mtime_ns / 1000000000LL;
+        info->mtime.tv_nsec = mtime_ns % 1000000000LL;
+        info->nlink = (nlink_t)get_journal_integer(next + 32, 4);
+        next += FILE_ENTRY_SIZE;
+    }
+    cursor->next = next;
+    return true;
+}
+
+// Returns a pointer to len more bytes of the listing, NULL once it failed
+uint8_t *extend_listing(CheckpointListing *listing, size_t len) {
+    if (listing->failed)
+        return NULL;
+    if (listing->capacity - listing->len < len) {
+        size_t capacity = listing->capacity * 2;
+        while (capacity - listing->len < len) {
+            capacity *= 2;
+        }
+        uint8_t *data = realloc(listing->data, capacity);
+        if (data == NULL) {
+            perror("Failed to allocate memory for checkpoint");
+            listing->failed = true;
+            return NULL;
+        }
+        listing->data = data;
+        listing->capacity = capacity;
+    }
+    uint8_t *next = listing->data + listing->len;
+    listing->len += len;
+    return next;
+}
+
+void add_listing_name(CheckpointListing *listing, const char *name) {
+    size_t len = strlen(name);
+    uint8_t *next = extend_listing(listing, 2 + len);
+    if (next != NULL) {
+        put_journal_integer(next, len, 2);
+        memcpy(next + 2, name, len);
+    }
+}
+
+void start_checkpoint_listing(CheckpointListing *listing, const char *path) {
+    listing->data = malloc(LISTING_CAPACITY);
+    listing->len = 0;
+    listing->capacity = LISTING_CAPACITY;
+    listing->num_entries = 0;
+    listing->failed = listing->data == NULL;
+    uint8_t *header = extend_listing(listing, RECORD_HEADER_SIZE);
+    if (header != NULL)
+        header[0] = CHECKPOINT_DIR;
+    add_listing_name(listing, path);
+    listing->count_offset = listing->len;
+    extend_listing(listing, 4);
+}
+
+void add_checkpoint_entry(CheckpointListing *listing, const char *name,
+                          const FileInfo *info) {
+    bool is_dir = S_ISDIR(info->mode);
+    uint8_t *type = extend_listing(listing, 1);
+    if (type != NULL)
+        *type = is_dir ? CHECKPOINT_ENTRY_DIR : CHECKPOINT_ENTRY_FILE;
+    add_listing_name(listing, name);
+    listing->num_entries++;
+    if (is_dir)
+        return;
+    uint8_t *next = extend_listing(listing, FILE_ENTRY_SIZE);
+    if (next == NULL)
+        return;
+    int64_t mtime_ns =
+        info->mtime.tv_sec * 1000000000LL + info->mtime.tv_nsec;
+    put_journal_integer(next, (uint64_t)info->size, 8);
+    put_journal_integer(next + 8, (uint64_t)info->dev, 8);
+    put_journal_integer(next + 16, (uint64_t)info->ino, 8);
+    put_journal_integer(next + 24, (uint64_t)mtime_ns, 8);
+    put_journal_integer(next + 32, (uint64_t)info->nlink, 4);
+}
+
+void finish_checkpoint_listing(CheckpointListing *listing) {
+    if (!listing->failed) {
+        put_journal_integer(listing->data + 1,
+                            listing->len - RECORD_HEADER_SIZE, 4);
+        put_journal_integer(listing->data + listing->count_offset,
+                            listing->num_entries, 4);
+        append_journal(listing->data, listing->len);
+    }
+    free(listing->data);
+}
+
+int lookup_checkpoint_hash(const char *path, HashStage stage, uint8_t *hash,
+                           uint64_t *size) {
+    CheckpointHash *entry;
+    HASH_FIND(hh, checkpoint_hashes, path, strlen(path), entry);
+    if (entry == NULL || entry->hashed[stage] < 0)
+        return -1;
+    int hashed = entry->hashed[stage];
+    memcpy(hash, entry->digests[hashed], MAX_DIGEST_LEN);
+    *size = entry->size;
+    return hashed;
+}
+
+void store_checkpoint_hash(const char *path, HashStage stage, int hashed,
+                           uint64_t size, const uint8_t *hash) {
+    if (journal_fd < 0)
+        return;
+    size_t path_len = strlen(path);
+    uint8_t record[RECORD_HEADER_SIZE + HASH_RECORD_SIZE + 2 + PATH_MAX];
+    if (path_len >= PATH_MAX)
+        return;
+    uint8_t *payload = record + RECORD_HEADER_SIZE;
+    record[0] = CHECKPOINT_HASH;
+    put_journal_integer(record + 1, HASH_RECORD_SIZE + 2 + path_len, 4);
+    payload[0] = (uint8_t)stage;
+    payload[1] = (uint8_t)hashed;
+    put_journal_integer(payload + 2, size, 8);
+    memcpy(payload + 10, hash, MAX_DIGEST_LEN);
+    put_journal_integer(payload + HASH_RECORD_SIZE, path_len, 2);
+    memcpy(payload + HASH_RECORD_SIZE + 2, path, path_len);
+    append_journal(record,
+                   RECORD_HEADER_SIZE + HASH_RECORD_SIZE + 2 + path_len);
+}
+
+int close_checkpoint() {
+    if (journal_fd < 0)
+        return 0;
+    pthread_mutex_lock(&journal_mutex);
+    journal_closing = true;
+    pthread_cond_signal(&journal_cond);
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_join(sync_thread, NULL);
+    pthread_cond_destroy(&journal_cond);
+
+    flush_journal();
+    int result = journal_failed ? -1 : 0;
+    if (result == 0 && fdatasync(journal_fd) != 0) {
+        perror("Failed to sync checkpoint");
+        result = -1;
+    }
+    close(journal_fd);
+    journal_fd = -1;
+    free(journal_buffer);
+    journal_buffer = NULL;
+
+    CheckpointDir *dir, *next_dir;
+    HASH_ITER(hh, checkpoint_dirs, dir, next_dir) {
+        HASH_DEL(checkpoint_dirs, dir);
+        free(dir);
+    }
+    CheckpointHash *entry, *next_entry;
+    HASH_ITER(hh, checkpoint_hashes, entry, next_entry) {
+        HASH_DEL(checkpoint_hashes, entry);
+        free(entry);
+    }
+    free(journal_data);
+    journal_data = NULL;
+    return result;
+}
@@ -0,0 +1,129 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "hash_cache.h"
+#include "hashing.h"
+#include "uthash.h"
+#include "walker.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Keeps a journal of a scan, so one that is killed can go on where it
+// stopped. Every directory listed in full goes in with its entries, every
+// digest with the path of its file, and the journal is written out and
+// synced every CHECKPOINT_INTERVAL seconds. A resumed scan replays the
+// directories of the journal instead of listing them and takes the digests
+// from it instead of reading the files, which rebuilds the index of the
+// interrupted scan in the time it takes to read the journal. What was left
+// of the walk follows from it: the directories missing from the journal
+// are listed again.
+//
+// The journal is the header and the root of the scan, then records. The
+// header is the magic, u32 version, u32 first pass engine, u32 length of
+// the root and u32 reserved. Every run that writes to the journal starts
+// with a CHECKPOINT_RUN record. A record is its type byte and its u32
+// length followed by the payload. Integers are little endian, in the header
+// as well, and a path or a name is its u16 length and its bytes:
+//   CHECKPOINT_RUN:  nothing
+//   CHECKPOINT_DIR:  path, u32 number of entries, each its entry type byte
+//                    and name, files followed by u64 size, dev, ino, mtime
+//                    in ns and u32 number of links
+//   CHECKPOINT_HASH: u8 stage asked for, u8 stage hashed, u64 size of the
+//                    file as it was hashed, digest[32], path
+//
+// A digest only counts if the directory of its file was listed by the same
+// run or one before, a directory listed again may hold other files. A torn
+// record at the end is cut off before a run appends to the journal.
+
+#define CHECKPOINT_MAGIC "DDUPCKP1"
+#define CHECKPOINT_VERSION 2
+// Seconds between two syncs, the most work an interruption loses
+#define CHECKPOINT_INTERVAL 5
+#define CHECKPOINT_BUFFER_SIZE (1024 * 1024)
+// Bytes of the header as it is in the journal
+#define CHECKPOINT_HEADER_SIZE 24
+
+typedef enum {
+    CHECKPOINT_RUN = 1,
+    CHECKPOINT_DIR = 2,
+    CHECKPOINT_HASH = 3
+} CheckpointRecord;
+
+typedef enum { CHECKPOINT_ENTRY_DIR, CHECKPOINT_ENTRY_FILE } CheckpointEntry;
+
+// The header as it is read, the journal holds it in little endian
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t first_pass; // engine of the stages before the full one
+    uint32_t root_len; // length of the root that follows
+    uint32_t reserved;
+} CheckpointHeader;
+
+// A directory an earlier run listed, its entries stay in the journal
+typedef struct {
+    const char *path; // in the journal, not terminated
+    uint32_t run;
+    const uint8_t *entries;
+    const uint8_t *end;
+    UT_hash_handle hh;
+} CheckpointDir;
+
+// Digests an earlier run got for a file, keyed on its path
+typedef struct {
+    const char *path; // in the journal, not terminated
+    int8_t hashed[NUM_HASH_STAGES]; // stage hashed per stage asked for
+    const uint8_t *digests[NUM_HASH_STAGES]; // in the journal, by stage
+    uint64_t size; // of the file when it was last hashed
+    UT_hash_handle hh;
+} CheckpointHash;
+
+// Reads the entries of a directory of the journal one at a time
+typedef struct {
+    const uint8_t *next;
+    const uint8_t *end;
+} CheckpointCursor;
+
+// Collects the entries of a directory while it is listed
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+    size_t count_offset; // where the number of entries goes
+    uint32_t num_entries;
+    bool failed;
+} CheckpointListing;
+
+// Function to start the journal at path for a scan of root. With resume the
+// journal of an interrupted scan of the same root is read and appended to,
+// a missing one starts a new scan. Returns -1 on failure.
+int open_checkpoint(const char *path, const char *root, bool resume);
+bool is_checkpoint_open();
+// Function to find a directory an earlier run listed in full, returns false
+// if it has to be listed
+bool find_checkpoint_dir(const char *path, CheckpointCursor *cursor);
+// Function to take the next entry of a directory, name holds NAME_MAX + 1
+// bytes. Directories only have the file type in info. Returns false at the
+// end.
+bool next_checkpoint_entry(CheckpointCursor *cursor, char *name,
+                           FileInfo *info);
+// Functions to collect the entries of a directory as it is listed, and to
+// add it to the journal once it is listed in full
+void start_checkpoint_listing(CheckpointListing *listing, const char *path);
+void add_checkpoint_entry(CheckpointListing *listing, const char *name,
+                          const FileInfo *info);
+void finish_checkpoint_listing(CheckpointListing *listing);
+// Function to look up the digest an earlier run got for a stage and the
+// size of the file it was hashed at, returns the stage that was hashed or -1
+// if there is none
+int lookup_checkpoint_hash(const char *path, HashStage stage, uint8_t *hash,
+                           uint64_t *size);
+// Function to add the digest of the stage hashed for the stage asked for
+void store_checkpoint_hash(const char *path, HashStage stage, int hashed,
+                           uint64_t size, const uint8_t *hash);
+// Function to write out the rest of the journal and close it, returns -1 if
+// a write failed
+int close_checkpoint();
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,239 @@
+#define _POSIX_C_SOURCE 200809L
+#include "chunk_index.h"
+#include "stats.h"
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A chunked file and the chunks it is made of, in order
+typedef struct {
+    FilePath file;
+    uint64_t size;
+    uint64_t shared; // bytes in chunks found more than once, for the report
+    ChunkEntry **chunks;
+    uint32_t num_chunks;
+} ChunkedFile;
+
+ChunkShard chunk_shards[NUM_CHUNK_SHARDS];
+pthread_once_t chunk_once = PTHREAD_ONCE_INIT;
+
+ChunkedFile *chunked_files = NULL;
+size_t num_chunked_files = 0;
+size_t chunked_files_capacity = 0;
+pthread_mutex_t chunked_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void init_chunk_shards() {
+    for (int i = 0; i < NUM_CHUNK_SHARDS; i++) {
+        pthread_mutex_init(&chunk_shards[i].mutex, NULL);
+        chunk_shards[i].entries = NULL;
+        chunk_shards[i].capacity = 0;
+        chunk_shards[i].count = 0;
+    }
+}
+
+// Bucket of the digest, from bits the shard index does not use
+size_t get_chunk_bucket(const uint8_t *hash, size_t capacity) {
+    uint64_t bits;
+    memcpy(&bits, hash + sizeof(bits), sizeof(bits));
+    return bits & (capacity - 1);
+}
+
+// Doubles the shard once it is 3/4 full, the caller holds its mutex
+bool grow_chunk_shard(ChunkShard *shard) {
+    size_t capacity = shard->capacity ? shard->capacity * 2
+                                      : INITIAL_CHUNK_SHARD_CAPACITY;
+    ChunkEntry **entries = calloc(capacity, sizeof(ChunkEntry *));
+    if (entries == NULL) {
+        perror("Failed to allocate memory for chunk shard");
+        return false;
+    }
+    for (size_t i = 0; i < shard->capacity; i++) {
+        ChunkEntry *entry = shard->entries[i];
+        if (entry == NULL)
+            continue;
+        size_t bucket = get_chunk_bucket(entry->hash, capacity);
+        while (entries[bucket] != NULL) {
+            bucket = (bucket + 1) & (capacity - 1);
+        }
+        entries[bucket] = entry;
+    }
+    free(shard->entries);
+    shard->entries = entries;
+    shard->capacity = capacity;
+    return true;
+}
+
+ChunkEntry *add_chunk(const uint8_t *hash, uint32_t size) {
+    pthread_once(&chunk_once, init_chunk_shards);
+    ChunkShard *shard = &chunk_shards[hash[0] % NUM_CHUNK_SHARDS];
+    lock_counting_wait(&shard->mutex);
+    if ((shard->count + 1) * 4 > shard->capacity * 3 &&
+        !grow_chunk_shard(shard)) {
+        pthread_mutex_unlock(&shard->mutex);
+        return NULL;
+    }
+    size_t bucket = get_chunk_bucket(hash, shard->capacity);
+    ChunkEntry *entry;
+    while ((entry = shard->entries[bucket]) != NULL &&
+           memcmp(entry->hash, hash, CHUNK_KEY_LEN) != 0) {
+        bucket = (bucket + 1) & (shard->capacity - 1);
+    }
+    if (entry == NULL) {
+        // The arena of the calling thread, no lock needed for it
+        entry = arena_alloc(sizeof(ChunkEntry));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&shard->mutex);
+            return NULL;
+        }
+        memcpy(entry->hash, hash, CHUNK_KEY_LEN);
+        entry->size = size;
+        entry->refs = 0;
+        shard->entries[bucket] = entry;
+        shard->count++;
+    }
+    entry->refs++;
+    pthread_mutex_unlock(&shard->mutex);
+    return entry;
+}
+
+void add_chunked_file(FilePath file, uint64_t size, ChunkEntry **chunks,
+                      uint32_t num_chunks) {
+    pthread_mutex_lock(&chunked_files_mutex);
+    if (num_chunked_files == chunked_files_capacity) {
+        size_t capacity =
+            chunked_files_capacity ? chunked_files_capacity * 2 : 1024;
+        ChunkedFile *files =
+            realloc(chunked_files, capacity * sizeof(ChunkedFile));
+        if (files == NULL) {
+            perror("Failed to allocate memory for chunked files");
+            pthread_mutex_unlock(&chunked_files_mutex);
+            free(chunks);
+            return;
+        }
+        chunked_files = files;
+        chunked_files_capacity = capacity;
+    }
+    chunked_files[num_chunked_files++] = (ChunkedFile){.file = file,
+                                                       .size = size,
+                                                       .shared = 0,
+                                                       .chunks = chunks,
+                                                       .num_chunks = num_chunks};
+    pthread_mutex_unlock(&chunked_files_mutex);
+}
+
+void format_bytes(uint64_t bytes, char *text, size_t size) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = (double)bytes;
+    int unit = 0;
+    for (; value >= 1024 && unit < 4; unit++) {
+        value /= 1024;
+    }
+    snprintf(text, size, unit ? "%.1f %s" : "%.0f %s", value, units[unit]);
+}
+
+// Most shared first
+int compare_shared(const void *a, const void *b) {
+    const ChunkedFile *x = a, *y = b;
+    if (x->shared != y->shared)
+        return x->shared < y->shared ? 1 : -1;
+    return (x->size < y->size) - (x->size > y->size);
+}
+
+typedef struct {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t chunks;
+    uint64_t distinct_chunks;
+    uint64_t distinct_bytes;
+} ChunkTotals;
+
+void sum_chunks(ChunkTotals *totals) {
+    pthread_once(&chunk_once, init_chunk_shards);
+    memset(totals, 0, sizeof(*totals));
+    totals->files = num_chunked_files;
+    for (size_t i = 0; i < num_chunked_files; i++) {
+        totals->bytes += chunked_files[i].size;
+        totals->chunks += chunked_files[i].num_chunks;
+    }
+    for (int i = 0; i < NUM_CHUNK_SHARDS; i++) {
+        ChunkShard *shard = &chunk_shards[i];
+        for (size_t j = 0; j < shard->capacity; j++) {
+            if (shard->entries[j] == NULL)
+                continue;
+            totals->distinct_chunks++;
+            totals->distinct_bytes += shard->entries[j]->size;
+        }
+    }
+}
+
+void print_chunk_report() {
+    // A chunk is shared if it was found twice, in this file or another one
+    for (size_t i = 0; i < num_chunked_files; i++) {
+        ChunkedFile *file = &chunked_files[i];
+        file->shared = 0;
+        for (uint32_t j = 0; j < file->num_chunks; j++) {
+            if (file->chunks[j]->refs > 1)
+                file->shared += file->chunks[j]->size;
+        }
+    }
+    qsort(chunked_files, num_chunked_files, sizeof(ChunkedFile),
+          compare_shared);
+
+    char path[PATH_MAX], shared[32], size[32];
+    for (size_t i = 0; i < num_chunked_files; i++) {
+        ChunkedFile *file = &chunked_files[i];
+        if (file->shared == 0)
+            break;
+        if (i == 0)
+            printf("Files with chunks found elsewhere:\n");
+        if (get_file_path(file->file, path, sizeof(path)) >= sizeof(path))
+            continue;
+        format_bytes(file->shared, shared, sizeof(shared));
+        format_bytes(file->size, size, sizeof(size));
+        printf("  %s: %s of %s shared (%.1f%%)\n", path, shared, size,
+               100.0 * file->shared / file->size);
+    }
+
+    ChunkTotals totals;
+    sum_chunks(&totals);
+    format_bytes(totals.bytes, size, sizeof(size));
+    format_bytes(totals.distinct_bytes, shared, sizeof(shared));
+    printf("Chunked %llu files of %s into %llu chunks, %llu distinct chunks "
+           "of %s, dedup ratio %.2f\n",
+           (unsigned long long)totals.files, size,
+           (unsigned long long)totals.chunks,
+           (unsigned long long)totals.distinct_chunks, shared,
+           totals.distinct_bytes ? (double)totals.bytes / totals.distinct_bytes
+                                 : 1.0);
+}
+
+void write_chunk_json(FILE *file) {
+    ChunkTotals totals;
+    sum_chunks(&totals);
+    fprintf(file,
+            "  \"chunks\": {\"files\": %llu, \"bytes\": %llu, \"chunks\": "
+            "%llu, \"distinct_chunks\": %llu, \"distinct_bytes\": %llu},\n",
+            (unsigned long long)totals.files, (unsigned long long)totals.bytes,
+            (unsigned long long)totals.chunks,
+            (unsigned long long)totals.distinct_chunks,
+            (unsigned long long)totals.distinct_bytes);
+}
+
+// The entries themselves live in the path store
+void free_chunk_index() {
+    pthread_once(&chunk_once, init_chunk_shards);
+    for (int i = 0; i < NUM_CHUNK_SHARDS; i++) {
+        free(chunk_shards[i].entries);
+        chunk_shards[i].entries = NULL;
+        chunk_shards[i].capacity = 0;
+        chunk_shards[i].count = 0;
+    }
+    for (size_t i = 0; i < num_chunked_files; i++) {
+        free(chunked_files[i].chunks);
+    }
+    free(chunked_files);
+    chunked_files = NULL;
+    num_chunked_files = 0;
+    chunked_files_capacity = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef CHUNK_INDEX_H
+#define CHUNK_INDEX_H
+
+#include "../shared/consts.h"
+#include "path_store.h"
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Chunks of all files by their digest, next to the index of whole files.
+// Entries live in the path store arenas and never move, so the files keep
+// pointers to their chunks and the report can tell which of them are
+// shared once every file is chunked.
+
+#define NUM_CHUNK_SHARDS 64
+#define INITIAL_CHUNK_SHARD_CAPACITY 1024
+// Bytes of the BLAKE3 digest that identify a chunk
+#define CHUNK_KEY_LEN 16
+
+typedef struct {
+    uint8_t hash[CHUNK_KEY_LEN];
+    uint32_t size;
+    uint32_t refs; // times the chunk was found, in any file
+} ChunkEntry;
+
+// Open addressing table with linear probing like the file index
+typedef struct {
+    alignas(CACHE_LINE_SIZE) pthread_mutex_t mutex;
+    ChunkEntry **entries;
+    size_t capacity; // a power of two
+    size_t count;
+} ChunkShard;
+
+// Function to count a chunk, returns its entry or NULL on failure
+ChunkEntry *add_chunk(const uint8_t *hash, uint32_t size);
+// Function to record the chunks of a file, the index takes over the array
+void add_chunked_file(FilePath file, uint64_t size, ChunkEntry **chunks,
+                      uint32_t num_chunks);
+// Function to print the share of each file that is found elsewhere, and
+// the ratio of all bytes to the bytes of distinct chunks
+void print_chunk_report();
+// Function to write the totals as a member of a JSON object
+void write_chunk_json(FILE *file);
+// Function to free the chunk index
+void free_chunk_index();
+
+#endif // CHUNK_INDEX_H
@@ -0,0 +1,230 @@
+#define _POSIX_C_SOURCE 200809L
+#include "chunker.h"
+#include "chunk_index.h"
+#include "reader.h"
+#include "stats.h"
+#include <blake3.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Zero bits a boundary needs before and after the average size, normalized
+// two bits around log2(CDC_AVG_SIZE)
+#define CDC_MASK_SMALL (((1ULL << 16) - 1) << 46)
+#define CDC_MASK_LARGE (((1ULL << 12) - 1) << 50)
+// Segments of a block hashed side by side, and the bytes of each
+#define CDC_LANES 4
+#define CDC_LANE_SIZE 1024
+
+uint64_t gear[256];
+pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Fixed random values, the boundaries must be the same in every run
+void init_gear() {
+    uint64_t state = 0x6a09e667f3bcc908ULL;
+    for (int i = 0; i < 256; i++) {
+        state += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+void chunker_init(Chunker *chunker) {
+    pthread_once(&gear_once, init_gear);
+    chunker->len = 0;
+}
+
+// Gear hash of the window before data, without data[0]
+uint64_t warm_up_gear(const uint8_t *data) {
+    uint64_t hash = 0;
+    for (int k = 1 - CDC_WINDOW; k < 0; k++) {
+        hash = (hash << 1) + gear[data[k]];
+    }
+    return hash;
+}
+
+// Finds the first byte whose window hash has the bits of the mask clear,
+// returns the number of bytes up to and including it, or size if there is
+// none. The hash of a byte only depends on its window, so the segments of
+// a block are hashed side by side as independent chains, each warmed up on
+// the window before it. Only the block with the boundary is hashed in vain
+// after it.
+size_t scan_gear(const uint8_t *data, size_t size, uint64_t mask,
+                 bool *found) {
+    size_t i = 0;
+    for (; size - i >= CDC_LANES * CDC_LANE_SIZE;
+         i += CDC_LANES * CDC_LANE_SIZE) {
+        const uint8_t *lane0 = data + i, *lane1 = lane0 + CDC_LANE_SIZE,
+                      *lane2 = lane1 + CDC_LANE_SIZE,
+                      *lane3 = lane2 + CDC_LANE_SIZE;
+        uint64_t h0 = warm_up_gear(lane0), h1 = warm_up_gear(lane1),
+                 h2 = warm_up_gear(lane2), h3 = warm_up_gear(lane3);
+        size_t hits[CDC_LANES] = {SIZE_MAX, SIZE_MAX, SIZE_MAX, SIZE_MAX};
+        for (size_t k = 0; k < CDC_LANE_SIZE; k++) {
+            h0 = (h0 << 1) + gear[lane0[k]];
+            h1 = (h1 << 1) + gear[lane1[k]];
+            h2 = (h2 << 1) + gear[lane2[k]];
+            h3 = (h3 << 1) + gear[lane3[k]];
+            if (((h0 & mask) && (h1 & mask) && (h2 & mask) && (h3 & mask)))
+                continue;
+            // Rare, only the first hit of each lane counts
+            uint64_t lanes[CDC_LANES] = {h0, h1, h2, h3};
+            for (int l = 0; l < CDC_LANES; l++) {
+                if ((lanes[l] & mask) == 0 && hits[l] == SIZE_MAX)
+                    hits[l] = k;
+            }
+        }
+        for (int l = 0; l < CDC_LANES; l++) {
+            if (hits[l] != SIZE_MAX) {
+                *found = true;
+                return i + l * CDC_LANE_SIZE + hits[l] + 1;
+            }
+        }
+    }
+    if (i == size)
+        return size;
+    uint64_t hash = warm_up_gear(data + i);
+    for (; i < size; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & mask) == 0) {
+            *found = true;
+            return i + 1;
+        }
+    }
+    return size;
+}
+
+size_t chunker_next(Chunker *chunker, const uint8_t *data, size_t size,
+                    bool *boundary) {
+    *boundary = false;
+    size_t used = 0;
+    if (chunker->len < CDC_MIN_SIZE) {
+        // No boundary this early, the bytes need no hashing
+        used = CDC_MIN_SIZE - chunker->len < size ? CDC_MIN_SIZE - chunker->len
+                                                  : size;
+        chunker->len += used;
+    }
+    if (chunker->len >= CDC_MIN_SIZE && chunker->len < CDC_AVG_SIZE &&
+        used < size) {
+        size_t n = CDC_AVG_SIZE - chunker->len < size - used
+                       ? CDC_AVG_SIZE - chunker->len
+                       : size - used;
+        n = scan_gear(data + used, n, CDC_MASK_SMALL, boundary);
+        used += n;
+        chunker->len += n;
+    }
+    if (!*boundary && chunker->len >= CDC_AVG_SIZE && used < size) {
+        size_t n = CDC_MAX_SIZE - chunker->len < size - used
+                       ? CDC_MAX_SIZE - chunker->len
+                       : size - used;
+        n = scan_gear(data + used, n, CDC_MASK_LARGE, boundary);
+        used += n;
+        chunker->len += n;
+        *boundary = *boundary || chunker->len == CDC_MAX_SIZE;
+    }
+    if (*boundary)
+        chunker_init(chunker);
+    return used;
+}
+
+typedef struct {
+    ChunkEntry **entries;
+    uint32_t count;
+    uint32_t capacity;
+} ChunkList;
+
+// Adds the chunk to the index and its digest to the digest of the file
+void finish_chunk(blake3_hasher *chunk_hasher, uint32_t size,
+                  blake3_hasher *file_hasher, ChunkList *list) {
+    uint8_t digest[BLAKE3_OUT_LEN];
+    blake3_hasher_finalize(chunk_hasher, digest, BLAKE3_OUT_LEN);
+    blake3_hasher_init(chunk_hasher);
+    blake3_hasher_update(file_hasher, digest, BLAKE3_OUT_LEN);
+
+    ChunkEntry *entry = add_chunk(digest, size);
+    if (entry == NULL)
+        return;
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+        ChunkEntry **entries =
+            realloc(list->entries, capacity * sizeof(ChunkEntry *));
+        if (entries == NULL) {
+            perror("Failed to allocate memory for chunk list");
+            return;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    list->entries[list->count++] = entry;
+}
+
+int chunk_file(FilePath file, uint8_t *buffer, uint8_t *hash, uint64_t *size) {
+    // Reads go after the window, which holds the end of the previous read
+    uint8_t *data = buffer + CDC_WINDOW;
+    char path[PATH_MAX];
+    if (get_file_path(file, path, sizeof(path)) >= sizeof(path))
+        return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        add_error();
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t start = get_time_ns();
+    uint64_t nested = get_nested_time();
+    Chunker chunker;
+    chunker_init(&chunker);
+    blake3_hasher chunk_hasher, file_hasher;
+    blake3_hasher_init(&chunk_hasher);
+    blake3_hasher_init(&file_hasher);
+    ChunkList list = {NULL, 0, 0};
+    uint64_t total = 0;
+    uint32_t chunk_size = 0;
+    ssize_t n;
+    while ((n = read(fd, data, CDC_READ_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        // The chunker runs over the buffer while it is still in the cache
+        for (size_t offset = 0; offset < (size_t)n;) {
+            bool boundary;
+            size_t len =
+                chunker_next(&chunker, data + offset, n - offset, &boundary);
+            blake3_hasher_update(&chunk_hasher, data + offset, len);
+            offset += len;
+            chunk_size += len;
+            if (boundary) {
+                finish_chunk(&chunk_hasher, chunk_size, &file_hasher, &list);
+                chunk_size = 0;
+            }
+        }
+        drop_read_pages(fd, (off_t)total, n);
+        total += n;
+        memmove(buffer, buffer + n, CDC_WINDOW);
+    }
+    close(fd);
+    if (n < 0) {
+        add_error();
+        free(list.entries);
+        return -1;
+    }
+    if (chunk_size > 0)
+        finish_chunk(&chunk_hasher, chunk_size, &file_hasher, &list);
+
+    blake3_hasher_finalize(&file_hasher, hash, BLAKE3_OUT_LEN);
+    add_chunked_file(file, total, list.entries, list.count);
+    *size = total;
+    add_hashed_stage(total);
+    add_hashed_file(start);
+    add_outer_stage_time(STAGE_HASH, start, nested);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include "path_store.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Content-defined chunking with a gear hash, as in FastCDC. The hash of
+// the CDC_WINDOW bytes up to a byte decides whether a chunk ends after it,
+// so an insertion only moves the boundaries around it and the chunks after
+// it are found again. The first CDC_MIN_SIZE bytes of a chunk are skipped
+// without hashing. Up to CDC_AVG_SIZE a boundary needs more zero bits than
+// after it, which keeps the sizes close to the average.
+
+#define CDC_MIN_SIZE (4 * 1024)
+#define CDC_AVG_SIZE (16 * 1024)
+#define CDC_MAX_SIZE (64 * 1024)
+// Bytes of the gear hash, older bytes are shifted out of it
+#define CDC_WINDOW 64
+// Bytes read at once when a file is chunked
+#define CDC_READ_SIZE (1024 * 1024)
+
+typedef struct {
+    size_t len; // bytes of the current chunk so far
+} Chunker;
+
+void chunker_init(Chunker *chunker);
+// Function to find the end of the current chunk, returns the number of
+// bytes of data that belong to it. Sets boundary if they end it. The
+// CDC_WINDOW bytes before data must be the ones before it in the stream.
+size_t chunker_next(Chunker *chunker, const uint8_t *data, size_t size,
+                    bool *boundary);
+// Function to chunk a file into the chunk index. The digest of the file is
+// the hash of its chunk digests, so equal files get equal digests. buffer
+// holds CDC_WINDOW + CDC_READ_SIZE bytes and size is set to the bytes
+// chunked. Returns -1 if the file cannot be read.
+int chunk_file(FilePath file, uint8_t *buffer, uint8_t *hash, uint64_t *size);
+
+#endif // CHUNKER_H
@@ -0,0 +1,353 @@
+#define _POSIX_C_SOURCE 200809L
+#include "external.h"
+#include "hash_table.h"
+#include "output.h"
+#include "spill.h"
+#include "stats.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The budget is split by phase. While walking the sizes are spilled with
+// half of it. While hashing two cursors over the sizes read with an eighth
+// each, the digests are spilled with a quarter and the names of a batch
+// take the last quarter. The merge of the digests reads with half of it.
+#define NAME_BLOCK_SIZE (256 * 1024)
+
+// Names of the files in flight, freed all at once
+typedef struct NameBlock {
+    struct NameBlock *next;
+    size_t used;
+    size_t capacity;
+    alignas(FileName) char data[];
+} NameBlock;
+
+// A file as the merge of the sizes returns it, the name is only valid
+// until the next one
+typedef struct {
+    uint64_t size;
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t dir;
+    const char *name;
+    size_t name_len;
+} SizedFile;
+
+// The files of one size, counted ahead of queueing them
+typedef struct {
+    uint64_t size;
+    uint64_t files; // without further names of the same file
+    size_t bytes; // what the files cost in a batch
+} SizeCount;
+
+size_t external_budget = 0;
+Spill *size_spill = NULL;
+Spill *digest_spill = NULL;
+unsigned external_sizes = 0;
+unsigned external_links = 0;
+
+// Only the thread queueing the batches touches these
+NameBlock *name_blocks = NULL;
+size_t batch_bytes = 0;
+uint64_t batch_queued = 0;
+// Changed only while no file is in flight
+atomic_bool hash_in_full = false;
+
+uint64_t batch_done = 0;
+pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+
+int start_external(size_t budget) {
+    external_budget = budget;
+    size_spill = create_spill(budget / 2);
+    return size_spill != NULL ? 0 : -1;
+}
+
+bool is_external() { return external_budget > 0; }
+
+unsigned count_external_sizes() { return external_sizes; }
+
+unsigned count_external_links() { return external_links; }
+
+// Keys are big endian, so they sort by size first
+void put_be64(uint8_t *data, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        data[i] = (uint8_t)(value >> (56 - 8 * i));
+    }
+}
+
+uint64_t get_be64(const uint8_t *data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+// The payload of both spills is the directory and the name of the file
+uint16_t put_name(uint8_t *payload, uint32_t dir, const char *name,
+                  size_t len) {
+    memcpy(payload, &dir, sizeof(dir));
+    memcpy(payload + sizeof(dir), name, len);
+    return (uint16_t)(sizeof(dir) + len);
+}
+
+void add_sized_file(const FileInfo *info, uint32_t dir, const char *name) {
+    uint8_t key[SPILL_KEY_LEN] = {0};
+    put_be64(key, (uint64_t)info->size);
+    put_be64(key + 8, (uint64_t)info->dev);
+    put_be64(key + 16, (uint64_t)info->ino);
+    uint8_t payload[sizeof(uint32_t) + NAME_MAX];
+    size_t len = strlen(name);
+    if (len > NAME_MAX)
+        return;
+    add_spill_record(size_spill, key, payload,
+                     put_name(payload, dir, name, len));
+}
+
+bool read_sized_file(SpillMerge *merge, SizedFile *file) {
+    SpillRecord record;
+    if (!next_spill_record(merge, &record))
+        return false;
+    file->size = get_be64(record.key);
+    file->dev = get_be64(record.key + 8);
+    file->ino = get_be64(record.key + 16);
+    memcpy(&file->dir, record.payload, sizeof(file->dir));
+    file->name = (const char *)record.payload + sizeof(file->dir);
+    file->name_len = record.payload_len - sizeof(file->dir);
+    return true;
+}
+
+size_t get_name_size(size_t name_len) {
+    size_t size = sizeof(FileName) + name_len + 1;
+    return (size + alignof(FileName) - 1) & ~(alignof(FileName) - 1);
+}
+
+// Counts the next size with the cursor that runs ahead, next holds its
+// first file and then the first file of the size after it
+bool count_next_size(SpillMerge *ahead, SizedFile *next, bool *has_next,
+                     SizeCount *count) {
+    if (!*has_next)
+        return false;
+    count->size = next->size;
+    count->files = 0;
+    count->bytes = 0;
+    uint64_t dev = 0, ino = 0;
+    do {
+        if (count->files == 0 || next->dev != dev || next->ino != ino) {
+            count->files++;
+            count->bytes += get_name_size(next->name_len) + CANDIDATE_OVERHEAD;
+            dev = next->dev;
+            ino = next->ino;
+        }
+        *has_next = read_sized_file(ahead, next);
+    } while (*has_next && next->size == count->size);
+    return true;
+}
+
+FileName *alloc_name(uint32_t dir, const char *name, size_t len) {
+    size_t size = get_name_size(len);
+    if (name_blocks == NULL ||
+        name_blocks->capacity - name_blocks->used < size) {
+        size_t capacity = size > NAME_BLOCK_SIZE ? size : NAME_BLOCK_SIZE;
+        NameBlock *block = malloc(sizeof(NameBlock) + capacity);
+        if (block == NULL) {
+            perror("Failed to allocate memory for file names");
+            return NULL;
+        }
+        block->next = name_blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        name_blocks = block;
+    }
+    FileName *file = (FileName *)(name_blocks->data + name_blocks->used);
+    name_blocks->used += size;
+    file->dir = dir;
+    memcpy(file->name, name, len);
+    file->name[len] = '\0';
+    return file;
+}
+
+void free_names() {
+    while (name_blocks != NULL) {
+        NameBlock *next = name_blocks->next;
+        free(name_blocks);
+        name_blocks = next;
+    }
+}
+
+HashStage get_external_stage() {
+    return atomic_load(&hash_in_full) ? HASH_STAGE_FULL : HASH_STAGE_HEAD;
+}
+
+void finish_external_file() {
+    pthread_mutex_lock(&batch_mutex);
+    batch_done++;
+    pthread_cond_signal(&batch_cond);
+    pthread_mutex_unlock(&batch_mutex);
+}
+
+// Waits until every file queued so far is hashed, then the prefilter index
+// and the names can go
+void wait_for_batch() {
+    pthread_mutex_lock(&batch_mutex);
+    while (batch_done < batch_queued) {
+        pthread_cond_wait(&batch_cond, &batch_mutex);
+    }
+    pthread_mutex_unlock(&batch_mutex);
+    free_candidates();
+    free_names();
+    batch_bytes = 0;
+}
+
+void add_external_hash(const uint8_t *hash, FilePath file) {
+    uint8_t payload[sizeof(uint32_t) + NAME_MAX];
+    size_t len = strlen(file->name);
+    add_spill_record(digest_spill, hash, payload,
+                     put_name(payload, file->dir, file->name, len));
+}
+
+void queue_sized_file(Scheduler *scheduler, Walker *walker,
+                      const SizedFile *file, size_t batch_budget) {
+    size_t cost = get_name_size(file->name_len) + CANDIDATE_OVERHEAD;
+    // Files hashed in full depend on no other file of the batch
+    if (atomic_load(&hash_in_full) && batch_bytes + cost > batch_budget)
+        wait_for_batch();
+    FileName *name = alloc_name(file->dir, file->name, file->name_len);
+    if (name == NULL)
+        return;
+    batch_bytes += cost;
+    batch_queued++;
+    uint64_t start = get_time_ns();
+    schedule_file(scheduler, name, (dev_t)file->dev);
+    add_stage_time(STAGE_QUEUE, start);
+    atomic_fetch_add(&walker->candidate_count, 1);
+}
+
+int queue_external_candidates(Scheduler *scheduler, Walker *walker) {
+    // Opening the first cursor frees the buffer of the spill
+    SpillMerge *files = open_spill_merge(size_spill, external_budget / 8);
+    SpillMerge *ahead =
+        files != NULL ? open_spill_merge(size_spill, external_budget / 8)
+                      : NULL;
+    digest_spill = ahead != NULL ? create_spill(external_budget / 4) : NULL;
+    if (digest_spill == NULL) {
+        if (files != NULL)
+            close_spill_merge(files);
+        if (ahead != NULL)
+            close_spill_merge(ahead);
+        return -1;
+    }
+
+    size_t batch_budget = external_budget / 4;
+    SizedFile next, file;
+    bool has_next = read_sized_file(ahead, &next);
+    bool has_file = read_sized_file(files, &file);
+    SizeCount count;
+    while (count_next_size(ahead, &next, &has_next, &count)) {
+        bool colliding = count.files > 1;
+        if (colliding) {
+            external_sizes++;
+            if (count.bytes > batch_budget) {
+                // Too many files to compare them in one batch
+                wait_for_batch();
+                atomic_store(&hash_in_full, true);
+            } else if (batch_bytes + count.bytes > batch_budget) {
+                wait_for_batch();
+            }
+        }
+        uint64_t dev = 0, ino = 0;
+        bool first = true;
+        while (has_file && file.size == count.size) {
+            if (!first && file.dev == dev && file.ino == ino) {
+                // Another name of the file before, it shares its data
+                external_links++;
+            } else if (colliding) {
+                queue_sized_file(scheduler, walker, &file, batch_budget);
+            }
+            dev = file.dev;
+            ino = file.ino;
+            first = false;
+            has_file = read_sized_file(files, &file);
+        }
+        if (atomic_load(&hash_in_full)) {
+            wait_for_batch();
+            atomic_store(&hash_in_full, false);
+        }
+    }
+    wait_for_batch();
+    bool failed = spill_merge_failed(files) || spill_merge_failed(ahead);
+    close_spill_merge(files);
+    close_spill_merge(ahead);
+    return failed ? -1 : 0;
+}
+
+// Prints or streams a group of files with the same digest
+void report_external_group(const uint8_t *hash, const FilePath *files,
+                           uint32_t num_files) {
+    if (is_output_started())
+        output_group(hash, files, num_files);
+    else
+        print_duplicate_group(hash, files, num_files);
+}
+
+int report_external_duplicates() {
+    SpillMerge *merge = open_spill_merge(digest_spill, external_budget / 2);
+    if (merge == NULL)
+        return -1;
+    uint8_t hash[SPILL_KEY_LEN];
+    FilePath *group = NULL;
+    uint32_t num_files = 0, capacity = 0;
+    SpillRecord record;
+    bool more;
+    do {
+        more = next_spill_record(merge, &record);
+        if (num_files > 0 &&
+            (!more || memcmp(record.key, hash, SPILL_KEY_LEN) != 0)) {
+            if (num_files > 1)
+                report_external_group(hash, group, num_files);
+            num_files = 0;
+            free_names();
+        }
+        if (!more)
+            break;
+        if (num_files == capacity) {
+            uint32_t new_capacity = capacity ? capacity * 2 : 16;
+            FilePath *files = realloc(group, new_capacity * sizeof(FilePath));
+            if (files == NULL) {
+                perror("Failed to allocate memory for duplicate group");
+                break;
+            }
+            group = files;
+            capacity = new_capacity;
+        }
+        uint32_t dir;
+        memcpy(&dir, record.payload, sizeof(dir));
+        FilePath file =
+            alloc_name(dir, (const char *)record.payload + sizeof(dir),
+                       record.payload_len - sizeof(dir));
+        if (file == NULL)
+            break;
+        memcpy(hash, record.key, SPILL_KEY_LEN);
+        group[num_files++] = file;
+    } while (more);
+    bool failed = more || spill_merge_failed(merge);
+    free(group);
+    free_names();
+    close_spill_merge(merge);
+    return failed ? -1 : 0;
+}
+
+void free_external() {
+    if (size_spill != NULL)
+        destroy_spill(size_spill);
+    if (digest_spill != NULL)
+        destroy_spill(digest_spill);
+    size_spill = NULL;
+    digest_spill = NULL;
+    free_names();
+}
@@ -0,0 +1,55 @@
+#ifndef EXTERNAL_H
+#define EXTERNAL_H
+
+#include "hashing.h"
+#include "path_store.h"
+#include "scheduler.h"
+#include "walker.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory-bounded mode for trees whose files do not fit in memory. The
+// walkers spill every file as a (size, device, inode, name) record instead
+// of interning it, and once the walk is done the records are merged back in
+// order of size. Hard links of a file come out next to each other and only
+// the first name is kept. Files whose size collides go to the workers in
+// batches of whole sizes, the prefilter index is cleared between batches.
+// A size with more files than a batch holds skips the prefilter and is
+// hashed in full, in as many batches as it takes. Full digests are spilled
+// as (digest, name) records, and merging them puts duplicates next to each
+// other.
+//
+// Directories are still interned, only the files are kept out of memory.
+
+// Smallest budget, in bytes
+#define EXTERNAL_MIN_BUDGET (16 * 1024 * 1024)
+// Memory a candidate costs in the prefilter index besides its name
+#define CANDIDATE_OVERHEAD 256
+
+// Function to turn on the mode with a budget in bytes, before the walk.
+// Returns -1 if the spill cannot be created.
+int start_external(size_t budget);
+bool is_external();
+// Function for the walkers to spill a file
+void add_sized_file(const FileInfo *info, uint32_t dir, const char *name);
+// Function to get the stage the workers start a file of the batch at
+HashStage get_external_stage();
+// Function for the workers to tell that a file of the batch is done
+void finish_external_file();
+// Function to spill the full digest of a file
+void add_external_hash(const uint8_t *hash, FilePath file);
+// Function to feed the files whose size collides to the workers once the
+// walk is done, returns once the last batch is hashed. Returns -1 on
+// failure.
+int queue_external_candidates(Scheduler *scheduler, Walker *walker);
+// Function to print or stream the groups once every digest is spilled,
+// returns -1 on failure
+int report_external_duplicates();
+// Functions to get what the merge of the sizes found
+unsigned count_external_sizes();
+unsigned count_external_links();
+// Function to free the spills
+void free_external();
+
+#endif // EXTERNAL_H
@@ -0,0 +1,141 @@
+#include "fast_hash.h"
+#include <string.h>
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+uint64_t rotate_left(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Reads are little endian like the reference, memcpy keeps them aligned
+uint64_t read64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint64_t lane_round(uint64_t lane, uint64_t input) {
+    lane += input * PRIME2;
+    lane = rotate_left(lane, 31);
+    return lane * PRIME1;
+}
+
+uint64_t merge_lane(uint64_t hash, uint64_t lane) {
+    hash ^= lane_round(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+uint64_t avalanche(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void consume_stripe(uint64_t *lanes, const uint8_t *stripe) {
+    lanes[0] = lane_round(lanes[0], read64(stripe));
+    lanes[1] = lane_round(lanes[1], read64(stripe + 8));
+    lanes[2] = lane_round(lanes[2], read64(stripe + 16));
+    lanes[3] = lane_round(lanes[3], read64(stripe + 24));
+}
+
+void fast_hasher_init(FastHasher *hasher) {
+    hasher->lanes[0] = PRIME1 + PRIME2;
+    hasher->lanes[1] = PRIME2;
+    hasher->lanes[2] = 0;
+    hasher->lanes[3] = -PRIME1;
+    hasher->total = 0;
+    hasher->buffered = 0;
+}
+
+void fast_hasher_update(FastHasher *hasher, const void *input, size_t len) {
+    const uint8_t *p = input;
+    hasher->total += len;
+    if (hasher->buffered > 0) {
+        size_t fill = FAST_STRIPE_SIZE - hasher->buffered;
+        if (len < fill) {
+            memcpy(hasher->buffer + hasher->buffered, p, len);
+            hasher->buffered += len;
+            return;
+        }
+        memcpy(hasher->buffer + hasher->buffered, p, fill);
+        consume_stripe(hasher->lanes, hasher->buffer);
+        p += fill;
+        len -= fill;
+        hasher->buffered = 0;
+    }
+
+    // The lanes stay in registers for the bulk of the input
+    uint64_t lanes[4] = {hasher->lanes[0], hasher->lanes[1], hasher->lanes[2],
+                         hasher->lanes[3]};
+    while (len >= FAST_STRIPE_SIZE) {
+        consume_stripe(lanes, p);
+        p += FAST_STRIPE_SIZE;
+        len -= FAST_STRIPE_SIZE;
+    }
+    memcpy(hasher->lanes, lanes, sizeof(lanes));
+
+    memcpy(hasher->buffer, p, len);
+    hasher->buffered = len;
+}
+
+// Mixes in the bytes of the last incomplete stripe, as xxHash64 does
+uint64_t fold_tail(uint64_t hash, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        hash ^= lane_round(0, read64(p));
+        hash = rotate_left(hash, 27) * PRIME1 + PRIME4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME1;
+        hash = rotate_left(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        hash ^= *p * PRIME5;
+        hash = rotate_left(hash, 11) * PRIME1;
+        p++;
+        len--;
+    }
+    return hash;
+}
+
+void fast_hasher_finalize(const FastHasher *hasher, uint8_t *out, size_t len) {
+    const uint64_t *lanes = hasher->lanes;
+    uint64_t low, high;
+    if (hasher->total >= FAST_STRIPE_SIZE) {
+        low = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) +
+              rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        // The same lanes the other way round
+        high = rotate_left(lanes[3], 1) + rotate_left(lanes[2], 7) +
+               rotate_left(lanes[1], 12) + rotate_left(lanes[0], 18);
+        for (int i = 0; i < 4; i++) {
+            low = merge_lane(low, lanes[i]);
+            high = merge_lane(high, lanes[3 - i]);
+        }
+    } else {
+        low = PRIME5;
+        high = PRIME5 ^ PRIME1;
+    }
+    low += hasher->total;
+    high += hasher->total * PRIME3;
+
+    uint64_t digest[2] = {
+        avalanche(fold_tail(low, hasher->buffer, hasher->buffered)),
+        avalanche(fold_tail(high, hasher->buffer, hasher->buffered))};
+    memcpy(out, digest, len < sizeof(digest) ? len : sizeof(digest));
+}
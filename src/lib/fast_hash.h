@@ -0,0 +1,28 @@
+#ifndef FAST_HASH_H
+#define FAST_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Non-cryptographic hash for grouping candidates, several times faster than
+// BLAKE3 without SIMD. Four xxHash64 lanes consume 32 bytes per round and
+// are folded into 128 bits at the end: the first 64 bits are xxHash64 of
+// the input, the second 64 bits come from a second fold of the same lanes.
+// Files that collide on it are confirmed with BLAKE3.
+
+#define FAST_HASH_LEN 16
+#define FAST_STRIPE_SIZE 32
+
+typedef struct {
+    uint64_t lanes[4];
+    uint64_t total; // bytes consumed so far
+    uint8_t buffer[FAST_STRIPE_SIZE]; // bytes of an incomplete stripe
+    size_t buffered;
+} FastHasher;
+
+void fast_hasher_init(FastHasher *hasher);
+void fast_hasher_update(FastHasher *hasher, const void *input, size_t len);
+// Writes up to FAST_HASH_LEN bytes of the digest
+void fast_hasher_finalize(const FastHasher *hasher, uint8_t *out, size_t len);
+
+#endif // FAST_HASH_H
@@ -0,0 +1,341 @@
+#define _POSIX_C_SOURCE 200809L
+#include "hash_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+char *cache_path = NULL; // NULL while the cache is off
+CacheHeader *cache_map = NULL;
+size_t cache_map_size = 0;
+const CacheEntry *cache_entries = NULL; // entries of the last run, mapped
+uint64_t num_cache_entries = 0;
+uint64_t cache_generation = 0;
+atomic_uchar *cache_seen = NULL; // mapped entries seen during this run
+CachedHash *added_hashes = NULL;
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Checks the mapping is a cache this version wrote completely
+bool is_valid_cache(const CacheHeader *header, size_t size) {
+    return memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == CACHE_VERSION &&
+           header->entry_size == sizeof(CacheEntry) &&
+           header->num_entries == (size - sizeof(CacheHeader)) / sizeof(CacheEntry) &&
+           (size - sizeof(CacheHeader)) % sizeof(CacheEntry) == 0;
+}
+
+int open_hash_cache(const char *path) {
+    cache_path = strdup(path);
+    if (cache_path == NULL) {
+        perror("Failed to allocate memory for cache path");
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        perror("Failed to open hash cache");
+        return -1;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        perror("Failed to stat hash cache");
+        close(fd);
+        return -1;
+    }
+    if ((size_t)file_stat.st_size < sizeof(CacheHeader)) {
+        fprintf(stderr, "Ignoring invalid hash cache %s\n", path);
+        close(fd);
+        return 0;
+    }
+
+    // The cache is only ever replaced by a rename, never written in place
+    cache_map_size = file_stat.st_size;
+    cache_map = mmap(NULL, cache_map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache_map == MAP_FAILED) {
+        perror("Failed to map hash cache");
+        cache_map = NULL;
+        return -1;
+    }
+    if (!is_valid_cache(cache_map, cache_map_size)) {
+        fprintf(stderr, "Ignoring invalid hash cache %s\n", path);
+        munmap(cache_map, cache_map_size);
+        cache_map = NULL;
+        return 0;
+    }
+    posix_madvise(cache_map, cache_map_size, POSIX_MADV_RANDOM);
+
+    cache_entries = (const CacheEntry *)(cache_map + 1);
+    num_cache_entries = cache_map->num_entries;
+    cache_generation = cache_map->generation;
+    cache_seen = calloc(num_cache_entries > 0 ? num_cache_entries : 1, 1);
+    if (cache_seen == NULL) {
+        perror("Failed to allocate memory for hash cache");
+        return -1;
+    }
+    return 0;
+}
+
+// Digests of the first pass stages are only of use to a run with the same
+// first pass engine, the full digest always is
+uint32_t get_usable_stages() {
+    if (cache_map == NULL ||
+        cache_map->first_pass == get_first_pass_engine()->id)
+        return UINT32_MAX;
+    return 1u << HASH_STAGE_FULL;
+}
+
+void get_cache_key(const struct stat *file_stat, CacheKey *key) {
+    key->dev = file_stat->st_dev;
+    key->ino = file_stat->st_ino;
+    key->size = file_stat->st_size;
+    key->mtime_ns =
+        file_stat->st_mtim.tv_sec * 1000000000LL + file_stat->st_mtim.tv_nsec;
+    key->ctime_ns =
+        file_stat->st_ctim.tv_sec * 1000000000LL + file_stat->st_ctim.tv_nsec;
+}
+
+int compare_ids(const CacheKey *a, const CacheKey *b) {
+    if (a->dev != b->dev)
+        return a->dev < b->dev ? -1 : 1;
+    if (a->ino != b->ino)
+        return a->ino < b->ino ? -1 : 1;
+    return 0;
+}
+
+bool same_key(const CacheKey *a, const CacheKey *b) {
+    return compare_ids(a, b) == 0 && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+// Binary search of the mapped entries for the file
+const CacheEntry *find_mapped_entry(const CacheKey *key) {
+    uint64_t low = 0, high = num_cache_entries;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        int order = compare_ids(&cache_entries[middle].key, key);
+        if (order == 0)
+            return &cache_entries[middle];
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+CachedHash *find_added_hash(const CacheKey *key) {
+    uint64_t id[2] = {key->dev, key->ino};
+    CachedHash *cached;
+    HASH_FIND(hh, added_hashes, id, sizeof(id), cached);
+    return cached;
+}
+
+int lookup_cached_hash(const CacheKey *key, HashStage stage, uint8_t *hash) {
+    if (cache_path == NULL)
+        return -1;
+    stage = get_hash_stage(stage, key->size);
+
+    // Entries added this run hold every stage the mapped one had
+    pthread_mutex_lock(&cache_mutex);
+    CachedHash *cached = find_added_hash(key);
+    if (cached != NULL && same_key(&cached->entry.key, key)) {
+        bool found = cached->entry.stages & (1u << stage);
+        if (found)
+            memcpy(hash, cached->entry.digests[stage], MAX_DIGEST_LEN);
+        pthread_mutex_unlock(&cache_mutex);
+        return found ? (int)stage : -1;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    const CacheEntry *entry = find_mapped_entry(key);
+    if (entry == NULL || !same_key(&entry->key, key))
+        return -1;
+    atomic_store_explicit(&cache_seen[entry - cache_entries], 1,
+                          memory_order_relaxed);
+    if (!(entry->stages & get_usable_stages() & (1u << stage)))
+        return -1;
+    memcpy(hash, entry->digests[stage], MAX_DIGEST_LEN);
+    return stage;
+}
+
+void store_cached_hash(const CacheKey *key, int hashed, const uint8_t *hash) {
+    if (cache_path == NULL)
+        return;
+    pthread_mutex_lock(&cache_mutex);
+    CachedHash *cached = find_added_hash(key);
+    if (cached == NULL) {
+        cached = calloc(1, sizeof(CachedHash));
+        if (cached == NULL) {
+            perror("Failed to allocate memory for cached hash");
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+        cached->id[0] = key->dev;
+        cached->id[1] = key->ino;
+        // Keep the stages of the last run if the file did not change
+        const CacheEntry *entry = find_mapped_entry(key);
+        if (entry != NULL && same_key(&entry->key, key)) {
+            cached->entry = *entry;
+            cached->entry.stages &= get_usable_stages();
+        }
+        HASH_ADD(hh, added_hashes, id, sizeof(cached->id), cached);
+    }
+    if (!same_key(&cached->entry.key, key)) {
+        // The file changed, the digests we have are of the old content
+        cached->entry.stages = 0;
+    }
+    cached->entry.key = *key;
+    cached->entry.stages |= 1u << hashed;
+    memcpy(cached->entry.digests[hashed], hash, MAX_DIGEST_LEN);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+int compare_entries(const void *a, const void *b) {
+    return compare_ids(&(*(const CacheEntry *const *)a)->key,
+                       &(*(const CacheEntry *const *)b)->key);
+}
+
+// Writes the mapped entries merged with the added ones, the added ones
+// replace mapped ones of the same file. Compacts the cache on the way by
+// dropping files that were not seen for CACHE_MAX_AGE runs.
+int write_cache_entries(FILE *file, uint64_t generation, uint64_t *count) {
+    size_t num_added = HASH_COUNT(added_hashes);
+    CacheEntry **added = malloc((num_added > 0 ? num_added : 1) *
+                                sizeof(CacheEntry *));
+    if (added == NULL) {
+        perror("Failed to allocate memory for hash cache");
+        return -1;
+    }
+    size_t n = 0;
+    CachedHash *cached, *tmp;
+    HASH_ITER(hh, added_hashes, cached, tmp) {
+        cached->entry.generation = generation;
+        added[n++] = &cached->entry;
+    }
+    qsort(added, num_added, sizeof(CacheEntry *), compare_entries);
+
+    size_t i = 0, j = 0;
+    *count = 0;
+    while (i < num_cache_entries || j < num_added) {
+        int order = i == num_cache_entries ? 1
+                    : j == num_added       ? -1
+                                           : compare_ids(&cache_entries[i].key,
+                                                         &added[j]->key);
+        CacheEntry entry;
+        if (order < 0) {
+            entry = cache_entries[i];
+            entry.stages &= get_usable_stages();
+            if (atomic_load_explicit(&cache_seen[i], memory_order_relaxed))
+                entry.generation = generation;
+            i++;
+            if (entry.generation + CACHE_MAX_AGE < generation)
+                continue;
+        } else {
+            entry = *added[j++];
+            if (order == 0)
+                i++;
+        }
+        if (fwrite(&entry, sizeof(entry), 1, file) != 1) {
+            free(added);
+            return -1;
+        }
+        (*count)++;
+    }
+    free(added);
+    return 0;
+}
+
+// Makes the rename durable
+void sync_parent_dir(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) {
+        slash[1] = '\0';
+    } else if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+int save_hash_cache() {
+    if (cache_path == NULL)
+        return 0;
+
+    // A crash leaves the old cache, concurrent runs each use their own file
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path,
+                 (int)getpid()) >= (int)sizeof(tmp_path)) {
+        fprintf(stderr, "Hash cache path is too long\n");
+        return -1;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (file == NULL) {
+        perror("Failed to create hash cache");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    CacheHeader header = {.version = CACHE_VERSION,
+                          .entry_size = sizeof(CacheEntry),
+                          .generation = cache_generation + 1,
+                          .first_pass = get_first_pass_engine()->id};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    pthread_mutex_lock(&cache_mutex);
+    int result = fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+    if (result == 0)
+        result = write_cache_entries(file, header.generation,
+                                     &header.num_entries);
+    pthread_mutex_unlock(&cache_mutex);
+    if (result == 0 && (fseek(file, 0, SEEK_SET) != 0 ||
+                        fwrite(&header, sizeof(header), 1, file) != 1 ||
+                        fflush(file) != 0 || fsync(fd) != 0))
+        result = -1;
+    if (fclose(file) != 0)
+        result = -1;
+    if (result == 0 && rename(tmp_path, cache_path) != 0)
+        result = -1;
+    if (result != 0) {
+        perror("Failed to write hash cache");
+        unlink(tmp_path);
+        return -1;
+    }
+    sync_parent_dir(cache_path);
+    return 0;
+}
+
+void close_hash_cache() {
+    CachedHash *cached, *tmp;
+    HASH_ITER(hh, added_hashes, cached, tmp) {
+        HASH_DEL(added_hashes, cached);
+        free(cached);
+    }
+    if (cache_map != NULL)
+        munmap(cache_map, cache_map_size);
+    free(cache_seen);
+    free(cache_path);
+    cache_map = NULL;
+    cache_entries = NULL;
+    num_cache_entries = 0;
+    cache_seen = NULL;
+    cache_path = NULL;
+}
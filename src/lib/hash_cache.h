@@ -0,0 +1,67 @@
+#ifndef HASH_CACHE_H
+#define HASH_CACHE_H
+
+#include "blake3.h"
+#include "hashing.h"
+#include "uthash.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "DDUPHSH1"
+#define CACHE_VERSION 2
+// Entries not seen for this many runs are dropped when the cache is saved
+#define CACHE_MAX_AGE 8
+#define NUM_HASH_STAGES (HASH_STAGE_FULL + 1)
+
+// Identifies a file and its content, any write changes mtime and ctime
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+} CacheKey;
+
+// The cache file is this header followed by the entries sorted by dev and
+// ino, so it can be searched right in the mapping
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t generation; // number of runs that saved the cache
+    uint64_t num_entries;
+    uint32_t first_pass; // engine of the stages before the full one
+    uint32_t reserved;
+} CacheHeader;
+
+typedef struct {
+    CacheKey key;
+    uint64_t generation; // last run that saw the file
+    uint32_t stages; // bit per stage with a digest
+    uint32_t reserved;
+    uint8_t digests[NUM_HASH_STAGES][MAX_DIGEST_LEN];
+} CacheEntry;
+
+// Entries added during this run, keyed on dev and ino
+typedef struct {
+    uint64_t id[2];
+    CacheEntry entry;
+    UT_hash_handle hh;
+} CachedHash;
+
+// Function to map the cache file, a missing file starts an empty cache
+int open_hash_cache(const char *path);
+// Function to build the key of a file from the fstat of the descriptor it
+// is read through, so the key matches the content that is hashed
+void get_cache_key(const struct stat *file_stat, CacheKey *key);
+// Function to look up the digest of a stage, returns the stage the digest
+// is for or -1 if it is not cached
+int lookup_cached_hash(const CacheKey *key, HashStage stage, uint8_t *hash);
+// Function to remember the digest of the stage that was hashed
+void store_cached_hash(const CacheKey *key, int hashed, const uint8_t *hash);
+// Function to write the cache to a new file and rename it over the old one
+int save_hash_cache();
+void close_hash_cache();
+
+#endif // HASH_CACHE_H
@@ -1,72 +1,280 @@
 #define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
-#include <bits/pthreadtypes.h>
-#include "uthash.h"
 #include "blake3.h"
 #include "hash_table.h"
+#include "inode_table.h"
+#include "stats.h"
+#include <linux/limits.h>
 #include <string.h>
 
-FileHash *hashes = NULL; // The hashmap
-pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+HashIndex hashes; // The hashmap
+HashIndex candidates; // Stage hashes of files not fully hashed yet
+pthread_once_t index_once = PTHREAD_ONCE_INIT;
 
-// Function to add a file path to an existing hash
-void add_to_existing_hash(FileHash *file_hash, const char *file_path) {
-    // Print a message indicating that the file is being processed
-    // If the array is full, double its capacity
-    if (file_hash->num_paths == file_hash->paths_capacity) {
-        file_hash->paths_capacity *= 2;
-        file_hash->file_paths = realloc(file_hash->file_paths, file_hash->paths_capacity * sizeof(char *));
+void init_index(HashIndex *index) {
+    for (int i = 0; i < NUM_HASH_SHARDS; i++) {
+        pthread_mutex_init(&index->shards[i].mutex, NULL);
+        index->shards[i].entries = NULL;
+        index->shards[i].capacity = 0;
+        index->shards[i].count = 0;
     }
+}
 
-    // Add the file path to the array
-    file_hash->file_paths[file_hash->num_paths] = strdup(file_path);
-    file_hash->num_paths++;
+void init_indexes() {
+    init_index(&hashes);
+    init_index(&candidates);
 }
 
-// Function to add a new hash to the hashmap
-void add_new_hash(const char *hash, const char *file_path) {
-    pthread_mutex_lock(&hash_mutex);
-    FileHash *file_hash;
+void hash_to_hex(const uint8_t *hash, char *hash_str) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < BLAKE3_OUT_LEN; i++) {
+        hash_str[i * 2] = digits[hash[i] >> 4];
+        hash_str[i * 2 + 1] = digits[hash[i] & 0xf];
+    }
+    hash_str[BLAKE3_OUT_LEN * 2] = '\0';
+}
 
-    // Look for the hash in the hashmap
-    HASH_FIND_STR(hashes, hash, file_hash);
+HashShard *get_shard(HashIndex *index, const uint8_t *hash) {
+    return &index->shards[hash[0] % NUM_HASH_SHARDS];
+}
 
-    if (file_hash == NULL) {
-        // If the hash is not in the hashmap, add a new entry
-        file_hash = malloc(sizeof(FileHash));
-        if (file_hash == NULL) {
-            perror("Failed to allocate memory for new file hash");
-            pthread_mutex_unlock(&hash_mutex);
-            return;
+// Bucket of the digest, from bits the shard index does not use
+size_t get_bucket(const uint8_t *hash, size_t capacity) {
+    uint64_t bits;
+    memcpy(&bits, hash + sizeof(bits), sizeof(bits));
+    return bits & (capacity - 1);
+}
+
+// Doubles the shard once it is 3/4 full, the caller holds its mutex
+bool grow_shard(HashShard *shard) {
+    size_t capacity = shard->capacity ? shard->capacity * 2
+                                      : INITIAL_SHARD_CAPACITY;
+    FileHash *entries = calloc(capacity, sizeof(FileHash));
+    if (entries == NULL) {
+        perror("Failed to allocate memory for hash shard");
+        return false;
+    }
+    for (size_t i = 0; i < shard->capacity; i++) {
+        FileHash *old = &shard->entries[i];
+        if (old->num_paths == 0)
+            continue;
+        size_t bucket = get_bucket(old->hash, capacity);
+        while (entries[bucket].num_paths != 0) {
+            bucket = (bucket + 1) & (capacity - 1);
         }
+        entries[bucket] = *old;
+    }
+    free(shard->entries);
+    shard->entries = entries;
+    shard->capacity = capacity;
+    return true;
+}
 
-        strcpy(file_hash->hash, hash);
-        file_hash->num_paths = 0;
-        file_hash->paths_capacity = 1;
-        file_hash->file_paths = malloc(file_hash->paths_capacity * sizeof(char *));
-        if (file_hash->file_paths == NULL) {
+// Finds the entry of the digest or the empty slot for it, the caller holds
+// the mutex of the shard. Returns NULL if the shard cannot grow.
+FileHash *find_slot(HashShard *shard, const uint8_t *hash) {
+    if ((shard->count + 1) * 4 > shard->capacity * 3 && !grow_shard(shard))
+        return NULL;
+    size_t bucket = get_bucket(hash, shard->capacity);
+    while (1) {
+        FileHash *file_hash = &shard->entries[bucket];
+        if (file_hash->num_paths == 0 ||
+            memcmp(file_hash->hash, hash, BLAKE3_OUT_LEN) == 0)
+            return file_hash;
+        bucket = (bucket + 1) & (shard->capacity - 1);
+    }
+}
+
+// Takes the mutex of the shard, counting the time spent waiting for it
+void lock_shard(HashShard *shard) { lock_counting_wait(&shard->mutex); }
+
+FilePath *get_file_paths(FileHash *file_hash) {
+    return file_hash->num_paths > 1 ? file_hash->files : &file_hash->file;
+}
+
+// Function to add a file to an existing hash
+void add_to_existing_hash(FileHash *file_hash, FilePath file) {
+    if (file_hash->num_paths == 1) {
+        // The second file moves both out of line
+        FilePath *files = malloc(2 * sizeof(FilePath));
+        if (files == NULL) {
             perror("Failed to allocate memory for file paths");
-            free(file_hash);
-            pthread_mutex_unlock(&hash_mutex);
             return;
         }
-        HASH_ADD_STR(hashes, hash, file_hash);
+        files[0] = file_hash->file;
+        file_hash->files = files;
+        file_hash->paths_capacity = 2;
+    } else if (file_hash->num_paths == file_hash->paths_capacity) {
+        // If the array is full, double its capacity
+        FilePath *files = realloc(file_hash->files,
+                                  file_hash->paths_capacity * 2 *
+                                      sizeof(FilePath));
+        if (files == NULL) {
+            perror("Failed to allocate memory for file paths");
+            return;
+        }
+        file_hash->files = files;
+        file_hash->paths_capacity *= 2;
     }
 
-    // Add the file path to the hash
-    add_to_existing_hash(file_hash, file_path);
-    pthread_mutex_unlock(&hash_mutex);
+    // Add the file to the array
+    file_hash->files[file_hash->num_paths++] = file;
+}
+
+// Function to add a new hash to the hashmap
+uint32_t add_new_hash(const uint8_t *hash, FilePath file, FilePath *first) {
+    pthread_once(&index_once, init_indexes);
+    HashShard *shard = get_shard(&hashes, hash);
+    lock_shard(shard);
+    if (first != NULL)
+        *first = NULL;
+    FileHash *file_hash = find_slot(shard, hash);
+    if (file_hash == NULL) {
+        pthread_mutex_unlock(&shard->mutex);
+        return 0;
+    }
+
+    if (file_hash->num_paths == 0) {
+        // If the hash is not in the hashmap, the file goes in inline
+        memcpy(file_hash->hash, hash, BLAKE3_OUT_LEN);
+        file_hash->file = file;
+        file_hash->num_paths = 1;
+        shard->count++;
+    } else {
+        if (file_hash->num_paths == 1 && first != NULL)
+            *first = file_hash->file;
+        // Add the file to the hash
+        add_to_existing_hash(file_hash, file);
+    }
+    uint32_t num_paths = file_hash->num_paths;
+    pthread_mutex_unlock(&shard->mutex);
+    return num_paths;
+}
+
+// Function to add a file to the candidates of a prefilter stage
+bool add_candidate_hash(const uint8_t *hash, FilePath file, FilePath *held) {
+    pthread_once(&index_once, init_indexes);
+    HashShard *shard = get_shard(&candidates, hash);
+    lock_shard(shard);
+    *held = NULL;
+    FileHash *file_hash = find_slot(shard, hash);
+    if (file_hash == NULL) {
+        pthread_mutex_unlock(&shard->mutex);
+        return false;
+    }
+
+    if (file_hash->num_paths == 0) {
+        // First file with this stage hash, keep it until another one
+        // collides with it
+        memcpy(file_hash->hash, hash, BLAKE3_OUT_LEN);
+        file_hash->file = file;
+        file_hash->num_paths = 1;
+        shard->count++;
+        pthread_mutex_unlock(&shard->mutex);
+        return false;
+    }
+
+    if (file_hash->num_paths == 1) {
+        // The held back file moves on together with this one
+        *held = file_hash->file;
+        file_hash->file = NULL;
+    }
+    file_hash->num_paths++;
+    pthread_mutex_unlock(&shard->mutex);
+    return true;
+}
+
+// Other names of the same file share its data already, they are listed
+// under it rather than as copies
+void print_hard_links(FilePath file) {
+    InodeLinks *links = find_inode_links(file);
+    if (links == NULL)
+        return;
+    char path[PATH_MAX];
+    for (unsigned i = 0; i < links->num_links; i++) {
+        if (get_file_path(links->links[i], path, sizeof(path)) < sizeof(path))
+            printf("    %s (hard link)\n", path);
+    }
+}
+
+void print_duplicate_group(const uint8_t *hash, const FilePath *files,
+                           uint32_t num_files) {
+    char hash_str[BLAKE3_OUT_LEN * 2 + 1];
+    char path[PATH_MAX];
+    // Hex and full paths only for the output
+    hash_to_hex(hash, hash_str);
+    printf("Duplicate files found for hash %s:\n", hash_str);
+    for (uint32_t k = 0; k < num_files; k++) {
+        if (get_file_path(files[k], path, sizeof(path)) < sizeof(path))
+            printf("  %s\n", path);
+        print_hard_links(files[k]);
+    }
 }
 
 void print_duplicates() {
-    FileHash *current_hash, *tmp;
-    HASH_ITER(hh, hashes, current_hash, tmp) {
-        if (current_hash->num_paths > 1) {
-            printf("Duplicate files found for hash %s:\n", current_hash->hash);
-            for (int i = 0; i < current_hash->num_paths; i++) {
-                printf("  %s\n", current_hash->file_paths[i]);
-            }
+    pthread_once(&index_once, init_indexes);
+    for (int i = 0; i < NUM_HASH_SHARDS; i++) {
+        HashShard *shard = &hashes.shards[i];
+        for (size_t j = 0; j < shard->capacity; j++) {
+            FileHash *current_hash = &shard->entries[j];
+            if (current_hash->num_paths > 1)
+                print_duplicate_group(current_hash->hash,
+                                      get_file_paths(current_hash),
+                                      current_hash->num_paths);
         }
     }
 }
+
+// Same order as print_duplicates, nothing may add to the index any more
+long collect_duplicates(FileHash ***groups) {
+    pthread_once(&index_once, init_indexes);
+    size_t count = 0;
+    for (int i = 0; i < NUM_HASH_SHARDS; i++) {
+        HashShard *shard = &hashes.shards[i];
+        for (size_t j = 0; j < shard->capacity; j++) {
+            count += shard->entries[j].num_paths > 1;
+        }
+    }
+    *groups = malloc((count > 0 ? count : 1) * sizeof(FileHash *));
+    if (*groups == NULL) {
+        perror("Failed to allocate memory for duplicate groups");
+        return -1;
+    }
+    count = 0;
+    for (int i = 0; i < NUM_HASH_SHARDS; i++) {
+        HashShard *shard = &hashes.shards[i];
+        for (size_t j = 0; j < shard->capacity; j++) {
+            if (shard->entries[j].num_paths > 1)
+                (*groups)[count++] = &shard->entries[j];
+        }
+    }
+    return (long)count;
+}
+
+// The files themselves live in the path store
+void free_index(HashIndex *index) {
+    for (int i = 0; i < NUM_HASH_SHARDS; i++) {
+        HashShard *shard = &index->shards[i];
+        for (size_t j = 0; j < shard->capacity; j++) {
+            if (shard->entries[j].num_paths > 1 &&
+                shard->entries[j].paths_capacity > 0)
+                free(shard->entries[j].files);
+        }
+        free(shard->entries);
+        shard->entries = NULL;
+        shard->capacity = 0;
+        shard->count = 0;
+    }
+}
+
+void free_candidates() {
+    pthread_once(&index_once, init_indexes);
+    free_index(&candidates);
+}
+
+void free_hashes() {
+    pthread_once(&index_once, init_indexes);
+    free_index(&hashes);
+}
@@ -1,22 +1,67 @@
 #ifndef HASH_TABLE_H
 #define HASH_TABLE_H
 
-#include "uthash.h"
+#include "../shared/consts.h"
 #include "blake3.h"
+#include "path_store.h"
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Digests are spread over the shards by their first byte
+#define NUM_HASH_SHARDS 64
+#define INITIAL_SHARD_CAPACITY 64
 
 typedef struct {
-    char hash[BLAKE3_OUT_LEN * 2 + 1]; // Key
-    char **file_paths; // Value
-    int num_paths; // Number of paths in the array
-    int paths_capacity; // Capacity of the array
-    UT_hash_handle hh; // Makes this structure hashable
+    uint8_t hash[BLAKE3_OUT_LEN]; // Key, the raw digest
+    uint32_t num_paths; // Number of paths, 0 marks an empty slot
+    uint32_t paths_capacity; // Capacity of files once there are two
+    union {
+        FilePath file; // The only file, most files have no duplicate
+        FilePath *files;
+    };
 } FileHash;
 
-// Function to add a file path to an existing hash
-void add_to_existing_hash(FileHash *file_hash, const char *file_path);
-// Function to add a new hash to the hashmap
-void add_new_hash(const char *hash, const char *file_path);
+// Open addressing table with linear probing, the digest bits are random
+// enough to be used as the bucket index right away
+typedef struct {
+    alignas(CACHE_LINE_SIZE) pthread_mutex_t mutex;
+    FileHash *entries;
+    size_t capacity; // a power of two
+    size_t count;
+} HashShard;
+
+typedef struct {
+    HashShard shards[NUM_HASH_SHARDS];
+} HashIndex;
+
+// Function to turn a digest into the hex string that is printed
+void hash_to_hex(const uint8_t *hash, char *hash_str);
+// Function to get the files of an entry
+FilePath *get_file_paths(FileHash *file_hash);
+// Function to add a file to an existing hash
+void add_to_existing_hash(FileHash *file_hash, FilePath file);
+// Function to add a new hash to the hashmap, returns the number of files
+// with the hash or 0 on failure. When the file is the second one, first is
+// set to the one before it.
+uint32_t add_new_hash(const uint8_t *hash, FilePath file, FilePath *first);
+// Function to add a file to the candidates of a prefilter stage, returns
+// true if the file collides and needs the next stage. On the first collision
+// the earlier file is handed over in held, it needs the next stage as well.
+bool add_candidate_hash(const uint8_t *hash, FilePath file, FilePath *held);
+// Function to print a group of files with the same content
+void print_duplicate_group(const uint8_t *hash, const FilePath *files,
+                           uint32_t num_files);
 // Function to get the duplicates
 void print_duplicates();
+// Function to get the entries with more than one file once the hashing is
+// done, returns their number or -1. The caller frees the array.
+long collect_duplicates(FileHash ***groups);
+// Function to free the candidates of the prefilter stages
+void free_candidates();
+// Function to free the hashmap
+void free_hashes();
 
-#endif // HASH_TABLE_H
\ No newline at end of file
+#endif // HASH_TABLE_H
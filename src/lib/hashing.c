@@ -1,22 +1,136 @@
+#define _POSIX_C_SOURCE 200809L
 #include "hashing.h"
+#include "reader.h"
+#include "stats.h"
+#include "tree_hash.h"
 #include <blake3.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 
-void blake3_init(void *state) { blake3_hasher_init((blake3_hasher *)state); }
+const HashAlgorithm blake3_engine = {.id = HASH_ENGINE_BLAKE3,
+                                     .name = "blake3",
+                                     .digest_len = BLAKE3_OUT_LEN};
+const HashAlgorithm fast_engine = {.id = HASH_ENGINE_FAST,
+                                   .name = "fast",
+                                   .digest_len = FAST_HASH_LEN};
 
-void blake3_update(void *state, const void *input, size_t input_len) {
-    blake3_hasher_update((blake3_hasher *)state, input, input_len);
+// Set once before the workers start
+const HashAlgorithm *first_pass_engine = &blake3_engine;
+
+const HashAlgorithm *find_hash_engine(const char *name) {
+    const HashAlgorithm *engines[] = {&blake3_engine, &fast_engine};
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i]->name, name) == 0)
+            return engines[i];
+    }
+    return NULL;
+}
+
+void set_first_pass_engine(const HashAlgorithm *engine) {
+    first_pass_engine = engine;
+}
+
+const HashAlgorithm *get_first_pass_engine() { return first_pass_engine; }
+
+const HashAlgorithm *get_stage_engine(HashStage stage) {
+    return stage == HASH_STAGE_FULL ? &blake3_engine : first_pass_engine;
+}
+
+HashStage get_next_stage(HashStage hashed) {
+    // A whole file pass with BLAKE3 would only be repeated by the full stage
+    if (hashed == HASH_STAGE_SAMPLE &&
+        first_pass_engine->id == HASH_ENGINE_BLAKE3)
+        return HASH_STAGE_FULL;
+    return hashed + 1;
+}
+
+void init_hash(const HashAlgorithm *engine, HashState *state) {
+    switch (engine->id) {
+    case HASH_ENGINE_FAST:
+        fast_hasher_init(&state->fast);
+        break;
+    default:
+        blake3_hasher_init(&state->blake3);
+        break;
+    }
+}
+
+void update_hash(const HashAlgorithm *engine, HashState *state,
+                 const void *input, size_t input_len) {
+    switch (engine->id) {
+    case HASH_ENGINE_FAST:
+        fast_hasher_update(&state->fast, input, input_len);
+        break;
+    default:
+        blake3_hasher_update(&state->blake3, input, input_len);
+        break;
+    }
+}
+
+void finalize_hash(const HashAlgorithm *engine, HashState *state,
+                   uint8_t *hash) {
+    switch (engine->id) {
+    case HASH_ENGINE_FAST:
+        fast_hasher_finalize(&state->fast, hash, FAST_HASH_LEN);
+        break;
+    default:
+        blake3_hasher_finalize(&state->blake3, hash, BLAKE3_OUT_LEN);
+        break;
+    }
+    // Digests of all engines are compared and indexed at the same length
+    memset(hash + engine->digest_len, 0, MAX_DIGEST_LEN - engine->digest_len);
+}
+
+// Hashes a file that was just opened into a started state, a read of the
+// whole buffer at a time. The window after the one being hashed is already
+// on its way, and the one hashed is dropped if the cache is to be spared.
+// Returns -1 if the file cannot be read.
+int read_into_hash(int fd, off_t size, const HashAlgorithm *engine,
+                   HashState *state, size_t *total) {
+    uint8_t *buffer = get_read_buffer();
+    if (buffer == NULL)
+        return -1;
+    size_t read_size = get_read_size();
+    bool direct = start_sequential_read(fd, size);
+    off_t offset = 0;
+    while (1) {
+        ssize_t n = read(fd, buffer, read_size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        bool full = (size_t)n == read_size;
+        if (full && !direct)
+            prefetch_read(fd, offset + n);
+        update_hash(engine, state, buffer, n);
+        if (!direct)
+            drop_read_pages(fd, offset, n);
+        offset += n;
+        *total += n;
+        // A short read of a regular file only happens at its end, and an
+        // O_DIRECT read from an unaligned offset would fail
+        if (!full)
+            break;
+    }
+    return 0;
 }
 
-void blake3_finalize(void *state, uint8_t *output, size_t output_len) {
-    blake3_hasher_finalize((blake3_hasher *)state, output, output_len);
+int hash_fd(int fd, off_t size, const HashAlgorithm *engine, uint8_t *hash,
+            size_t *total) {
+    HashState state;
+    init_hash(engine, &state);
+    int result = read_into_hash(fd, size, engine, &state, total);
+    finalize_hash(engine, &state, hash);
+    return result;
 }
 
-int compute_hash(const char *path, HashAlgorithm *algorithm, uint8_t *hash,
+int compute_hash(const char *path, const HashAlgorithm *engine, uint8_t *hash,
                  size_t *total) {
 
     int fd = open(path, O_RDONLY | O_NONBLOCK);
@@ -25,43 +139,162 @@ int compute_hash(const char *path, HashAlgorithm *algorithm, uint8_t *hash,
         return -1;
     }
 
-    blake3_hasher hasher;
-    algorithm->init(&hasher);
+    int result = hash_fd(fd, -1, engine, hash, total);
+    close(fd);
+    return result;
+}
 
-    uint8_t buffer[16384];
+int hash_small_file(const char *path, off_t size, uint8_t *buffer,
+                    uint8_t *hash) {
+    // Special files were left out by the walk, one that took the place of
+    // a file since fails the read rather than blocking it
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        add_error();
+        return -1;
+    }
+    // The extra byte tells a file that grew from one that did not
     ssize_t n;
+    do {
+        n = pread(fd, buffer, (size_t)size + 1, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n >= 0)
+        drop_read_pages(fd, 0, n);
+    close(fd);
+    if (n < 0) {
+        add_error();
+        return -1;
+    }
+    if (n != size)
+        return 1;
+
+    HashState state;
+    init_hash(&blake3_engine, &state);
+    update_hash(&blake3_engine, &state, buffer, n);
+    finalize_hash(&blake3_engine, &state, hash);
+    add_hashed_stage(n);
+    return 0;
+}
+
+int get_stage_blocks(HashStage stage, off_t size, off_t *offsets) {
+    switch (stage) {
+    case HASH_STAGE_HEAD:
+        offsets[0] = 0;
+        return 1;
+    case HASH_STAGE_TAIL:
+        offsets[0] = size - PARTIAL_BLOCK_SIZE;
+        return 1;
+    case HASH_STAGE_SAMPLE:
+        // Spread the samples evenly, aligned to the block size
+        for (int i = 0; i < SAMPLE_BLOCKS; i++) {
+            offsets[i] = size / (SAMPLE_BLOCKS + 1) * (i + 1);
+            offsets[i] -= offsets[i] % PARTIAL_BLOCK_SIZE;
+        }
+        return SAMPLE_BLOCKS;
+    default:
+        return 0;
+    }
+}
 
-    fd_set set;
-    struct timeval timeout;
+HashStage get_hash_stage(HashStage stage, off_t size) {
+    // Small files are hashed in full straight away, a partial read would
+    // cost about as much as reading the whole file
+    return size < PREFILTER_MIN_SIZE ? HASH_STAGE_FULL : stage;
+}
 
-    // Initialize the file descriptor set.
-    FD_ZERO(&set);
-    FD_SET(fd, &set);
+void init_stage_hash(HashState *state, HashStage stage, off_t size,
+                     const uint8_t *previous) {
+    const HashAlgorithm *engine = get_stage_engine(stage);
+    init_hash(engine, state);
 
-    // Initialize the timeout data structure.
-    timeout.tv_sec = 1; // 1 seconds timeout
-    timeout.tv_usec = 0;
+    // Chain the size, the stage and the digest of the previous stage, so
+    // files only collide if they collided in every stage before
+    uint64_t file_size = (uint64_t)size;
+    uint8_t stage_id = (uint8_t)stage;
+    update_hash(engine, state, &file_size, sizeof(file_size));
+    update_hash(engine, state, &stage_id, sizeof(stage_id));
+    if (previous != NULL) {
+        update_hash(engine, state, previous, MAX_DIGEST_LEN);
+    }
+}
 
-    while (select(fd + 1, &set, NULL, NULL, &timeout) > 0) {
-        n = read(fd, buffer, sizeof(buffer));
-        if (n > 0) {
-            algorithm->update(&hasher, buffer, n);
-            *total += n;
-        } else if (n == 0 || (n < 0 && errno != EAGAIN)) {
-            // End of file or read error other than EAGAIN
-            break;
+int compute_stage_hash_fd(int fd, off_t file_size, HashStage stage,
+                          const uint8_t *previous, uint8_t *hash,
+                          uint64_t *size) {
+    stage = get_hash_stage(stage, file_size);
+    if (stage == HASH_STAGE_FULL) {
+        int result = 0;
+        size_t total = 0;
+        if (file_size >= TREE_HASH_MIN_SIZE) {
+            // Large enough to share among the workers
+            start_sequential_read(fd, file_size);
+            result = tree_hash_file(fd, file_size, hash);
+            total = file_size;
+        } else {
+            result = hash_fd(fd, file_size, &blake3_engine, hash, &total);
+        }
+        if (result != 0) {
+            add_error();
+            return -1;
         }
+        add_hashed_stage(total);
+        *size = total;
+        return HASH_STAGE_FULL;
+    }
 
-        // Reinitialize the file descriptor set for the next select call.
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
+    const HashAlgorithm *engine = get_stage_engine(stage);
+    HashState state;
+    init_stage_hash(&state, stage, file_size, previous);
+    if (stage == HASH_STAGE_CONTENT) {
+        size_t total = 0;
+        if (read_into_hash(fd, file_size, engine, &state, &total) != 0) {
+            add_error();
+            return -1;
+        }
+        finalize_hash(engine, &state, hash);
+        add_hashed_stage(total);
+        *size = total;
+        return stage;
+    }
 
-        // Reinitialize the timeout for the next select call.
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+    uint8_t buffer[PARTIAL_BLOCK_SIZE];
+    off_t offsets[SAMPLE_BLOCKS];
+    start_block_reads(fd);
+    int num_blocks = get_stage_blocks(stage, file_size, offsets);
+    uint64_t total = 0;
+    for (int i = 0; i < num_blocks; i++) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), offsets[i]);
+        if (n < 0) {
+            add_error();
+            return -1;
+        }
+        update_hash(engine, &state, buffer, n);
+        total += n;
     }
-    close(fd);
 
-    algorithm->finalize(&hasher, hash, BLAKE3_OUT_LEN);
-    return 0;
-}
\ No newline at end of file
+    finalize_hash(engine, &state, hash);
+    add_hashed_stage(total);
+    *size = (uint64_t)file_size;
+    return stage;
+}
+
+int compute_stage_hash(const char *path, HashStage stage,
+                       const uint8_t *previous, uint8_t *hash,
+                       uint64_t *size) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        add_error();
+        return -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        add_error();
+        close(fd);
+        return -1;
+    }
+    int hashed = compute_stage_hash_fd(fd, file_stat.st_size, stage, previous,
+                                       hash, size);
+    close(fd);
+    return hashed;
+}
@@ -2,20 +2,95 @@
 #define HASHING_H
 
 #include "blake3.h"
+#include "fast_hash.h"
+#include <stdint.h>
+#include <sys/types.h>
 
+// Size of the blocks read by the prefilter stages
+#define PARTIAL_BLOCK_SIZE 4096
+// Number of blocks sampled from the middle of a file
+#define SAMPLE_BLOCKS 4
+// Files smaller than this are cheap enough to hash in full right away
+#define PREFILTER_MIN_SIZE (16 * PARTIAL_BLOCK_SIZE)
+// Room for the longest digest, shorter ones are padded with zeros
+#define MAX_DIGEST_LEN BLAKE3_OUT_LEN
+
+// Stages a candidate goes through, each only for files that still collide
+typedef enum {
+    HASH_STAGE_HEAD, // First block of the file
+    HASH_STAGE_TAIL, // Last block of the file
+    HASH_STAGE_SAMPLE, // Blocks spread over the middle of the file
+    HASH_STAGE_CONTENT, // The whole file with a first pass engine that is
+                        // not BLAKE3, skipped otherwise
+    HASH_STAGE_FULL // The whole file with BLAKE3
+} HashStage;
+
+typedef enum { HASH_ENGINE_BLAKE3, HASH_ENGINE_FAST } HashEngineId;
+
+// State of any engine, the engine decides which member is used
+typedef union {
+    blake3_hasher blake3;
+    FastHasher fast;
+} HashState;
+
+// Engines are called through a switch on the id rather than function
+// pointers, so the read loops call the hash functions directly
 typedef struct {
-    void (*init)(void *);
-    void (*update)(void *, const void *, size_t);
-    void (*finalize)(void *, uint8_t *, size_t);
+    HashEngineId id;
+    const char *name;
+    size_t digest_len; // the rest of a digest is zero
 } HashAlgorithm;
 
-// Declare the functions
-void blake3_init(void *state);
-void blake3_update(void *state, const void *input, size_t input_len);
-void blake3_finalize(void *state, uint8_t *output, size_t output_len);
+extern const HashAlgorithm blake3_engine;
+extern const HashAlgorithm fast_engine;
+
+// Function to look up an engine by name, returns NULL if there is none
+const HashAlgorithm *find_hash_engine(const char *name);
+// Function to pick the engine of the stages before HASH_STAGE_FULL
+void set_first_pass_engine(const HashAlgorithm *engine);
+const HashAlgorithm *get_first_pass_engine();
+// Function to get the engine a stage is hashed with
+const HashAlgorithm *get_stage_engine(HashStage stage);
+// Function to get the stage after the one a file was hashed at
+HashStage get_next_stage(HashStage hashed);
+// Functions to run an engine
+void init_hash(const HashAlgorithm *engine, HashState *state);
+void update_hash(const HashAlgorithm *engine, HashState *state,
+                 const void *input, size_t input_len);
+void finalize_hash(const HashAlgorithm *engine, HashState *state,
+                   uint8_t *hash);
 
+// Function to hash a file just opened, of the given size or -1 if it is not
+// known.
+// Returns -1 if it cannot be read.
+int hash_fd(int fd, off_t size, const HashAlgorithm *engine, uint8_t *hash,
+            size_t *total);
 // Function to hash a file
-int compute_hash(const char *path, HashAlgorithm *algorithm, uint8_t *hash,
+int compute_hash(const char *path, const HashAlgorithm *engine, uint8_t *hash,
                  size_t *total);
+// Function to hash a file the walk found to be smaller than
+// PREFILTER_MIN_SIZE with a single read into buffer, which holds one byte
+// more. The digest is the one of HASH_STAGE_FULL. Returns -1 if the file
+// cannot be read and 1 if its size is no longer the one given.
+int hash_small_file(const char *path, off_t size, uint8_t *buffer,
+                    uint8_t *hash);
+// Function to get the stage a file of the given size is actually hashed at
+HashStage get_hash_stage(HashStage stage, off_t size);
+// Function to get the offsets of the blocks a prefilter stage looks at,
+// returns the number of blocks
+int get_stage_blocks(HashStage stage, off_t size, off_t *offsets);
+// Function to start the hash of a stage that is chained to the ones before
+void init_stage_hash(HashState *state, HashStage stage, off_t size,
+                     const uint8_t *previous);
+// Function to hash the blocks of a file a stage looks at, returns the stage
+// that was actually hashed or -1 on error. Size is set to the size of the
+// file as it was hashed.
+int compute_stage_hash(const char *path, HashStage stage,
+                       const uint8_t *previous, uint8_t *hash,
+                       uint64_t *size);
+// Function to do the same with a file that is already open, fd stays open
+int compute_stage_hash_fd(int fd, off_t file_size, HashStage stage,
+                          const uint8_t *previous, uint8_t *hash,
+                          uint64_t *size);
 
-#endif // HASHING_H
\ No newline at end of file
+#endif // HASHING_H
@@ -0,0 +1,85 @@
+#define _POSIX_C_SOURCE 200809L
+#include "inode_table.h"
+#include "uthash.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+InodeLinks *inodes = NULL; // The inode table
+InodeLinks *inodes_by_first = NULL; // The same entries by their first name
+unsigned num_hard_links = 0;
+pthread_mutex_t inode_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to record a name of a file with several links
+bool add_inode_link(dev_t dev, ino_t ino, FilePath file) {
+    InodeKey key;
+    memset(&key, 0, sizeof(key));
+    key.dev = dev;
+    key.ino = ino;
+
+    pthread_mutex_lock(&inode_mutex);
+    InodeLinks *entry;
+    HASH_FIND(hh, inodes, &key, sizeof(InodeKey), entry);
+
+    if (entry == NULL) {
+        // First name of the file, it is hashed like any other file
+        entry = calloc(1, sizeof(InodeLinks));
+        if (entry == NULL) {
+            perror("Failed to allocate memory for new inode");
+            pthread_mutex_unlock(&inode_mutex);
+            return false;
+        }
+        entry->key = key;
+        entry->first = file;
+        HASH_ADD(hh, inodes, key, sizeof(InodeKey), entry);
+        HASH_ADD(hh_first, inodes_by_first, first, sizeof(FilePath), entry);
+        pthread_mutex_unlock(&inode_mutex);
+        return false;
+    }
+
+    if (entry->num_links == entry->links_capacity) {
+        // If the array is full, double its capacity
+        unsigned capacity = entry->links_capacity ? entry->links_capacity * 2 : 1;
+        FilePath *links = realloc(entry->links, capacity * sizeof(FilePath));
+        if (links == NULL) {
+            perror("Failed to allocate memory for hard links");
+            pthread_mutex_unlock(&inode_mutex);
+            return true;
+        }
+        entry->links = links;
+        entry->links_capacity = capacity;
+    }
+    entry->links[entry->num_links++] = file;
+    num_hard_links++;
+    pthread_mutex_unlock(&inode_mutex);
+    return true;
+}
+
+// Function to get the other names of a hashed file
+InodeLinks *find_inode_links(FilePath first) {
+    pthread_mutex_lock(&inode_mutex);
+    InodeLinks *entry;
+    HASH_FIND(hh_first, inodes_by_first, &first, sizeof(FilePath), entry);
+    pthread_mutex_unlock(&inode_mutex);
+    return entry != NULL && entry->num_links > 0 ? entry : NULL;
+}
+
+// Function to get the number of names that were recorded as links
+unsigned count_hard_links() {
+    pthread_mutex_lock(&inode_mutex);
+    unsigned count = num_hard_links;
+    pthread_mutex_unlock(&inode_mutex);
+    return count;
+}
+
+// Function to free the inode table
+void free_inode_table() {
+    InodeLinks *current_entry, *tmp;
+    HASH_ITER(hh, inodes, current_entry, tmp) {
+        HASH_DELETE(hh_first, inodes_by_first, current_entry);
+        HASH_DEL(inodes, current_entry);
+        free(current_entry->links);
+        free(current_entry);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef INODE_TABLE_H
+#define INODE_TABLE_H
+
+#include "path_store.h"
+#include "uthash.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} InodeKey;
+
+// A file with more than one name. Only the first name is hashed, the others
+// are listed next to it in the report.
+typedef struct {
+    InodeKey key; // Key
+    FilePath first; // The name that is hashed
+    FilePath *links; // The other names
+    unsigned num_links; // Number of other names
+    unsigned links_capacity; // Capacity of the array
+    UT_hash_handle hh; // Makes this structure hashable by key
+    UT_hash_handle hh_first; // and by the first name
+} InodeLinks;
+
+// Function to record a name of a file with several links, returns true if
+// the file was seen under another name before. The name is then recorded as
+// a link of the first one and needs no hashing.
+bool add_inode_link(dev_t dev, ino_t ino, FilePath file);
+// Function to get the other names of a hashed file, NULL if it has none
+InodeLinks *find_inode_links(FilePath first);
+// Function to get the number of names that were recorded as links
+unsigned count_hard_links();
+// Function to free the inode table
+void free_inode_table();
+
+#endif // INODE_TABLE_H
@@ -0,0 +1,431 @@
+#define _POSIX_C_SOURCE 200809L
+#include "output.h"
+#include "blake3.h"
+#include "hash_table.h"
+#include "stats.h"
+#include <errno.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes a record is built in before it needs the heap, enough for any
+// record with one or two paths
+#define RECORD_INLINE_SIZE (16 * 1024)
+
+typedef struct OutputBuffer {
+    struct OutputBuffer *next;
+    size_t used;
+    size_t capacity; // more than OUTPUT_BUFFER_SIZE for a larger record
+    char data[];
+} OutputBuffer;
+
+// A record being formatted by the thread that adds it
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    bool failed;
+    char inline_data[RECORD_INLINE_SIZE];
+} Record;
+
+OutputFormat output_format = OUTPUT_NDJSON;
+bool output_started = false;
+int output_fd = -1;
+pthread_t output_thread;
+
+// All of these are guarded by the mutex
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t output_cond;
+OutputBuffer *current_buffer = NULL; // the one records are copied into
+OutputBuffer *full_buffers = NULL; // waiting for the writer, oldest first
+OutputBuffer *last_full_buffer = NULL;
+OutputBuffer *spare_buffers = NULL;
+int num_spare_buffers = 0;
+uint64_t num_records = 0;
+bool output_stopping = false;
+bool output_failed = false;
+
+int find_output_format(const char *name) {
+    const char *names[] = {"ndjson", "binary"};
+    for (int i = 0; i < 2; i++) {
+        if (strcmp(names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+bool is_output_started() { return output_started; }
+
+// Takes a spare buffer or allocates one, the caller holds the mutex
+OutputBuffer *get_output_buffer(size_t len) {
+    if (len <= OUTPUT_BUFFER_SIZE && spare_buffers != NULL) {
+        OutputBuffer *buffer = spare_buffers;
+        spare_buffers = buffer->next;
+        num_spare_buffers--;
+        buffer->next = NULL;
+        buffer->used = 0;
+        return buffer;
+    }
+    size_t capacity = len > OUTPUT_BUFFER_SIZE ? len : OUTPUT_BUFFER_SIZE;
+    OutputBuffer *buffer = malloc(sizeof(OutputBuffer) + capacity);
+    if (buffer == NULL) {
+        perror("Failed to allocate memory for output buffer");
+        return NULL;
+    }
+    buffer->next = NULL;
+    buffer->used = 0;
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+// Keeps a few written buffers for reuse, the caller holds the mutex
+void recycle_output_buffer(OutputBuffer *buffer) {
+    if (buffer->capacity != OUTPUT_BUFFER_SIZE ||
+        num_spare_buffers >= OUTPUT_SPARE_BUFFERS) {
+        free(buffer);
+        return;
+    }
+    buffer->next = spare_buffers;
+    spare_buffers = buffer;
+    num_spare_buffers++;
+}
+
+// Hands the current buffer to the writer, the caller holds the mutex
+void queue_current_buffer() {
+    if (last_full_buffer != NULL)
+        last_full_buffer->next = current_buffer;
+    else
+        full_buffers = current_buffer;
+    last_full_buffer = current_buffer;
+    current_buffer = NULL;
+    pthread_cond_signal(&output_cond);
+}
+
+// Copies a whole record into the current buffer, records are never split
+// between two writes
+void append_record(Record *record) {
+    if (record->failed)
+        return;
+    pthread_mutex_lock(&output_mutex);
+    if (current_buffer != NULL &&
+        current_buffer->capacity - current_buffer->used < record->len)
+        queue_current_buffer();
+    if (current_buffer == NULL)
+        current_buffer = get_output_buffer(record->len);
+    if (current_buffer != NULL) {
+        memcpy(current_buffer->data + current_buffer->used, record->data,
+               record->len);
+        current_buffer->used += record->len;
+        num_records++;
+    }
+    pthread_mutex_unlock(&output_mutex);
+}
+
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Writes full buffers as they come and the current one every
+// OUTPUT_FLUSH_MS, until the stream is stopped and everything is written
+void *write_output(void *arg) {
+    (void)arg;
+    set_thread_role("writer");
+    pthread_mutex_lock(&output_mutex);
+    while (1) {
+        if (full_buffers == NULL && !output_stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += OUTPUT_FLUSH_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&output_cond, &output_mutex, &deadline);
+        }
+        OutputBuffer *buffer = full_buffers;
+        if (buffer != NULL) {
+            full_buffers = buffer->next;
+            if (full_buffers == NULL)
+                last_full_buffer = NULL;
+        } else if (current_buffer != NULL && current_buffer->used > 0) {
+            buffer = current_buffer;
+            current_buffer = NULL;
+        } else if (output_stopping) {
+            break;
+        } else {
+            continue;
+        }
+        bool failed = output_failed;
+        pthread_mutex_unlock(&output_mutex);
+
+        // After a failed write the rest is dropped
+        if (!failed && write_all(output_fd, buffer->data, buffer->used) != 0) {
+            perror("Failed to write output");
+            failed = true;
+        }
+
+        pthread_mutex_lock(&output_mutex);
+        output_failed = failed;
+        recycle_output_buffer(buffer);
+    }
+    pthread_mutex_unlock(&output_mutex);
+    return NULL;
+}
+
+void init_record(Record *record) {
+    record->data = record->inline_data;
+    record->len = 0;
+    record->capacity = RECORD_INLINE_SIZE;
+    record->failed = false;
+}
+
+void free_record(Record *record) {
+    if (record->data != record->inline_data)
+        free(record->data);
+}
+
+bool reserve_record(Record *record, size_t len) {
+    if (record->failed)
+        return false;
+    if (record->capacity - record->len >= len)
+        return true;
+    size_t capacity = record->capacity * 2;
+    while (capacity - record->len < len) {
+        capacity *= 2;
+    }
+    char *data = record->data == record->inline_data
+                     ? malloc(capacity)
+                     : realloc(record->data, capacity);
+    if (data == NULL) {
+        perror("Failed to allocate memory for output record");
+        record->failed = true;
+        return false;
+    }
+    if (record->data == record->inline_data)
+        memcpy(data, record->data, record->len);
+    record->data = data;
+    record->capacity = capacity;
+    return true;
+}
+
+void put_bytes(Record *record, const void *data, size_t len) {
+    if (!reserve_record(record, len))
+        return;
+    memcpy(record->data + record->len, data, len);
+    record->len += len;
+}
+
+void put_text(Record *record, const char *text) {
+    put_bytes(record, text, strlen(text));
+}
+
+// Integers of the binary format are little endian
+void put_integer(Record *record, uint64_t value, int bytes) {
+    uint8_t data[8];
+    for (int i = 0; i < bytes; i++) {
+        data[i] = (uint8_t)(value >> (8 * i));
+    }
+    put_bytes(record, data, bytes);
+}
+
+// Paths are bytes, only what JSON does not allow in a string is escaped
+void put_json_string(Record *record, const char *text, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    if (!reserve_record(record, len * 6 + 2))
+        return;
+    char *out = record->data + record->len;
+    *out++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char)c;
+        } else if (c < 0x20) {
+            memcpy(out, "\\u00", 4);
+            out[4] = digits[c >> 4];
+            out[5] = digits[c & 0xf];
+            out += 6;
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out++ = '"';
+    record->len = out - record->data;
+}
+
+// Returns false if the path does not fit, the record is then dropped
+bool put_path(Record *record, FilePath file) {
+    char path[PATH_MAX];
+    size_t len = get_file_path(file, path, sizeof(path));
+    if (len >= sizeof(path)) {
+        record->failed = true;
+        return false;
+    }
+    if (output_format == OUTPUT_NDJSON) {
+        put_json_string(record, path, len);
+    } else {
+        put_integer(record, len, 2);
+        put_bytes(record, path, len);
+    }
+    return true;
+}
+
+void put_hash(Record *record, const uint8_t *hash) {
+    if (output_format == OUTPUT_NDJSON) {
+        char hash_str[BLAKE3_OUT_LEN * 2 + 1];
+        hash_to_hex(hash, hash_str);
+        put_text(record, "\"");
+        put_text(record, hash_str);
+        put_text(record, "\"");
+    } else {
+        put_bytes(record, hash, BLAKE3_OUT_LEN);
+    }
+}
+
+int start_output(OutputFormat format, int fd) {
+    output_format = format;
+    output_fd = fd;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&output_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&output_thread, NULL, write_output, NULL) != 0) {
+        perror("Failed to create output thread");
+        pthread_cond_destroy(&output_cond);
+        return -1;
+    }
+    output_started = true;
+    if (format == OUTPUT_BINARY) {
+        Record record;
+        init_record(&record);
+        put_text(&record, OUTPUT_MAGIC);
+        append_record(&record);
+        num_records = 0;
+    }
+    return 0;
+}
+
+void output_duplicate(const uint8_t *hash, FilePath file) {
+    if (!output_started)
+        return;
+    Record record;
+    init_record(&record);
+    if (output_format == OUTPUT_NDJSON) {
+        put_text(&record, "{\"type\":\"duplicate\",\"hash\":");
+        put_hash(&record, hash);
+        put_text(&record, ",\"path\":");
+        put_path(&record, file);
+        put_text(&record, "}\n");
+    } else {
+        put_integer(&record, OUTPUT_DUPLICATE, 1);
+        put_hash(&record, hash);
+        put_path(&record, file);
+    }
+    append_record(&record);
+    free_record(&record);
+}
+
+void output_group(const uint8_t *hash, const FilePath *files,
+                  uint32_t num_files) {
+    if (!output_started)
+        return;
+    Record record;
+    init_record(&record);
+    if (output_format == OUTPUT_NDJSON) {
+        put_text(&record, "{\"type\":\"group\",\"hash\":");
+        put_hash(&record, hash);
+        put_text(&record, ",\"paths\":[");
+        for (uint32_t i = 0; i < num_files; i++) {
+            if (i > 0)
+                put_text(&record, ",");
+            put_path(&record, files[i]);
+        }
+        put_text(&record, "]}\n");
+    } else {
+        put_integer(&record, OUTPUT_GROUP, 1);
+        put_hash(&record, hash);
+        put_integer(&record, num_files, 4);
+        for (uint32_t i = 0; i < num_files; i++) {
+            put_path(&record, files[i]);
+        }
+    }
+    append_record(&record);
+    free_record(&record);
+}
+
+void output_hard_link(FilePath file, FilePath target) {
+    if (!output_started)
+        return;
+    Record record;
+    init_record(&record);
+    if (output_format == OUTPUT_NDJSON) {
+        put_text(&record, "{\"type\":\"hard_link\",\"path\":");
+        put_path(&record, file);
+        put_text(&record, ",\"target\":");
+        put_path(&record, target);
+        put_text(&record, "}\n");
+    } else {
+        put_integer(&record, OUTPUT_HARD_LINK, 1);
+        put_path(&record, file);
+        put_path(&record, target);
+    }
+    append_record(&record);
+    free_record(&record);
+}
+
+int stop_output(uint32_t files, uint32_t directories) {
+    if (!output_started)
+        return 0;
+    pthread_mutex_lock(&output_mutex);
+    uint64_t records = num_records;
+    pthread_mutex_unlock(&output_mutex);
+    Record record;
+    init_record(&record);
+    if (output_format == OUTPUT_NDJSON) {
+        char text[128];
+        snprintf(text, sizeof(text),
+                 "{\"type\":\"end\",\"files\":%u,\"directories\":%u,"
+                 "\"records\":%llu}\n",
+                 files, directories, (unsigned long long)records);
+        put_text(&record, text);
+    } else {
+        put_integer(&record, OUTPUT_END, 1);
+        put_integer(&record, files, 4);
+        put_integer(&record, directories, 4);
+        put_integer(&record, records, 8);
+    }
+    append_record(&record);
+
+    pthread_mutex_lock(&output_mutex);
+    output_stopping = true;
+    pthread_cond_signal(&output_cond);
+    pthread_mutex_unlock(&output_mutex);
+    pthread_join(output_thread, NULL);
+    output_started = false;
+
+    while (spare_buffers != NULL) {
+        OutputBuffer *next = spare_buffers->next;
+        free(spare_buffers);
+        spare_buffers = next;
+    }
+    num_spare_buffers = 0;
+    pthread_cond_destroy(&output_cond);
+    int result = output_failed ? -1 : 0;
+    if (close(output_fd) != 0 && result == 0) {
+        perror("Failed to close output");
+        result = -1;
+    }
+    return result;
+}
@@ -0,0 +1,67 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "path_store.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Streams the duplicates as records while the scan runs. The workers format
+// a record on their own stack and only copy it into a large buffer under a
+// mutex, a writer thread writes the full buffers out. The workers never
+// wait for the writer, a slow reader costs memory rather than hashing time,
+// and a partly filled buffer is written every OUTPUT_FLUSH_MS so a reader
+// does not wait for it to fill up.
+//
+// Records of the index come in as soon as a file joins a group, a reader
+// groups them by digest. Verified groups come in whole once they are
+// compared, as the files of a digest may split into several groups, and so
+// do the groups of the memory-bounded mode once the digests are merged. Hard
+// links of the files follow at the end, then a last record ends the stream.
+//
+// NDJSON, one object per line:
+//   {"type":"duplicate","hash":"<hex>","path":"<path>"}
+//   {"type":"group","hash":"<hex>","paths":["<path>",...]}
+//   {"type":"hard_link","path":"<path>","target":"<path>"}
+//   {"type":"end","files":<n>,"directories":<n>,"records":<n>}
+//
+// Binary, little endian, after the 8 bytes of OUTPUT_MAGIC. Every record
+// starts with its type byte and a path is its u16 length and its bytes:
+//   OUTPUT_DUPLICATE: digest[32], path
+//   OUTPUT_GROUP:     digest[32], u32 number of paths, paths
+//   OUTPUT_HARD_LINK: path, target path
+//   OUTPUT_END:       u32 files, u32 directories, u64 records
+
+#define OUTPUT_MAGIC "DDUPREC1"
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+// Time after which a partly filled buffer is written
+#define OUTPUT_FLUSH_MS 100
+// Empty buffers kept for reuse, others are freed once written
+#define OUTPUT_SPARE_BUFFERS 4
+
+typedef enum { OUTPUT_NDJSON, OUTPUT_BINARY } OutputFormat;
+
+typedef enum {
+    OUTPUT_DUPLICATE = 1,
+    OUTPUT_GROUP = 2,
+    OUTPUT_HARD_LINK = 3,
+    OUTPUT_END = 4
+} OutputRecord;
+
+// Function to look up a format by name, returns -1 if there is none
+int find_output_format(const char *name);
+// Function to start the writer thread on fd, which it closes when it stops.
+// Returns -1 if it cannot be started.
+int start_output(OutputFormat format, int fd);
+// Function to check whether records are streamed
+bool is_output_started();
+// Functions to add a record to the stream, they do nothing if it is not
+// started
+void output_duplicate(const uint8_t *hash, FilePath file);
+void output_group(const uint8_t *hash, const FilePath *files,
+                  uint32_t num_files);
+void output_hard_link(FilePath file, FilePath target);
+// Function to end the stream and wait until everything is written, returns
+// -1 if a write failed
+int stop_output(uint32_t files, uint32_t directories);
+
+#endif // OUTPUT_H
@@ -0,0 +1,170 @@
+#define _POSIX_C_SOURCE 200809L
+#include "path_store.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Records are aligned for their integer fields
+#define ARENA_ALIGN 8
+#define DIR_CHUNK_SIZE (1 << DIR_CHUNK_BITS)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+} ArenaBlock;
+
+// Every thread allocates from a block of its own, only taking a new block
+// needs the lock
+_Thread_local char *arena_next = NULL;
+_Thread_local char *arena_end = NULL;
+ArenaBlock *arena_blocks = NULL;
+pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const DirName **dir_chunks[NUM_DIR_CHUNKS];
+uint32_t num_dirs = 0;
+pthread_mutex_t dir_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+char *new_arena_block(size_t size) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL) {
+        perror("Failed to allocate memory for path arena");
+        return NULL;
+    }
+    pthread_mutex_lock(&arena_mutex);
+    block->next = arena_blocks;
+    arena_blocks = block;
+    pthread_mutex_unlock(&arena_mutex);
+    return (char *)(block + 1);
+}
+
+void *arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size > ARENA_BLOCK_SIZE / 4) {
+        // Would waste most of a block, give it one of its own
+        return new_arena_block(size);
+    }
+    if (arena_next == NULL || (size_t)(arena_end - arena_next) < size) {
+        arena_next = new_arena_block(ARENA_BLOCK_SIZE);
+        if (arena_next == NULL)
+            return NULL;
+        arena_end = arena_next + ARENA_BLOCK_SIZE;
+    }
+    void *memory = arena_next;
+    arena_next += size;
+    return memory;
+}
+
+uint32_t intern_dir(uint32_t parent, const char *name) {
+    size_t len = strlen(name);
+    if (len > UINT16_MAX) {
+        fprintf(stderr, "Directory name too long: %s\n", name);
+        return NO_DIR;
+    }
+    DirName *dir = arena_alloc(sizeof(DirName) + len);
+    if (dir == NULL)
+        return NO_DIR;
+    dir->parent = parent;
+    dir->len = (uint16_t)len;
+    memcpy(dir->name, name, len);
+
+    pthread_mutex_lock(&dir_mutex);
+    uint32_t id = num_dirs;
+    if (id == NO_DIR) {
+        fprintf(stderr, "Too many directories\n");
+        pthread_mutex_unlock(&dir_mutex);
+        return NO_DIR;
+    }
+    const DirName ***chunk = &dir_chunks[id >> DIR_CHUNK_BITS];
+    if (*chunk == NULL &&
+        (*chunk = malloc(DIR_CHUNK_SIZE * sizeof(DirName *))) == NULL) {
+        perror("Failed to allocate memory for directories");
+        pthread_mutex_unlock(&dir_mutex);
+        return NO_DIR;
+    }
+    (*chunk)[id & (DIR_CHUNK_SIZE - 1)] = dir;
+    num_dirs++;
+    pthread_mutex_unlock(&dir_mutex);
+    return id;
+}
+
+FilePath intern_file(uint32_t dir, const char *name) {
+    size_t len = strlen(name);
+    FileName *file = arena_alloc(sizeof(FileName) + len + 1);
+    if (file == NULL)
+        return NULL;
+    file->dir = dir;
+    memcpy(file->name, name, len + 1);
+    return file;
+}
+
+// Ids reach other threads through a lock or the ring buffer, which orders
+// the store into the chunk before the lookup
+const DirName *get_dir(uint32_t dir) {
+    return dir_chunks[dir >> DIR_CHUNK_BITS][dir & (DIR_CHUNK_SIZE - 1)];
+}
+
+// Entries of a root of "/" follow without another separator
+bool needs_separator(const DirName *dir) {
+    return !(dir->parent == NO_DIR && dir->len == 1 && dir->name[0] == '/');
+}
+
+size_t get_dir_path(uint32_t dir, char *path, size_t size) {
+    // Measure first, then fill in the names from the end
+    size_t len = 0;
+    for (uint32_t id = dir; id != NO_DIR;) {
+        const DirName *current = get_dir(id);
+        len += current->len;
+        if (current->parent != NO_DIR &&
+            needs_separator(get_dir(current->parent)))
+            len++;
+        id = current->parent;
+    }
+    if (len >= size)
+        return len;
+
+    path[len] = '\0';
+    size_t end = len;
+    for (uint32_t id = dir; id != NO_DIR;) {
+        const DirName *current = get_dir(id);
+        end -= current->len;
+        memcpy(path + end, current->name, current->len);
+        if (current->parent != NO_DIR &&
+            needs_separator(get_dir(current->parent)))
+            path[--end] = '/';
+        id = current->parent;
+    }
+    return len;
+}
+
+size_t get_file_path(FilePath file, char *path, size_t size) {
+    size_t dir_len = get_dir_path(file->dir, path, size);
+    size_t separator = needs_separator(get_dir(file->dir)) ? 1 : 0;
+    size_t name_len = strlen(file->name);
+    size_t len = dir_len + separator + name_len;
+    if (len >= size)
+        return len;
+    if (separator)
+        path[dir_len] = '/';
+    memcpy(path + dir_len + separator, file->name, name_len + 1);
+    return len;
+}
+
+void free_path_store() {
+    pthread_mutex_lock(&arena_mutex);
+    while (arena_blocks != NULL) {
+        ArenaBlock *block = arena_blocks;
+        arena_blocks = block->next;
+        free(block);
+    }
+    arena_next = arena_end = NULL;
+    pthread_mutex_unlock(&arena_mutex);
+
+    pthread_mutex_lock(&dir_mutex);
+    for (uint32_t i = 0; i < NUM_DIR_CHUNKS && dir_chunks[i] != NULL; i++) {
+        free(dir_chunks[i]);
+        dir_chunks[i] = NULL;
+    }
+    num_dirs = 0;
+    pthread_mutex_unlock(&dir_mutex);
+}
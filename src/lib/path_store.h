@@ -0,0 +1,44 @@
+#ifndef PATH_STORE_H
+#define PATH_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Directories and file names are stored once, in arenas that live until
+// the end of the run. A directory is its parent and its own name, a file
+// is its directory and its name, so a path is only spelled out in full when
+// a file is opened or reported.
+
+#define NO_DIR UINT32_MAX
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+// Directory ids are looked up in chunks, which never move once allocated
+#define DIR_CHUNK_BITS 16
+#define NUM_DIR_CHUNKS (1 << 16)
+
+typedef struct {
+    uint32_t parent; // NO_DIR for the root of the walk
+    uint16_t len; // length of the name
+    char name[]; // the root keeps the path it was given
+} DirName;
+
+typedef struct {
+    uint32_t dir; // directory the file is in
+    char name[];
+} FileName;
+
+typedef const FileName *FilePath;
+
+// Function to allocate from the arena of the calling thread
+void *arena_alloc(size_t size);
+// Function to add a directory below parent, returns NO_DIR on failure
+uint32_t intern_dir(uint32_t parent, const char *name);
+// Function to add a file of a directory, returns NULL on failure
+FilePath intern_file(uint32_t dir, const char *name);
+// Functions to spell out a path, they return its length. The path did not
+// fit if that is size or more.
+size_t get_dir_path(uint32_t dir, char *path, size_t size);
+size_t get_file_path(FilePath file, char *path, size_t size);
+// Function to free all arenas, no path may be used afterwards
+void free_path_store();
+
+#endif // PATH_STORE_H
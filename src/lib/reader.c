@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include "reader.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+typedef struct {
+    uint8_t *data;
+    size_t size; // mapped bytes, at least the read size
+} ReadBuffer;
+
+// Set once before the workers start
+ReadOptions read_options = {.read_size = DEFAULT_READ_SIZE};
+
+pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+pthread_key_t buffer_key;
+
+void set_read_options(const ReadOptions *options) { read_options = *options; }
+
+size_t get_read_size() { return read_options.read_size; }
+
+void free_read_buffer(void *arg) {
+    ReadBuffer *buffer = (ReadBuffer *)arg;
+    munmap(buffer->data, buffer->size);
+    free(buffer);
+}
+
+void create_buffer_key() { pthread_key_create(&buffer_key, free_read_buffer); }
+
+// Maps size bytes, with huge pages if asked for. Reserved huge pages are
+// tried first, then transparent ones.
+uint8_t *map_buffer(size_t *size) {
+    void *data = MAP_FAILED;
+    if (read_options.huge_pages) {
+        size_t huge_size =
+            (*size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        data = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED)
+            *size = huge_size;
+    }
+    if (data == MAP_FAILED) {
+        data = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            return NULL;
+        if (read_options.huge_pages)
+            madvise(data, *size, MADV_HUGEPAGE);
+    }
+    return data;
+}
+
+uint8_t *get_read_buffer() {
+    pthread_once(&buffer_once, create_buffer_key);
+    ReadBuffer *buffer = pthread_getspecific(buffer_key);
+    if (buffer != NULL)
+        return buffer->data;
+    buffer = malloc(sizeof(ReadBuffer));
+    if (buffer == NULL) {
+        perror("Failed to allocate memory for read buffer");
+        return NULL;
+    }
+    buffer->size = read_options.read_size;
+    buffer->data = map_buffer(&buffer->size);
+    if (buffer->data == NULL) {
+        perror("Failed to map read buffer");
+        free(buffer);
+        return NULL;
+    }
+    pthread_setspecific(buffer_key, buffer);
+    return buffer->data;
+}
+
+bool start_sequential_read(int fd, off_t size) {
+    if (read_options.direct && size >= DIRECT_MIN_SIZE) {
+        // File systems without O_DIRECT read through the cache instead
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0)
+            return true;
+    }
+    // A file that fits in one read gains nothing from larger readahead
+    if (size < 0 || size > (off_t)read_options.read_size)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return false;
+}
+
+void end_direct_read(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_DIRECT))
+        fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+}
+
+void prefetch_read(int fd, off_t offset) {
+    posix_fadvise(fd, offset, (off_t)read_options.read_size,
+                  POSIX_FADV_WILLNEED);
+}
+
+void drop_read_pages(int fd, off_t offset, off_t len) {
+    if (read_options.drop_cache)
+        posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+void start_block_reads(int fd) { posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM); }
@@ -0,0 +1,54 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Whole files are read through one buffer per thread, large and aligned so
+// a file takes few syscalls and O_DIRECT can read into it. The kernel is
+// told up front that a file is read from start to end, and the next window
+// is prefetched while the current one is hashed. With drop_cache the pages
+// behind the cursor are evicted once they are hashed, so a scan does not
+// push the working set of other processes out of the page cache. With
+// direct, large files bypass the page cache altogether. Reads of single
+// blocks turn readahead off, as it would read far more than the block.
+
+// Alignment of the buffers and of the read size, enough for O_DIRECT
+#define READ_ALIGNMENT 4096
+#define DEFAULT_READ_SIZE (1024 * 1024)
+#define MIN_READ_SIZE (64 * 1024)
+#define MAX_READ_SIZE (64 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Files from this size on are read with O_DIRECT in the direct mode
+#define DIRECT_MIN_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    size_t read_size; // bytes read at once, a multiple of READ_ALIGNMENT
+    bool huge_pages; // back the buffers with huge pages
+    bool drop_cache; // evict the pages of a file once they are hashed
+    bool direct; // read large files with O_DIRECT
+} ReadOptions;
+
+// Function to set the options before the workers start
+void set_read_options(const ReadOptions *options);
+size_t get_read_size();
+// Function to get the buffer of the calling thread, get_read_size() bytes.
+// It is freed when the thread exits. Returns NULL on failure.
+uint8_t *get_read_buffer();
+// Function to prepare a file of the given size, -1 if it is not known, to
+// be read from start to end. Returns true if it is read with O_DIRECT, the
+// reads then have to be aligned.
+bool start_sequential_read(int fd, off_t size);
+// Function to go back to reads through the page cache, for an unaligned
+// read at the end of a file
+void end_direct_read(int fd);
+// Function to start reading the window at offset ahead of the cursor
+void prefetch_read(int fd, off_t offset);
+// Function to evict pages that were hashed, if drop_cache is set
+void drop_read_pages(int fd, off_t offset, off_t len);
+// Function to prepare a file for reads of a few blocks
+void start_block_reads(int fd);
+
+#endif // READER_H
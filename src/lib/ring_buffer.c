@@ -1,163 +1,217 @@
+#define _DEFAULT_SOURCE
 #include "ring_buffer.h"
 #include "../shared/consts.h"
-#include <errno.h>
+#include <linux/futex.h>
 #include <linux/limits.h>
-#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// How often a thread retries before it parks on the futex
+#define SPIN_TRIES 64
 
 RingBuffer *create_ring_buffer(int size) {
-    RingBuffer *buffer = (RingBuffer *)malloc(sizeof(RingBuffer));
+    RingBuffer *buffer = (RingBuffer *)aligned_alloc(
+        CACHE_LINE_SIZE, sizeof(RingBuffer));
+    if (buffer == NULL) {
+        perror("Failed to allocate memory for buffer");
+        return NULL;
+    }
     buffer->size = size;
-    buffer->start = 0;
-    buffer->end = 0;
-
-    // Try to allocate one big chunk of memory for the 2D array
-    buffer->elems =
-        malloc(size * sizeof(char *) + size * PATH_MAX * sizeof(char));
-    if (buffer->elems != NULL) {
-        char *rowStart = (char *)(buffer->elems + size);
-        for (int i = 0; i < size; i++) {
-            buffer->elems[i] = rowStart + i * PATH_MAX;
-        }
-    } else {
-        // If that fails, fall back to allocating each row separately
-        buffer->elems = malloc(size * sizeof(char *));
-        if (buffer->elems != NULL) {
-            for (int i = 0; i < size; i++) {
-                buffer->elems[i] = malloc(PATH_MAX * sizeof(char));
-                if (buffer->elems[i] == NULL) {
-                    perror("Failed to allocate memory for buffer->elems");
-                    exit(1);
-                }
-            }
-        } else {
-            perror("Failed to allocate memory for buffer->elems indices");
-        }
+    buffer->slots = malloc(size * sizeof(RingBufferSlot));
+    if (buffer->slots == NULL) {
+        perror("Failed to allocate memory for buffer->slots");
+        free(buffer);
+        return NULL;
     }
 
-    pthread_mutex_init(&buffer->mutex, NULL);
-    pthread_cond_init(&buffer->cond, NULL);
+    // Slot i is the first to be written at position i
+    for (int i = 0; i < size; i++) {
+        atomic_init(&buffer->slots[i].sequence, i);
+    }
+    atomic_init(&buffer->end, 0);
+    atomic_init(&buffer->start, 0);
+    atomic_init(&buffer->not_empty, 0);
+    atomic_init(&buffer->not_full, 0);
+    atomic_init(&buffer->readers_waiting, 0);
+    atomic_init(&buffer->writers_waiting, 0);
+    atomic_init(&buffer->closed, false);
     return buffer;
 }
 
 void destroy_ring_buffer(RingBuffer *buffer) {
-    pthread_mutex_destroy(&buffer->mutex);
-    pthread_cond_destroy(&buffer->cond);
-    free(buffer->elems);
+    free(buffer->slots);
     free(buffer);
 }
 
-void write_ring_buffer(RingBuffer *buffer, char *path, char *filename) {
-    pthread_mutex_lock(&buffer->mutex);
-    if (buffer->full) {
-        pthread_cond_wait(&buffer->cond, &buffer->mutex); // wait for space
-    }
-    // printf("Write Entry Start: %d, End: %d\n", buffer->start, buffer->end);
+void futex_wait(_Atomic uint32_t *futex, uint32_t value) {
+    syscall(SYS_futex, (uint32_t *)futex, FUTEX_WAIT_PRIVATE, value, NULL, NULL,
+            0);
+}
 
-    if (strcmp(path, "/") == 0) {
-        snprintf(buffer->elems[buffer->end], PATH_MAX, "%s%s", path, filename);
-    } else {
-        snprintf(buffer->elems[buffer->end], PATH_MAX, "%s" PATH_SEPARATOR "%s",
-                 path, filename);
+void futex_wake(_Atomic uint32_t *futex, atomic_int *waiting) {
+    // The fence orders the element we just published before the check, a
+    // parked thread registers itself before it checks the buffer again
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) > 0) {
+        atomic_fetch_add(futex, 1);
+        syscall(SYS_futex, (uint32_t *)futex, FUTEX_WAKE_PRIVATE, INT32_MAX,
+                NULL, NULL, 0);
     }
+}
 
-    buffer->end = (buffer->end + 1) % buffer->size;
-    if (buffer->end == buffer->start) {
-        buffer->full = true;
+// Claims the slot at the write position, returns NULL if the buffer is full
+RingBufferSlot *claim_write_slot(RingBuffer *buffer, size_t *position) {
+    size_t pos = atomic_load_explicit(&buffer->end, memory_order_relaxed);
+    while (1) {
+        RingBufferSlot *slot = &buffer->slots[pos % buffer->size];
+        size_t seq =
+            atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &buffer->end, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *position = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            // The slot still holds an element from the previous lap
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&buffer->end, memory_order_relaxed);
+        }
     }
-    // printf("Write Exit Start: %d, End: %d\n", buffer->start, buffer->end);
-    pthread_cond_signal(&buffer->cond); // signal new data available
-    pthread_mutex_unlock(&buffer->mutex);
 }
 
-// char *read_and_free_ring_buffer(RingBuffer *buffer, const struct timespec *timeout) {
-//     pthread_mutex_lock(&buffer->mutex);
-//     if (!buffer->full && (buffer->start == buffer->end)) {
-//         if (pthread_cond_timedwait(&buffer->cond, &buffer->mutex, timeout) ==
-//             ETIMEDOUT) {
-//             pthread_mutex_unlock(&buffer->mutex);
-//             return NULL;
-//         }
-//     }
-//     char *elem = buffer->elems[buffer->start];
-//     pthread_mutex_unlock(&buffer->mutex);
-//     return elem;
-// }
-
-// void free_ring_buffer(RingBuffer *buffer) {
-//     pthread_mutex_lock(&buffer->mutex);
-//     // printf("Read Entry Start: %d, End: %d\n", buffer->start, buffer->end);
-//     if (!buffer->full && (buffer->start == buffer->end)) {
-//         pthread_mutex_unlock(&buffer->mutex);
-//         return;
-//     }
-//     buffer->start = (buffer->start + 1) % buffer->size;
-//     buffer->full = false;
-//     // printf("Read Exit Start: %d, End: %d\n", buffer->start, buffer->end);
-//     pthread_cond_signal(&buffer->cond); // signal new space available
-//     pthread_mutex_unlock(&buffer->mutex);
-// }
-
-char *read_and_free_ring_buffer(RingBuffer *buffer, const struct timespec *timeout) {
-    pthread_mutex_lock(&buffer->mutex);
-
-    // Wait until there's an element to read
-    while (!buffer->full && (buffer->start == buffer->end)) {
-        if (pthread_cond_timedwait(&buffer->cond, &buffer->mutex, timeout) == ETIMEDOUT) {
-            pthread_mutex_unlock(&buffer->mutex);
+// Claims the slot at the read position, returns NULL if the buffer is empty
+RingBufferSlot *claim_read_slot(RingBuffer *buffer, size_t *position) {
+    size_t pos = atomic_load_explicit(&buffer->start, memory_order_relaxed);
+    while (1) {
+        RingBufferSlot *slot = &buffer->slots[pos % buffer->size];
+        size_t seq =
+            atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &buffer->start, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *position = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            // Nothing has been written to the slot yet
             return NULL;
+        } else {
+            pos = atomic_load_explicit(&buffer->start, memory_order_relaxed);
         }
     }
+}
+
+void write_ring_buffer(RingBuffer *buffer, FilePath file) {
+    size_t pos;
+    RingBufferSlot *slot;
+    int tries = 0;
+    while ((slot = claim_write_slot(buffer, &pos)) == NULL) {
+        if (++tries < SPIN_TRIES)
+            continue;
+
+        // Wait for space, checking again after registering as a waiter so a
+        // reader freeing a slot in between cannot be missed
+        uint32_t seen = atomic_load(&buffer->not_full);
+        atomic_fetch_add(&buffer->writers_waiting, 1);
+        if (is_ring_buffer_full(buffer))
+            futex_wait(&buffer->not_full, seen);
+        atomic_fetch_sub(&buffer->writers_waiting, 1);
+    }
+
+    slot->file = file;
+
+    // Hand the slot over to the readers and signal new data available
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    futex_wake(&buffer->not_empty, &buffer->readers_waiting);
+}
 
-    // Read the element
-    char *elem = buffer->elems[buffer->start];
+// Copies the element out and hands the slot back to the writers of the next lap
+void take_slot(RingBuffer *buffer, RingBufferSlot *slot, size_t pos,
+               FilePath *file) {
+    *file = slot->file;
+    atomic_store_explicit(&slot->sequence, pos + buffer->size,
+                          memory_order_release);
+    futex_wake(&buffer->not_full, &buffer->writers_waiting);
+}
 
-    // Free the element
-    buffer->start = (buffer->start + 1) % buffer->size;
-    buffer->full = false;
+bool read_ring_buffer(RingBuffer *buffer, FilePath *file) {
+    size_t pos;
+    RingBufferSlot *slot;
+    int tries = 0;
+    while ((slot = claim_read_slot(buffer, &pos)) == NULL) {
+        if (atomic_load(&buffer->closed)) {
+            // Writes happened before the close, so an empty buffer now
+            // stays empty
+            if (is_ring_buffer_empty(buffer))
+                return false;
+            continue;
+        }
+        if (++tries < SPIN_TRIES)
+            continue;
+
+        uint32_t seen = atomic_load(&buffer->not_empty);
+        atomic_fetch_add(&buffer->readers_waiting, 1);
+        if (is_ring_buffer_empty(buffer) && !atomic_load(&buffer->closed))
+            futex_wait(&buffer->not_empty, seen);
+        atomic_fetch_sub(&buffer->readers_waiting, 1);
+    }
 
-    // Signal that new space is available
-    pthread_cond_signal(&buffer->cond);
+    take_slot(buffer, slot, pos, file);
+    return true;
+}
 
-    pthread_mutex_unlock(&buffer->mutex);
+bool try_read_ring_buffer(RingBuffer *buffer, FilePath *file) {
+    size_t pos;
+    RingBufferSlot *slot = claim_read_slot(buffer, &pos);
+    if (slot == NULL)
+        return false;
+    take_slot(buffer, slot, pos, file);
+    return true;
+}
 
-    return elem;
+void close_ring_buffer(RingBuffer *buffer) {
+    atomic_store(&buffer->closed, true);
+    atomic_fetch_add(&buffer->not_empty, 1);
+    syscall(SYS_futex, (uint32_t *)&buffer->not_empty, FUTEX_WAKE_PRIVATE,
+            INT32_MAX, NULL, NULL, 0);
 }
 
 int get_ring_buffer_free_space(RingBuffer *buffer) {
-    pthread_mutex_lock(&buffer->mutex);
-    int free_space = buffer->full
-                         ? 0
-                         : (buffer->end >= buffer->start
-                                ? buffer->size - buffer->end + buffer->start
-                                : buffer->start - buffer->end);
-    pthread_mutex_unlock(&buffer->mutex);
-    return free_space;
+    // Read start first, end can only have moved further ahead since
+    size_t start = atomic_load(&buffer->start);
+    size_t end = atomic_load(&buffer->end);
+    int used = (int)(end - start);
+    return used >= buffer->size ? 0 : buffer->size - used;
 }
 
 bool is_ring_buffer_full(RingBuffer *buffer) {
-    pthread_mutex_lock(&buffer->mutex);
-    bool full = buffer->full;
-    pthread_mutex_unlock(&buffer->mutex);
-    return full;
+    return get_ring_buffer_free_space(buffer) == 0;
 }
 
 void clear_ring_buffer(RingBuffer *buffer) {
-    pthread_mutex_lock(&buffer->mutex);
-    buffer->start = 0;
-    buffer->end = 0;
-    buffer->full = false;
-    pthread_cond_signal(&buffer->cond); // signal new space available
-    pthread_mutex_unlock(&buffer->mutex);
+    size_t pos;
+    RingBufferSlot *slot;
+    // Discard the elements like a reader would, so waiting writers wake up
+    while ((slot = claim_read_slot(buffer, &pos)) != NULL) {
+        atomic_store_explicit(&slot->sequence, pos + buffer->size,
+                              memory_order_release);
+    }
+    futex_wake(&buffer->not_full, &buffer->writers_waiting);
 }
 
 bool is_ring_buffer_empty(RingBuffer *buffer) {
-    pthread_mutex_lock(&buffer->mutex);
-    bool empty = (!buffer->full && (buffer->start == buffer->end));
-    pthread_mutex_unlock(&buffer->mutex);
-    return empty;
+    size_t end = atomic_load(&buffer->end);
+    size_t start = atomic_load(&buffer->start);
+    return (intptr_t)(end - start) <= 0;
 }
@@ -2,25 +2,50 @@
 #ifndef RING_BUFFER_H
 #define RING_BUFFER_H
 
-#include <pthread.h>
+#include "../shared/consts.h"
+#include "path_store.h"
+#include <linux/limits.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+// Bounded multi-producer/multi-consumer queue of files. Every slot carries a
+// sequence number telling whose turn it is: a writer may fill slot i when its
+// sequence equals the write position, a reader may empty it when it equals
+// the write position plus one. Positions are claimed with a compare and swap,
+// so neither side takes a lock. Threads that find the buffer full or empty
+// park on a futex instead of spinning.
 typedef struct {
-    int size;  // maximum number of elements   
-    int start;  // index of oldest element
-    int end;  // index at which to write new element
-    char **elems;  // vector of elements
-    bool full;  // true if buffer is full
-    pthread_mutex_t mutex;  // protects access to the buffer
-    pthread_cond_t cond;  // signals when space is available
+    atomic_size_t sequence; // turn of the slot
+    FilePath file; // element stored in the slot, the name lives in the
+                   // path store
+} RingBufferSlot;
+
+typedef struct {
+    int size; // maximum number of elements
+    RingBufferSlot *slots; // vector of elements
+    alignas(CACHE_LINE_SIZE) atomic_size_t end; // next position to write
+    alignas(CACHE_LINE_SIZE) atomic_size_t start; // next position to read
+    alignas(CACHE_LINE_SIZE) _Atomic uint32_t not_empty; // futex, bumped on write
+    _Atomic uint32_t not_full; // futex, bumped on read
+    atomic_int readers_waiting; // readers parked on not_empty
+    atomic_int writers_waiting; // writers parked on not_full
+    atomic_bool closed; // no more writes will come
 } RingBuffer;
 
-RingBuffer* create_ring_buffer(int size);
+RingBuffer *create_ring_buffer(int size);
 void destroy_ring_buffer(RingBuffer *buffer);
-void write_ring_buffer(RingBuffer *buffer, char *path, char *filename);
-char *read_and_free_ring_buffer(RingBuffer *buffer, const struct timespec *timeout);
-// char* read_and_free_ring_buffer(RingBuffer *buffer, const struct timespec* timeout);
-// void free_ring_buffer(RingBuffer *buffer);
+// Blocks while the buffer is full
+void write_ring_buffer(RingBuffer *buffer, FilePath file);
+// Takes the oldest element, blocks while the buffer is empty. Returns false
+// once the buffer is closed and drained.
+bool read_ring_buffer(RingBuffer *buffer, FilePath *file);
+// Like read_ring_buffer, but returns false right away if the buffer is empty
+bool try_read_ring_buffer(RingBuffer *buffer, FilePath *file);
+// Tells the readers that no more elements will be written
+void close_ring_buffer(RingBuffer *buffer);
 int get_ring_buffer_free_space(RingBuffer *buffer);
 bool is_ring_buffer_full(RingBuffer *buffer);
 void clear_ring_buffer(RingBuffer *buffer);
@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+#include "scheduler.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+// Reads the rotational flag of the block device, or of the disk a partition
+// is on. Anything that has none, like a network file system, counts as solid
+// state.
+bool is_rotational(dev_t dev) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational",
+             major(dev), minor(dev));
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        snprintf(path, sizeof(path),
+                 "/sys/dev/block/%u:%u/../queue/rotational", major(dev),
+                 minor(dev));
+        file = fopen(path, "r");
+    }
+    if (file == NULL)
+        return false;
+    int flag = fgetc(file);
+    fclose(file);
+    return flag == '1';
+}
+
+int init_device(Scheduler *scheduler, Device *device, dev_t dev) {
+    device->dev = dev;
+    device->rotational = is_rotational(dev);
+    device->queue = create_ring_buffer(DEVICE_QUEUE_SIZE);
+    if (device->queue == NULL)
+        return -1;
+    device->batch = NULL;
+    if (device->rotational) {
+        device->batch = malloc(ELEVATOR_BATCH * sizeof(ElevatorEntry));
+        if (device->batch == NULL) {
+            perror("Failed to allocate memory for elevator batch");
+            destroy_ring_buffer(device->queue);
+            return -1;
+        }
+    }
+    int limit = device->rotational ? ROTATIONAL_START_LIMIT
+                                   : SOLID_STATE_START_LIMIT;
+    atomic_init(&device->active, 0);
+    atomic_init(&device->limit, limit < scheduler->max_limit
+                                    ? limit
+                                    : scheduler->max_limit);
+    atomic_init(&device->limited, false);
+    atomic_init(&device->files, 0);
+    atomic_init(&device->bytes, 0);
+    pthread_mutex_init(&device->batch_mutex, NULL);
+    device->batch_next = 0;
+    device->batch_len = 0;
+    pthread_mutex_init(&device->small_mutex, NULL);
+    pthread_cond_init(&device->small_room, NULL);
+    device->small_head = NULL;
+    device->small_tail = NULL;
+    atomic_init(&device->num_small, 0);
+    pthread_mutex_init(&device->window_mutex, NULL);
+    device->window_start = get_time_ns();
+    device->window_files = 0;
+    device->window_bytes = 0;
+    device->window_latency = 0;
+    device->last_throughput = 0;
+    device->last_latency = 0;
+    device->step = 1;
+    return 0;
+}
+
+Scheduler *create_scheduler(int num_workers) {
+    Scheduler *scheduler = malloc(sizeof(Scheduler));
+    if (scheduler == NULL) {
+        perror("Failed to allocate memory for scheduler");
+        return NULL;
+    }
+    atomic_init(&scheduler->num_devices, 0);
+    pthread_mutex_init(&scheduler->devices_mutex, NULL);
+    scheduler->max_limit = num_workers > 0 ? num_workers : 1;
+    atomic_init(&scheduler->next_device, 0);
+    atomic_init(&scheduler->events, 0);
+    atomic_init(&scheduler->sleepers, 0);
+    pthread_mutex_init(&scheduler->mutex, NULL);
+    pthread_cond_init(&scheduler->cond, NULL);
+    atomic_init(&scheduler->closed, false);
+    return scheduler;
+}
+
+void destroy_scheduler(Scheduler *scheduler) {
+    int num_devices = atomic_load(&scheduler->num_devices);
+    for (int i = 0; i < num_devices; i++) {
+        Device *device = &scheduler->devices[i];
+        destroy_ring_buffer(device->queue);
+        free(device->batch);
+        while (device->small_head != NULL) {
+            SmallBatch *next = device->small_head->next;
+            free(device->small_head);
+            device->small_head = next;
+        }
+        pthread_mutex_destroy(&device->batch_mutex);
+        pthread_mutex_destroy(&device->small_mutex);
+        pthread_cond_destroy(&device->small_room);
+        pthread_mutex_destroy(&device->window_mutex);
+    }
+    pthread_mutex_destroy(&scheduler->devices_mutex);
+    pthread_mutex_destroy(&scheduler->mutex);
+    pthread_cond_destroy(&scheduler->cond);
+    free(scheduler);
+}
+
+// Returns the index of the device, adding it on first sight. Devices past
+// MAX_DEVICES share the last one.
+int find_device(Scheduler *scheduler, dev_t dev) {
+    int num_devices = atomic_load(&scheduler->num_devices);
+    for (int i = 0; i < num_devices; i++) {
+        if (scheduler->devices[i].dev == dev)
+            return i;
+    }
+    pthread_mutex_lock(&scheduler->devices_mutex);
+    num_devices = atomic_load(&scheduler->num_devices);
+    int index = num_devices;
+    for (int i = 0; i < num_devices; i++) {
+        if (scheduler->devices[i].dev == dev)
+            index = i;
+    }
+    if (index == MAX_DEVICES) {
+        index = MAX_DEVICES - 1;
+    } else if (index == num_devices) {
+        if (init_device(scheduler, &scheduler->devices[index], dev) == 0)
+            atomic_store(&scheduler->num_devices, num_devices + 1);
+        else
+            index = num_devices - 1;
+    }
+    pthread_mutex_unlock(&scheduler->devices_mutex);
+    return index;
+}
+
+// Wakes a waiting worker when a file or a slot of a device came free, or
+// all of them once there is nothing left
+void notify_workers(Scheduler *scheduler, bool all) {
+    atomic_fetch_add(&scheduler->events, 1);
+    if (atomic_load(&scheduler->sleepers) > 0) {
+        pthread_mutex_lock(&scheduler->mutex);
+        if (all)
+            pthread_cond_broadcast(&scheduler->cond);
+        else
+            pthread_cond_signal(&scheduler->cond);
+        pthread_mutex_unlock(&scheduler->mutex);
+    }
+}
+
+void schedule_file(Scheduler *scheduler, FilePath file, dev_t dev) {
+    int index = find_device(scheduler, dev);
+    if (index < 0)
+        return;
+    RingBuffer *queue = scheduler->devices[index].queue;
+    write_ring_buffer(queue, file);
+    add_queue_occupancy(queue->size - get_ring_buffer_free_space(queue),
+                        queue->size);
+    notify_workers(scheduler, false);
+}
+
+void schedule_small_batch(Scheduler *scheduler, SmallBatch *batch) {
+    int index = find_device(scheduler, batch->dev);
+    if (index < 0) {
+        free(batch);
+        return;
+    }
+    Device *device = &scheduler->devices[index];
+    batch->next = NULL;
+    pthread_mutex_lock(&device->small_mutex);
+    while (atomic_load(&device->num_small) >= MAX_SMALL_BATCHES) {
+        pthread_cond_wait(&device->small_room, &device->small_mutex);
+    }
+    if (device->small_tail != NULL)
+        device->small_tail->next = batch;
+    else
+        device->small_head = batch;
+    device->small_tail = batch;
+    atomic_fetch_add(&device->num_small, 1);
+    pthread_mutex_unlock(&device->small_mutex);
+    notify_workers(scheduler, false);
+}
+
+SmallBatch *take_small_batch(Device *device) {
+    pthread_mutex_lock(&device->small_mutex);
+    SmallBatch *batch = device->small_head;
+    if (batch != NULL) {
+        device->small_head = batch->next;
+        if (device->small_head == NULL)
+            device->small_tail = NULL;
+        atomic_fetch_sub(&device->num_small, 1);
+        pthread_cond_signal(&device->small_room);
+    }
+    pthread_mutex_unlock(&device->small_mutex);
+    return batch;
+}
+
+// Physical offset of the first extent of the file, files that have none or
+// cannot be asked go last
+uint64_t get_physical_offset(FilePath file) {
+    char path[PATH_MAX];
+    if (get_file_path(file, path, sizeof(path)) >= sizeof(path))
+        return UINT64_MAX;
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return UINT64_MAX;
+    uint64_t request[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) /
+                         sizeof(uint64_t) +
+                     1];
+    memset(request, 0, sizeof(request));
+    struct fiemap *map = (struct fiemap *)request;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    uint64_t offset = UINT64_MAX;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0)
+        offset = map->fm_extents[0].fe_physical;
+    close(fd);
+    return offset;
+}
+
+int compare_elevator_entries(const void *a, const void *b) {
+    const ElevatorEntry *first = a, *second = b;
+    if (first->offset != second->offset)
+        return first->offset < second->offset ? -1 : 1;
+    return first->order < second->order ? -1 : first->order > second->order;
+}
+
+// Takes the next file of a rotational device in order of its place on the
+// disk, sorting the next batch of the queue when the last one is used up
+bool take_sorted_file(Device *device, FilePath *file) {
+    pthread_mutex_lock(&device->batch_mutex);
+    if (device->batch_next == device->batch_len) {
+        size_t len = 0;
+        while (len < ELEVATOR_BATCH &&
+               try_read_ring_buffer(device->queue, &device->batch[len].file)) {
+            device->batch[len].order = len;
+            len++;
+        }
+        for (size_t i = 0; i < len; i++) {
+            ElevatorEntry *entry = &device->batch[i];
+            entry->offset = get_physical_offset(entry->file);
+        }
+        qsort(device->batch, len, sizeof(ElevatorEntry),
+              compare_elevator_entries);
+        device->batch_next = 0;
+        device->batch_len = len;
+    }
+    bool taken = device->batch_next < device->batch_len;
+    if (taken)
+        *file = device->batch[device->batch_next++].file;
+    pthread_mutex_unlock(&device->batch_mutex);
+    return taken;
+}
+
+// Takes a batch of small files or a file of the device if it is below its
+// limit
+bool try_take_file(Device *device, FilePath *file, SmallBatch **batch) {
+    int active = atomic_load(&device->active);
+    do {
+        if (active >= atomic_load(&device->limit)) {
+            if (!is_ring_buffer_empty(device->queue) ||
+                atomic_load(&device->num_small) > 0)
+                atomic_store(&device->limited, true);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&device->active, &active,
+                                           active + 1));
+    if (batch != NULL && atomic_load(&device->num_small) > 0 &&
+        (*batch = take_small_batch(device)) != NULL)
+        return true;
+    if (device->rotational ? take_sorted_file(device, file)
+                           : try_read_ring_buffer(device->queue, file))
+        return true;
+    atomic_fetch_sub(&device->active, 1);
+    return false;
+}
+
+// Checks whether every queue is empty, only final once the scheduler is
+// closed
+bool is_drained(Scheduler *scheduler) {
+    int num_devices = atomic_load(&scheduler->num_devices);
+    for (int i = 0; i < num_devices; i++) {
+        Device *device = &scheduler->devices[i];
+        if (!is_ring_buffer_empty(device->queue) ||
+            atomic_load(&device->num_small) > 0)
+            return false;
+        if (device->rotational) {
+            pthread_mutex_lock(&device->batch_mutex);
+            bool empty = device->batch_next == device->batch_len;
+            pthread_mutex_unlock(&device->batch_mutex);
+            if (!empty)
+                return false;
+        }
+    }
+    return true;
+}
+
+int take_file(Scheduler *scheduler, FilePath *file, SmallBatch **batch,
+              bool wait) {
+    if (batch != NULL)
+        *batch = NULL;
+    while (1) {
+        // Read before looking, so an event after the search is not missed
+        uint64_t seen = atomic_load(&scheduler->events);
+        bool closed = atomic_load(&scheduler->closed);
+        int num_devices = atomic_load(&scheduler->num_devices);
+        // Workers start at different devices so none is always last
+        unsigned first = atomic_fetch_add(&scheduler->next_device, 1);
+        for (int i = 0; i < num_devices; i++) {
+            int index = (int)((first + i) % num_devices);
+            if (try_take_file(&scheduler->devices[index], file, batch))
+                return index;
+        }
+        if (closed && is_drained(scheduler)) {
+            // Workers that went to sleep before the last file was taken
+            // wait for an event that would not come otherwise
+            notify_workers(scheduler, true);
+            return -1;
+        }
+        if (!wait)
+            return -1;
+
+        pthread_mutex_lock(&scheduler->mutex);
+        atomic_fetch_add(&scheduler->sleepers, 1);
+        while (atomic_load(&scheduler->events) == seen) {
+            pthread_cond_wait(&scheduler->cond, &scheduler->mutex);
+        }
+        atomic_fetch_sub(&scheduler->sleepers, 1);
+        pthread_mutex_unlock(&scheduler->mutex);
+    }
+}
+
+// Moves the limit of the device a step at the end of a window. A step that
+// cost throughput is taken back, and so is one that only made the files
+// wait longer. Windows in which no worker was turned away say nothing about
+// the limit, the climb starts over after them.
+void adapt_limit(Scheduler *scheduler, Device *device, uint64_t now) {
+    double seconds = (now - device->window_start) / 1e9;
+    double throughput = device->window_bytes / seconds;
+    double latency = (double)device->window_latency / device->window_files;
+    if (!atomic_exchange(&device->limited, false)) {
+        device->last_throughput = 0;
+        device->step = 1;
+    } else {
+        if (device->last_throughput > 0) {
+            if (throughput < device->last_throughput * 0.95)
+                device->step = -device->step;
+            else if (throughput < device->last_throughput * 1.05 &&
+                     latency > device->last_latency * 1.2)
+                device->step = -1;
+        }
+        int limit = atomic_load(&device->limit) + device->step;
+        if (limit < 1)
+            limit = 1;
+        if (limit > scheduler->max_limit)
+            limit = scheduler->max_limit;
+        atomic_store(&device->limit, limit);
+        device->last_throughput = throughput;
+        device->last_latency = latency;
+    }
+    device->window_start = now;
+    device->window_files = 0;
+    device->window_bytes = 0;
+    device->window_latency = 0;
+}
+
+void finish_file(Scheduler *scheduler, int device, uint32_t files,
+                 uint64_t bytes, uint64_t start) {
+    if (device < 0)
+        return;
+    Device *done = &scheduler->devices[device];
+    uint64_t now = get_time_ns();
+    atomic_fetch_sub(&done->active, 1);
+    atomic_fetch_add(&done->files, files);
+    atomic_fetch_add(&done->bytes, bytes);
+
+    pthread_mutex_lock(&done->window_mutex);
+    done->window_files += files;
+    done->window_bytes += bytes;
+    done->window_latency += now - start;
+    if (done->window_files >= ADAPT_MIN_FILES &&
+        now - done->window_start >= ADAPT_INTERVAL_MS * 1000000ull)
+        adapt_limit(scheduler, done, now);
+    pthread_mutex_unlock(&done->window_mutex);
+    notify_workers(scheduler, false);
+}
+
+void close_scheduler(Scheduler *scheduler) {
+    atomic_store(&scheduler->closed, true);
+    notify_workers(scheduler, true);
+}
+
+int get_queue_fill(Scheduler *scheduler) {
+    int num_devices = atomic_load(&scheduler->num_devices);
+    if (num_devices == 0)
+        return 0;
+    int64_t used = 0;
+    for (int i = 0; i < num_devices; i++) {
+        RingBuffer *queue = scheduler->devices[i].queue;
+        used += queue->size - get_ring_buffer_free_space(queue);
+    }
+    return (int)(used * 100 / ((int64_t)num_devices * DEVICE_QUEUE_SIZE));
+}
+
+void write_scheduler_json(Scheduler *scheduler, FILE *file) {
+    int num_devices = atomic_load(&scheduler->num_devices);
+    fprintf(file, "  \"devices\": [");
+    for (int i = 0; i < num_devices; i++) {
+        Device *device = &scheduler->devices[i];
+        fprintf(file,
+                "%s\n    {\"device\": \"%u:%u\", \"rotational\": %s, "
+                "\"limit\": %d, \"files\": %llu, \"bytes\": %llu}",
+                i ? "," : "", major(device->dev), minor(device->dev),
+                device->rotational ? "true" : "false",
+                atomic_load(&device->limit),
+                (unsigned long long)atomic_load(&device->files),
+                (unsigned long long)atomic_load(&device->bytes));
+    }
+    fprintf(file, "%s],\n", num_devices > 0 ? "\n  " : "");
+}
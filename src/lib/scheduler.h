@@ -0,0 +1,124 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "path_store.h"
+#include "ring_buffer.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Hands the candidates to the workers by the device they live on. Every
+// device has a queue of its own and a limit on how many of its files are
+// read at once, so a slow disk does not tie up every worker while a fast one
+// sits idle. The limit climbs a step at a time while the device is busy and
+// turns around once a step cost throughput, or raised the latency without
+// gaining any. A rotational device hands its files out in batches sorted
+// by where their first extent lies on the disk, so the head sweeps across
+// it instead of seeking back and forth.
+//
+// Small files come in batches, which a worker takes as a whole under one
+// slot of the device, so they do not pay for the queue one by one.
+//
+// Devices are told apart by st_dev, so subvolumes of one file system count
+// as devices of their own.
+
+#define MAX_DEVICES 64
+// Files queued per device before the walkers wait
+#define DEVICE_QUEUE_SIZE 4096
+// Files of a rotational device sorted at once
+#define ELEVATOR_BATCH 256
+// A window of a device ends after this long and this many files
+#define ADAPT_INTERVAL_MS 200
+#define ADAPT_MIN_FILES 32
+#define ROTATIONAL_START_LIMIT 2
+#define SOLID_STATE_START_LIMIT 8
+#define SMALL_BATCH_FILES 64
+// Batches queued per device before the walkers wait
+#define MAX_SMALL_BATCHES (DEVICE_QUEUE_SIZE / SMALL_BATCH_FILES)
+
+// Small files of one device with the sizes the walk found
+typedef struct SmallBatch {
+    struct SmallBatch *next;
+    dev_t dev;
+    uint32_t count;
+    FilePath files[SMALL_BATCH_FILES];
+    uint32_t sizes[SMALL_BATCH_FILES];
+} SmallBatch;
+
+typedef struct {
+    uint64_t offset; // physical offset of the first extent
+    size_t order; // position in the queue, breaks ties
+    FilePath file;
+} ElevatorEntry;
+
+typedef struct {
+    dev_t dev;
+    bool rotational;
+    RingBuffer *queue;
+    atomic_int active; // files being read
+    atomic_int limit; // files that may be read at once
+    atomic_bool limited; // a worker was turned away in this window
+    atomic_uint_fast64_t files; // files read in total
+    atomic_uint_fast64_t bytes; // bytes read in total
+    pthread_mutex_t batch_mutex; // protects the batch
+    ElevatorEntry *batch; // sorted files of a rotational device
+    size_t batch_next;
+    size_t batch_len;
+    pthread_mutex_t small_mutex; // protects the list of small batches
+    pthread_cond_t small_room; // signals a batch taken
+    SmallBatch *small_head;
+    SmallBatch *small_tail;
+    atomic_int num_small; // batches queued, read without lock
+    pthread_mutex_t window_mutex; // protects the window
+    uint64_t window_start;
+    uint64_t window_files;
+    uint64_t window_bytes;
+    uint64_t window_latency; // nanoseconds, added up
+    double last_throughput; // bytes per second of the window before
+    double last_latency;
+    int step; // direction the limit moves in
+} Device;
+
+typedef struct {
+    Device devices[MAX_DEVICES];
+    atomic_int num_devices; // devices in use, the last one is shared
+    pthread_mutex_t devices_mutex; // protects adding a device
+    int max_limit; // number of workers
+    atomic_uint next_device; // where the next search starts
+    atomic_uint_fast64_t events; // bumped when a file or a slot comes free
+    atomic_int sleepers; // workers waiting for an event
+    pthread_mutex_t mutex; // protects the wait for an event
+    pthread_cond_t cond;
+    atomic_bool closed; // no more files will come
+} Scheduler;
+
+// Function to create a scheduler for num_workers workers, NULL on failure
+Scheduler *create_scheduler(int num_workers);
+void destroy_scheduler(Scheduler *scheduler);
+// Function to queue a file of the device dev, blocks while its queue is full
+void schedule_file(Scheduler *scheduler, FilePath file, dev_t dev);
+// Function to queue a batch of small files, the worker taking it frees it.
+// Blocks while the device has MAX_SMALL_BATCHES queued.
+void schedule_small_batch(Scheduler *scheduler, SmallBatch *batch);
+// Function to take a file of a device that is below its limit. Returns the
+// device, which the worker passes to finish_file, or -1 once the scheduler
+// is closed and drained. Without wait it returns -1 as well if no file can
+// be taken right away. Workers that pass batch may get a batch of small
+// files there instead of a file, it is set to NULL otherwise.
+int take_file(Scheduler *scheduler, FilePath *file, SmallBatch **batch,
+              bool wait);
+// Function to tell that the files taken at start from device are done
+// after reading bytes. Does nothing for device -1.
+void finish_file(Scheduler *scheduler, int device, uint32_t files,
+                 uint64_t bytes, uint64_t start);
+// Function to tell the workers that no more files will be queued
+void close_scheduler(Scheduler *scheduler);
+// Function to get how full the queues are, in percent
+int get_queue_fill(Scheduler *scheduler);
+// Function to write the devices as a member of a JSON object
+void write_scheduler_json(Scheduler *scheduler, FILE *file);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,597 @@
+#define _POSIX_C_SOURCE 200809L
+#include "shard_index.h"
+#include "fast_hash.h"
+#include "hash_table.h"
+#include "hashing.h"
+#include "spill.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INDEX_HEADER_SIZE 16
+#define INDEX_CHECKSUM_LEN 8
+#define BLOCK_HEADER_SIZE (4 + INDEX_CHECKSUM_LEN)
+// Bytes of a record before its path
+#define INDEX_RECORD_SIZE (8 + MAX_DIGEST_LEN + 2)
+// The spill key is the size, big endian, and the start of the digest, the
+// rest of the digest goes in front of the path
+#define KEY_DIGEST_LEN (SPILL_KEY_LEN - 8)
+
+// Files of one size and spill key, sorted by digest and path before they
+// are written
+typedef struct {
+    uint8_t digest[MAX_DIGEST_LEN];
+    size_t path_offset; // in the names of the group
+    uint16_t path_len;
+} IndexEntry;
+
+// Records being written, a block at a time
+typedef struct {
+    FILE *file;
+    uint8_t block[INDEX_BLOCK_SIZE];
+    size_t used;
+    uint64_t records;
+    bool failed;
+} IndexWriter;
+
+// An index being merged. Records are read out of the block that is
+// checked last, which stays in the buffer until it is done with.
+typedef struct {
+    const char *path;
+    int fd;
+    uint8_t *buffer;
+    size_t start; // unread bytes are from start to end
+    size_t end;
+    size_t block_end; // end of the records of the current block
+    off_t offset; // next byte of the file to read
+    uint64_t records; // records read so far
+    // Current record, the name is valid until the reader moves on
+    bool done;
+    uint64_t size;
+    uint8_t digest[MAX_DIGEST_LEN];
+    const char *name;
+    uint16_t name_len;
+} IndexReader;
+
+// Only the thread that writes or merges the index touches these
+Spill *index_spill = NULL;
+char *index_path = NULL;
+char *index_tmp_path = NULL;
+FILE *index_file = NULL;
+IndexEntry *group_entries = NULL;
+size_t group_capacity = 0;
+char *group_names = NULL;
+size_t group_names_used = 0;
+size_t group_names_capacity = 0;
+
+void put_index_integer(uint8_t *data, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        data[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+uint64_t get_index_integer(const uint8_t *data, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+void get_index_checksum(const void *data, size_t len, uint8_t *checksum) {
+    FastHasher hasher;
+    fast_hasher_init(&hasher);
+    fast_hasher_update(&hasher, data, len);
+    fast_hasher_finalize(&hasher, checksum, INDEX_CHECKSUM_LEN);
+}
+
+int start_shard_index(const char *path) {
+    // A crash leaves no index rather than half of one
+    size_t len = strlen(path) + 32;
+    index_path = strdup(path);
+    index_tmp_path = malloc(len);
+    if (index_path == NULL || index_tmp_path == NULL) {
+        perror("Failed to allocate memory for index path");
+        return -1;
+    }
+    snprintf(index_tmp_path, len, "%s.%d.tmp", path, (int)getpid());
+    int fd = open(index_tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    index_file = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (index_file == NULL) {
+        perror("Failed to create index");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    index_spill = create_spill(INDEX_SPILL_BUDGET);
+    return index_spill != NULL ? 0 : -1;
+}
+
+bool is_indexing() { return index_spill != NULL; }
+
+void add_index_file(const uint8_t *hash, uint64_t size, FilePath file) {
+    char path[PATH_MAX];
+    size_t len = get_file_path(file, path, sizeof(path));
+    if (len >= sizeof(path)) {
+        add_error();
+        return;
+    }
+    uint8_t key[SPILL_KEY_LEN];
+    for (int i = 0; i < 8; i++) {
+        key[i] = (uint8_t)(size >> (56 - 8 * i));
+    }
+    memcpy(key + 8, hash, KEY_DIGEST_LEN);
+    uint8_t payload[MAX_DIGEST_LEN - KEY_DIGEST_LEN + PATH_MAX];
+    memcpy(payload, hash + KEY_DIGEST_LEN, MAX_DIGEST_LEN - KEY_DIGEST_LEN);
+    memcpy(payload + MAX_DIGEST_LEN - KEY_DIGEST_LEN, path, len);
+    add_spill_record(index_spill, key, payload,
+                     (uint16_t)(MAX_DIGEST_LEN - KEY_DIGEST_LEN + len));
+}
+
+void write_index_bytes(IndexWriter *writer, const void *data, size_t len) {
+    if (!writer->failed && fwrite(data, 1, len, writer->file) != len)
+        writer->failed = true;
+}
+
+void flush_index_block(IndexWriter *writer) {
+    if (writer->used == 0)
+        return;
+    uint8_t header[BLOCK_HEADER_SIZE];
+    put_index_integer(header, writer->used, 4);
+    get_index_checksum(writer->block, writer->used, header + 4);
+    write_index_bytes(writer, header, sizeof(header));
+    write_index_bytes(writer, writer->block, writer->used);
+    writer->used = 0;
+}
+
+void write_index_record(IndexWriter *writer, uint64_t size,
+                        const uint8_t *digest, const char *path,
+                        uint16_t path_len) {
+    if (INDEX_BLOCK_SIZE - writer->used < (size_t)INDEX_RECORD_SIZE + path_len)
+        flush_index_block(writer);
+    uint8_t *record = writer->block + writer->used;
+    put_index_integer(record, size, 8);
+    memcpy(record + 8, digest, MAX_DIGEST_LEN);
+    put_index_integer(record + 8 + MAX_DIGEST_LEN, path_len, 2);
+    memcpy(record + INDEX_RECORD_SIZE, path, path_len);
+    writer->used += INDEX_RECORD_SIZE + path_len;
+    writer->records++;
+}
+
+int compare_index_entries(const void *a, const void *b) {
+    const IndexEntry *first = a, *second = b;
+    int order = memcmp(first->digest, second->digest, MAX_DIGEST_LEN);
+    if (order != 0)
+        return order;
+    uint16_t len = first->path_len < second->path_len ? first->path_len
+                                                      : second->path_len;
+    order = memcmp(group_names + first->path_offset,
+                   group_names + second->path_offset, len);
+    if (order != 0)
+        return order;
+    return (int)first->path_len - (int)second->path_len;
+}
+
+// Adds a file to the group of its spill key, returns false on failure
+bool add_group_entry(size_t *num_entries, const SpillRecord *record) {
+    size_t tail_len = MAX_DIGEST_LEN - KEY_DIGEST_LEN;
+    uint16_t path_len = record->payload_len - tail_len;
+    if (*num_entries == group_capacity) {
+        size_t capacity = group_capacity ? group_capacity * 2 : 16;
+        IndexEntry *entries =
+            realloc(group_entries, capacity * sizeof(IndexEntry));
+        if (entries == NULL)
+            return false;
+        group_entries = entries;
+        group_capacity = capacity;
+    }
+    if (group_names_capacity - group_names_used < path_len) {
+        size_t capacity = group_names_capacity ? group_names_capacity : 4096;
+        while (capacity - group_names_used < path_len) {
+            capacity *= 2;
+        }
+        char *names = realloc(group_names, capacity);
+        if (names == NULL)
+            return false;
+        group_names = names;
+        group_names_capacity = capacity;
+    }
+    IndexEntry *entry = &group_entries[(*num_entries)++];
+    memcpy(entry->digest, record->key + 8, KEY_DIGEST_LEN);
+    memcpy(entry->digest + KEY_DIGEST_LEN, record->payload, tail_len);
+    entry->path_offset = group_names_used;
+    entry->path_len = path_len;
+    memcpy(group_names + group_names_used, record->payload + tail_len,
+           path_len);
+    group_names_used += path_len;
+    return true;
+}
+
+void write_index_group(IndexWriter *writer, uint64_t size,
+                       size_t num_entries) {
+    qsort(group_entries, num_entries, sizeof(IndexEntry),
+          compare_index_entries);
+    for (size_t i = 0; i < num_entries; i++) {
+        write_index_record(writer, size, group_entries[i].digest,
+                           group_names + group_entries[i].path_offset,
+                           group_entries[i].path_len);
+    }
+    group_names_used = 0;
+}
+
+// Merges the spilled records into the index, the spill sorts them by size
+// and the start of the digest and the groups sort the rest
+int write_index_records(IndexWriter *writer) {
+    SpillMerge *merge = open_spill_merge(index_spill, INDEX_SPILL_BUDGET);
+    if (merge == NULL)
+        return -1;
+    uint8_t key[SPILL_KEY_LEN];
+    size_t num_entries = 0;
+    SpillRecord record;
+    bool more, failed = false;
+    do {
+        more = next_spill_record(merge, &record);
+        if (num_entries > 0 &&
+            (!more || memcmp(record.key, key, SPILL_KEY_LEN) != 0)) {
+            uint64_t size = 0;
+            for (int i = 0; i < 8; i++) {
+                size = (size << 8) | key[i];
+            }
+            write_index_group(writer, size, num_entries);
+            num_entries = 0;
+        }
+        if (!more)
+            break;
+        memcpy(key, record.key, SPILL_KEY_LEN);
+        if (!add_group_entry(&num_entries, &record)) {
+            perror("Failed to allocate memory for index");
+            failed = true;
+            break;
+        }
+    } while (more);
+    failed = failed || spill_merge_failed(merge);
+    close_spill_merge(merge);
+    return failed ? -1 : 0;
+}
+
+int write_shard_index(uint64_t *num_files) {
+    IndexWriter *writer = calloc(1, sizeof(IndexWriter));
+    if (writer == NULL) {
+        perror("Failed to allocate memory for index");
+        return -1;
+    }
+    writer->file = index_file;
+    index_file = NULL;
+
+    uint8_t header[INDEX_HEADER_SIZE] = {0};
+    memcpy(header, INDEX_MAGIC, 8);
+    put_index_integer(header + 8, INDEX_VERSION, 4);
+    write_index_bytes(writer, header, sizeof(header));
+    int result = write_index_records(writer);
+    flush_index_block(writer);
+
+    uint8_t end[BLOCK_HEADER_SIZE + 8] = {0};
+    put_index_integer(end + BLOCK_HEADER_SIZE, writer->records, 8);
+    get_index_checksum(end + BLOCK_HEADER_SIZE, 8, end + 4);
+    write_index_bytes(writer, end, sizeof(end));
+    *num_files = writer->records;
+
+    if (writer->failed || fflush(writer->file) != 0 ||
+        fsync(fileno(writer->file)) != 0)
+        result = -1;
+    if (fclose(writer->file) != 0)
+        result = -1;
+    free(writer);
+    if (result == 0 && rename(index_tmp_path, index_path) != 0)
+        result = -1;
+    if (result != 0) {
+        perror("Failed to write index");
+        unlink(index_tmp_path);
+    }
+    return result;
+}
+
+void free_shard_index() {
+    if (index_file != NULL) {
+        fclose(index_file);
+        unlink(index_tmp_path);
+    }
+    if (index_spill != NULL)
+        destroy_spill(index_spill);
+    free(index_path);
+    free(index_tmp_path);
+    free(group_entries);
+    free(group_names);
+    index_file = NULL;
+    index_spill = NULL;
+    index_path = NULL;
+    index_tmp_path = NULL;
+    group_entries = NULL;
+    group_capacity = 0;
+    group_names = NULL;
+    group_names_used = group_names_capacity = 0;
+}
+
+// Reads until at least len bytes are unread, returns false at the end of
+// the file or on an error
+bool fill_index_reader(IndexReader *reader, size_t len) {
+    while (reader->end - reader->start < len) {
+        if (reader->start > 0) {
+            memmove(reader->buffer, reader->buffer + reader->start,
+                    reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->block_end -= reader->start;
+            reader->start = 0;
+        }
+        ssize_t n;
+        do {
+            n = pread(reader->fd, reader->buffer + reader->end,
+                      INDEX_READ_SIZE - reader->end, reader->offset);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            if (n < 0)
+                perror("Failed to read index");
+            return false;
+        }
+        reader->offset += n;
+        reader->end += n;
+    }
+    return true;
+}
+
+// Checks the next block and makes its records the unread ones, returns
+// false if the index ends there or cannot be read
+bool next_index_block(IndexReader *reader) {
+    if (!fill_index_reader(reader, BLOCK_HEADER_SIZE)) {
+        fprintf(stderr, "Index %s is truncated\n", reader->path);
+        return false;
+    }
+    const uint8_t *header = reader->buffer + reader->start;
+    size_t len = get_index_integer(header, 4);
+    size_t covered = len > 0 ? len : 8;
+    if (len > INDEX_BLOCK_SIZE ||
+        !fill_index_reader(reader, BLOCK_HEADER_SIZE + covered)) {
+        fprintf(stderr, "Index %s is truncated\n", reader->path);
+        return false;
+    }
+    header = reader->buffer + reader->start;
+    uint8_t checksum[INDEX_CHECKSUM_LEN];
+    get_index_checksum(header + BLOCK_HEADER_SIZE, covered, checksum);
+    if (memcmp(checksum, header + 4, INDEX_CHECKSUM_LEN) != 0) {
+        fprintf(stderr, "Index %s is corrupt\n", reader->path);
+        return false;
+    }
+    reader->start += BLOCK_HEADER_SIZE;
+    if (len == 0) {
+        uint64_t records = get_index_integer(header + BLOCK_HEADER_SIZE, 8);
+        if (records != reader->records) {
+            fprintf(stderr, "Index %s is corrupt\n", reader->path);
+            return false;
+        }
+        reader->done = true;
+        return true;
+    }
+    reader->block_end = reader->start + len;
+    return true;
+}
+
+// Moves on to the next record, returns false if the index is unusable
+bool advance_index_reader(IndexReader *reader) {
+    if (reader->start == reader->block_end && !next_index_block(reader))
+        return false;
+    if (reader->done)
+        return true;
+    const uint8_t *record = reader->buffer + reader->start;
+    size_t left = reader->block_end - reader->start;
+    size_t name_len = left < INDEX_RECORD_SIZE
+                          ? 0
+                          : get_index_integer(record + 8 + MAX_DIGEST_LEN, 2);
+    if (left < INDEX_RECORD_SIZE || left - INDEX_RECORD_SIZE < name_len) {
+        fprintf(stderr, "Index %s is corrupt\n", reader->path);
+        return false;
+    }
+    uint64_t size = get_index_integer(record, 8);
+    if (reader->records > 0 &&
+        (size < reader->size ||
+         (size == reader->size &&
+          memcmp(record + 8, reader->digest, MAX_DIGEST_LEN) < 0))) {
+        fprintf(stderr, "Index %s is out of order\n", reader->path);
+        return false;
+    }
+    reader->size = size;
+    memcpy(reader->digest, record + 8, MAX_DIGEST_LEN);
+    reader->name = (const char *)record + INDEX_RECORD_SIZE;
+    reader->name_len = (uint16_t)name_len;
+    reader->start += INDEX_RECORD_SIZE + name_len;
+    reader->records++;
+    return true;
+}
+
+int open_index_reader(IndexReader *reader, const char *path) {
+    reader->path = path;
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+        fprintf(stderr, "Index: %s ", path);
+        perror("Failed to open index");
+        return -1;
+    }
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    reader->buffer = malloc(INDEX_READ_SIZE);
+    if (reader->buffer == NULL) {
+        perror("Failed to allocate memory for index");
+        return -1;
+    }
+    if (!fill_index_reader(reader, INDEX_HEADER_SIZE) ||
+        memcmp(reader->buffer, INDEX_MAGIC, 8) != 0 ||
+        get_index_integer(reader->buffer + 8, 4) != INDEX_VERSION) {
+        fprintf(stderr, "Not an index: %s\n", path);
+        return -1;
+    }
+    reader->start = reader->block_end = INDEX_HEADER_SIZE;
+    return advance_index_reader(reader) ? 0 : -1;
+}
+
+// Orders the current records by size, digest and path, then by index
+int compare_index_readers(const IndexReader *a, const IndexReader *b) {
+    if (a->size != b->size)
+        return a->size < b->size ? -1 : 1;
+    int order = memcmp(a->digest, b->digest, MAX_DIGEST_LEN);
+    if (order != 0)
+        return order;
+    uint16_t len = a->name_len < b->name_len ? a->name_len : b->name_len;
+    order = memcmp(a->name, b->name, len);
+    if (order != 0)
+        return order;
+    if (a->name_len != b->name_len)
+        return a->name_len < b->name_len ? -1 : 1;
+    return a < b ? -1 : a > b;
+}
+
+void sift_index_heap(IndexReader *readers, int *heap, int heap_size, int i) {
+    while (1) {
+        int first = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < heap_size && compare_index_readers(&readers[heap[left]],
+                                                      &readers[heap[first]]) <
+                                    0)
+            first = left;
+        if (right < heap_size &&
+            compare_index_readers(&readers[heap[right]],
+                                  &readers[heap[first]]) < 0)
+            first = right;
+        if (first == i)
+            return;
+        int reader = heap[i];
+        heap[i] = heap[first];
+        heap[first] = reader;
+        i = first;
+    }
+}
+
+// A group of files with the same size and digest, the names are copied as
+// the readers move on
+typedef struct {
+    uint64_t size;
+    uint8_t digest[MAX_DIGEST_LEN];
+    uint32_t num_files;
+    int first_reader; // reader of the first file, -1 for an empty group
+    bool cross_shard;
+} MergeGroup;
+
+void report_merge_group(const MergeGroup *group, MergeTotals *totals) {
+    if (group->num_files > 1) {
+        char hash_str[BLAKE3_OUT_LEN * 2 + 1];
+        hash_to_hex(group->digest, hash_str);
+        printf("Duplicate files found for hash %s:\n", hash_str);
+        for (size_t i = 0; i < group_names_used;) {
+            uint16_t len;
+            memcpy(&len, group_names + i, sizeof(len));
+            printf("  %.*s\n", (int)len, group_names + i + sizeof(len));
+            i += sizeof(len) + len;
+        }
+        totals->groups++;
+        totals->cross_shard_groups += group->cross_shard;
+        totals->duplicate_bytes += group->size * (group->num_files - 1);
+    }
+    group_names_used = 0;
+}
+
+// Copies the name of the current record of a reader into the group
+bool add_merge_name(const IndexReader *reader) {
+    size_t len = sizeof(uint16_t) + reader->name_len;
+    if (group_names_capacity - group_names_used < len) {
+        size_t capacity = group_names_capacity ? group_names_capacity : 4096;
+        while (capacity - group_names_used < len) {
+            capacity *= 2;
+        }
+        char *names = realloc(group_names, capacity);
+        if (names == NULL) {
+            perror("Failed to allocate memory for duplicate group");
+            return false;
+        }
+        group_names = names;
+        group_names_capacity = capacity;
+    }
+    memcpy(group_names + group_names_used, &reader->name_len,
+           sizeof(uint16_t));
+    memcpy(group_names + group_names_used + sizeof(uint16_t), reader->name,
+           reader->name_len);
+    group_names_used += len;
+    return true;
+}
+
+int merge_index_readers(IndexReader *readers, int num_readers, int *heap,
+                        MergeTotals *totals) {
+    int heap_size = 0;
+    for (int i = 0; i < num_readers; i++) {
+        if (!readers[i].done)
+            heap[heap_size++] = i;
+    }
+    for (int i = heap_size / 2 - 1; i >= 0; i--) {
+        sift_index_heap(readers, heap, heap_size, i);
+    }
+
+    MergeGroup group = {.first_reader = -1};
+    while (heap_size > 0) {
+        IndexReader *reader = &readers[heap[0]];
+        if (group.first_reader < 0 || reader->size != group.size ||
+            memcmp(reader->digest, group.digest, MAX_DIGEST_LEN) != 0) {
+            report_merge_group(&group, totals);
+            group.size = reader->size;
+            memcpy(group.digest, reader->digest, MAX_DIGEST_LEN);
+            group.num_files = 0;
+            group.first_reader = heap[0];
+            group.cross_shard = false;
+        }
+        if (!add_merge_name(reader))
+            return -1;
+        group.num_files++;
+        group.cross_shard |= heap[0] != group.first_reader;
+        totals->files++;
+
+        // The name is copied, the reader can move on
+        if (!advance_index_reader(reader))
+            return -1;
+        if (reader->done)
+            heap[0] = heap[--heap_size];
+        sift_index_heap(readers, heap, heap_size, 0);
+    }
+    report_merge_group(&group, totals);
+    return 0;
+}
+
+int merge_shard_indexes(char *const *paths, int num_paths,
+                        MergeTotals *totals) {
+    memset(totals, 0, sizeof(*totals));
+    IndexReader *readers = calloc(num_paths, sizeof(IndexReader));
+    int *heap = malloc(num_paths * sizeof(int));
+    if (readers == NULL || heap == NULL) {
+        perror("Failed to allocate memory for index merge");
+        free(readers);
+        free(heap);
+        return -1;
+    }
+    int result = 0, opened = 0;
+    for (; opened < num_paths && result == 0; opened++) {
+        if (open_index_reader(&readers[opened], paths[opened]) != 0)
+            result = -1;
+    }
+    if (result == 0)
+        result = merge_index_readers(readers, num_paths, heap, totals);
+    for (int i = 0; i < opened; i++) {
+        if (readers[i].fd >= 0)
+            close(readers[i].fd);
+        free(readers[i].buffer);
+    }
+    free(readers);
+    free(heap);
+    free(group_names);
+    group_names = NULL;
+    group_names_used = group_names_capacity = 0;
+    return result;
+}
@@ -0,0 +1,68 @@
+#ifndef SHARD_INDEX_H
+#define SHARD_INDEX_H
+
+#include "path_store.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lets several processes, on one host or many, each scan a part of a tree
+// and find the duplicates across all of them. A shard hashes every file in
+// full, as its size may collide with a file of another shard, and writes
+// the files as (size, digest, path) records sorted by size, digest and
+// path. The records are spilled while the scan runs and merged into the
+// index at the end, so a shard does not hold them in memory. The merge
+// mode reads any number of indexes side by side, a block at a time, and
+// reports the files whose size and digest match as they come past. It
+// only holds a block of every index and one group of duplicates.
+//
+// Records have no device or inode, as the shards may be scanned on other
+// hosts, where the same numbers stand for other files. A shard skips the
+// further names of a file it has seen, but the names of a file in two
+// shards are two records, so a hard link across shards is reported as a
+// copy and counted in duplicate_bytes.
+//
+// An index is little endian. It starts with the 8 bytes of INDEX_MAGIC and
+// u32 INDEX_VERSION and u32 0, followed by blocks of whole records:
+//   u32 length of the records, checksum[8] of them, records
+//   record: u64 size, digest[32], u16 length of the path, path
+// The last block has length 0 and is followed by the u64 number of records,
+// its checksum is that of these 8 bytes. Checksums are the first 8 bytes of
+// the fast hash of what they cover.
+
+#define INDEX_MAGIC "DDUPIDX1"
+#define INDEX_VERSION 1
+// Most bytes of records in one block
+#define INDEX_BLOCK_SIZE (64 * 1024)
+// Records of a shard kept in memory before they are spilled
+#define INDEX_SPILL_BUDGET (64 * 1024 * 1024)
+// Bytes read from one index at once by the merge
+#define INDEX_READ_SIZE (1024 * 1024)
+
+// What the merge found
+typedef struct {
+    uint64_t files;
+    uint64_t groups; // digests shared by more than one file
+    uint64_t cross_shard_groups; // of those, the ones in several indexes
+    uint64_t duplicate_bytes; // held by all but one file of every group
+} MergeTotals;
+
+// Function to start the index of a shard at path, before the walk. It is
+// written next to path and renamed over it once it is complete. Returns -1
+// on failure.
+int start_shard_index(const char *path);
+bool is_indexing();
+// Function to add a file hashed in full to the index, with its size as it
+// was hashed
+void add_index_file(const uint8_t *hash, uint64_t size, FilePath file);
+// Function to write the index once every file is added, returns -1 on
+// failure
+int write_shard_index(uint64_t *num_files);
+void free_shard_index();
+// Function to merge the indexes at paths and print the groups of
+// duplicates across all of them. Returns -1 if an index cannot be read, or
+// is truncated, corrupt or out of order.
+int merge_shard_indexes(char *const *paths, int num_paths,
+                        MergeTotals *totals);
+
+#endif // SHARD_INDEX_H
@@ -0,0 +1,70 @@
+#define _POSIX_C_SOURCE 200809L
+#include "size_table.h"
+#include "uthash.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+SizeGroup *sizes = NULL; // The size table
+pthread_mutex_t size_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to record a file size
+bool add_file_size(off_t size, FilePath file, dev_t dev, FilePath *held,
+                   dev_t *held_dev) {
+    pthread_mutex_lock(&size_mutex);
+    SizeGroup *group;
+    *held = NULL;
+
+    // Look for the size in the table
+    HASH_FIND(hh, sizes, &size, sizeof(off_t), group);
+
+    if (group == NULL) {
+        // First file of this size, keep its path until another one shows up
+        group = malloc(sizeof(SizeGroup));
+        if (group == NULL) {
+            perror("Failed to allocate memory for new size group");
+            pthread_mutex_unlock(&size_mutex);
+            return false;
+        }
+
+        group->size = size;
+        group->count = 1;
+        group->first = file;
+        group->first_dev = dev;
+        HASH_ADD(hh, sizes, size, sizeof(off_t), group);
+        pthread_mutex_unlock(&size_mutex);
+        return false;
+    }
+
+    if (group->count == 1) {
+        // The held back file becomes a candidate together with this one
+        *held = group->first;
+        *held_dev = group->first_dev;
+        group->first = NULL;
+    }
+    group->count++;
+    pthread_mutex_unlock(&size_mutex);
+    return true;
+}
+
+// Function to get the number of sizes shared by more than one file
+unsigned count_colliding_sizes() {
+    unsigned colliding = 0;
+    SizeGroup *current_group, *tmp;
+    HASH_ITER(hh, sizes, current_group, tmp) {
+        if (current_group->count > 1) {
+            colliding++;
+        }
+    }
+    return colliding;
+}
+
+// Function to free the size table
+void free_size_table() {
+    SizeGroup *current_group, *tmp;
+    HASH_ITER(hh, sizes, current_group, tmp) {
+        HASH_DEL(sizes, current_group);
+        free(current_group);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef SIZE_TABLE_H
+#define SIZE_TABLE_H
+
+#include "path_store.h"
+#include "uthash.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct {
+    off_t size; // Key
+    FilePath first; // The first file seen with this size
+    dev_t first_dev; // Device the first file lives on
+    unsigned count; // Number of files seen with this size
+    UT_hash_handle hh; // Makes this structure hashable
+} SizeGroup;
+
+// Function to record a file size, returns true if the size collides with
+// another file. On the first collision the earlier file and its device are
+// handed over in held and held_dev.
+bool add_file_size(off_t size, FilePath file, dev_t dev, FilePath *held,
+                   dev_t *held_dev);
+// Function to get the number of sizes shared by more than one file
+unsigned count_colliding_sizes();
+// Function to free the size table
+void free_size_table();
+
+#endif // SIZE_TABLE_H
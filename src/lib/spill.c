@@ -0,0 +1,463 @@
+#define _POSIX_C_SOURCE 200809L
+#include "spill.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// A record in the buffer and in a run is its payload length, its key and
+// its payload. Runs only live as long as the process, the length is in
+// native byte order.
+#define RECORD_HEADER_LEN (sizeof(uint16_t) + SPILL_KEY_LEN)
+
+// A run being read, one block at a time
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t start; // unread bytes are from start to end
+    size_t end;
+    off_t offset; // next byte of the file to read
+    const char *record; // current record, NULL once the run is read
+} RunReader;
+
+struct SpillMerge {
+    RunReader *readers;
+    int num_readers;
+    int *heap; // readers by the key of their current record
+    int heap_size;
+    int last; // reader of the record returned last, it moves on next time
+    bool failed;
+};
+
+// Bytes written to a run, sent to the file a block at a time
+typedef struct {
+    int fd;
+    char *block;
+    size_t used;
+    bool failed;
+} RunWriter;
+
+Spill *create_spill(size_t budget) {
+    Spill *spill = malloc(sizeof(Spill));
+    if (spill == NULL) {
+        perror("Failed to allocate memory for spill");
+        return NULL;
+    }
+    // Half for the buffer that fills, half for the run being written. The
+    // pointers at the end of a buffer need their alignment.
+    budget /= 2;
+    budget -= budget % sizeof(char *);
+    spill->buffer = malloc(budget);
+    spill->spare = malloc(budget);
+    spill->block = malloc(SPILL_WRITE_SIZE);
+    if (spill->buffer == NULL || spill->spare == NULL ||
+        spill->block == NULL) {
+        perror("Failed to allocate memory for spill buffer");
+        free(spill->buffer);
+        free(spill->spare);
+        free(spill->block);
+        free(spill);
+        return NULL;
+    }
+    pthread_mutex_init(&spill->mutex, NULL);
+    pthread_cond_init(&spill->written, NULL);
+    spill->budget = budget;
+    spill->used = 0;
+    spill->num_records = 0;
+    spill->writing = false;
+    spill->num_runs = 0;
+    spill->num_spilled = 0;
+    spill->failed = false;
+    return spill;
+}
+
+// Pointers to the records grow down from the end of a buffer
+char **get_record_index(char *buffer, size_t budget, size_t num_records) {
+    return (char **)(buffer + budget) - num_records;
+}
+
+uint16_t get_payload_len(const char *record) {
+    uint16_t len;
+    memcpy(&len, record, sizeof(len));
+    return len;
+}
+
+int compare_records(const void *a, const void *b) {
+    const char *x = *(const char *const *)a, *y = *(const char *const *)b;
+    return memcmp(x + sizeof(uint16_t), y + sizeof(uint16_t), SPILL_KEY_LEN);
+}
+
+// The file is unlinked right away, it goes away with its descriptor
+int create_run_file() {
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/dedup-spill-XXXXXX",
+             dir != NULL && dir[0] != '\0' ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("Failed to create spill file");
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+void flush_run(RunWriter *writer) {
+    const char *data = writer->block;
+    size_t len = writer->used;
+    while (len > 0 && !writer->failed) {
+        ssize_t n = write(writer->fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("Failed to write spill file");
+            writer->failed = true;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    writer->used = 0;
+}
+
+void write_run(RunWriter *writer, const char *data, size_t len) {
+    while (len > 0) {
+        size_t n = SPILL_WRITE_SIZE - writer->used < len
+                       ? SPILL_WRITE_SIZE - writer->used
+                       : len;
+        memcpy(writer->block + writer->used, data, n);
+        writer->used += n;
+        data += n;
+        len -= n;
+        if (writer->used == SPILL_WRITE_SIZE)
+            flush_run(writer);
+    }
+}
+
+// Sorts the records of a full buffer and writes them to a new run, returns
+// its file or -1
+int write_spill_run(Spill *spill, char *buffer, size_t num_records) {
+    int fd = create_run_file();
+    if (fd < 0)
+        return -1;
+    char **index = get_record_index(buffer, spill->budget, num_records);
+    qsort(index, num_records, sizeof(char *), compare_records);
+    RunWriter writer = {fd, spill->block, 0, false};
+    for (size_t i = 0; i < num_records; i++) {
+        write_run(&writer, index[i],
+                  RECORD_HEADER_LEN + get_payload_len(index[i]));
+    }
+    flush_run(&writer);
+    if (writer.failed) {
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return fd;
+}
+
+// Swaps in the spare half and writes the full one as a run. The caller
+// holds the mutex, which is dropped while the run is written, and no other
+// run is being written.
+int spill_buffer(Spill *spill) {
+    if (spill->num_runs == SPILL_MAX_RUNS) {
+        fprintf(stderr, "Too many spill runs, the memory budget is too small\n");
+        spill->failed = true;
+        return -1;
+    }
+    char *full = spill->buffer;
+    size_t num_records = spill->num_records;
+    spill->buffer = spill->spare;
+    spill->spare = full;
+    spill->used = 0;
+    spill->num_records = 0;
+    // The slot keeps the runs in the order they were spilled
+    int run = spill->num_runs++;
+    spill->runs[run] = -1;
+    spill->writing = true;
+    pthread_mutex_unlock(&spill->mutex);
+
+    uint64_t start = get_time_ns();
+    int fd = write_spill_run(spill, full, num_records);
+    add_stage_time(STAGE_SPILL, start);
+
+    lock_counting_wait(&spill->mutex);
+    spill->runs[run] = fd;
+    if (fd < 0)
+        spill->failed = true;
+    else
+        spill->num_spilled += num_records;
+    spill->writing = false;
+    pthread_cond_broadcast(&spill->written);
+    return fd < 0 ? -1 : 0;
+}
+
+// Waits for the run being written, adding the time to STAGE_LOCK. The
+// caller holds the mutex.
+void wait_for_spill_run(Spill *spill) {
+    uint64_t start = get_time_ns();
+    while (spill->writing) {
+        pthread_cond_wait(&spill->written, &spill->mutex);
+    }
+    add_stage_time(STAGE_LOCK, start);
+}
+
+int add_spill_record(Spill *spill, const uint8_t *key, const void *payload,
+                     uint16_t payload_len) {
+    size_t len = RECORD_HEADER_LEN + payload_len;
+    lock_counting_wait(&spill->mutex);
+    // Other threads may fill the buffer again while a run is written
+    while (!spill->failed &&
+           spill->used + len + (spill->num_records + 1) * sizeof(char *) >
+               spill->budget) {
+        if (spill->num_records == 0) {
+            fprintf(stderr, "Spill record does not fit the memory budget\n");
+            spill->failed = true;
+        } else if (spill->writing) {
+            wait_for_spill_run(spill);
+        } else {
+            spill_buffer(spill);
+        }
+    }
+    if (spill->failed) {
+        pthread_mutex_unlock(&spill->mutex);
+        return -1;
+    }
+    char *record = spill->buffer + spill->used;
+    memcpy(record, &payload_len, sizeof(payload_len));
+    memcpy(record + sizeof(payload_len), key, SPILL_KEY_LEN);
+    memcpy(record + RECORD_HEADER_LEN, payload, payload_len);
+    spill->used += len;
+    spill->num_records++;
+    get_record_index(spill->buffer, spill->budget, spill->num_records)[0] =
+        record;
+    pthread_mutex_unlock(&spill->mutex);
+    return 0;
+}
+
+// Moves the unread bytes to the front and reads the next block behind them,
+// returns the bytes read
+ssize_t refill_reader(RunReader *reader) {
+    memmove(reader->buffer, reader->buffer + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+    ssize_t n;
+    do {
+        n = pread(reader->fd, reader->buffer + reader->end,
+                  reader->size - reader->end, reader->offset);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        reader->offset += n;
+        reader->end += n;
+    }
+    return n;
+}
+
+// Steps to the next record of the run, returns false if it cannot be read
+bool advance_reader(RunReader *reader) {
+    reader->record = NULL;
+    if (reader->end - reader->start < RECORD_HEADER_LEN &&
+        refill_reader(reader) < 0)
+        return false;
+    if (reader->end == reader->start)
+        return true;
+    if (reader->end - reader->start < RECORD_HEADER_LEN)
+        return false;
+    size_t len =
+        RECORD_HEADER_LEN + get_payload_len(reader->buffer + reader->start);
+    if (reader->end - reader->start < len &&
+        (refill_reader(reader) < 0 || reader->end - reader->start < len))
+        return false;
+    reader->record = reader->buffer + reader->start;
+    reader->start += len;
+    return true;
+}
+
+// Earlier runs first among equal keys, so records keep the order they
+// were spilled in
+bool is_before(SpillMerge *merge, int a, int b) {
+    int order = memcmp(merge->readers[a].record + sizeof(uint16_t),
+                       merge->readers[b].record + sizeof(uint16_t),
+                       SPILL_KEY_LEN);
+    return order < 0 || (order == 0 && a < b);
+}
+
+void sift_down(SpillMerge *merge, int i) {
+    while (1) {
+        int first = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < merge->heap_size &&
+            is_before(merge, merge->heap[left], merge->heap[first]))
+            first = left;
+        if (right < merge->heap_size &&
+            is_before(merge, merge->heap[right], merge->heap[first]))
+            first = right;
+        if (first == i)
+            return;
+        int reader = merge->heap[i];
+        merge->heap[i] = merge->heap[first];
+        merge->heap[first] = reader;
+        i = first;
+    }
+}
+
+SpillMerge *merge_runs(const int *runs, int num_runs, size_t read_size) {
+    SpillMerge *merge = calloc(1, sizeof(SpillMerge));
+    if (merge == NULL) {
+        perror("Failed to allocate memory for spill merge");
+        return NULL;
+    }
+    merge->readers = calloc(num_runs > 0 ? num_runs : 1, sizeof(RunReader));
+    merge->heap = malloc((num_runs > 0 ? num_runs : 1) * sizeof(int));
+    merge->last = -1;
+    if (merge->readers == NULL || merge->heap == NULL) {
+        perror("Failed to allocate memory for spill merge");
+        close_spill_merge(merge);
+        return NULL;
+    }
+    for (int i = 0; i < num_runs; i++) {
+        RunReader *reader = &merge->readers[i];
+        reader->fd = runs[i];
+        reader->size = read_size;
+        reader->buffer = malloc(read_size);
+        merge->num_readers++;
+        if (reader->buffer == NULL) {
+            perror("Failed to allocate memory for spill merge");
+            close_spill_merge(merge);
+            return NULL;
+        }
+        if (!advance_reader(reader)) {
+            perror("Failed to read spill file");
+            close_spill_merge(merge);
+            return NULL;
+        }
+        if (reader->record != NULL)
+            merge->heap[merge->heap_size++] = i;
+    }
+    for (int i = merge->heap_size / 2 - 1; i >= 0; i--) {
+        sift_down(merge, i);
+    }
+    return merge;
+}
+
+bool next_spill_record(SpillMerge *merge, SpillRecord *record) {
+    if (merge->last >= 0) {
+        // The record returned last is done with, its run moves on
+        RunReader *reader = &merge->readers[merge->last];
+        if (!advance_reader(reader)) {
+            perror("Failed to read spill file");
+            merge->failed = true;
+        }
+        if (reader->record == NULL)
+            merge->heap[0] = merge->heap[--merge->heap_size];
+        sift_down(merge, 0);
+        merge->last = -1;
+    }
+    if (merge->heap_size == 0)
+        return false;
+    merge->last = merge->heap[0];
+    const char *next = merge->readers[merge->last].record;
+    record->payload_len = get_payload_len(next);
+    record->key = (const uint8_t *)next + sizeof(uint16_t);
+    record->payload = (const uint8_t *)next + RECORD_HEADER_LEN;
+    return true;
+}
+
+bool spill_merge_failed(SpillMerge *merge) { return merge->failed; }
+
+// The runs belong to the spill, they stay open
+void close_spill_merge(SpillMerge *merge) {
+    for (int i = 0; i < merge->num_readers; i++) {
+        free(merge->readers[i].buffer);
+    }
+    free(merge->readers);
+    free(merge->heap);
+    free(merge);
+}
+
+// Merges the oldest runs into one, until all runs can be merged at once.
+// The merged run takes their place, so records of equal keys keep the
+// order they were spilled in.
+int reduce_runs(Spill *spill, int fan_in) {
+    while (spill->num_runs > fan_in) {
+        uint64_t start = get_time_ns();
+        int fd = create_run_file();
+        if (fd < 0)
+            return -1;
+        SpillMerge *merge =
+            merge_runs(spill->runs, fan_in, SPILL_MIN_READ_SIZE);
+        if (merge == NULL) {
+            close(fd);
+            return -1;
+        }
+        RunWriter writer = {fd, spill->block, 0, false};
+        SpillRecord record;
+        while (next_spill_record(merge, &record)) {
+            write_run(&writer, (const char *)record.key - sizeof(uint16_t),
+                      RECORD_HEADER_LEN + record.payload_len);
+        }
+        flush_run(&writer);
+        bool failed = writer.failed || spill_merge_failed(merge);
+        close_spill_merge(merge);
+        if (failed) {
+            close(fd);
+            return -1;
+        }
+        for (int i = 0; i < fan_in; i++) {
+            close(spill->runs[i]);
+        }
+        spill->runs[0] = fd;
+        memmove(spill->runs + 1, spill->runs + fan_in,
+                (spill->num_runs - fan_in) * sizeof(int));
+        spill->num_runs -= fan_in - 1;
+        add_stage_time(STAGE_SPILL, start);
+    }
+    return 0;
+}
+
+SpillMerge *open_spill_merge(Spill *spill, size_t read_budget) {
+    // Every record is added, so no run is being written
+    pthread_mutex_lock(&spill->mutex);
+    bool failed = spill->failed ||
+                  (spill->num_records > 0 && spill_buffer(spill) != 0);
+    pthread_mutex_unlock(&spill->mutex);
+    if (failed)
+        return NULL;
+    // The records are all in runs now, the merge gets their memory
+    free(spill->buffer);
+    free(spill->spare);
+    spill->buffer = NULL;
+    spill->spare = NULL;
+    spill->budget = 0;
+
+    int fan_in = (int)(read_budget / SPILL_MIN_READ_SIZE);
+    if (fan_in < 2)
+        fan_in = 2;
+    if (reduce_runs(spill, fan_in) != 0) {
+        spill->failed = true;
+        return NULL;
+    }
+    size_t read_size =
+        spill->num_runs > 0 ? read_budget / spill->num_runs : read_budget;
+    if (read_size < SPILL_MIN_READ_SIZE)
+        read_size = SPILL_MIN_READ_SIZE;
+    return merge_runs(spill->runs, spill->num_runs, read_size);
+}
+
+void destroy_spill(Spill *spill) {
+    for (int i = 0; i < spill->num_runs; i++) {
+        if (spill->runs[i] >= 0)
+            close(spill->runs[i]);
+    }
+    pthread_mutex_destroy(&spill->mutex);
+    pthread_cond_destroy(&spill->written);
+    free(spill->buffer);
+    free(spill->spare);
+    free(spill->block);
+    free(spill);
+}
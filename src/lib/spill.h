@@ -0,0 +1,73 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Records that do not have to fit in memory. They are collected in a
+// buffer of half a fixed budget, which is sorted and written to a temporary
+// file as a run whenever it is full. The thread that fills it swaps in the
+// other half and writes the run outside the mutex, so the other threads go
+// on adding records meanwhile. The runs are read back in key order with a
+// multi-way merge, several passes of it if there are more runs than readers
+// fit in the budget. Runs are written and read in large sequential blocks,
+// and their files are unlinked right away so nothing is left behind.
+//
+// A record is a key of SPILL_KEY_LEN bytes, compared with memcmp, and a
+// payload of up to UINT16_MAX bytes. Integers in a key are big endian so
+// they sort by value.
+
+#define SPILL_KEY_LEN 32
+// Bytes written to a run at once
+#define SPILL_WRITE_SIZE (1024 * 1024)
+// Smallest buffer of a run being merged, more than the largest record
+#define SPILL_MIN_READ_SIZE (128 * 1024)
+#define SPILL_MAX_RUNS 4096
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t written; // signalled when a run is written
+    char *buffer; // records, their pointers are kept at the end
+    char *spare; // the other half, written as a run while buffer fills
+    size_t budget; // of each half
+    size_t used;
+    size_t num_records;
+    bool writing; // spare is being written, only one run is at a time
+    char *block; // SPILL_WRITE_SIZE bytes for writing a run
+    int runs[SPILL_MAX_RUNS]; // unlinked files, one run each
+    int num_runs;
+    uint64_t num_spilled; // records written to runs
+    bool failed;
+} Spill;
+
+// A record as the merge returns it, valid until the next one is taken
+typedef struct {
+    const uint8_t *key;
+    const uint8_t *payload;
+    uint16_t payload_len;
+} SpillRecord;
+
+typedef struct SpillMerge SpillMerge;
+
+// Function to create a spill that keeps budget bytes of records in memory,
+// NULL on failure. Runs go to TMPDIR, or /tmp without it.
+Spill *create_spill(size_t budget);
+// Function to add a record from any thread, returns -1 if a run cannot be
+// written
+int add_spill_record(Spill *spill, const uint8_t *key, const void *payload,
+                     uint16_t payload_len);
+// Function to start reading the records in key order once every record is
+// added. The readers of the runs share read_budget bytes. Returns NULL on
+// failure.
+SpillMerge *open_spill_merge(Spill *spill, size_t read_budget);
+// Function to take the next record, returns false at the end
+bool next_spill_record(SpillMerge *merge, SpillRecord *record);
+// Function to check whether a run could not be read
+bool spill_merge_failed(SpillMerge *merge);
+void close_spill_merge(SpillMerge *merge);
+// Function to free the spill and close its runs
+void destroy_spill(Spill *spill);
+
+#endif // SPILL_H
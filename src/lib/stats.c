@@ -0,0 +1,235 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+ThreadStats thread_stats[MAX_STATS_THREADS];
+atomic_int num_stats_threads = 0;
+_Thread_local ThreadStats *own_stats = NULL;
+
+// Slot of the calling thread, claimed the first time it counts anything
+ThreadStats *get_own_stats() {
+    if (own_stats == NULL) {
+        int index = atomic_fetch_add(&num_stats_threads, 1);
+        own_stats = &thread_stats[index < MAX_STATS_THREADS
+                                      ? index
+                                      : MAX_STATS_THREADS - 1];
+    }
+    return own_stats;
+}
+
+// Only the owner adds to a slot unless threads share the last one, so the
+// add is never contended
+void add_counter(atomic_uint_fast64_t *counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+uint64_t read_counter(atomic_uint_fast64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+uint64_t get_time_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+void set_thread_role(const char *role) {
+    atomic_store_explicit(&get_own_stats()->role, role, memory_order_relaxed);
+}
+
+int get_latency_bucket(uint64_t nanoseconds) {
+    uint64_t microseconds = nanoseconds / 1000;
+    int bucket = 0;
+    while (microseconds > 0 && bucket < LATENCY_BUCKETS - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void add_hashed_stage(uint64_t bytes) {
+    ThreadStats *stats = get_own_stats();
+    add_counter(&stats->stages, 1);
+    add_counter(&stats->bytes, bytes);
+}
+
+void add_hashed_file(uint64_t start) {
+    ThreadStats *stats = get_own_stats();
+    add_counter(&stats->files, 1);
+    add_counter(&stats->latencies[get_latency_bucket(get_time_ns() - start)],
+                1);
+}
+
+uint64_t get_thread_bytes() {
+    return read_counter(&get_own_stats()->bytes);
+}
+
+void add_error() {
+    add_counter(&get_own_stats()->errors, 1);
+}
+
+void add_stage_time(PipelineStage stage, uint64_t start) {
+    add_counter(&get_own_stats()->times[stage], get_time_ns() - start);
+}
+
+uint64_t get_nested_time() {
+    ThreadStats *stats = get_own_stats();
+    return read_counter(&stats->times[STAGE_LOCK]) +
+           read_counter(&stats->times[STAGE_SPILL]);
+}
+
+void add_outer_stage_time(PipelineStage stage, uint64_t start,
+                          uint64_t nested) {
+    add_stage_time(stage, start + (get_nested_time() - nested));
+}
+
+void lock_counting_wait(pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) == 0)
+        return;
+    uint64_t start = get_time_ns();
+    pthread_mutex_lock(mutex);
+    add_stage_time(STAGE_LOCK, start);
+}
+
+void add_queue_occupancy(int used, int size) {
+    int bucket = size > 0 ? (int)((int64_t)used * OCCUPANCY_BUCKETS / size) : 0;
+    if (bucket >= OCCUPANCY_BUCKETS)
+        bucket = OCCUPANCY_BUCKETS - 1;
+    add_counter(&get_own_stats()->occupancy[bucket], 1);
+}
+
+int count_stats_threads() {
+    int count = atomic_load(&num_stats_threads);
+    return count < MAX_STATS_THREADS ? count : MAX_STATS_THREADS;
+}
+
+void add_slot(StatsTotals *totals, ThreadStats *stats) {
+    totals->files += read_counter(&stats->files);
+    totals->stages += read_counter(&stats->stages);
+    totals->bytes += read_counter(&stats->bytes);
+    totals->errors += read_counter(&stats->errors);
+    for (int i = 0; i < NUM_STAGES; i++) {
+        totals->times[i] += read_counter(&stats->times[i]);
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        totals->latencies[i] += read_counter(&stats->latencies[i]);
+    }
+    for (int i = 0; i < OCCUPANCY_BUCKETS; i++) {
+        totals->occupancy[i] += read_counter(&stats->occupancy[i]);
+    }
+}
+
+void sum_stats(StatsTotals *totals) {
+    memset(totals, 0, sizeof(*totals));
+    int count = count_stats_threads();
+    for (int i = 0; i < count; i++) {
+        add_slot(totals, &thread_stats[i]);
+    }
+}
+
+uint64_t get_stage_time(PipelineStage stage) {
+    uint64_t time = 0;
+    int count = count_stats_threads();
+    for (int i = 0; i < count; i++) {
+        time += read_counter(&thread_stats[i].times[stage]);
+    }
+    return time;
+}
+
+const char *get_stage_name(PipelineStage stage) {
+    static const char *names[NUM_STAGES] = {"walk",  "queue", "wait",
+                                            "hash",  "index", "lock",
+                                            "verify", "action", "spill"};
+    return names[stage];
+}
+
+void print_stage_times() {
+    for (int i = 0; i < NUM_STAGES; i++) {
+        printf("Time in %s: %.6f s\n", get_stage_name(i),
+               get_stage_time(i) / 1e9);
+    }
+}
+
+// Smallest latency in microseconds that falls into the bucket
+uint64_t get_bucket_start(int bucket) {
+    return bucket == 0 ? 0 : (uint64_t)1 << (bucket - 1);
+}
+
+// Latency in microseconds below which the given share of the files were
+// hashed, to the bucket. 0 if no file was hashed.
+uint64_t get_latency_percentile(const StatsTotals *totals, double share) {
+    if (totals->files == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(totals->files * share);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += totals->latencies[i];
+        if (seen > rank)
+            return (uint64_t)1 << i;
+    }
+    return (uint64_t)1 << (LATENCY_BUCKETS - 1);
+}
+
+void write_counters_json(FILE *file, const StatsTotals *totals) {
+    fprintf(file,
+            "\"files\": %llu, \"stages\": %llu, \"bytes\": %llu, "
+            "\"errors\": %llu",
+            (unsigned long long)totals->files,
+            (unsigned long long)totals->stages,
+            (unsigned long long)totals->bytes,
+            (unsigned long long)totals->errors);
+}
+
+void write_stats_json(FILE *file) {
+    StatsTotals totals;
+    sum_stats(&totals);
+    fprintf(file, "  \"hashed\": {");
+    write_counters_json(file, &totals);
+    fprintf(file, "},\n  \"time_s\": {");
+    for (int i = 0; i < NUM_STAGES; i++) {
+        fprintf(file, "%s\"%s\": %.6f", i ? ", " : "", get_stage_name(i),
+                totals.times[i] / 1e9);
+    }
+
+    fprintf(file, "},\n  \"hash_latency_us\": {\"p50\": %llu, \"p90\": %llu, "
+                  "\"p99\": %llu, \"buckets\": [",
+            (unsigned long long)get_latency_percentile(&totals, 0.5),
+            (unsigned long long)get_latency_percentile(&totals, 0.9),
+            (unsigned long long)get_latency_percentile(&totals, 0.99));
+    bool first = true;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (totals.latencies[i] == 0)
+            continue;
+        fprintf(file, "%s{\"from\": %llu, \"count\": %llu}", first ? "" : ", ",
+                (unsigned long long)get_bucket_start(i),
+                (unsigned long long)totals.latencies[i]);
+        first = false;
+    }
+
+    fprintf(file, "]},\n  \"queue_occupancy\": [");
+    for (int i = 0; i < OCCUPANCY_BUCKETS; i++) {
+        fprintf(file, "%s%llu", i ? ", " : "",
+                (unsigned long long)totals.occupancy[i]);
+    }
+
+    fprintf(file, "],\n  \"threads\": [");
+    int count = count_stats_threads();
+    for (int i = 0; i < count; i++) {
+        StatsTotals thread;
+        memset(&thread, 0, sizeof(thread));
+        add_slot(&thread, &thread_stats[i]);
+        const char *role =
+            atomic_load_explicit(&thread_stats[i].role, memory_order_relaxed);
+        fprintf(file, "%s\n    {\"role\": \"%s\", ", i ? "," : "",
+                role != NULL ? role : "other");
+        write_counters_json(file, &thread);
+        fprintf(file, ", \"busy_s\": %.6f}",
+                (thread.times[STAGE_HASH] + thread.times[STAGE_INDEX] +
+                 thread.times[STAGE_VERIFY] + thread.times[STAGE_ACTION] +
+                 thread.times[STAGE_SPILL]) /
+                    1e9);
+    }
+    fprintf(file, "\n  ]\n");
+}
@@ -0,0 +1,97 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "../shared/consts.h"
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters of the pipeline. Every thread counts into a slot of its own, on
+// cache lines of its own, and the slots are only added up when the numbers
+// are read. Threads beyond MAX_STATS_THREADS share the last slot.
+
+#define MAX_STATS_THREADS 512
+// Hash latencies in powers of two microseconds, the last one is open ended
+#define LATENCY_BUCKETS 32
+// Fill of the device queues in tenths, as seen after a write
+#define OCCUPANCY_BUCKETS 10
+
+// Time spent in each part of the pipeline. The walk is wall time, the others
+// add up the time of all threads in them, so they can exceed it. Waits for
+// locks and spills are left out of the stages they happen in, so no time is
+// counted twice.
+typedef enum {
+    STAGE_WALK, // walking the tree
+    STAGE_QUEUE, // walkers waiting for room in the device queues
+    STAGE_WAIT, // workers waiting for files in the device queues
+    STAGE_HASH, // workers reading and hashing files
+    STAGE_INDEX, // workers adding digests to the indexes
+    STAGE_LOCK, // workers waiting for a shard of the indexes
+    STAGE_VERIFY, // workers comparing duplicates byte for byte
+    STAGE_ACTION, // workers sharing the data of duplicates
+    STAGE_SPILL, // sorting, writing and merging runs of spilled records
+    NUM_STAGES
+} PipelineStage;
+
+typedef struct {
+    alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t files; // files hashed
+    atomic_uint_fast64_t stages; // stages read to hash them
+    atomic_uint_fast64_t bytes; // bytes read for those stages
+    atomic_uint_fast64_t errors; // files that could not be read
+    atomic_uint_fast64_t times[NUM_STAGES]; // nanoseconds
+    atomic_uint_fast64_t latencies[LATENCY_BUCKETS];
+    atomic_uint_fast64_t occupancy[OCCUPANCY_BUCKETS];
+    _Atomic(const char *) role; // what the thread does, NULL until set
+} ThreadStats;
+
+// The slots added up
+typedef struct {
+    uint64_t files;
+    uint64_t stages;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t times[NUM_STAGES];
+    uint64_t latencies[LATENCY_BUCKETS];
+    uint64_t occupancy[OCCUPANCY_BUCKETS];
+} StatsTotals;
+
+// Function to get a monotonic time stamp in nanoseconds
+uint64_t get_time_ns();
+// Function to name what the calling thread does in the report
+void set_thread_role(const char *role);
+// Function to count a stage of a file that was read
+void add_hashed_stage(uint64_t bytes);
+// Function to count a file that is done with its stages, taken at start
+void add_hashed_file(uint64_t start);
+// Function to get the bytes the calling thread has read so far
+uint64_t get_thread_bytes();
+// Function to count a file that could not be read
+void add_error();
+// Function to add the time since start to a stage
+void add_stage_time(PipelineStage stage, uint64_t start);
+// Function to get the time the calling thread spent waiting for locks and
+// spilling so far
+uint64_t get_nested_time();
+// Function to add the time since start to a stage, less the time spent
+// waiting for locks and spilling since get_nested_time returned nested
+void add_outer_stage_time(PipelineStage stage, uint64_t start,
+                          uint64_t nested);
+// Function to take a mutex, adding the time spent waiting for it to
+// STAGE_LOCK
+void lock_counting_wait(pthread_mutex_t *mutex);
+// Function to count how full a device queue is
+void add_queue_occupancy(int used, int size);
+// Function to add up the slots of all threads
+void sum_stats(StatsTotals *totals);
+// Function to get the time of a stage in nanoseconds
+uint64_t get_stage_time(PipelineStage stage);
+// Function to get the name of a stage
+const char *get_stage_name(PipelineStage stage);
+// Function to print the time of every stage
+void print_stage_times();
+// Function to write the counters as members of a JSON object
+void write_stats_json(FILE *file);
+
+#endif // STATS_H
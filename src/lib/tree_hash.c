@@ -0,0 +1,349 @@
+#define _POSIX_C_SOURCE 200809L
+#include "tree_hash.h"
+#include "blake3_impl.h"
+#include "reader.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Chunks hashed with one call, so blake3_hash_many can use its SIMD lanes
+#define CHUNK_BATCH 64
+// Deep enough for 2^64 subtrees
+#define MAX_TREE_DEPTH 64
+
+// A tree node that is not compressed yet, it only becomes a chaining value
+// or, with the ROOT flag, the hash of the file once we know which it is
+typedef struct {
+    uint32_t cv[8];
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint64_t counter;
+    uint8_t flags;
+} TreeNode;
+
+// A large file open for helpers. The subtrees are claimed and reported
+// under tree_mutex, so the owner can free the job once all are done.
+typedef struct TreeHashJob {
+    int fd;
+    const uint8_t *data; // the file in memory, NULL to pread it from fd
+    size_t subtree_size;
+    size_t num_subtrees;
+    size_t next; // next subtree to claim
+    size_t done;
+    bool failed;
+    uint8_t *cvs; // chaining value of every subtree
+    struct TreeHashJob *next_job;
+} TreeHashJob;
+
+pthread_mutex_t tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tree_cond = PTHREAD_COND_INITIALIZER;
+TreeHashJob *open_jobs = NULL;
+// Workers still hashing files of their own
+int hashing_workers = 0;
+
+void init_tree_hashing(int num_workers) {
+    pthread_mutex_lock(&tree_mutex);
+    hashing_workers = num_workers;
+    pthread_mutex_unlock(&tree_mutex);
+}
+
+void hash_chunks(const uint8_t *input, size_t num_chunks, uint64_t counter,
+                 uint8_t *cvs) {
+    const uint8_t *chunks[CHUNK_BATCH];
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks[i] = input + i * BLAKE3_CHUNK_LEN;
+    }
+    blake3_hash_many(chunks, num_chunks, BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN,
+                     IV, counter, true, 0, CHUNK_START, CHUNK_END, cvs);
+}
+
+void hash_parents(const uint8_t *cvs, size_t num_parents, uint8_t *parents) {
+    const uint8_t *children[CHUNK_BATCH];
+    for (size_t i = 0; i < num_parents; i++) {
+        children[i] = cvs + i * BLAKE3_BLOCK_LEN;
+    }
+    blake3_hash_many(children, num_parents, 1, IV, 0, false, PARENT, 0, 0,
+                     parents);
+}
+
+// Merges the chaining values of two siblings into their parent's
+void merge_cvs(const uint8_t *left, const uint8_t *right, uint8_t *parent) {
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    memcpy(block, left, BLAKE3_OUT_LEN);
+    memcpy(block + BLAKE3_OUT_LEN, right, BLAKE3_OUT_LEN);
+    hash_parents(block, 1, parent);
+}
+
+// Chaining value of a complete subtree, num_chunks is a power of two. The
+// chunks are hashed in batches whose chaining values are merged like
+// blake3_hasher does, so this needs no memory beyond a few stacks.
+void hash_subtree(const uint8_t *input, size_t num_chunks, uint64_t counter,
+                  uint8_t *cv) {
+    uint8_t stack[MAX_TREE_DEPTH][BLAKE3_OUT_LEN];
+    size_t depth = 0;
+    size_t batch = num_chunks < CHUNK_BATCH ? num_chunks : CHUNK_BATCH;
+    uint8_t cvs[CHUNK_BATCH * BLAKE3_OUT_LEN];
+    for (size_t i = 0; i < num_chunks / batch; i++) {
+        hash_chunks(input + i * batch * BLAKE3_CHUNK_LEN, batch,
+                    counter + i * batch, cvs);
+        for (size_t n = batch; n > 1; n /= 2) {
+            uint8_t parents[CHUNK_BATCH / 2 * BLAKE3_OUT_LEN];
+            hash_parents(cvs, n / 2, parents);
+            memcpy(cvs, parents, n / 2 * BLAKE3_OUT_LEN);
+        }
+        // Every second batch completes a pair with the one on the stack
+        memcpy(stack[depth], cvs, BLAKE3_OUT_LEN);
+        for (size_t total = i + 1; (total & 1) == 0; total >>= 1) {
+            depth--;
+            merge_cvs(stack[depth], stack[depth + 1], stack[depth]);
+        }
+        depth++;
+    }
+    memcpy(cv, stack[0], BLAKE3_OUT_LEN);
+}
+
+void node_cv(const TreeNode *node, uint8_t *cv) {
+    uint32_t words[8];
+    memcpy(words, node->cv, sizeof(words));
+    blake3_compress_in_place(words, node->block, node->block_len,
+                             node->counter, node->flags);
+    store_cv_words(cv, words);
+}
+
+void parent_node(const uint8_t *left, const uint8_t *right, TreeNode *node) {
+    memcpy(node->cv, IV, sizeof(node->cv));
+    memcpy(node->block, left, BLAKE3_OUT_LEN);
+    memcpy(node->block + BLAKE3_OUT_LEN, right, BLAKE3_OUT_LEN);
+    node->block_len = BLAKE3_BLOCK_LEN;
+    node->counter = 0;
+    node->flags = PARENT;
+}
+
+// Last block of a chunk of up to BLAKE3_CHUNK_LEN bytes
+void chunk_node(const uint8_t *input, size_t len, uint64_t counter,
+                TreeNode *node) {
+    memcpy(node->cv, IV, sizeof(node->cv));
+    uint8_t flags = CHUNK_START;
+    while (len > BLAKE3_BLOCK_LEN) {
+        blake3_compress_in_place(node->cv, input, BLAKE3_BLOCK_LEN, counter,
+                                 flags);
+        input += BLAKE3_BLOCK_LEN;
+        len -= BLAKE3_BLOCK_LEN;
+        flags = 0;
+    }
+    memset(node->block, 0, sizeof(node->block));
+    memcpy(node->block, input, len);
+    node->block_len = (uint8_t)len;
+    node->counter = counter;
+    node->flags = flags | CHUNK_END;
+}
+
+// Top node of the tree over the input, which is not empty. As in the
+// BLAKE3 spec, the left subtree holds the largest power of two chunks that
+// leaves at least one byte for the right one.
+void hash_region(const uint8_t *input, size_t len, uint64_t counter,
+                 TreeNode *node) {
+    if (len <= BLAKE3_CHUNK_LEN) {
+        chunk_node(input, len, counter, node);
+        return;
+    }
+    size_t num_chunks = (len + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+    size_t left_chunks = 1;
+    while (left_chunks * 2 < num_chunks) {
+        left_chunks *= 2;
+    }
+    size_t left_len = left_chunks * BLAKE3_CHUNK_LEN;
+
+    uint8_t left[BLAKE3_OUT_LEN], right[BLAKE3_OUT_LEN];
+    hash_subtree(input, left_chunks, counter, left);
+    hash_region(input + left_len, len - left_len, counter + left_chunks, node);
+    node_cv(node, right);
+    parent_node(left, right, node);
+}
+
+// Fills buffer with len bytes of the file at offset
+int read_region(int fd, uint8_t *buffer, size_t len, off_t offset) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = pread(fd, buffer + total, len - total, offset + total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            // The file shrank or cannot be read
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+// Hashes a claimed subtree of the job, buffer holds a subtree if the file
+// is not in memory
+void hash_job_subtree(TreeHashJob *job, size_t index, uint8_t *buffer) {
+    off_t offset = (off_t)(index * job->subtree_size);
+    const uint8_t *input = buffer;
+    bool failed = false;
+    if (job->data != NULL) {
+        input = job->data + offset;
+    } else {
+        failed = read_region(job->fd, buffer, job->subtree_size, offset) != 0;
+        drop_read_pages(job->fd, offset, (off_t)job->subtree_size);
+    }
+
+    size_t num_chunks = job->subtree_size / BLAKE3_CHUNK_LEN;
+    if (!failed) {
+        hash_subtree(input, num_chunks, index * num_chunks,
+                     job->cvs + index * BLAKE3_OUT_LEN);
+    }
+
+    pthread_mutex_lock(&tree_mutex);
+    job->failed |= failed;
+    if (++job->done == job->num_subtrees) {
+        pthread_cond_broadcast(&tree_cond);
+    }
+    pthread_mutex_unlock(&tree_mutex);
+}
+
+// Claims the next subtree of the job, the caller holds tree_mutex. Once all
+// are claimed the job is closed for helpers.
+size_t claim_subtree(TreeHashJob *job) {
+    size_t index = job->next++;
+    if (job->next == job->num_subtrees) {
+        TreeHashJob **link = &open_jobs;
+        while (*link != job) {
+            link = &(*link)->next_job;
+        }
+        *link = job->next_job;
+    }
+    return index;
+}
+
+int tree_hash(int fd, const uint8_t *data, size_t size, size_t subtree_size,
+              uint8_t *hash) {
+    // The last subtree is hashed with the rest and never empty, it may be
+    // the right child on any level of the tree
+    TreeHashJob job = {.fd = fd,
+                       .data = data,
+                       .subtree_size = subtree_size,
+                       .num_subtrees = size > 0 ? (size - 1) / subtree_size : 0};
+    size_t rest = size - job.num_subtrees * subtree_size;
+    uint8_t *buffer = NULL;
+    // Aligned, the file may be read with O_DIRECT
+    if (data == NULL &&
+        (buffer = aligned_alloc(READ_ALIGNMENT, subtree_size)) == NULL) {
+        perror("Failed to allocate memory for tree hash");
+        return -1;
+    }
+    job.cvs = malloc((job.num_subtrees + 1) * BLAKE3_OUT_LEN);
+    if (job.cvs == NULL) {
+        perror("Failed to allocate memory for tree hash");
+        free(buffer);
+        return -1;
+    }
+
+    pthread_mutex_lock(&tree_mutex);
+    if (job.num_subtrees > 0) {
+        job.next_job = open_jobs;
+        open_jobs = &job;
+        pthread_cond_broadcast(&tree_cond);
+    }
+    // Hash alongside the helpers until every subtree is claimed
+    while (job.next < job.num_subtrees) {
+        size_t index = claim_subtree(&job);
+        pthread_mutex_unlock(&tree_mutex);
+        hash_job_subtree(&job, index, buffer);
+        pthread_mutex_lock(&tree_mutex);
+    }
+    while (job.done < job.num_subtrees) {
+        pthread_cond_wait(&tree_cond, &tree_mutex);
+    }
+    pthread_mutex_unlock(&tree_mutex);
+
+    TreeNode node;
+    const uint8_t *input = data + job.num_subtrees * subtree_size;
+    if (data == NULL) {
+        // The rest is not a whole number of blocks
+        off_t offset = (off_t)(job.num_subtrees * subtree_size);
+        input = buffer;
+        end_direct_read(fd);
+        job.failed |= read_region(fd, buffer, rest, offset) != 0;
+        drop_read_pages(fd, offset, (off_t)rest);
+    }
+    if (job.failed) {
+        free(job.cvs);
+        free(buffer);
+        return -1;
+    }
+    hash_region(input, rest, job.num_subtrees * (subtree_size / BLAKE3_CHUNK_LEN),
+                &node);
+
+    // Merge the subtrees like blake3_hasher merges chunks: pairs as soon as
+    // they are complete, the rest from the right once the last one is in
+    uint8_t stack[MAX_TREE_DEPTH][BLAKE3_OUT_LEN];
+    size_t depth = 0;
+    for (size_t i = 0; i < job.num_subtrees; i++) {
+        memcpy(stack[depth], job.cvs + i * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+        for (size_t total = i + 1; (total & 1) == 0; total >>= 1) {
+            depth--;
+            merge_cvs(stack[depth], stack[depth + 1], stack[depth]);
+        }
+        depth++;
+    }
+    while (depth > 0) {
+        uint8_t right[BLAKE3_OUT_LEN];
+        node_cv(&node, right);
+        parent_node(stack[--depth], right, &node);
+    }
+
+    uint8_t root[BLAKE3_BLOCK_LEN];
+    blake3_compress_xof(node.cv, node.block, node.block_len, 0,
+                        node.flags | ROOT, root);
+    memcpy(hash, root, BLAKE3_OUT_LEN);
+    free(job.cvs);
+    free(buffer);
+    return 0;
+}
+
+int tree_hash_file(int fd, off_t size, uint8_t *hash) {
+    return tree_hash(fd, NULL, (size_t)size, TREE_SUBTREE_SIZE, hash);
+}
+
+int tree_hash_memory(const uint8_t *data, size_t size, size_t subtree_size,
+                     uint8_t *hash) {
+    return tree_hash(-1, data, size, subtree_size, hash);
+}
+
+void help_tree_hashes() {
+    uint8_t *buffer = NULL;
+    pthread_mutex_lock(&tree_mutex);
+    hashing_workers--;
+    pthread_cond_broadcast(&tree_cond);
+    while (open_jobs != NULL || hashing_workers > 0) {
+        if (open_jobs == NULL) {
+            pthread_cond_wait(&tree_cond, &tree_mutex);
+            continue;
+        }
+        TreeHashJob *job = open_jobs;
+        if (job->data == NULL && buffer == NULL) {
+            pthread_mutex_unlock(&tree_mutex);
+            buffer = aligned_alloc(READ_ALIGNMENT, TREE_SUBTREE_SIZE);
+            pthread_mutex_lock(&tree_mutex);
+            if (buffer == NULL) {
+                perror("Failed to allocate memory for tree hash");
+                break;
+            }
+            // The job may be gone while we were not holding the lock
+            continue;
+        }
+        size_t index = claim_subtree(job);
+        pthread_mutex_unlock(&tree_mutex);
+        hash_job_subtree(job, index, buffer);
+        pthread_mutex_lock(&tree_mutex);
+    }
+    pthread_mutex_unlock(&tree_mutex);
+    free(buffer);
+}
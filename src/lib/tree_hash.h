@@ -0,0 +1,33 @@
+#ifndef TREE_HASH_H
+#define TREE_HASH_H
+
+#include "blake3.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Files from this size on are hashed by several workers at once
+#define TREE_HASH_MIN_SIZE (256 * 1024 * 1024)
+// Bytes in the subtrees handed out to the workers, a power of two number of
+// BLAKE3 chunks
+#define TREE_SUBTREE_SIZE (4 * 1024 * 1024)
+
+// BLAKE3 is a Merkle tree over 1 KiB chunks. A file is cut into subtrees
+// of a power of two chunks, which the workers hash independently of each
+// other. The subtree chaining values are then merged the same way
+// blake3_hasher merges chunks, so the root hash is identical to hashing the
+// file sequentially.
+
+// Function to tell how many workers may lend a hand with large files
+void init_tree_hashing(int num_workers);
+// Function to hash a file with the help of idle workers
+int tree_hash_file(int fd, off_t size, uint8_t *hash);
+// Function to hash a buffer, subtree_size must be a power of two multiple
+// of BLAKE3_CHUNK_LEN
+int tree_hash_memory(const uint8_t *data, size_t size, size_t subtree_size,
+                     uint8_t *hash);
+// Function for workers out of files to help with the large files others
+// are hashing, returns once every worker got here
+void help_tree_hashes();
+
+#endif // TREE_HASH_H
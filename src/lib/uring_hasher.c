@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include "uring_hasher.h"
+#include "blake3.h"
+#include "hashing.h"
+#include "stats.h"
+#include "tree_hash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Size of the buffer every slot reads whole files into
+#define URING_CHUNK_SIZE (128 * 1024)
+
+// Fields of the statx a hash cache key is built from
+#define URING_KEY_MASK (STATX_SIZE | STATX_INO | STATX_MTIME | STATX_CTIME)
+
+// Operation a completion belongs to, stored next to the slot index
+typedef enum { OP_STATX, OP_OPEN, OP_READ, OP_CLOSE } SlotOp;
+
+typedef struct {
+    HashJob *job; // job in the slot, NULL if the slot is free
+    int fd; // file descriptor, or index in the registered files
+    int error; // first error seen while working on the job
+    struct statx stx; // filled in before the file is opened
+    HashStage stage; // stage actually hashed
+    off_t offsets[SAMPLE_BLOCKS]; // blocks read by a partial stage
+    int num_blocks;
+    int next_block;
+    off_t position; // read position when hashing the whole file
+    uint64_t bytes; // bytes read for the job
+    const HashAlgorithm *engine; // engine of the stage
+    HashState state;
+    uint8_t *buffer;
+} UringSlot;
+
+struct UringHasher {
+    int ring_fd;
+    unsigned depth; // number of slots
+    bool fixed_buffers; // reads go to registered buffers
+    bool direct_files; // files are opened straight into the registered table
+    // Submission queue shared with the kernel
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned to_submit; // queued but not handed to the kernel yet
+    // Completion queue shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    UringSlot *slots;
+    uint8_t *buffers;
+    int *free_slots; // stack of free slots
+    unsigned num_free;
+    int *finished; // stack of slots whose job is done
+    unsigned num_finished;
+};
+
+int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+int uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Hands the queued submissions to the kernel and optionally waits for
+// completions
+int submit_sqes(UringHasher *hasher, unsigned wait_nr) {
+    while (1) {
+        int submitted = uring_enter(hasher->ring_fd, hasher->to_submit,
+                                    wait_nr,
+                                    wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted >= 0) {
+            hasher->to_submit -= submitted;
+            return 0;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+struct io_uring_sqe *get_sqe(UringHasher *hasher) {
+    unsigned tail = *hasher->sq_tail;
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)hasher->sq_head,
+                                         memory_order_acquire);
+    if (tail - head >= hasher->sq_entries) {
+        // The kernel has not consumed the queue yet, push it along
+        submit_sqes(hasher, 0);
+        head = atomic_load_explicit((_Atomic unsigned *)hasher->sq_head,
+                                    memory_order_acquire);
+        if (tail - head >= hasher->sq_entries)
+            return NULL;
+    }
+
+    // Without SQPOLL the kernel only reads the entry in io_uring_enter, so
+    // it can be published before it is filled in
+    unsigned index = tail & *hasher->sq_mask;
+    struct io_uring_sqe *sqe = &hasher->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    hasher->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned *)hasher->sq_tail, tail + 1,
+                          memory_order_release);
+    hasher->to_submit++;
+    return sqe;
+}
+
+uint64_t slot_data(int slot, SlotOp op) { return (uint64_t)slot << 2 | op; }
+
+bool probe_ops(int ring_fd, bool *fixed_buffers) {
+    size_t size = sizeof(struct io_uring_probe) +
+                  IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL)
+        return false;
+    if (uring_register(ring_fd, IORING_REGISTER_PROBE, probe,
+                       IORING_OP_LAST) < 0) {
+        free(probe);
+        return false;
+    }
+
+    int needed[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ,
+                    IORING_OP_CLOSE};
+    bool supported = true;
+    for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        supported &= needed[i] <= probe->last_op &&
+                     (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    *fixed_buffers = IORING_OP_READ_FIXED <= probe->last_op &&
+                     (probe->ops[IORING_OP_READ_FIXED].flags &
+                      IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+int map_rings(UringHasher *hasher, struct io_uring_params *params) {
+    // Both rings share one mapping on every kernel with IORING_FEAT_SINGLE_MMAP
+    size_t sq_size =
+        params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    size_t cq_size = params->cq_off.cqes +
+                     params->cq_entries * sizeof(struct io_uring_cqe);
+    hasher->sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    hasher->sq_ring =
+        mmap(NULL, hasher->sq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, hasher->ring_fd, IORING_OFF_SQ_RING);
+    if (hasher->sq_ring == MAP_FAILED) {
+        hasher->sq_ring = NULL;
+        return -1;
+    }
+    hasher->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    hasher->sqes =
+        mmap(NULL, hasher->sqes_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, hasher->ring_fd, IORING_OFF_SQES);
+    if (hasher->sqes == MAP_FAILED) {
+        hasher->sqes = NULL;
+        return -1;
+    }
+
+    char *ring = hasher->sq_ring;
+    hasher->sq_head = (unsigned *)(ring + params->sq_off.head);
+    hasher->sq_tail = (unsigned *)(ring + params->sq_off.tail);
+    hasher->sq_mask = (unsigned *)(ring + params->sq_off.ring_mask);
+    hasher->sq_array = (unsigned *)(ring + params->sq_off.array);
+    hasher->sq_entries = params->sq_entries;
+    hasher->cq_head = (unsigned *)(ring + params->cq_off.head);
+    hasher->cq_tail = (unsigned *)(ring + params->cq_off.tail);
+    hasher->cq_mask = (unsigned *)(ring + params->cq_off.ring_mask);
+    hasher->cqes = (struct io_uring_cqe *)(ring + params->cq_off.cqes);
+    return 0;
+}
+
+// Waits for a single completion outside of the slot machinery, only used
+// while setting up
+int wait_setup_completion(UringHasher *hasher) {
+    if (submit_sqes(hasher, 1) != 0)
+        return -errno;
+    unsigned head = *hasher->cq_head;
+    int res = hasher->cqes[head & *hasher->cq_mask].res;
+    atomic_store_explicit((_Atomic unsigned *)hasher->cq_head, head + 1,
+                          memory_order_release);
+    return res;
+}
+
+// Opening files straight into the registered table needs Linux 5.15, try
+// it once instead of guessing from the version
+bool test_direct_open(UringHasher *hasher) {
+    struct io_uring_sqe *sqe = get_sqe(hasher);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) "/";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    if (wait_setup_completion(hasher) < 0)
+        return false;
+
+    sqe = get_sqe(hasher);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    return wait_setup_completion(hasher) >= 0;
+}
+
+int register_resources(UringHasher *hasher) {
+    struct iovec *iovecs = malloc(hasher->depth * sizeof(struct iovec));
+    int *fds = malloc(hasher->depth * sizeof(int));
+    if (iovecs == NULL || fds == NULL) {
+        free(iovecs);
+        free(fds);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < hasher->depth; i++) {
+        iovecs[i].iov_base = hasher->slots[i].buffer;
+        iovecs[i].iov_len = URING_CHUNK_SIZE;
+        fds[i] = -1;
+    }
+    // Both are optimizations, plain reads and descriptors work without
+    if (hasher->fixed_buffers) {
+        hasher->fixed_buffers =
+            uring_register(hasher->ring_fd, IORING_REGISTER_BUFFERS, iovecs,
+                           hasher->depth) == 0;
+    }
+    if (uring_register(hasher->ring_fd, IORING_REGISTER_FILES, fds,
+                       hasher->depth) == 0) {
+        hasher->direct_files = test_direct_open(hasher);
+    }
+    free(iovecs);
+    free(fds);
+    return 0;
+}
+
+UringHasher *create_uring_hasher(unsigned depth) {
+    UringHasher *hasher = calloc(1, sizeof(UringHasher));
+    if (hasher == NULL)
+        return NULL;
+    hasher->depth = depth;
+
+    // A job has at most two submissions queued, the statx and the open
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    hasher->ring_fd = syscall(__NR_io_uring_setup, depth * 2, &params);
+    if (hasher->ring_fd < 0) {
+        free(hasher);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !probe_ops(hasher->ring_fd, &hasher->fixed_buffers) ||
+        map_rings(hasher, &params) != 0) {
+        destroy_uring_hasher(hasher);
+        return NULL;
+    }
+
+    hasher->slots = calloc(depth, sizeof(UringSlot));
+    hasher->buffers = aligned_alloc(4096, (size_t)depth * URING_CHUNK_SIZE);
+    hasher->free_slots = malloc(depth * sizeof(int));
+    hasher->finished = malloc(depth * sizeof(int));
+    if (hasher->slots == NULL || hasher->buffers == NULL ||
+        hasher->free_slots == NULL || hasher->finished == NULL) {
+        perror("Failed to allocate memory for io_uring slots");
+        destroy_uring_hasher(hasher);
+        return NULL;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        hasher->slots[i].buffer =
+            hasher->buffers + (size_t)i * URING_CHUNK_SIZE;
+        hasher->free_slots[i] = depth - 1 - i;
+    }
+    hasher->num_free = depth;
+
+    if (register_resources(hasher) != 0) {
+        destroy_uring_hasher(hasher);
+        return NULL;
+    }
+    return hasher;
+}
+
+void destroy_uring_hasher(UringHasher *hasher) {
+    if (hasher->sqes != NULL)
+        munmap(hasher->sqes, hasher->sqes_size);
+    if (hasher->sq_ring != NULL)
+        munmap(hasher->sq_ring, hasher->sq_ring_size);
+    // Closing the ring drops the registered buffers and files with it
+    close(hasher->ring_fd);
+    free(hasher->slots);
+    free(hasher->buffers);
+    free(hasher->free_slots);
+    free(hasher->finished);
+    free(hasher);
+}
+
+bool uring_hasher_has_room(UringHasher *hasher) {
+    return hasher->num_free > 0;
+}
+
+bool uring_hasher_is_idle(UringHasher *hasher) {
+    return hasher->num_free == hasher->depth;
+}
+
+void finish_slot(UringHasher *hasher, int index) {
+    UringSlot *slot = &hasher->slots[index];
+    if (slot->error != 0) {
+        slot->job->hashed = -1;
+        add_error();
+    } else if (!slot->job->large && !slot->job->cached) {
+        add_hashed_stage(slot->bytes);
+    }
+    slot->job->bytes += slot->bytes;
+    hasher->finished[hasher->num_finished++] = index;
+}
+
+void close_slot(UringHasher *hasher, int index) {
+    UringSlot *slot = &hasher->slots[index];
+    struct io_uring_sqe *sqe = get_sqe(hasher);
+    if (sqe == NULL) {
+        // Cannot happen with two entries per slot, but never leak the fd
+        if (!hasher->direct_files)
+            close(slot->fd);
+        finish_slot(hasher, index);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    if (hasher->direct_files) {
+        sqe->file_index = index + 1;
+    } else {
+        sqe->fd = slot->fd;
+    }
+    sqe->user_data = slot_data(index, OP_CLOSE);
+}
+
+void read_slot(UringHasher *hasher, int index) {
+    UringSlot *slot = &hasher->slots[index];
+    off_t offset;
+    unsigned len;
+    if (slot->stage >= HASH_STAGE_CONTENT) {
+        offset = slot->position;
+        len = URING_CHUNK_SIZE;
+    } else if (slot->next_block < slot->num_blocks) {
+        offset = slot->offsets[slot->next_block];
+        len = PARTIAL_BLOCK_SIZE;
+    } else {
+        // All blocks of the stage are in
+        finalize_hash(slot->engine, &slot->state, slot->job->hash);
+        slot->job->hashed = slot->stage;
+        close_slot(hasher, index);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(hasher);
+    if (sqe == NULL) {
+        slot->error = EAGAIN;
+        close_slot(hasher, index);
+        return;
+    }
+    sqe->opcode =
+        hasher->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = slot->fd;
+    if (hasher->direct_files)
+        sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)slot->buffer;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = index;
+    sqe->user_data = slot_data(index, OP_READ);
+}
+
+// Builds the hash cache key from the statx the open is linked to
+bool get_statx_cache_key(const struct statx *stx, CacheKey *key) {
+    if ((stx->stx_mask & URING_KEY_MASK) != URING_KEY_MASK)
+        return false;
+    key->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    key->ino = stx->stx_ino;
+    key->size = stx->stx_size;
+    key->mtime_ns = stx->stx_mtime.tv_sec * 1000000000LL +
+                    stx->stx_mtime.tv_nsec;
+    key->ctime_ns = stx->stx_ctime.tv_sec * 1000000000LL +
+                    stx->stx_ctime.tv_nsec;
+    return true;
+}
+
+void start_reading(UringHasher *hasher, int index) {
+    UringSlot *slot = &hasher->slots[index];
+    HashJob *job = slot->job;
+    off_t size = slot->stx.stx_size;
+
+    job->size = (uint64_t)size;
+    if (job->keyed) {
+        job->keyed = get_statx_cache_key(&slot->stx, &job->key);
+        int hashed =
+            job->keyed ? lookup_cached_hash(&job->key, job->stage, job->hash)
+                       : -1;
+        if (hashed >= 0) {
+            job->hashed = hashed;
+            job->cached = true;
+            close_slot(hasher, index);
+            return;
+        }
+    }
+    slot->stage = get_hash_stage(job->stage, size);
+    if (slot->stage == HASH_STAGE_FULL && size >= TREE_HASH_MIN_SIZE) {
+        // Hashed by several workers instead, one ring cannot keep up
+        job->large = true;
+        close_slot(hasher, index);
+        return;
+    }
+    slot->engine = get_stage_engine(slot->stage);
+    slot->position = 0;
+    if (slot->stage == HASH_STAGE_FULL) {
+        init_hash(slot->engine, &slot->state);
+    } else {
+        // The content stage reads the whole file, it has no blocks
+        init_stage_hash(&slot->state, slot->stage, size,
+                        job->chained ? job->previous : NULL);
+        slot->num_blocks = get_stage_blocks(slot->stage, size, slot->offsets);
+        slot->next_block = 0;
+    }
+    read_slot(hasher, index);
+}
+
+void handle_completion(UringHasher *hasher, uint64_t user_data, int res) {
+    int index = user_data >> 2;
+    UringSlot *slot = &hasher->slots[index];
+    switch ((SlotOp)(user_data & 3)) {
+    case OP_STATX:
+        // A failed statx cancels the linked open
+        if (res < 0)
+            slot->error = -res;
+        break;
+    case OP_OPEN:
+        if (res < 0) {
+            if (slot->error == 0)
+                slot->error = -res;
+            finish_slot(hasher, index);
+            break;
+        }
+        slot->fd = hasher->direct_files ? index : res;
+        start_reading(hasher, index);
+        break;
+    case OP_READ:
+        if (res < 0) {
+            slot->error = -res;
+            close_slot(hasher, index);
+            break;
+        }
+        if (slot->stage >= HASH_STAGE_CONTENT && res == 0) {
+            // End of file, the same place the synchronous read loop stops
+            finalize_hash(slot->engine, &slot->state, slot->job->hash);
+            slot->job->hashed = slot->stage;
+            slot->job->size = (uint64_t)slot->position;
+            close_slot(hasher, index);
+            break;
+        }
+        update_hash(slot->engine, &slot->state, slot->buffer, res);
+        slot->position += res;
+        slot->bytes += res;
+        slot->next_block++;
+        read_slot(hasher, index);
+        break;
+    case OP_CLOSE:
+        finish_slot(hasher, index);
+        break;
+    }
+}
+
+void reap_completions(UringHasher *hasher) {
+    unsigned head = *hasher->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)hasher->cq_tail,
+                                         memory_order_acquire);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &hasher->cqes[head & *hasher->cq_mask];
+        handle_completion(hasher, cqe->user_data, cqe->res);
+        head++;
+    }
+    atomic_store_explicit((_Atomic unsigned *)hasher->cq_head, head,
+                          memory_order_release);
+}
+
+int submit_hash_job(UringHasher *hasher, HashJob *job) {
+    if (hasher->num_free == 0)
+        return -1;
+    int index = hasher->free_slots[--hasher->num_free];
+    UringSlot *slot = &hasher->slots[index];
+    slot->job = job;
+    slot->error = 0;
+    slot->bytes = 0;
+    job->hashed = -1;
+    job->large = false;
+    job->cached = false;
+
+    // Stat and open in one go, the open only runs if the statx succeeded
+    struct io_uring_sqe *sqe = get_sqe(hasher);
+    if (sqe == NULL) {
+        slot->job = NULL;
+        hasher->num_free++;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)job->path;
+    sqe->len = job->keyed ? URING_KEY_MASK : STATX_SIZE;
+    sqe->off = (uintptr_t)&slot->stx;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = slot_data(index, OP_STATX);
+
+    sqe = get_sqe(hasher);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)job->path;
+    // Direct descriptors never reach the fd table, O_CLOEXEC is invalid
+    if (hasher->direct_files) {
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = index + 1;
+    } else {
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    sqe->user_data = slot_data(index, OP_OPEN);
+    return 0;
+}
+
+HashJob *next_finished_job(UringHasher *hasher) {
+    while (hasher->num_finished == 0) {
+        if (hasher->num_free == hasher->depth)
+            return NULL;
+        if (submit_sqes(hasher, 1) != 0) {
+            perror("Failed to wait for io_uring completions");
+            return NULL;
+        }
+        reap_completions(hasher);
+    }
+
+    int index = hasher->finished[--hasher->num_finished];
+    HashJob *job = hasher->slots[index].job;
+    hasher->slots[index].job = NULL;
+    hasher->free_slots[hasher->num_free++] = index;
+    return job;
+}
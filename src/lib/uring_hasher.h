@@ -0,0 +1,49 @@
+#ifndef URING_HASHER_H
+#define URING_HASHER_H
+
+#include "blake3.h"
+#include "hash_cache.h"
+#include "hashing.h"
+#include "path_store.h"
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// A file to hash at one stage
+typedef struct {
+    FilePath file;
+    char path[PATH_MAX]; // path of file, spelled out while the job is around
+    HashStage stage; // stage to hash
+    bool chained; // previous holds the hash of the stage before
+    uint8_t previous[MAX_DIGEST_LEN];
+    int hashed; // stage that was actually hashed, -1 on error
+    bool large; // too large for the ring, hash it with tree_hash_file
+    bool keyed; // look the stage up in the hash cache, key holds the key of
+                // the file once the ring has stat'ed it
+    CacheKey key;
+    uint8_t hash[MAX_DIGEST_LEN];
+    uint64_t size; // of the file as the stage hashed it
+    int device; // device the scheduler handed the file out for, or -1
+    uint64_t taken; // when the file was taken from the scheduler
+    uint64_t bytes; // bytes read for the file in all stages so far
+    bool read; // a stage was read rather than found in the cache
+    bool cached; // the stage was found in the hash cache or the checkpoint
+} HashJob;
+
+typedef struct UringHasher UringHasher;
+
+// Sets up an io_uring that keeps up to depth files in flight. Returns NULL
+// if the kernel lacks the io_uring features the hasher needs, the caller
+// then falls back to compute_stage_hash.
+UringHasher *create_uring_hasher(unsigned depth);
+void destroy_uring_hasher(UringHasher *hasher);
+// Returns true if another job can be submitted
+bool uring_hasher_has_room(UringHasher *hasher);
+// Returns true if no job is in flight
+bool uring_hasher_is_idle(UringHasher *hasher);
+// Queues the open, reads and close of a job, returns -1 if there is no room
+int submit_hash_job(UringHasher *hasher, HashJob *job);
+// Waits for the next job to finish, returns NULL if no job is in flight
+HashJob *next_finished_job(UringHasher *hasher);
+
+#endif // URING_HASHER_H
@@ -0,0 +1,506 @@
+#define _POSIX_C_SOURCE 200809L
+#include "verify.h"
+#include "hash_table.h"
+#include "output.h"
+#include "reader.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define NO_CLASS UINT32_MAX
+// Class of a file that could not be opened or read, it is not compared
+#define UNREADABLE (UINT32_MAX - 1)
+#define VERIFY_ALIGNMENT 4096
+
+// Files of one digest that are equal byte for byte
+typedef struct {
+    FilePath *files;
+    uint32_t num_files;
+} VerifiedGroup;
+
+// What became of one group of the index, a group splits if its files
+// differ after all
+typedef struct {
+    VerifiedGroup *groups;
+    uint32_t num_groups;
+} VerifyResult;
+
+FileHash **pending = NULL; // groups of the index, in the order printed
+VerifyResult *results = NULL; // written by the worker that took the group
+size_t num_pending = 0;
+atomic_size_t next_pending = 0;
+bool prepared = false;
+uint32_t max_open = VERIFY_MAX_OPEN; // files one worker opens at once
+
+atomic_uint_fast64_t verified_groups = 0;
+atomic_uint_fast64_t differing_files = 0;
+atomic_uint_fast64_t unreadable_files = 0;
+atomic_uint_fast64_t verified_bytes = 0;
+
+// A file of the slice being compared
+typedef struct {
+    FilePath file;
+    int fd;
+    uint32_t class; // files of one class were equal so far
+    ssize_t len; // bytes of the last chunk
+    uint8_t *chunk;
+} Member;
+
+// Per slice state of the classes, indexed by class
+typedef struct {
+    uint32_t *anchor; // member the others of the class compare with
+    uint32_t *parent; // class a new class split off from in this round
+    uint32_t *size;
+    bool *done;
+} Classes;
+
+void init_verification(int num_workers) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return;
+    if (num_workers < 1)
+        num_workers = 1;
+    rlim_t wanted =
+        (rlim_t)num_workers * VERIFY_MAX_OPEN + VERIFY_RESERVED_FDS;
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted) {
+        struct rlimit raised = limit;
+        raised.rlim_cur = limit.rlim_max != RLIM_INFINITY &&
+                                  limit.rlim_max < wanted
+                              ? limit.rlim_max
+                              : wanted;
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+            limit = raised;
+    }
+    max_open = VERIFY_MAX_OPEN;
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= wanted)
+        return;
+    rlim_t available = limit.rlim_cur > VERIFY_RESERVED_FDS
+                           ? limit.rlim_cur - VERIFY_RESERVED_FDS
+                           : 0;
+    // A slice needs the first file and one other
+    max_open = available / num_workers < 2 ? 2 : available / num_workers;
+}
+
+int prepare_verification() {
+    long count = collect_duplicates(&pending);
+    if (count < 0)
+        return -1;
+    results = calloc(count > 0 ? count : 1, sizeof(VerifyResult));
+    if (results == NULL) {
+        perror("Failed to allocate memory for verification");
+        free(pending);
+        pending = NULL;
+        return -1;
+    }
+    num_pending = (size_t)count;
+    atomic_store(&next_pending, 0);
+    prepared = true;
+    return 0;
+}
+
+// Reads until the chunk is full or the file ends
+ssize_t read_chunk(int fd, uint8_t *chunk, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, chunk + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    drop_read_pages(fd, offset, (off_t)done);
+    return (ssize_t)done;
+}
+
+void drop_member(Member *member) {
+    if (member->fd >= 0)
+        close(member->fd);
+    member->fd = -1;
+    member->class = NO_CLASS;
+}
+
+// Reports a file that cannot be compared and takes it out of the slice
+void drop_unreadable(Member *member, const char *what) {
+    int error = errno;
+    char path[PATH_MAX];
+    get_file_path(member->file, path, sizeof(path));
+    fprintf(stderr, "Failed to %s %s for verification: %s\n", what, path,
+            strerror(error));
+    add_error();
+    drop_member(member);
+    member->class = UNREADABLE;
+}
+
+bool same_chunk(const Member *a, const Member *b) {
+    return a->len == b->len && memcmp(a->chunk, b->chunk, a->len) == 0;
+}
+
+// Finds the class a member that left its class joins, one that split off
+// from the same class in this round or a new one
+uint32_t find_new_class(Member *members, Classes *classes, uint32_t *num_classes,
+                        uint32_t first_new, uint32_t i, uint32_t from) {
+    for (uint32_t c = first_new; c < *num_classes; c++) {
+        if (classes->parent[c] == from &&
+            same_chunk(&members[i], &members[classes->anchor[c]]))
+            return c;
+    }
+    uint32_t c = (*num_classes)++;
+    classes->anchor[c] = i;
+    classes->parent[c] = from;
+    classes->done[c] = false;
+    return c;
+}
+
+// Reads the next chunk of every file still in a class of two or more and
+// splits the classes, returns the bytes read
+uint64_t compare_round(Member *members, uint32_t num_members,
+                       Classes *classes, uint32_t *num_classes,
+                       size_t chunk_size, off_t offset) {
+    uint64_t bytes = 0;
+    uint32_t first_new = *num_classes;
+    for (uint32_t c = 0; c < first_new; c++) {
+        classes->anchor[c] = NO_CLASS;
+    }
+    for (uint32_t i = 0; i < num_members; i++) {
+        Member *member = &members[i];
+        if (member->class == NO_CLASS || member->class == UNREADABLE ||
+            classes->done[member->class])
+            continue;
+        member->len = read_chunk(member->fd, member->chunk, chunk_size, offset);
+        if (member->len < 0) {
+            drop_unreadable(member, "read");
+            continue;
+        }
+        bytes += member->len;
+        uint32_t c = member->class;
+        if (classes->anchor[c] == NO_CLASS) {
+            classes->anchor[c] = i;
+        } else if (!same_chunk(member, &members[classes->anchor[c]])) {
+            member->class = find_new_class(members, classes, num_classes,
+                                           first_new, i, c);
+        }
+    }
+
+    for (uint32_t c = 0; c < *num_classes; c++) {
+        classes->size[c] = 0;
+    }
+    for (uint32_t i = 0; i < num_members; i++) {
+        if (members[i].class != NO_CLASS && members[i].class != UNREADABLE)
+            classes->size[members[i].class]++;
+    }
+    for (uint32_t i = 0; i < num_members; i++) {
+        Member *member = &members[i];
+        uint32_t c = member->class;
+        if (c == NO_CLASS || c == UNREADABLE || classes->done[c])
+            continue;
+        if (classes->size[c] < 2) {
+            // Equal to no other file, stop reading it right away
+            drop_member(member);
+        } else if ((size_t)members[classes->anchor[c]].len < chunk_size) {
+            // All files of the class ended at the same byte
+            classes->done[c] = true;
+        }
+    }
+    return bytes;
+}
+
+bool has_open_class(const Member *members, uint32_t num_members,
+                    const Classes *classes) {
+    for (uint32_t i = 0; i < num_members; i++) {
+        uint32_t c = members[i].class;
+        if (c != NO_CLASS && c != UNREADABLE && !classes->done[c])
+            return true;
+    }
+    return false;
+}
+
+// Compares the files in lockstep and sets the class of every file. Files of
+// one class are equal, files that are equal to no other file get NO_CLASS
+// and files that cannot be opened or read UNREADABLE.
+int compare_files(const FilePath *files, uint32_t num_files, uint32_t *class_of,
+                  uint8_t *buffers, size_t chunk_size) {
+    Member *members = malloc(num_files * sizeof(Member));
+    uint32_t *indexes = malloc(3 * num_files * sizeof(uint32_t));
+    bool *done = malloc(num_files * sizeof(bool));
+    if (members == NULL || indexes == NULL || done == NULL) {
+        perror("Failed to allocate memory for verification");
+        free(members);
+        free(indexes);
+        free(done);
+        return -1;
+    }
+    Classes classes = {.anchor = indexes,
+                       .parent = indexes + num_files,
+                       .size = indexes + 2 * num_files,
+                       .done = done};
+    uint32_t num_classes = 1;
+    classes.done[0] = false;
+
+    char path[PATH_MAX];
+    for (uint32_t i = 0; i < num_files; i++) {
+        members[i].file = files[i];
+        members[i].fd = -1;
+        members[i].class = 0;
+        members[i].chunk = buffers + (size_t)i * chunk_size;
+        if (get_file_path(files[i], path, sizeof(path)) >= sizeof(path))
+            errno = ENAMETOOLONG;
+        else
+            members[i].fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (members[i].fd < 0) {
+            drop_unreadable(&members[i], "open");
+            continue;
+        }
+        posix_fadvise(members[i].fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    uint64_t bytes = 0;
+    for (off_t offset = 0; has_open_class(members, num_files, &classes);
+         offset += chunk_size) {
+        bytes += compare_round(members, num_files, &classes, &num_classes,
+                               chunk_size, offset);
+    }
+    atomic_fetch_add(&verified_bytes, bytes);
+
+    for (uint32_t i = 0; i < num_files; i++) {
+        class_of[i] = members[i].class;
+        if (members[i].fd >= 0)
+            close(members[i].fd);
+    }
+    free(members);
+    free(indexes);
+    free(done);
+    return 0;
+}
+
+bool add_verified_group(VerifyResult *result, const FilePath *files,
+                        uint32_t num_files) {
+    VerifiedGroup *groups = realloc(
+        result->groups, (result->num_groups + 1) * sizeof(VerifiedGroup));
+    if (groups == NULL) {
+        perror("Failed to allocate memory for verified groups");
+        return false;
+    }
+    result->groups = groups;
+    VerifiedGroup *group = &groups[result->num_groups];
+    group->files = malloc(num_files * sizeof(FilePath));
+    if (group->files == NULL) {
+        perror("Failed to allocate memory for verified groups");
+        return false;
+    }
+    memcpy(group->files, files, num_files * sizeof(FilePath));
+    group->num_files = num_files;
+    result->num_groups++;
+    return true;
+}
+
+// Adds the files of each class of a slice. The class of the first file
+// goes to same, the files equal to the first file of the whole group.
+void add_slice_classes(VerifyResult *result, const FilePath *files,
+                       const uint32_t *class_of, uint32_t num_files,
+                       FilePath *same, uint32_t *num_same, FilePath *scratch) {
+    for (uint32_t i = 0; i < num_files; i++) {
+        uint32_t c = class_of[i];
+        if (c == NO_CLASS || c == UNREADABLE)
+            continue;
+        // Only the first file of a class gathers it
+        bool first = true;
+        for (uint32_t j = 0; j < i && first; j++) {
+            first = class_of[j] != c;
+        }
+        if (!first)
+            continue;
+        uint32_t count = 0;
+        for (uint32_t j = i; j < num_files; j++) {
+            if (class_of[j] == c)
+                scratch[count++] = files[j];
+        }
+        if (i == 0) {
+            // The first file is in same already
+            memcpy(same + *num_same, scratch + 1,
+                   (count - 1) * sizeof(FilePath));
+            *num_same += count - 1;
+        } else if (add_verified_group(result, scratch, count)) {
+            atomic_fetch_add(&verified_groups, 1);
+        }
+    }
+}
+
+// Splits a group of the index into the files that are really equal
+void verify_group(FileHash *entry, VerifyResult *result) {
+    FilePath *files = get_file_paths(entry);
+    uint32_t num_files = entry->num_paths;
+    uint32_t slice_size = num_files < max_open ? num_files : max_open;
+    size_t chunk_size = VERIFY_BUFFER_BUDGET / slice_size;
+    if (chunk_size > VERIFY_MAX_CHUNK_SIZE)
+        chunk_size = VERIFY_MAX_CHUNK_SIZE;
+    chunk_size -= chunk_size % VERIFY_ALIGNMENT;
+
+    void *buffers = NULL;
+    FilePath *same = malloc(num_files * sizeof(FilePath));
+    FilePath *slice = malloc(2 * slice_size * sizeof(FilePath));
+    uint32_t *class_of = malloc(slice_size * sizeof(uint32_t));
+    if (same == NULL || slice == NULL || class_of == NULL ||
+        posix_memalign(&buffers, VERIFY_ALIGNMENT, slice_size * chunk_size) !=
+            0) {
+        perror("Failed to allocate memory for verification");
+        free(same);
+        free(slice);
+        free(class_of);
+        free(buffers);
+        return;
+    }
+
+    // Every slice starts with the first file, so the files equal to it in
+    // different slices end up in one group
+    same[0] = files[0];
+    uint32_t num_same = 1;
+    uint32_t unreadable = 0;
+    bool first_unreadable = false;
+    for (uint32_t start = 1; start < num_files; start += slice_size - 1) {
+        uint32_t count = num_files - start < slice_size - 1 ? num_files - start
+                                                            : slice_size - 1;
+        slice[0] = files[0];
+        memcpy(slice + 1, files + start, count * sizeof(FilePath));
+        if (compare_files(slice, count + 1, class_of, buffers, chunk_size) !=
+            0)
+            break;
+        add_slice_classes(result, slice, class_of, count + 1, same, &num_same,
+                          slice + slice_size);
+        first_unreadable |= class_of[0] == UNREADABLE;
+        for (uint32_t i = 1; i <= count; i++) {
+            unreadable += class_of[i] == UNREADABLE;
+        }
+    }
+    // The first file is only unreadable if no slice could read it
+    if (first_unreadable && num_same == 1)
+        unreadable++;
+    if (num_same > 1 && add_verified_group(result, same, num_same)) {
+        atomic_fetch_add(&verified_groups, 1);
+        // The group of the first file is printed first
+        VerifiedGroup last = result->groups[result->num_groups - 1];
+        memmove(result->groups + 1, result->groups,
+                (result->num_groups - 1) * sizeof(VerifiedGroup));
+        result->groups[0] = last;
+    }
+
+    uint32_t confirmed = 0;
+    for (uint32_t i = 0; i < result->num_groups; i++) {
+        confirmed += result->groups[i].num_files;
+    }
+    // Files that could not be read differ from nothing, they are errors
+    atomic_fetch_add(&unreadable_files, unreadable);
+    if (num_files > confirmed + unreadable)
+        atomic_fetch_add(&differing_files, num_files - confirmed - unreadable);
+    free(same);
+    free(slice);
+    free(class_of);
+    free(buffers);
+}
+
+void verify_groups() {
+    if (!prepared)
+        return;
+    size_t index;
+    while ((index = atomic_fetch_add(&next_pending, 1)) < num_pending) {
+        uint64_t start = get_time_ns();
+        verify_group(pending[index], &results[index]);
+        add_stage_time(STAGE_VERIFY, start);
+        // The groups of the digest are final now
+        for (uint32_t j = 0; j < results[index].num_groups; j++) {
+            output_group(pending[index]->hash, results[index].groups[j].files,
+                         results[index].groups[j].num_files);
+        }
+    }
+}
+
+void print_verified_duplicates() {
+    if (!prepared) {
+        print_duplicates();
+        return;
+    }
+    for (size_t i = 0; i < num_pending; i++) {
+        for (uint32_t j = 0; j < results[i].num_groups; j++) {
+            VerifiedGroup *group = &results[i].groups[j];
+            print_duplicate_group(pending[i]->hash, group->files,
+                                  group->num_files);
+        }
+    }
+}
+
+long list_duplicate_groups(DuplicateGroup **groups) {
+    if (!prepared) {
+        FileHash **entries;
+        long count = collect_duplicates(&entries);
+        if (count < 0)
+            return -1;
+        *groups = malloc((count > 0 ? count : 1) * sizeof(DuplicateGroup));
+        if (*groups == NULL) {
+            perror("Failed to allocate memory for duplicate groups");
+            free(entries);
+            return -1;
+        }
+        for (long i = 0; i < count; i++) {
+            (*groups)[i] = (DuplicateGroup){.hash = entries[i]->hash,
+                                            .files = get_file_paths(entries[i]),
+                                            .num_files = entries[i]->num_paths,
+                                            .verified = false};
+        }
+        free(entries);
+        return count;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < num_pending; i++) {
+        count += results[i].num_groups;
+    }
+    *groups = malloc((count > 0 ? count : 1) * sizeof(DuplicateGroup));
+    if (*groups == NULL) {
+        perror("Failed to allocate memory for duplicate groups");
+        return -1;
+    }
+    count = 0;
+    for (size_t i = 0; i < num_pending; i++) {
+        for (uint32_t j = 0; j < results[i].num_groups; j++) {
+            (*groups)[count++] =
+                (DuplicateGroup){.hash = pending[i]->hash,
+                                 .files = results[i].groups[j].files,
+                                 .num_files = results[i].groups[j].num_files,
+                                 .verified = true};
+        }
+    }
+    return (long)count;
+}
+
+uint64_t count_verified_groups() { return atomic_load(&verified_groups); }
+
+uint64_t count_differing_files() { return atomic_load(&differing_files); }
+
+uint64_t count_unreadable_files() { return atomic_load(&unreadable_files); }
+
+uint64_t count_verified_bytes() { return atomic_load(&verified_bytes); }
+
+void free_verification() {
+    for (size_t i = 0; i < num_pending; i++) {
+        for (uint32_t j = 0; j < results[i].num_groups; j++) {
+            free(results[i].groups[j].files);
+        }
+        free(results[i].groups);
+    }
+    free(results);
+    free(pending);
+    results = NULL;
+    pending = NULL;
+    num_pending = 0;
+    prepared = false;
+}
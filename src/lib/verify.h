@@ -0,0 +1,56 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "path_store.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Groups that share a full digest are read again and compared byte for
+// byte. All members of a group are read in lockstep, one large aligned
+// chunk each, and a member leaves its group at the first chunk that differs
+// from the rest, so every file is read at most once more. The workers take
+// whole groups once the hashing is done.
+
+// Bytes of buffers a worker uses for one group, split over its members
+#define VERIFY_BUFFER_BUDGET (16 * 1024 * 1024)
+#define VERIFY_MAX_CHUNK_SIZE (1024 * 1024)
+#define VERIFY_MIN_CHUNK_SIZE (64 * 1024)
+// Files open at once for a group. Larger groups are compared in slices that
+// all start with the first file, which is the only one read more than once.
+// The workers together stay within the limit of open files as well.
+#define VERIFY_MAX_OPEN (VERIFY_BUFFER_BUDGET / VERIFY_MIN_CHUNK_SIZE)
+// Descriptors left to the rest of the program when the limit is split
+#define VERIFY_RESERVED_FDS 64
+
+// Files of one digest, equal byte for byte if they were verified
+typedef struct {
+    const uint8_t *hash;
+    FilePath *files;
+    uint32_t num_files;
+    bool verified;
+} DuplicateGroup;
+
+// Function to split the limit of open files between the workers that verify,
+// raising the soft limit towards the hard one if it is too low
+void init_verification(int num_workers);
+// Function to collect the groups of duplicates, called by one thread after
+// every file was hashed. Returns -1 if the groups cannot be verified.
+int prepare_verification();
+// Function for the workers to verify groups until none are left
+void verify_groups();
+// Function to print the groups that were confirmed, or the groups of the
+// index if verification was not prepared
+void print_verified_duplicates();
+// Function to list the confirmed groups, or the groups of the index if
+// verification was not prepared. Returns their number or -1, the caller
+// frees the array but not the files.
+long list_duplicate_groups(DuplicateGroup **groups);
+// Functions to get what verification found
+uint64_t count_verified_groups();
+uint64_t count_differing_files();
+uint64_t count_unreadable_files();
+uint64_t count_verified_bytes();
+// Function to free the verified groups
+void free_verification();
+
+#endif // VERIFY_H
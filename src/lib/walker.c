@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+#include "walker.h"
+#include "../shared/consts.h"
+#include "checkpoint.h"
+#include "hashing.h"
+#include "inode_table.h"
+#include "scheduler.h"
+#include "size_table.h"
+#include "external.h"
+#include "stats.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+// Initial number of directories per deque
+#define DEQUE_CAPACITY 64
+
+typedef struct {
+    Walker *walker;
+    int id;
+} WalkerThread;
+
+Walker *create_walker(int num_threads, Scheduler *scheduler) {
+    Walker *walker = malloc(sizeof(Walker));
+    if (walker == NULL) {
+        perror("Failed to allocate memory for walker");
+        return NULL;
+    }
+    walker->deques = calloc(num_threads, sizeof(DirDeque));
+    walker->small_batches = calloc(num_threads, sizeof(SmallBatch *));
+    if (walker->deques == NULL || walker->small_batches == NULL) {
+        perror("Failed to allocate memory for walker deques");
+        free(walker->deques);
+        free(walker->small_batches);
+        free(walker);
+        return NULL;
+    }
+
+    walker->num_threads = num_threads;
+    walker->scheduler = scheduler;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&walker->deques[i].mutex, NULL);
+        atomic_init(&walker->deques[i].count, 0);
+    }
+    atomic_init(&walker->pending, 0);
+    atomic_init(&walker->idle, 0);
+    pthread_mutex_init(&walker->idle_mutex, NULL);
+    pthread_cond_init(&walker->idle_cond, NULL);
+    atomic_init(&walker->file_count, 0);
+    atomic_init(&walker->dir_count, 0);
+    atomic_init(&walker->candidate_count, 0);
+    walker->queue_all = false;
+    walker->batch_small = false;
+    return walker;
+}
+
+void destroy_walker(Walker *walker) {
+    for (int i = 0; i < walker->num_threads; i++) {
+        pthread_mutex_destroy(&walker->deques[i].mutex);
+        free(walker->deques[i].dirs);
+    }
+    pthread_mutex_destroy(&walker->idle_mutex);
+    pthread_cond_destroy(&walker->idle_cond);
+    free(walker->deques);
+    free(walker->small_batches);
+    free(walker);
+}
+
+bool push_dir(DirDeque *deque, uint32_t dir) {
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->end == deque->capacity) {
+        if (deque->start > 0) {
+            // Reuse the room left behind by stolen directories
+            memmove(deque->dirs, deque->dirs + deque->start,
+                    (deque->end - deque->start) * sizeof(uint32_t));
+            deque->end -= deque->start;
+            deque->start = 0;
+        } else {
+            size_t capacity =
+                deque->capacity ? deque->capacity * 2 : DEQUE_CAPACITY;
+            uint32_t *dirs = realloc(deque->dirs, capacity * sizeof(uint32_t));
+            if (dirs == NULL) {
+                perror("Failed to allocate memory for directory deque");
+                pthread_mutex_unlock(&deque->mutex);
+                return false;
+            }
+            deque->dirs = dirs;
+            deque->capacity = capacity;
+        }
+    }
+    deque->dirs[deque->end++] = dir;
+    atomic_fetch_add(&deque->count, 1);
+    pthread_mutex_unlock(&deque->mutex);
+    return true;
+}
+
+// Takes the newest directory, used by the owner of the deque
+uint32_t pop_dir(DirDeque *deque) {
+    if (atomic_load(&deque->count) == 0)
+        return NO_DIR;
+
+    uint32_t dir = NO_DIR;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->end > deque->start) {
+        dir = deque->dirs[--deque->end];
+        atomic_fetch_sub(&deque->count, 1);
+    }
+    if (deque->end == deque->start) {
+        deque->start = deque->end = 0;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return dir;
+}
+
+// Takes the oldest directory, used by idle walkers
+uint32_t steal_dir(DirDeque *deque) {
+    if (atomic_load(&deque->count) == 0)
+        return NO_DIR;
+
+    uint32_t dir = NO_DIR;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->end > deque->start) {
+        dir = deque->dirs[deque->start++];
+        atomic_fetch_sub(&deque->count, 1);
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return dir;
+}
+
+bool has_queued_dirs(Walker *walker) {
+    for (int i = 0; i < walker->num_threads; i++) {
+        if (atomic_load(&walker->deques[i].count) > 0)
+            return true;
+    }
+    return false;
+}
+
+void queue_dir(Walker *walker, int id, uint32_t dir) {
+    atomic_fetch_add(&walker->pending, 1);
+    if (!push_dir(&walker->deques[id], dir)) {
+        atomic_fetch_sub(&walker->pending, 1);
+        return;
+    }
+
+    // Wake up an idle walker to steal it, idle walkers register themselves
+    // before they look at the deques again
+    if (atomic_load(&walker->idle) > 0) {
+        pthread_mutex_lock(&walker->idle_mutex);
+        pthread_cond_signal(&walker->idle_cond);
+        pthread_mutex_unlock(&walker->idle_mutex);
+    }
+}
+
+// Waits until there are directories to steal, returns false once the walk
+// is over
+bool wait_for_dirs(Walker *walker) {
+    pthread_mutex_lock(&walker->idle_mutex);
+    atomic_fetch_add(&walker->idle, 1);
+    while (atomic_load(&walker->pending) > 0 && !has_queued_dirs(walker)) {
+        pthread_cond_wait(&walker->idle_cond, &walker->idle_mutex);
+    }
+    atomic_fetch_sub(&walker->idle, 1);
+    bool more = atomic_load(&walker->pending) > 0;
+    pthread_mutex_unlock(&walker->idle_mutex);
+    return more;
+}
+
+void finish_dir(Walker *walker) {
+    if (atomic_fetch_sub(&walker->pending, 1) == 1) {
+        // That was the last directory, release all idle walkers
+        pthread_mutex_lock(&walker->idle_mutex);
+        pthread_cond_broadcast(&walker->idle_cond);
+        pthread_mutex_unlock(&walker->idle_mutex);
+    }
+}
+
+// Hands the batch of small files the walker thread is filling to the
+// workers
+void flush_small_files(Walker *walker, int id) {
+    if (walker->small_batches[id] != NULL) {
+        schedule_small_batch(walker->scheduler, walker->small_batches[id]);
+        walker->small_batches[id] = NULL;
+    }
+}
+
+// Queues a candidate, small files go into the batch of the walker thread
+void queue_candidate(Walker *walker, int id, FilePath file, off_t size,
+                     dev_t dev) {
+    atomic_fetch_add(&walker->candidate_count, 1);
+    if (!walker->batch_small || size >= PREFILTER_MIN_SIZE) {
+        schedule_file(walker->scheduler, file, dev);
+        return;
+    }
+    SmallBatch *batch = walker->small_batches[id];
+    if (batch != NULL && batch->dev != dev) {
+        flush_small_files(walker, id);
+        batch = NULL;
+    }
+    if (batch == NULL) {
+        batch = malloc(sizeof(SmallBatch));
+        if (batch == NULL) {
+            perror("Failed to allocate memory for small files");
+            schedule_file(walker->scheduler, file, dev);
+            return;
+        }
+        batch->dev = dev;
+        batch->count = 0;
+        walker->small_batches[id] = batch;
+    }
+    batch->files[batch->count] = file;
+    batch->sizes[batch->count] = (uint32_t)size;
+    if (++batch->count == SMALL_BATCH_FILES)
+        flush_small_files(walker, id);
+}
+
+// A file can only have a duplicate if another file has the same size, so
+// files are held back until their size collides, unless the walker queues
+// all files. Empty files are skipped, and so are further names of a file
+// with several hard links.
+void queue_if_size_collides(Walker *walker, int id, const FileInfo *info,
+                            uint32_t dir, const char *filename) {
+    if (info->size == 0)
+        return;
+    if (is_external()) {
+        // Sorted by size on disk rather than held in memory
+        add_sized_file(info, dir, filename);
+        return;
+    }
+
+    FilePath file = intern_file(dir, filename);
+    if (file == NULL)
+        return;
+    if (info->nlink > 1 && add_inode_link(info->dev, info->ino, file))
+        return;
+
+    FilePath held = NULL;
+    dev_t held_dev = 0;
+    if (!walker->queue_all &&
+        !add_file_size(info->size, file, info->dev, &held, &held_dev))
+        return;
+
+    // Waiting here means the workers cannot keep up
+    uint64_t start = get_time_ns();
+    if (held != NULL) {
+        // Release the file that was held back for this size
+        queue_candidate(walker, id, held, info->size, held_dev);
+    }
+    queue_candidate(walker, id, file, info->size, info->dev);
+    add_stage_time(STAGE_QUEUE, start);
+}
+
+int stat_entry(int dir_fd, const char *name, FileInfo *info) {
+#ifdef STATX_TYPE
+    struct statx stx;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+              STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME | STATX_NLINK,
+              &stx) == 0) {
+        info->mode = stx.stx_mode;
+        info->size = stx.stx_size;
+        info->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        info->ino = stx.stx_ino;
+        info->nlink = stx.stx_nlink;
+        info->mtime.tv_sec = stx.stx_mtime.tv_sec;
+        info->mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+        return 0;
+    }
+    // Fall back to fstatat on kernels without statx
+    if (errno != ENOSYS)
+        return -1;
+#endif
+    struct stat path_stat;
+    if (fstatat(dir_fd, name, &path_stat, AT_SYMLINK_NOFOLLOW) != 0)
+        return -1;
+    info->mode = path_stat.st_mode;
+    info->size = path_stat.st_size;
+    info->dev = path_stat.st_dev;
+    info->ino = path_stat.st_ino;
+    info->nlink = path_stat.st_nlink;
+    info->mtime = path_stat.st_mtim;
+    return 0;
+}
+
+void queue_sub_dir(Walker *walker, int id, uint32_t dir, const char *name) {
+    uint32_t sub_dir = intern_dir(dir, name);
+    if (sub_dir != NO_DIR)
+        queue_dir(walker, id, sub_dir);
+}
+
+// Queues the entries an interrupted scan found in a directory
+void replay_directory(Walker *walker, int id, uint32_t dir_id,
+                      CheckpointCursor *cursor) {
+    char name[NAME_MAX + 1];
+    FileInfo info;
+    while (next_checkpoint_entry(cursor, name, &info)) {
+        if (S_ISDIR(info.mode)) {
+            atomic_fetch_add(&walker->dir_count, 1);
+            queue_sub_dir(walker, id, dir_id, name);
+        } else {
+            atomic_fetch_add(&walker->file_count, 1);
+            queue_if_size_collides(walker, id, &info, dir_id, name);
+        }
+    }
+}
+
+void list_directory(Walker *walker, int id, uint32_t dir_id) {
+    // The full path is resolved once per directory, entries are looked up
+    // relative to the directory
+    char dir_path[PATH_MAX];
+    if (get_dir_path(dir_id, dir_path, sizeof(dir_path)) >= sizeof(dir_path)) {
+        fprintf(stderr, "Directory path too long\n");
+        return;
+    }
+    // Directories an interrupted scan listed in full are not listed again
+    CheckpointCursor cursor;
+    if (find_checkpoint_dir(dir_path, &cursor)) {
+        replay_directory(walker, id, dir_id, &cursor);
+        return;
+    }
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dir_fd < 0 ? NULL : fdopendir(dir_fd);
+    if (dir == NULL) {
+        fprintf(stderr, "Directory: %s ", dir_path);
+        perror("Failed to open directory");
+        add_error();
+        if (dir_fd >= 0)
+            close(dir_fd);
+        return;
+    }
+
+    bool checkpoint = is_checkpoint_open();
+    CheckpointListing listing;
+    if (checkpoint)
+        start_checkpoint_listing(&listing, dir_path);
+    struct dirent *entry;
+    FileInfo info;
+    while ((entry = readdir(dir)) != NULL) {
+        // Skip the entries "." and ".." as we don't want to loop on them.
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        // Trust the type from the directory entry when the filesystem
+        // provides it, directories and special files then need no stat
+        unsigned char type = entry->d_type;
+        if (type == DT_DIR) {
+            atomic_fetch_add(&walker->dir_count, 1);
+            queue_sub_dir(walker, id, dir_id, entry->d_name);
+            if (checkpoint) {
+                info.mode = S_IFDIR;
+                add_checkpoint_entry(&listing, entry->d_name, &info);
+            }
+            continue;
+        }
+        if (type != DT_REG && type != DT_UNKNOWN)
+            continue;
+
+        if (stat_entry(dir_fd, entry->d_name, &info) != 0) {
+            fprintf(stderr, "File: %s" PATH_SEPARATOR "%s ", dir_path,
+                    entry->d_name);
+            perror("Error");
+            add_error();
+            continue;
+        }
+
+        if (S_ISDIR(info.mode)) {
+            atomic_fetch_add(&walker->dir_count, 1);
+            queue_sub_dir(walker, id, dir_id, entry->d_name);
+        } else if (S_ISREG(info.mode)) {
+            atomic_fetch_add(&walker->file_count, 1);
+            queue_if_size_collides(walker, id, &info, dir_id,
+                                   entry->d_name);
+        } else {
+            continue;
+        }
+        if (checkpoint)
+            add_checkpoint_entry(&listing, entry->d_name, &info);
+    }
+    closedir(dir);
+    if (checkpoint)
+        finish_checkpoint_listing(&listing);
+}
+
+void *walk_thread(void *arg) {
+    WalkerThread *self = (WalkerThread *)arg;
+    Walker *walker = self->walker;
+    set_thread_role("walker");
+    while (1) {
+        uint32_t dir = pop_dir(&walker->deques[self->id]);
+        // Own deque is empty, try to steal from the others
+        for (int i = 1; dir == NO_DIR && i < walker->num_threads; i++) {
+            dir = steal_dir(
+                &walker->deques[(self->id + i) % walker->num_threads]);
+        }
+        if (dir == NO_DIR) {
+            // The workers may be waiting for the small files held here
+            flush_small_files(walker, self->id);
+            if (!wait_for_dirs(walker))
+                break;
+            continue;
+        }
+
+        list_directory(walker, self->id, dir);
+        finish_dir(walker);
+    }
+    return NULL;
+}
+
+int walk_directory(Walker *walker, const char *root) {
+    uint32_t root_dir = intern_dir(NO_DIR, root);
+    if (root_dir == NO_DIR) {
+        return -1;
+    }
+    queue_dir(walker, 0, root_dir);
+
+    pthread_t *threads = malloc(walker->num_threads * sizeof(pthread_t));
+    WalkerThread *args = malloc(walker->num_threads * sizeof(WalkerThread));
+    if (threads == NULL || args == NULL) {
+        perror("Failed to allocate memory for walker threads");
+        free(threads);
+        free(args);
+        return -1;
+    }
+
+    int started = 0;
+    for (; started < walker->num_threads; started++) {
+        args[started] = (WalkerThread){.walker = walker, .id = started};
+        if (pthread_create(&threads[started], NULL, walk_thread,
+                           &args[started]) != 0) {
+            perror("Failed to create directory walker thread");
+            break;
+        }
+    }
+    if (started == 0) {
+        // Nobody to do the walk, take the root back
+        pop_dir(&walker->deques[0]);
+        atomic_store(&walker->pending, 0);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(args);
+    return started == 0 ? -1 : 0;
+}
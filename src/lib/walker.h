@@ -0,0 +1,61 @@
+#ifndef WALKER_H
+#define WALKER_H
+
+#include "path_store.h"
+#include "scheduler.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+// What the walk needs to know about a directory entry
+typedef struct {
+    mode_t mode; // file type and permissions
+    off_t size; // size in bytes
+    dev_t dev; // device the file lives on
+    ino_t ino; // inode number
+    nlink_t nlink; // number of hard links
+    struct timespec mtime; // last modification
+} FileInfo;
+
+// Directories waiting to be listed by one walker thread. The owner pushes
+// and pops at the end, so it walks depth first and stays close to what it
+// just read. Idle walkers steal from the start, which holds the directories
+// closest to the root and so the largest pieces of remaining work.
+typedef struct {
+    pthread_mutex_t mutex; // protects access to the deque
+    uint32_t *dirs; // vector of directory ids in the path store
+    size_t start; // index of the oldest directory
+    size_t end; // index at which to push the next directory
+    size_t capacity; // allocated number of directories
+    atomic_size_t count; // number of queued directories, read without lock
+} DirDeque;
+
+typedef struct {
+    int num_threads; // number of walker threads
+    DirDeque *deques; // one deque per walker thread
+    Scheduler *scheduler; // receives the files to hash
+    atomic_size_t pending; // directories queued or being listed
+    atomic_int idle; // walkers waiting for directories
+    pthread_mutex_t idle_mutex; // protects the idle condition
+    pthread_cond_t idle_cond; // signals new directories or the end of the walk
+    atomic_uint file_count; // regular files found
+    atomic_uint dir_count; // directories found
+    atomic_uint candidate_count; // files queued for hashing
+    bool queue_all; // queue every file, not only those whose size collides
+    bool batch_small; // hand out files hashed in full right away in batches
+    SmallBatch **small_batches; // batch each walker thread is filling
+} Walker;
+
+Walker *create_walker(int num_threads, Scheduler *scheduler);
+// Stats an entry relative to its directory, asking only for the fields in
+// FileInfo. Symbolic links are not followed.
+int stat_entry(int dir_fd, const char *name, FileInfo *info);
+void destroy_walker(Walker *walker);
+// Walks the tree below root with all walker threads, returns once every
+// directory has been listed
+int walk_directory(Walker *walker, const char *root);
+
+#endif // WALKER_H
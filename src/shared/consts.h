@@ -3,3 +3,6 @@
 #else
 #define PATH_SEPARATOR "/"
 #endif
+
+// Keeps data written by different threads on different cache lines
+#define CACHE_LINE_SIZE 64
@@ -0,0 +1,219 @@
+#define _DEFAULT_SOURCE
+
+#include "../src/lib/checkpoint.h"
+#include "criterion/assert.h"
+#include "criterion/internal/assert.h"
+#include <criterion/criterion.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+char test_dir[] = "/tmp/dedup-checkpoint-XXXXXX";
+char journal_path[PATH_MAX];
+
+void make_test_dir() {
+    cr_assert_not_null(mkdtemp(test_dir), "Failed to create the test dir");
+    snprintf(journal_path, sizeof(journal_path), "%s/journal", test_dir);
+}
+
+void remove_test_dir() {
+    unlink(journal_path);
+    rmdir(test_dir);
+}
+
+// The root of the scans, nothing is read below it
+const char *scan_root = "/scan";
+
+void fill_digest(uint8_t *hash, uint8_t value) {
+    memset(hash, value, MAX_DIGEST_LEN);
+}
+
+FileInfo make_file_info(off_t size, ino_t ino) {
+    FileInfo info = {0};
+    info.mode = S_IFREG;
+    info.size = size;
+    info.dev = 7;
+    info.ino = ino;
+    info.nlink = 2;
+    info.mtime.tv_sec = 1700000000;
+    info.mtime.tv_nsec = 123456789;
+    return info;
+}
+
+// Adds a directory listed in full with a file and a sub directory
+void add_test_listing(const char *path, const char *file, const char *dir) {
+    CheckpointListing listing;
+    start_checkpoint_listing(&listing, path);
+    FileInfo info = make_file_info(4096, 42);
+    add_checkpoint_entry(&listing, file, &info);
+    FileInfo dir_info = {0};
+    dir_info.mode = S_IFDIR;
+    add_checkpoint_entry(&listing, dir, &dir_info);
+    finish_checkpoint_listing(&listing);
+}
+
+off_t get_journal_size() {
+    struct stat file_stat;
+    cr_assert_eq(stat(journal_path, &file_stat), 0);
+    return file_stat.st_size;
+}
+
+Test(checkpoint, replays_directories_and_digests) {
+    make_test_dir();
+    uint8_t head[MAX_DIGEST_LEN], full[MAX_DIGEST_LEN];
+    fill_digest(head, 0x11);
+    fill_digest(full, 0x22);
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, false), 0);
+    add_test_listing("/scan", "a", "sub");
+    store_checkpoint_hash("/scan/a", HASH_STAGE_HEAD, HASH_STAGE_HEAD, 4096,
+                          head);
+    store_checkpoint_hash("/scan/a", HASH_STAGE_FULL, HASH_STAGE_FULL, 4096,
+                          full);
+    cr_assert_eq(close_checkpoint(), 0);
+
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, true), 0);
+    CheckpointCursor cursor;
+    cr_assert(find_checkpoint_dir("/scan", &cursor));
+    char name[NAME_MAX + 1];
+    FileInfo info;
+    FileInfo expected = make_file_info(4096, 42);
+    cr_assert(next_checkpoint_entry(&cursor, name, &info));
+    cr_assert_str_eq(name, "a");
+    cr_assert(S_ISREG(info.mode));
+    cr_assert_eq(info.size, expected.size);
+    cr_assert_eq(info.dev, expected.dev);
+    cr_assert_eq(info.ino, expected.ino);
+    cr_assert_eq(info.nlink, expected.nlink);
+    cr_assert_eq(info.mtime.tv_sec, expected.mtime.tv_sec);
+    cr_assert_eq(info.mtime.tv_nsec, expected.mtime.tv_nsec);
+    cr_assert(next_checkpoint_entry(&cursor, name, &info));
+    cr_assert_str_eq(name, "sub");
+    cr_assert(S_ISDIR(info.mode));
+    cr_assert_not(next_checkpoint_entry(&cursor, name, &info));
+    cr_assert_not(find_checkpoint_dir("/scan/sub", &cursor),
+                  "A directory that was not listed should be listed again");
+
+    uint8_t hash[MAX_DIGEST_LEN];
+    uint64_t size = 0;
+    cr_assert_eq(lookup_checkpoint_hash("/scan/a", HASH_STAGE_HEAD, hash,
+                                        &size),
+                 HASH_STAGE_HEAD);
+    cr_assert_arr_eq(hash, head, MAX_DIGEST_LEN);
+    cr_assert_eq(size, 4096);
+    cr_assert_eq(lookup_checkpoint_hash("/scan/a", HASH_STAGE_FULL, hash,
+                                        &size),
+                 HASH_STAGE_FULL);
+    cr_assert_arr_eq(hash, full, MAX_DIGEST_LEN);
+    cr_assert_eq(lookup_checkpoint_hash("/scan/a", HASH_STAGE_CONTENT, hash,
+                                        &size),
+                 -1);
+    cr_assert_eq(close_checkpoint(), 0);
+    remove_test_dir();
+}
+
+Test(checkpoint, torn_record_is_cut_off) {
+    make_test_dir();
+    uint8_t first[MAX_DIGEST_LEN], second[MAX_DIGEST_LEN];
+    fill_digest(first, 0x33);
+    fill_digest(second, 0x44);
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, false), 0);
+    add_test_listing("/scan", "a", "sub");
+    store_checkpoint_hash("/scan/a", HASH_STAGE_FULL, HASH_STAGE_FULL, 4096,
+                          first);
+    store_checkpoint_hash("/scan/b", HASH_STAGE_FULL, HASH_STAGE_FULL, 8192,
+                          second);
+    cr_assert_eq(close_checkpoint(), 0);
+
+    // Tears the last digest, as a kill in the middle of a write would
+    off_t size = get_journal_size();
+    cr_assert_eq(truncate(journal_path, size - 10), 0);
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, true), 0);
+    cr_assert_eq(close_checkpoint(), 0);
+    // The torn record goes, the run record of the resumed run comes
+    size_t torn = 5 + 2 + 8 + MAX_DIGEST_LEN + 2 + strlen("/scan/b");
+    cr_assert_eq(get_journal_size(), size - (off_t)torn + 5,
+                 "The torn record should be cut off before the run appends");
+
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, true), 0);
+    uint8_t hash[MAX_DIGEST_LEN];
+    uint64_t hashed_size;
+    cr_assert_eq(lookup_checkpoint_hash("/scan/a", HASH_STAGE_FULL, hash,
+                                        &hashed_size),
+                 HASH_STAGE_FULL);
+    cr_assert_arr_eq(hash, first, MAX_DIGEST_LEN);
+    cr_assert_eq(lookup_checkpoint_hash("/scan/b", HASH_STAGE_FULL, hash,
+                                        &hashed_size),
+                 -1, "The torn digest should be gone");
+    cr_assert_eq(close_checkpoint(), 0);
+    remove_test_dir();
+}
+
+Test(checkpoint, digest_needs_directory_listed_before) {
+    make_test_dir();
+    uint8_t early[MAX_DIGEST_LEN], late[MAX_DIGEST_LEN];
+    fill_digest(early, 0x55);
+    fill_digest(late, 0x66);
+    // The digest comes before its directory is listed, a run that lists
+    // the directory again may find another file there
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, false), 0);
+    add_test_listing("/scan", "a", "sub");
+    store_checkpoint_hash("/scan/sub/b", HASH_STAGE_FULL, HASH_STAGE_FULL,
+                          100, early);
+    store_checkpoint_hash("/scan/other/c", HASH_STAGE_FULL, HASH_STAGE_FULL,
+                          100, early);
+    cr_assert_eq(close_checkpoint(), 0);
+
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, true), 0);
+    add_test_listing("/scan/sub", "b", "deeper");
+    store_checkpoint_hash("/scan/sub/d", HASH_STAGE_FULL, HASH_STAGE_FULL,
+                          100, late);
+    cr_assert_eq(close_checkpoint(), 0);
+
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, true), 0);
+    uint8_t hash[MAX_DIGEST_LEN];
+    uint64_t size;
+    cr_assert_eq(lookup_checkpoint_hash("/scan/sub/b", HASH_STAGE_FULL, hash,
+                                        &size),
+                 -1, "A digest from before its directory was listed counts");
+    cr_assert_eq(lookup_checkpoint_hash("/scan/other/c", HASH_STAGE_FULL,
+                                        hash, &size),
+                 -1, "A digest in a directory never listed counts");
+    cr_assert_eq(lookup_checkpoint_hash("/scan/sub/d", HASH_STAGE_FULL, hash,
+                                        &size),
+                 HASH_STAGE_FULL);
+    cr_assert_arr_eq(hash, late, MAX_DIGEST_LEN);
+    cr_assert_eq(close_checkpoint(), 0);
+    remove_test_dir();
+}
+
+Test(checkpoint, digest_below_root_directory) {
+    make_test_dir();
+    uint8_t digest[MAX_DIGEST_LEN];
+    fill_digest(digest, 0x77);
+    // The root keeps its separator, its files have none of their own
+    cr_assert_eq(open_checkpoint(journal_path, "/", false), 0);
+    add_test_listing("/", "a", "sub");
+    store_checkpoint_hash("/a", HASH_STAGE_FULL, HASH_STAGE_FULL, 100,
+                          digest);
+    cr_assert_eq(close_checkpoint(), 0);
+
+    cr_assert_eq(open_checkpoint(journal_path, "/", true), 0);
+    uint8_t hash[MAX_DIGEST_LEN];
+    uint64_t size;
+    cr_assert_eq(lookup_checkpoint_hash("/a", HASH_STAGE_FULL, hash, &size),
+                 HASH_STAGE_FULL);
+    cr_assert_arr_eq(hash, digest, MAX_DIGEST_LEN);
+    cr_assert_eq(close_checkpoint(), 0);
+    remove_test_dir();
+}
+
+Test(checkpoint, other_root_is_refused) {
+    make_test_dir();
+    cr_assert_eq(open_checkpoint(journal_path, scan_root, false), 0);
+    cr_assert_eq(close_checkpoint(), 0);
+    cr_assert_eq(open_checkpoint(journal_path, "/elsewhere", true), -1);
+    remove_test_dir();
+}
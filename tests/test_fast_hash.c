@@ -0,0 +1,71 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/lib/fast_hash.h"
+#include "criterion/assert.h"
+#include "criterion/internal/assert.h"
+#include <criterion/criterion.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The first 64 bits are xxHash64 with seed 0, in the byte order of the host
+uint64_t read_low_bits(const uint8_t *hash) {
+    uint64_t value;
+    memcpy(&value, hash, sizeof(value));
+    return value;
+}
+
+void one_shot_hash(const void *data, size_t size, uint8_t *hash) {
+    FastHasher hasher;
+    fast_hasher_init(&hasher);
+    fast_hasher_update(&hasher, data, size);
+    fast_hasher_finalize(&hasher, hash, FAST_HASH_LEN);
+}
+
+Test(fast_hash, matches_xxhash64) {
+    const char *inputs[] = {"", "a", "abc"};
+    uint64_t expected[] = {0xef46db3751d8e999ULL, 0xd24ec4f1a98c6e5bULL,
+                           0x44bc2cf5ad770999ULL};
+    for (int i = 0; i < 3; i++) {
+        uint8_t hash[FAST_HASH_LEN];
+        one_shot_hash(inputs[i], strlen(inputs[i]), hash);
+        cr_assert_eq(read_low_bits(hash), expected[i],
+                     "xxHash64 of \"%s\" differs", inputs[i]);
+    }
+}
+
+Test(fast_hash, incremental_matches_one_shot) {
+    size_t size = 4099;
+    uint8_t *data = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)(i % 251);
+    }
+    uint8_t expected[FAST_HASH_LEN];
+    one_shot_hash(data, size, expected);
+
+    // Pieces that end inside, at and across stripe boundaries
+    size_t pieces[] = {1, 7, 31, 32, 33, 64, 100};
+    for (size_t p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++) {
+        FastHasher hasher;
+        fast_hasher_init(&hasher);
+        for (size_t offset = 0; offset < size; offset += pieces[p]) {
+            size_t len = size - offset < pieces[p] ? size - offset : pieces[p];
+            fast_hasher_update(&hasher, data + offset, len);
+        }
+        uint8_t hash[FAST_HASH_LEN];
+        fast_hasher_finalize(&hasher, hash, FAST_HASH_LEN);
+        cr_assert(memcmp(expected, hash, FAST_HASH_LEN) == 0,
+                  "Hash in pieces of %zu differs", pieces[p]);
+    }
+    free(data);
+}
+
+Test(fast_hash, single_byte_changes_digest) {
+    uint8_t data[256] = {0};
+    uint8_t original[FAST_HASH_LEN], changed[FAST_HASH_LEN];
+    one_shot_hash(data, sizeof(data), original);
+    data[200] = 1;
+    one_shot_hash(data, sizeof(data), changed);
+    cr_assert(memcmp(original, changed, FAST_HASH_LEN) != 0);
+    // Both halves of the digest depend on the input
+    cr_assert(memcmp(original + 8, changed + 8, 8) != 0);
+}
@@ -4,41 +4,91 @@
 #include "criterion/assert.h"
 #include "criterion/internal/assert.h"
 #include <criterion/criterion.h>
+#include <linux/limits.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <time.h>
 
-struct timespec timeout;
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ELEMENTS_PER_PRODUCER 10000
 
-void setup_timeout(void) {
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += 5;  // Wait up to 5 seconds
+// Queues dir/name through the path store, like the walker does
+void write_path(RingBuffer *buffer, const char *dir, const char *name) {
+    write_ring_buffer(buffer, intern_file(intern_dir(NO_DIR, dir), name));
+}
+
+// Takes the oldest file and spells out its path
+bool read_path(RingBuffer *buffer, char *path) {
+    FilePath file;
+    if (!read_ring_buffer(buffer, &file))
+        return false;
+    get_file_path(file, path, PATH_MAX);
+    return true;
+}
+
+const char *slot_path(RingBuffer *buffer, int index) {
+    static char path[PATH_MAX];
+    get_file_path(buffer->slots[index].file, path, sizeof(path));
+    return path;
 }
 
 void *write_to_buffer(void *arg) {
     RingBuffer *buffer = (RingBuffer *)arg;
     for (int i = 0; i < 3; i++) {
-        char *filename = malloc(20);
+        char filename[20];
         sprintf(filename, "test%d", i + 1);
-        write_ring_buffer(buffer, "path", filename);
+        write_path(buffer, "path", filename);
     }
     return NULL;
 }
 
 void *read_from_buffer(void *arg) {
     RingBuffer *buffer = (RingBuffer *)arg;
-    pthread_mutex_lock(&buffer->mutex);
-    while (!buffer->full) {
-        pthread_cond_wait(&buffer->cond,
-                          &buffer->mutex); // wait for buffer to be full
+    // Wait for the writer to fill the buffer and block on the third element
+    while (!is_ring_buffer_full(buffer)) {
+        sched_yield();
     }
-    pthread_mutex_unlock(&buffer->mutex);
-    char *elem = read_and_free_ring_buffer(buffer, &timeout);
+    char elem[PATH_MAX];
+    cr_assert(read_path(buffer, elem), "Read from a full buffer failed");
     cr_assert_str_eq(elem, "path/test1", "First element was not read correctly, expected 'path/test1', got %s", elem);
     return NULL;
 }
 
-TestSuite(ring_buffer, .init = setup_timeout);
+void *close_after_delay(void *arg) {
+    RingBuffer *buffer = (RingBuffer *)arg;
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 50000000};
+    nanosleep(&delay, NULL);
+    close_ring_buffer(buffer);
+    return NULL;
+}
+
+typedef struct {
+    RingBuffer *buffer;
+    int id;
+    long sum;
+    int count;
+} StressArgs;
+
+void *produce(void *arg) {
+    StressArgs *args = (StressArgs *)arg;
+    char filename[20];
+    for (int i = 0; i < ELEMENTS_PER_PRODUCER; i++) {
+        sprintf(filename, "%d", args->id * ELEMENTS_PER_PRODUCER + i);
+        write_path(args->buffer, "p", filename);
+    }
+    return NULL;
+}
+
+void *consume(void *arg) {
+    StressArgs *args = (StressArgs *)arg;
+    char elem[PATH_MAX];
+    while (read_path(args->buffer, elem)) {
+        args->sum += atol(elem + 2);
+        args->count++;
+    }
+    return NULL;
+}
 
 Test(ring_buffer, write_blocks_when_full) {
     RingBuffer *buffer = create_ring_buffer(2);
@@ -50,23 +100,20 @@ Test(ring_buffer, write_blocks_when_full) {
     pthread_join(write_thread, NULL);
     pthread_join(read_thread, NULL);
 
-    cr_assert_eq(buffer->start, 1,
-                 "Buffer start was not updated correctly, expected 1 got %d",
-                 buffer->start);
-
-    cr_assert_eq(buffer->end, 1,
-                 "Buffer end was not updated correctly, expected 1 got %d",
-                 buffer->end);
+    cr_assert(is_ring_buffer_full(buffer),
+              "Blocked writer did not fill the freed slot");
 
+    char elem[PATH_MAX];
+    read_path(buffer, elem);
     cr_assert_str_eq(
-        buffer->elems[buffer->start], "path/test2",
+        elem, "path/test2",
         "Element 1 was not written correctly, expected 'path/test2' got %s",
-        buffer->elems[buffer->start]);
-
+        elem);
+    read_path(buffer, elem);
     cr_assert_str_eq(
-        buffer->elems[(buffer->start + 1) % buffer->size], "path/test3",
-        "Element 0 was not written correctly, expected 'path/test3' got %s",
-        buffer->elems[(buffer->start + 1) % buffer->size]);
+        elem, "path/test3",
+        "Element 2 was not written correctly, expected 'path/test3' got %s",
+        elem);
 
     destroy_ring_buffer(buffer);
 }
@@ -74,9 +121,7 @@ Test(ring_buffer, write_blocks_when_full) {
 Test(ring_buffer, create_and_destroy) {
     RingBuffer *buffer = create_ring_buffer(2);
     cr_assert_not_null(buffer, "Buffer was not created");
-    cr_assert_not_null(buffer->elems[0],
-                   "Memory for buffer elements was not allocated");
-    cr_assert_not_null(buffer->elems[1],
+    cr_assert_not_null(buffer->slots,
                    "Memory for buffer elements was not allocated");
     destroy_ring_buffer(buffer);
 }
@@ -84,10 +129,21 @@ Test(ring_buffer, create_and_destroy) {
 Test(ring_buffer, write_single_element) {
     RingBuffer *buffer = create_ring_buffer(2);
 
-    write_ring_buffer(buffer, "path", "test1");
+    write_path(buffer, "path", "test1");
+
+    cr_assert_str_eq(slot_path(buffer, 0), "path/test1",
+                     "First element was not written correctly, expected 'path/test1' got %s", slot_path(buffer, 0));
+
+    destroy_ring_buffer(buffer);
+}
+
+Test(ring_buffer, write_root_element) {
+    RingBuffer *buffer = create_ring_buffer(2);
+
+    write_path(buffer, "/", "test1");
 
-    cr_assert_str_eq(buffer->elems[0], "path/test1",
-                     "First element was not written correctly, expected 'path/test1' got %s", buffer->elems[0]);
+    cr_assert_str_eq(slot_path(buffer, 0), "/test1",
+                     "Root element was not written correctly, expected '/test1' got %s", slot_path(buffer, 0));
 
     destroy_ring_buffer(buffer);
 }
@@ -95,13 +151,13 @@ Test(ring_buffer, write_single_element) {
 Test(ring_buffer, write_two_elements) {
     RingBuffer *buffer = create_ring_buffer(2);
 
-    write_ring_buffer(buffer, "path", "test1");
-    write_ring_buffer(buffer, "path", "test2");
+    write_path(buffer, "path", "test1");
+    write_path(buffer, "path", "test2");
 
-    cr_assert_str_eq(buffer->elems[1], "path/test2",
-                     "Second element was not written correctly, expected 'path/test2' got %s", buffer->elems[1]);
+    cr_assert_str_eq(slot_path(buffer, 1), "path/test2",
+                     "Second element was not written correctly, expected 'path/test2' got %s", slot_path(buffer, 1));
 
-    cr_assert(buffer->full,
+    cr_assert(is_ring_buffer_full(buffer),
               "Buffer not marked as full after writing 2 elements");
 
     destroy_ring_buffer(buffer);
@@ -110,14 +166,14 @@ Test(ring_buffer, write_two_elements) {
 Test(ring_buffer, read_single_element) {
     RingBuffer *buffer = create_ring_buffer(2);
 
-    write_ring_buffer(buffer, "path", "test1");
-    write_ring_buffer(buffer, "path", "test2");
+    write_path(buffer, "path", "test1");
+    write_path(buffer, "path", "test2");
 
-    char *path = read_and_free_ring_buffer(buffer, &timeout);
+    char path[PATH_MAX];
+    read_path(buffer, path);
     cr_assert_str_eq(path, "path/test1",
                      "First element was not read correctly, , expected 'path/test1' got %s", path);
-    // free_ring_buffer(buffer);
-    cr_assert_not(buffer->full,
+    cr_assert_not(is_ring_buffer_full(buffer),
                   "Buffer should not be marked full after reading one element");
 
     destroy_ring_buffer(buffer);
@@ -125,14 +181,14 @@ Test(ring_buffer, read_single_element) {
 
 Test(ring_buffer, write_after_read) {
     RingBuffer *buffer = create_ring_buffer(2);
+    char path[PATH_MAX];
 
-    write_ring_buffer(buffer, "path", "test1");
-    write_ring_buffer(buffer, "path", "test2");
-    read_and_free_ring_buffer(buffer, &timeout);
-    // free_ring_buffer(buffer);
-    write_ring_buffer(buffer, "path", "test3");
+    write_path(buffer, "path", "test1");
+    write_path(buffer, "path", "test2");
+    read_path(buffer, path);
+    write_path(buffer, "path", "test3");
 
-    cr_assert(buffer->full,
+    cr_assert(is_ring_buffer_full(buffer),
               "Buffer not marked as full after writing second elements again");
 
     destroy_ring_buffer(buffer);
@@ -140,27 +196,25 @@ Test(ring_buffer, write_after_read) {
 
 Test(ring_buffer, read_second_element) {
     RingBuffer *buffer = create_ring_buffer(2);
+    char path[PATH_MAX];
 
-    write_ring_buffer(buffer, "path", "test1");
-    write_ring_buffer(buffer, "path", "test2");
-    read_and_free_ring_buffer(buffer, &timeout);
-    // free_ring_buffer(buffer);
-    write_ring_buffer(buffer, "path", "test3");
-    char *path = read_and_free_ring_buffer(buffer, &timeout);
+    write_path(buffer, "path", "test1");
+    write_path(buffer, "path", "test2");
+    read_path(buffer, path);
+    write_path(buffer, "path", "test3");
+    read_path(buffer, path);
     cr_assert_str_eq(path, "path/test2",
                      "Second element was not read correctly, expected 'path/test2' got %s", path);
-    // free_ring_buffer(buffer);
-    path = read_and_free_ring_buffer(buffer, &timeout);
+    read_path(buffer, path);
     cr_assert_str_eq(path, "path/test3",
                      "Third element was not read correctly, expected 'path/test3' got %s", path);
-    // free_ring_buffer(buffer);
     destroy_ring_buffer(buffer);
 }
 
 Test(ring_buffer, buffer_not_full_initially) {
     RingBuffer *buffer = create_ring_buffer(2);
 
-    cr_assert_not(buffer->full,
+    cr_assert_not(is_ring_buffer_full(buffer),
                   "Buffer should not be marked as full initially");
 
     destroy_ring_buffer(buffer);
@@ -169,10 +223,10 @@ Test(ring_buffer, buffer_not_full_initially) {
 Test(ring_buffer, buffer_full_after_two_writes) {
     RingBuffer *buffer = create_ring_buffer(2);
 
-    write_ring_buffer(buffer, "path", "test1");
-    write_ring_buffer(buffer, "path", "test2");
+    write_path(buffer, "path", "test1");
+    write_path(buffer, "path", "test2");
 
-    cr_assert(buffer->full,
+    cr_assert(is_ring_buffer_full(buffer),
               "Buffer should be marked as full after writing 2 elements");
 
     destroy_ring_buffer(buffer);
@@ -180,14 +234,14 @@ Test(ring_buffer, buffer_full_after_two_writes) {
 
 Test(ring_buffer, buffer_not_full_after_read) {
     RingBuffer *buffer = create_ring_buffer(2);
+    char path[PATH_MAX];
 
-    write_ring_buffer(buffer, "path", "test1");
-    write_ring_buffer(buffer, "path", "test2");
-    read_and_free_ring_buffer(buffer, &timeout);
-    // free_ring_buffer(buffer);
+    write_path(buffer, "path", "test1");
+    write_path(buffer, "path", "test2");
+    read_path(buffer, path);
 
     cr_assert_not(
-        buffer->full,
+        is_ring_buffer_full(buffer),
         "Buffer should not be marked as full after reading one element");
 
     destroy_ring_buffer(buffer);
@@ -195,14 +249,14 @@ Test(ring_buffer, buffer_not_full_after_read) {
 
 Test(ring_buffer, buffer_full_after_write_read_write) {
     RingBuffer *buffer = create_ring_buffer(2);
+    char path[PATH_MAX];
 
-    write_ring_buffer(buffer, "path", "test1");
-    write_ring_buffer(buffer, "path", "test2");
-    read_and_free_ring_buffer(buffer, &timeout);
-    // free_ring_buffer(buffer);
-    write_ring_buffer(buffer, "path", "test3");
+    write_path(buffer, "path", "test1");
+    write_path(buffer, "path", "test2");
+    read_path(buffer, path);
+    write_path(buffer, "path", "test3");
 
-    cr_assert(buffer->full, "Buffer should be marked as full after writing, "
+    cr_assert(is_ring_buffer_full(buffer), "Buffer should be marked as full after writing, "
                             "reading, and writing again");
 
     destroy_ring_buffer(buffer);
@@ -211,7 +265,7 @@ Test(ring_buffer, buffer_full_after_write_read_write) {
 Test(ring_buffer, test_get_free_space) {
     RingBuffer *buffer = create_ring_buffer(5);
     cr_assert_eq(get_ring_buffer_free_space(buffer), 5, "After initialization, free space should be equal to buffer size");
-    write_ring_buffer(buffer, "path", "test");
+    write_path(buffer, "path", "test");
     cr_assert_eq(get_ring_buffer_free_space(buffer), 4, "After writing one element, free space should decrease by 1");
     clear_ring_buffer(buffer);
     cr_assert_eq(get_ring_buffer_free_space(buffer), 5, "After clearing, free space should be equal to buffer size");
@@ -221,9 +275,9 @@ Test(ring_buffer, test_get_free_space) {
 Test(ring_buffer, test_is_buffer_full) {
     RingBuffer *buffer = create_ring_buffer(2);
     cr_assert_eq(is_ring_buffer_full(buffer), false, "After initialization, buffer should not be full");
-    write_ring_buffer(buffer, "path", "test");
+    write_path(buffer, "path", "test");
     cr_assert_eq(is_ring_buffer_full(buffer), false, "After writing one element to a buffer of size 2, buffer should not be full");
-    write_ring_buffer(buffer, "path", "test");
+    write_path(buffer, "path", "test");
     cr_assert_eq(is_ring_buffer_full(buffer), true, "After writing two elements to a buffer of size 2, buffer should be full");
     clear_ring_buffer(buffer);
     cr_assert_eq(is_ring_buffer_full(buffer), false, "After clearing, buffer should not be full");
@@ -232,8 +286,8 @@ Test(ring_buffer, test_is_buffer_full) {
 
 Test(ring_buffer, test_clear_buffer) {
     RingBuffer *buffer = create_ring_buffer(2);
-    write_ring_buffer(buffer, "path", "test");
-    write_ring_buffer(buffer, "path", "test");
+    write_path(buffer, "path", "test");
+    write_path(buffer, "path", "test");
     cr_assert_eq(is_ring_buffer_full(buffer), true, "After writing two elements to a buffer of size 2, buffer should be full");
     clear_ring_buffer(buffer);
     cr_assert_eq(is_ring_buffer_full(buffer), false, "After clearing, buffer should not be full");
@@ -243,11 +297,64 @@ Test(ring_buffer, test_clear_buffer) {
 
 Test(ring_buffer, test_is_buffer_empty) {
     RingBuffer *buffer = create_ring_buffer(2);
+    char path[PATH_MAX];
     cr_assert(is_ring_buffer_empty(buffer), "After initialization, buffer should be empty");
-    write_ring_buffer(buffer, "path", "test");
+    write_path(buffer, "path", "test");
     cr_assert_not(is_ring_buffer_empty(buffer), "After writing an element, buffer should not be empty");
-    read_and_free_ring_buffer(buffer, &timeout);
-    // free_ring_buffer(buffer);
+    read_path(buffer, path);
     cr_assert(is_ring_buffer_empty(buffer), "After reading the only element, buffer should be empty");
     destroy_ring_buffer(buffer);
 }
+
+Test(ring_buffer, read_drains_after_close) {
+    RingBuffer *buffer = create_ring_buffer(2);
+    char path[PATH_MAX];
+    write_path(buffer, "path", "test1");
+    close_ring_buffer(buffer);
+    cr_assert(read_path(buffer, path), "Elements written before the close should still be read");
+    cr_assert_str_eq(path, "path/test1", "Drained element was not read correctly, expected 'path/test1' got %s", path);
+    cr_assert_not(read_path(buffer, path), "Reading a closed and drained buffer should fail");
+    destroy_ring_buffer(buffer);
+}
+
+Test(ring_buffer, close_wakes_blocked_reader) {
+    RingBuffer *buffer = create_ring_buffer(2);
+    char path[PATH_MAX];
+    pthread_t close_thread;
+    pthread_create(&close_thread, NULL, close_after_delay, buffer);
+    cr_assert_not(read_path(buffer, path), "A reader blocked on an empty buffer should return once it is closed");
+    pthread_join(close_thread, NULL);
+    destroy_ring_buffer(buffer);
+}
+
+Test(ring_buffer, multiple_producers_and_consumers) {
+    RingBuffer *buffer = create_ring_buffer(8);
+    pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+    StressArgs producer_args[PRODUCERS], consumer_args[CONSUMERS];
+
+    for (int i = 0; i < CONSUMERS; i++) {
+        consumer_args[i] = (StressArgs){.buffer = buffer, .id = i};
+        pthread_create(&consumers[i], NULL, consume, &consumer_args[i]);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        producer_args[i] = (StressArgs){.buffer = buffer, .id = i};
+        pthread_create(&producers[i], NULL, produce, &producer_args[i]);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    close_ring_buffer(buffer);
+
+    long sum = 0;
+    int count = 0;
+    for (int i = 0; i < CONSUMERS; i++) {
+        pthread_join(consumers[i], NULL);
+        sum += consumer_args[i].sum;
+        count += consumer_args[i].count;
+    }
+
+    long total = (long)PRODUCERS * ELEMENTS_PER_PRODUCER;
+    cr_assert_eq(count, total, "Expected %ld elements to be read, got %d", total, count);
+    cr_assert_eq(sum, total * (total - 1) / 2, "Every element should be read exactly once");
+    destroy_ring_buffer(buffer);
+}
@@ -0,0 +1,296 @@
+#define _DEFAULT_SOURCE
+
+#include "../src/lib/fast_hash.h"
+#include "../src/lib/hashing.h"
+#include "../src/lib/shard_index.h"
+#include "criterion/assert.h"
+#include "criterion/internal/assert.h"
+#include <criterion/criterion.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Files of unique sizes, enough for the records to fill several blocks
+#define FILLER_FILES 3000
+
+char test_dir[] = "/tmp/dedup-index-XXXXXX";
+char first_index[PATH_MAX];
+char second_index[PATH_MAX];
+
+void make_test_dir() {
+    cr_assert_not_null(mkdtemp(test_dir), "Failed to create the test dir");
+    snprintf(first_index, sizeof(first_index), "%s/first.idx", test_dir);
+    snprintf(second_index, sizeof(second_index), "%s/second.idx", test_dir);
+}
+
+void remove_test_dir() {
+    unlink(first_index);
+    unlink(second_index);
+    rmdir(test_dir);
+}
+
+void fill_digest(uint8_t *hash, uint8_t value) {
+    memset(hash, value, MAX_DIGEST_LEN);
+}
+
+void add_test_file(uint32_t dir, const char *name, uint64_t size,
+                   uint8_t digest) {
+    uint8_t hash[MAX_DIGEST_LEN];
+    fill_digest(hash, digest);
+    FilePath file = intern_file(dir, name);
+    cr_assert_not_null(file);
+    add_index_file(hash, size, file);
+}
+
+// Writes the index of one shard from its files, in no particular order
+void write_first_shard() {
+    cr_assert_eq(start_shard_index(first_index), 0);
+    uint32_t dir = intern_dir(NO_DIR, "/first");
+    char name[32];
+    for (int i = 0; i < FILLER_FILES; i++) {
+        snprintf(name, sizeof(name), "filler%d", i);
+        add_test_file(dir, name, 100000 + i, 0xf0);
+    }
+    add_test_file(dir, "y", 100, 1);
+    add_test_file(dir, "x", 100, 1);
+    add_test_file(dir, "z", 200, 2);
+    add_test_file(dir, "u", 100, 3);
+    add_test_file(dir, "q", 400, 5);
+    add_test_file(dir, "p", 400, 5);
+    uint64_t num_files;
+    cr_assert_eq(write_shard_index(&num_files), 0);
+    cr_assert_eq(num_files, FILLER_FILES + 6);
+    free_shard_index();
+}
+
+void write_second_shard() {
+    cr_assert_eq(start_shard_index(second_index), 0);
+    uint32_t dir = intern_dir(NO_DIR, "/second");
+    add_test_file(dir, "x", 100, 1);
+    add_test_file(dir, "w", 200, 2);
+    add_test_file(dir, "v", 300, 4);
+    // Same digest as the group of size 100, but another size
+    add_test_file(dir, "t", 500, 1);
+    uint64_t num_files;
+    cr_assert_eq(write_shard_index(&num_files), 0);
+    cr_assert_eq(num_files, 4);
+    free_shard_index();
+}
+
+// Merges the indexes with stderr going to message, returns the result
+int merge_with_message(char *const *paths, int num_paths,
+                       MergeTotals *totals, char *message, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stderr", test_dir);
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    cr_assert_geq(fd, 0);
+    dup2(fd, STDERR_FILENO);
+    int result = merge_shard_indexes(paths, num_paths, totals);
+    fflush(stderr);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    ssize_t n = pread(fd, message, size - 1, 0);
+    message[n > 0 ? n : 0] = '\0';
+    close(fd);
+    unlink(path);
+    return result;
+}
+
+off_t get_file_size(const char *path) {
+    struct stat file_stat;
+    cr_assert_eq(stat(path, &file_stat), 0);
+    return file_stat.st_size;
+}
+
+Test(shard_index, merge_groups_across_indexes) {
+    make_test_dir();
+    write_first_shard();
+    write_second_shard();
+    char *paths[] = {first_index, second_index};
+    MergeTotals totals;
+    cr_assert_eq(merge_shard_indexes(paths, 2, &totals), 0);
+    cr_assert_eq(totals.files, FILLER_FILES + 10);
+    // Size 100 with three files, 200 with two, both across the indexes,
+    // and 400 with two files of the first index only
+    cr_assert_eq(totals.groups, 3, "Expected 3 groups, got %llu",
+                 (unsigned long long)totals.groups);
+    cr_assert_eq(totals.cross_shard_groups, 2,
+                 "Expected 2 groups across indexes, got %llu",
+                 (unsigned long long)totals.cross_shard_groups);
+    cr_assert_eq(totals.duplicate_bytes, 2 * 100 + 200 + 400);
+    remove_test_dir();
+}
+
+Test(shard_index, index_merges_alone) {
+    make_test_dir();
+    write_first_shard();
+    char *paths[] = {first_index};
+    MergeTotals totals;
+    cr_assert_eq(merge_shard_indexes(paths, 1, &totals), 0);
+    cr_assert_eq(totals.files, FILLER_FILES + 6);
+    cr_assert_eq(totals.groups, 2);
+    cr_assert_eq(totals.cross_shard_groups, 0);
+    remove_test_dir();
+}
+
+Test(shard_index, flipped_byte_is_corrupt) {
+    make_test_dir();
+    write_first_shard();
+    write_second_shard();
+    // A byte in the middle of the records of the first block
+    FILE *file = fopen(first_index, "r+b");
+    cr_assert_not_null(file);
+    cr_assert_eq(fseek(file, 16 + 12 + 1000, SEEK_SET), 0);
+    int byte = fgetc(file);
+    cr_assert_eq(fseek(file, 16 + 12 + 1000, SEEK_SET), 0);
+    fputc(byte ^ 0x01, file);
+    fclose(file);
+
+    char *paths[] = {second_index, first_index};
+    MergeTotals totals;
+    char message[256];
+    cr_assert_eq(merge_with_message(paths, 2, &totals, message,
+                                    sizeof(message)),
+                 -1);
+    cr_assert_not_null(strstr(message, "corrupt"),
+                       "Expected the index to be corrupt, got: %s", message);
+    remove_test_dir();
+}
+
+Test(shard_index, truncated_index_is_refused) {
+    make_test_dir();
+    write_first_shard();
+    write_second_shard();
+    char *paths[] = {first_index, second_index};
+    MergeTotals totals;
+    char message[256];
+    off_t size = get_file_size(second_index);
+
+    // Into the number of records at the end
+    cr_assert_eq(truncate(second_index, size - 4), 0);
+    cr_assert_eq(merge_with_message(paths, 2, &totals, message,
+                                    sizeof(message)),
+                 -1);
+    cr_assert_not_null(strstr(message, "truncated"),
+                       "Expected the index to be truncated, got: %s",
+                       message);
+
+    // Without the last block, the records before it are all whole
+    cr_assert_eq(truncate(second_index, size - 12 - 8), 0);
+    cr_assert_eq(merge_with_message(paths, 2, &totals, message,
+                                    sizeof(message)),
+                 -1);
+    cr_assert_not_null(strstr(message, "truncated"),
+                       "Expected the index to be truncated, got: %s",
+                       message);
+    remove_test_dir();
+}
+
+// Builds an index of one block by hand, records are (size, digest, name)
+void put_test_integer(uint8_t *data, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        data[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+void put_test_checksum(const uint8_t *data, size_t len, uint8_t *checksum) {
+    FastHasher hasher;
+    fast_hasher_init(&hasher);
+    fast_hasher_update(&hasher, data, len);
+    fast_hasher_finalize(&hasher, checksum, 8);
+}
+
+void write_raw_index(const char *path, const uint64_t *sizes,
+                     const uint8_t *digests, int num_records,
+                     uint64_t count) {
+    uint8_t records[4096];
+    size_t used = 0;
+    for (int i = 0; i < num_records; i++) {
+        uint8_t *record = records + used;
+        put_test_integer(record, sizes[i], 8);
+        memset(record + 8, digests[i], MAX_DIGEST_LEN);
+        put_test_integer(record + 8 + MAX_DIGEST_LEN, 4, 2);
+        char name[16];
+        snprintf(name, sizeof(name), "f%03d", i);
+        memcpy(record + 8 + MAX_DIGEST_LEN + 2, name, 4);
+        used += 8 + MAX_DIGEST_LEN + 2 + 4;
+    }
+    FILE *file = fopen(path, "wb");
+    cr_assert_not_null(file);
+    uint8_t header[16] = {0};
+    memcpy(header, INDEX_MAGIC, 8);
+    put_test_integer(header + 8, INDEX_VERSION, 4);
+    fwrite(header, 1, sizeof(header), file);
+    uint8_t block[12];
+    put_test_integer(block, used, 4);
+    put_test_checksum(records, used, block + 4);
+    fwrite(block, 1, sizeof(block), file);
+    fwrite(records, 1, used, file);
+    uint8_t end[12 + 8] = {0};
+    put_test_integer(end + 12, count, 8);
+    put_test_checksum(end + 12, 8, end + 4);
+    fwrite(end, 1, sizeof(end), file);
+    fclose(file);
+}
+
+Test(shard_index, hand_built_index_merges) {
+    make_test_dir();
+    uint64_t sizes[] = {100, 100, 100, 200};
+    uint8_t digests[] = {1, 2, 2, 2};
+    write_raw_index(first_index, sizes, digests, 4, 4);
+    char *paths[] = {first_index};
+    MergeTotals totals;
+    cr_assert_eq(merge_shard_indexes(paths, 1, &totals), 0);
+    cr_assert_eq(totals.files, 4);
+    cr_assert_eq(totals.groups, 1);
+    cr_assert_eq(totals.duplicate_bytes, 100);
+    remove_test_dir();
+}
+
+Test(shard_index, out_of_order_is_refused) {
+    make_test_dir();
+    char *paths[] = {first_index};
+    MergeTotals totals;
+    char message[256];
+
+    uint64_t sizes[] = {100, 300, 200};
+    uint8_t digests[] = {1, 1, 1};
+    write_raw_index(first_index, sizes, digests, 3, 3);
+    cr_assert_eq(merge_with_message(paths, 1, &totals, message,
+                                    sizeof(message)),
+                 -1);
+    cr_assert_not_null(strstr(message, "out of order"),
+                       "Expected a size out of order, got: %s", message);
+
+    uint64_t same_sizes[] = {100, 100, 100};
+    uint8_t unsorted[] = {1, 3, 2};
+    write_raw_index(first_index, same_sizes, unsorted, 3, 3);
+    cr_assert_eq(merge_with_message(paths, 1, &totals, message,
+                                    sizeof(message)),
+                 -1);
+    cr_assert_not_null(strstr(message, "out of order"),
+                       "Expected a digest out of order, got: %s", message);
+    remove_test_dir();
+}
+
+Test(shard_index, wrong_record_count_is_corrupt) {
+    make_test_dir();
+    uint64_t sizes[] = {100, 100};
+    uint8_t digests[] = {1, 1};
+    write_raw_index(first_index, sizes, digests, 2, 3);
+    char *paths[] = {first_index};
+    MergeTotals totals;
+    char message[256];
+    cr_assert_eq(merge_with_message(paths, 1, &totals, message,
+                                    sizeof(message)),
+                 -1);
+    cr_assert_not_null(strstr(message, "corrupt"),
+                       "Expected the index to be corrupt, got: %s", message);
+    remove_test_dir();
+}
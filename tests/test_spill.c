@@ -0,0 +1,298 @@
+#define _DEFAULT_SOURCE
+
+#include "../src/lib/external.h"
+#include "../src/lib/spill.h"
+#include "criterion/assert.h"
+#include "criterion/internal/assert.h"
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define THREADS 4
+#define RECORDS_PER_THREAD 20000
+// Holds a few thousand records a half, so every thread fills many of them
+#define SMALL_BUDGET (256 * 1024)
+// A half holds one record of a 4 byte payload but not two
+#define ONE_RECORD_BUDGET 128
+// Halves larger than a write block, so runs span several blocks
+#define LARGE_BUDGET (8 * 1024 * 1024)
+
+// Spreads the keys so every buffer holds them out of order
+void put_test_key(uint8_t *key, uint32_t value) {
+    uint32_t mixed = value * 2654435761u;
+    memset(key, 0, SPILL_KEY_LEN);
+    for (int i = 0; i < 4; i++) {
+        key[i] = (uint8_t)(mixed >> (24 - 8 * i));
+    }
+    for (int i = 0; i < 4; i++) {
+        key[4 + i] = (uint8_t)(value >> (24 - 8 * i));
+    }
+}
+
+typedef struct {
+    Spill *spill;
+    uint32_t thread;
+} SpillThread;
+
+void *add_thread_records(void *arg) {
+    SpillThread *args = arg;
+    for (uint32_t i = 0; i < RECORDS_PER_THREAD; i++) {
+        uint32_t value = args->thread * RECORDS_PER_THREAD + i;
+        uint8_t key[SPILL_KEY_LEN];
+        put_test_key(key, value);
+        cr_assert_eq(add_spill_record(args->spill, key, &value, sizeof(value)),
+                     0, "Failed to add record %u", value);
+    }
+    return NULL;
+}
+
+Test(spill, threads_merge_sorted_and_complete) {
+    Spill *spill = create_spill(SMALL_BUDGET);
+    cr_assert_not_null(spill);
+    pthread_t threads[THREADS];
+    SpillThread args[THREADS];
+    for (uint32_t i = 0; i < THREADS; i++) {
+        args[i] = (SpillThread){spill, i};
+        pthread_create(&threads[i], NULL, add_thread_records, &args[i]);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    cr_assert_gt(spill->num_runs, THREADS,
+                 "Every thread should have spilled several buffers");
+
+    // Few enough readers that the runs are merged in several passes
+    SpillMerge *merge = open_spill_merge(spill, 4 * SPILL_MIN_READ_SIZE);
+    cr_assert_not_null(merge);
+    uint8_t *seen = calloc(THREADS * RECORDS_PER_THREAD, 1);
+    uint8_t last[SPILL_KEY_LEN];
+    uint32_t count = 0;
+    SpillRecord record;
+    while (next_spill_record(merge, &record)) {
+        cr_assert_eq(record.payload_len, sizeof(uint32_t));
+        uint32_t value;
+        memcpy(&value, record.payload, sizeof(value));
+        cr_assert_lt(value, THREADS * RECORDS_PER_THREAD);
+        cr_assert_not(seen[value], "Record %u came out twice", value);
+        seen[value] = 1;
+        uint8_t key[SPILL_KEY_LEN];
+        put_test_key(key, value);
+        cr_assert_arr_eq(record.key, key, SPILL_KEY_LEN,
+                         "Record %u has the key of another", value);
+        if (count > 0)
+            cr_assert_lt(memcmp(last, record.key, SPILL_KEY_LEN), 0,
+                         "Record %u came out of order", value);
+        memcpy(last, record.key, SPILL_KEY_LEN);
+        count++;
+    }
+    cr_assert_not(spill_merge_failed(merge));
+    cr_assert_eq(count, THREADS * RECORDS_PER_THREAD,
+                 "Expected %d records, got %u", THREADS * RECORDS_PER_THREAD,
+                 count);
+    free(seen);
+    close_spill_merge(merge);
+    destroy_spill(spill);
+}
+
+Test(spill, equal_keys_keep_spill_order) {
+    // One record a run, so the order of the runs is the order of the
+    // records
+    Spill *spill = create_spill(ONE_RECORD_BUDGET);
+    cr_assert_not_null(spill);
+    const uint32_t num_records = 600;
+    for (uint32_t i = 0; i < num_records; i++) {
+        uint8_t key[SPILL_KEY_LEN] = {0};
+        key[0] = (uint8_t)(i % 7);
+        cr_assert_eq(add_spill_record(spill, key, &i, sizeof(i)), 0);
+    }
+    cr_assert_eq(spill->num_runs, num_records - 1);
+
+    // Two readers at a time, the runs are merged in many passes
+    SpillMerge *merge = open_spill_merge(spill, 2 * SPILL_MIN_READ_SIZE);
+    cr_assert_not_null(merge);
+    int64_t last[7];
+    for (int i = 0; i < 7; i++) {
+        last[i] = -1;
+    }
+    uint32_t count = 0;
+    SpillRecord record;
+    while (next_spill_record(merge, &record)) {
+        uint32_t value;
+        memcpy(&value, record.payload, sizeof(value));
+        cr_assert_eq(record.key[0], value % 7);
+        cr_assert_gt((int64_t)value, last[value % 7],
+                     "Record %u came out after a later one of its key",
+                     value);
+        last[value % 7] = value;
+        count++;
+    }
+    cr_assert_eq(count, num_records);
+    close_spill_merge(merge);
+    destroy_spill(spill);
+}
+
+// Payloads of many lengths, so records straddle the write and read blocks
+uint16_t get_test_payload(uint32_t value, uint8_t *payload) {
+    uint16_t len = (uint16_t)(value * 7919 % 3000 + 1);
+    for (uint16_t i = 0; i < len; i++) {
+        payload[i] = (uint8_t)(value + i);
+    }
+    return len;
+}
+
+Test(spill, records_straddle_blocks) {
+    Spill *spill = create_spill(LARGE_BUDGET);
+    cr_assert_not_null(spill);
+    const uint32_t num_records = 12000;
+    uint8_t payload[3000];
+    for (uint32_t i = 0; i < num_records; i++) {
+        uint8_t key[SPILL_KEY_LEN];
+        put_test_key(key, i);
+        uint16_t len = get_test_payload(i, payload);
+        cr_assert_eq(add_spill_record(spill, key, payload, len), 0);
+    }
+    cr_assert_gt(spill->num_runs, 1);
+
+    SpillMerge *merge = open_spill_merge(spill, 4 * SPILL_MIN_READ_SIZE);
+    cr_assert_not_null(merge);
+    uint32_t count = 0;
+    SpillRecord record;
+    while (next_spill_record(merge, &record)) {
+        uint32_t value = (uint32_t)record.key[4] << 24 |
+                         (uint32_t)record.key[5] << 16 |
+                         (uint32_t)record.key[6] << 8 | record.key[7];
+        cr_assert_lt(value, num_records);
+        uint16_t len = get_test_payload(value, payload);
+        cr_assert_eq(record.payload_len, len,
+                     "Record %u has a payload of %u bytes, not %u", value,
+                     record.payload_len, len);
+        cr_assert_arr_eq(record.payload, payload, len,
+                         "Record %u has another payload", value);
+        count++;
+    }
+    cr_assert_not(spill_merge_failed(merge));
+    cr_assert_eq(count, num_records);
+    close_spill_merge(merge);
+    destroy_spill(spill);
+}
+
+Test(spill, too_many_runs_fail) {
+    // Every run stays open until the merge
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_max < SPILL_MAX_RUNS + 64)
+        cr_skip_test("Needs %d open files", SPILL_MAX_RUNS + 64);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    Spill *spill = create_spill(ONE_RECORD_BUDGET);
+    cr_assert_not_null(spill);
+    uint8_t key[SPILL_KEY_LEN] = {0};
+    uint32_t added = 0;
+    while (added <= SPILL_MAX_RUNS + 1 &&
+           add_spill_record(spill, key, &added, sizeof(added)) == 0) {
+        added++;
+    }
+    // The record after the last run has no run left to go to
+    cr_assert_eq(added, SPILL_MAX_RUNS + 1,
+                 "Expected the spill to fail after %d records, it took %u",
+                 SPILL_MAX_RUNS + 1, added);
+    cr_assert(spill->failed);
+    cr_assert_null(open_spill_merge(spill, 2 * SPILL_MIN_READ_SIZE));
+    destroy_spill(spill);
+}
+
+#define BIG_FILES 20000
+#define PAIR_SIZES 50
+
+Scheduler *test_scheduler;
+uint32_t test_dir_id;
+atomic_uint big_in_full, big_in_parts, pairs_in_parts, pairs_in_full;
+
+void add_test_file(const char *name, off_t size, ino_t ino, dev_t dev) {
+    FileInfo info = {0};
+    info.size = size;
+    info.dev = dev;
+    info.ino = ino;
+    add_sized_file(&info, test_dir_id, name);
+}
+
+// Takes the files the way a worker does, without reading them
+void *take_external_files(void *arg) {
+    (void)arg;
+    FilePath file;
+    int device;
+    while ((device = take_file(test_scheduler, &file, NULL, true)) >= 0) {
+        bool full = get_external_stage() == HASH_STAGE_FULL;
+        if (strncmp(file->name, "big", 3) == 0)
+            atomic_fetch_add(full ? &big_in_full : &big_in_parts, 1);
+        else
+            atomic_fetch_add(full ? &pairs_in_full : &pairs_in_parts, 1);
+        finish_file(test_scheduler, device, 1, 0, 0);
+        finish_external_file();
+    }
+    return NULL;
+}
+
+Test(external, size_larger_than_batch_is_hashed_in_full) {
+    struct stat dir_stat;
+    cr_assert_eq(stat("/tmp", &dir_stat), 0);
+    dev_t dev = dir_stat.st_dev;
+    // The files need not exist, the workers do not read them
+    test_dir_id = intern_dir(NO_DIR, "/tmp");
+    cr_assert_eq(start_external(EXTERNAL_MIN_BUDGET), 0);
+    char name[32];
+    // One size with more files than a quarter of the budget holds
+    for (int i = 0; i < BIG_FILES; i++) {
+        snprintf(name, sizeof(name), "big%d", i);
+        add_test_file(name, 4096, 1000000 + i, dev);
+    }
+    // Sizes of two files and a hard link to one of them
+    for (int i = 0; i < PAIR_SIZES; i++) {
+        snprintf(name, sizeof(name), "pair%d-a", i);
+        add_test_file(name, 100 + i, 2 * i + 1, dev);
+        snprintf(name, sizeof(name), "pair%d-b", i);
+        add_test_file(name, 100 + i, 2 * i + 2, dev);
+        snprintf(name, sizeof(name), "pair%d-link", i);
+        add_test_file(name, 100 + i, 2 * i + 2, dev);
+    }
+    // Sizes of one file only, never queued
+    for (int i = 0; i < 10; i++) {
+        snprintf(name, sizeof(name), "single%d", i);
+        add_test_file(name, 10000 + i, 500000 + i, dev);
+    }
+
+    test_scheduler = create_scheduler(THREADS);
+    cr_assert_not_null(test_scheduler);
+    Walker *walker = calloc(1, sizeof(Walker));
+    pthread_t workers[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&workers[i], NULL, take_external_files, NULL);
+    }
+    cr_assert_eq(queue_external_candidates(test_scheduler, walker), 0);
+    close_scheduler(test_scheduler);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    cr_assert_eq(atomic_load(&big_in_full), BIG_FILES,
+                 "Every file of the large size should be hashed in full, "
+                 "%u were", atomic_load(&big_in_full));
+    cr_assert_eq(atomic_load(&big_in_parts), 0);
+    cr_assert_eq(atomic_load(&pairs_in_parts), 2 * PAIR_SIZES,
+                 "Both files of a pair should go through the prefilter, "
+                 "%u did", atomic_load(&pairs_in_parts));
+    cr_assert_eq(atomic_load(&pairs_in_full), 0);
+    cr_assert_eq(count_external_sizes(), PAIR_SIZES + 1);
+    cr_assert_eq(count_external_links(), PAIR_SIZES);
+    cr_assert_eq(atomic_load(&walker->candidate_count),
+                 BIG_FILES + 2 * PAIR_SIZES);
+    free(walker);
+    destroy_scheduler(test_scheduler);
+    free_external();
+}
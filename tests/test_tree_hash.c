@@ -0,0 +1,78 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/lib/tree_hash.h"
+#include "criterion/assert.h"
+#include "criterion/internal/assert.h"
+#include <blake3.h>
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HELPERS 3
+
+uint8_t *make_input(size_t size) {
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)(i % 251);
+    }
+    return data;
+}
+
+void sequential_hash(const uint8_t *data, size_t size, uint8_t *hash) {
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, data, size);
+    blake3_hasher_finalize(&hasher, hash, BLAKE3_OUT_LEN);
+}
+
+void assert_same_hash(const uint8_t *data, size_t size, size_t subtree_size) {
+    uint8_t expected[BLAKE3_OUT_LEN], hash[BLAKE3_OUT_LEN];
+    sequential_hash(data, size, expected);
+    cr_assert_eq(tree_hash_memory(data, size, subtree_size, hash), 0);
+    cr_assert(memcmp(expected, hash, BLAKE3_OUT_LEN) == 0,
+              "Tree hash of %zu bytes in subtrees of %zu differs", size,
+              subtree_size);
+}
+
+Test(tree_hash, matches_sequential_hash) {
+    // Sizes around chunk, subtree and power of two boundaries
+    size_t sizes[] = {0,     1,     64,    1023,  1024,   1025,   2048,
+                      3073,  4096,  8191,  8192,  8193,   65536,  70000,
+                      131072, 262143, 262144, 262145, 1048576 + 17};
+    size_t subtree_sizes[] = {1024, 4096, 65536, 131072};
+    uint8_t *data = make_input(1048576 + 17);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(subtree_sizes) / sizeof(subtree_sizes[0]);
+             j++) {
+            assert_same_hash(data, sizes[i], subtree_sizes[j]);
+        }
+    }
+    free(data);
+}
+
+void *help(void *arg) {
+    (void)arg;
+    help_tree_hashes();
+    return NULL;
+}
+
+Test(tree_hash, helpers_share_the_work) {
+    size_t size = 4 * 1048576 + 12345;
+    uint8_t *data = make_input(size);
+    init_tree_hashing(HELPERS + 1);
+
+    pthread_t helpers[HELPERS];
+    for (int i = 0; i < HELPERS; i++) {
+        pthread_create(&helpers[i], NULL, help, NULL);
+    }
+    for (int i = 0; i < 8; i++) {
+        assert_same_hash(data, size - i * 1000, 4096);
+    }
+    // The owner is done as well, which lets the helpers go
+    help_tree_hashes();
+    for (int i = 0; i < HELPERS; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(data);
+}
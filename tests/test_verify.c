@@ -0,0 +1,136 @@
+#define _DEFAULT_SOURCE
+
+#include "../src/lib/hash_table.h"
+#include "../src/lib/verify.h"
+#include "criterion/assert.h"
+#include "criterion/internal/assert.h"
+#include <criterion/criterion.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define GROUPS 4
+#define FILES_PER_GROUP 300
+#define FILE_SIZE 70000
+#define WORKERS 4
+// Leaves each worker a slice of 16 files with the reserve taken off
+#define FILE_LIMIT (VERIFY_RESERVED_FDS + WORKERS * 16)
+
+char test_dir[] = "/tmp/dedup-verify-XXXXXX";
+uint32_t test_dir_id;
+
+// Writes a file of the group's content and adds it to the group's digest
+FilePath add_group_file(int group, int index, uint8_t fill) {
+    char name[32], path[PATH_MAX];
+    snprintf(name, sizeof(name), "g%d-%d", group, index);
+    snprintf(path, sizeof(path), "%s/%s", test_dir, name);
+    uint8_t *data = malloc(FILE_SIZE);
+    memset(data, fill, FILE_SIZE);
+    FILE *file = fopen(path, "wb");
+    cr_assert_not_null(file, "Failed to create %s", path);
+    cr_assert_eq(fwrite(data, 1, FILE_SIZE, file), FILE_SIZE);
+    fclose(file);
+    free(data);
+
+    uint8_t hash[BLAKE3_OUT_LEN];
+    memset(hash, 0, sizeof(hash));
+    hash[0] = (uint8_t)group;
+    FilePath path_id = intern_file(test_dir_id, name);
+    FilePath first;
+    cr_assert_gt(add_new_hash(hash, path_id, &first), 0);
+    return path_id;
+}
+
+void add_groups() {
+    cr_assert_not_null(mkdtemp(test_dir), "Failed to create the test dir");
+    test_dir_id = intern_dir(NO_DIR, test_dir);
+    for (int group = 0; group < GROUPS; group++) {
+        for (int i = 0; i < FILES_PER_GROUP; i++) {
+            add_group_file(group, i, (uint8_t)group);
+        }
+    }
+}
+
+void remove_groups() {
+    char path[PATH_MAX];
+    for (int group = 0; group < GROUPS; group++) {
+        for (int i = 0; i < FILES_PER_GROUP; i++) {
+            snprintf(path, sizeof(path), "%s/g%d-%d", test_dir, group, i);
+            unlink(path);
+        }
+    }
+    rmdir(test_dir);
+}
+
+void *verify_worker(void *arg) {
+    (void)arg;
+    verify_groups();
+    return NULL;
+}
+
+// Verifies with a lowered limit of open files, the way the workers do
+void run_verification() {
+    struct rlimit limit = {FILE_LIMIT, FILE_LIMIT};
+    cr_assert_eq(setrlimit(RLIMIT_NOFILE, &limit), 0,
+                 "Failed to lower the limit of open files");
+    init_verification(WORKERS);
+    cr_assert_eq(prepare_verification(), 0);
+    pthread_t workers[WORKERS];
+    for (int i = 0; i < WORKERS; i++) {
+        pthread_create(&workers[i], NULL, verify_worker, NULL);
+    }
+    for (int i = 0; i < WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+Test(verify, large_groups_within_file_limit) {
+    add_groups();
+    run_verification();
+    cr_assert_eq(count_verified_groups(), GROUPS,
+                 "Expected %d verified groups, got %llu", GROUPS,
+                 (unsigned long long)count_verified_groups());
+    cr_assert_eq(count_differing_files(), 0,
+                 "No file should differ, %llu did",
+                 (unsigned long long)count_differing_files());
+    cr_assert_eq(count_unreadable_files(), 0,
+                 "Every file should be read, %llu could not be",
+                 (unsigned long long)count_unreadable_files());
+    free_verification();
+    remove_groups();
+}
+
+Test(verify, unreadable_file_does_not_differ) {
+    add_groups();
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/g1-%d", test_dir, FILES_PER_GROUP / 2);
+    unlink(path);
+    run_verification();
+    cr_assert_eq(count_verified_groups(), GROUPS);
+    cr_assert_eq(count_unreadable_files(), 1,
+                 "The removed file should be unreadable");
+    cr_assert_eq(count_differing_files(), 0,
+                 "An unreadable file should not count as differing");
+    free_verification();
+    remove_groups();
+}
+
+Test(verify, differing_file_leaves_group) {
+    add_groups();
+    // Same digest as group 2, other content
+    add_group_file(2, FILES_PER_GROUP, 0xff);
+    run_verification();
+    cr_assert_eq(count_verified_groups(), GROUPS);
+    cr_assert_eq(count_differing_files(), 1,
+                 "The changed file should differ from its group");
+    cr_assert_eq(count_unreadable_files(), 0);
+    free_verification();
+    char extra[PATH_MAX];
+    snprintf(extra, sizeof(extra), "%s/g2-%d", test_dir, FILES_PER_GROUP);
+    unlink(extra);
+    remove_groups();
+}